@@ -0,0 +1,169 @@
+// associations.cpp
+// Get, set and remove associated objects from several threads at once,
+// through one lock and one hash table of std::maps, as
+// objc-references.mm did, and through a lock and hash table per stripe
+// of object addresses holding objc-associations-engine.h's flat maps,
+// as it does now.
+//
+// usage: associations
+//
+// Each thread owns 4096 objects and works on 4 keys of them: 80% of
+// its operations get a value, 15% set one, and 5% set one to nil,
+// which removes it. std::mutex stands in for spinlock_t, and the
+// stripes hash addresses as StripedMap does, 64 of them.
+// Columns are millions of operations per second across all threads.
+//
+// Every object's associations must end as its thread last set them.
+
+#include "bench.h"
+#include "objc-associations-engine.h"
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+enum { ObjectsPerThread = 4096, Keys = 4, Stripes = 64 };
+
+static const char KeyStorage[Keys] = { 0 };
+
+struct Association {
+    uintptr_t policy;
+    uintptr_t value;
+};
+
+// The old store: one lock, one table, a std::map per object.
+struct GlobalStore {
+    std::mutex lock;
+    std::unordered_map<uintptr_t, std::map<const void *, Association> *> map;
+
+    ~GlobalStore() { for (auto& i : map) delete i.second; }
+
+    uintptr_t get(uintptr_t obj, const void *key) {
+        std::lock_guard<std::mutex> l(lock);
+        auto i = map.find(obj);
+        if (i == map.end()) return 0;
+        auto j = i->second->find(key);
+        return j == i->second->end() ? 0 : j->second.value;
+    }
+
+    void set(uintptr_t obj, const void *key, uintptr_t value) {
+        std::lock_guard<std::mutex> l(lock);
+        auto i = map.find(obj);
+        if (value) {
+            if (i == map.end()) {
+                i = map.emplace(obj, new std::map<const void *, Association>).first;
+            }
+            (*i->second)[key] = Association{1, value};
+        } else if (i != map.end()) {
+            i->second->erase(key);
+        }
+    }
+};
+
+// The new store: a lock and a table per stripe, a flat map per object.
+struct ShardedStore {
+    typedef objc::AssociationFlatMap<Association> ObjectMap;
+
+    struct Stripe {
+        std::mutex lock alignas(64);
+        std::unordered_map<uintptr_t, ObjectMap *> map;
+    };
+    Stripe stripes[Stripes];
+
+    ~ShardedStore() {
+        for (auto& s : stripes) for (auto& i : s.map) delete i.second;
+    }
+
+    // StripedMap::indexForPointer()
+    Stripe& stripe(uintptr_t addr) {
+        return stripes[((addr >> 4) ^ (addr >> 9)) % Stripes];
+    }
+
+    uintptr_t get(uintptr_t obj, const void *key) {
+        Stripe& s = stripe(obj);
+        std::lock_guard<std::mutex> l(s.lock);
+        auto i = s.map.find(obj);
+        if (i == s.map.end()) return 0;
+        Association *a = i->second->find(key);
+        return a ? a->value : 0;
+    }
+
+    void set(uintptr_t obj, const void *key, uintptr_t value) {
+        Stripe& s = stripe(obj);
+        std::lock_guard<std::mutex> l(s.lock);
+        auto i = s.map.find(obj);
+        if (value) {
+            if (i == s.map.end()) i = s.map.emplace(obj, new ObjectMap).first;
+            bool inserted;
+            Association *a = i->second->insert(key, &inserted);
+            if (!a) benchfail("no memory");
+            *a = Association{1, value};
+        } else if (i != s.map.end()) {
+            Association old;
+            i->second->erase(key, &old);
+        }
+    }
+};
+
+template <typename Store>
+static void run(const char *label, unsigned threads, size_t opsPerThread)
+{
+    Store store;
+    std::vector<std::vector<uintptr_t>> objects(threads);
+    std::vector<std::vector<uintptr_t>> expected(threads);
+    for (unsigned t = 0; t < threads; t++) {
+        for (size_t i = 0; i < ObjectsPerThread; i++) {
+            objects[t].push_back((uintptr_t)new char[16]);
+        }
+        expected[t].assign(ObjectsPerThread * Keys, 0);
+    }
+
+    uint64_t start = nanoseconds();
+    benchthreads(threads, [&](unsigned t) {
+        BenchRandom rng(t + 1);
+        uint64_t sum = 0;
+        for (size_t n = 0; n < opsPerThread; n++) {
+            uint32_t o = rng.below(ObjectsPerThread);
+            uint32_t k = rng.below(Keys);
+            uint32_t op = rng.below(100);
+            uintptr_t obj = objects[t][o];
+            if (op < 80) {
+                uintptr_t value = store.get(obj, &KeyStorage[k]);
+                if (value != expected[t][o * Keys + k]) benchfail("wrong value");
+                sum += value;
+            } else {
+                uintptr_t value = op < 95 ? n + 1 : 0;
+                store.set(obj, &KeyStorage[k], value);
+                expected[t][o * Keys + k] = value;
+            }
+        }
+        benchkeep(sum);
+    });
+    uint64_t elapsed = nanoseconds() - start;
+
+    for (unsigned t = 0; t < threads; t++) {
+        for (size_t o = 0; o < ObjectsPerThread; o++) {
+            for (unsigned k = 0; k < Keys; k++) {
+                if (store.get(objects[t][o], &KeyStorage[k]) !=
+                    expected[t][o * Keys + k])
+                {
+                    benchfail("%s: association lost", label);
+                }
+            }
+            delete[] (char *)objects[t][o];
+        }
+    }
+
+    printf("%-8s %u threads: %7.2f Mops/s\n", label, threads,
+           (double)opsPerThread * threads * 1000.0 / elapsed);
+}
+
+int main()
+{
+    size_t ops = benchscale(2000000);
+    for (unsigned threads : { 1u, 2u, 4u, 8u }) {
+        run<GlobalStore>("global", threads, ops);
+        run<ShardedStore>("sharded", threads, ops);
+    }
+    return 0;
+}
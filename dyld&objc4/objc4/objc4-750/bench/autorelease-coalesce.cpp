@@ -0,0 +1,233 @@
+// autorelease-coalesce.cpp
+// Replay traces of autorelease pool pushes, autoreleases and pops into
+// a host pool, with no coalescing, as AutoreleasePoolPage::add() does
+// by default, and with OBJC_AUTORELEASE_COALESCING=n's search of the
+// top n entries from objc-autorelease-coalesce-engine.h.
+//
+// usage: autorelease-coalesce
+//
+// The pool is a list of 4 KB pages, as in pool-drain.cpp, and is popped
+// a batch of 128 releases at a time with autorelease_take(), as
+// releaseUntil() does with OBJC_BATCHED_POOL_DRAIN. Pages are kept once
+// allocated, so the pages column is the pool's high-water mark.
+//
+// "getter" autoreleases one of 1000 objects, Zipf-distributed, 1 to 32
+// times in a row, as a getter called in a loop does. "interleaved"
+// autoreleases one object again after one or two others, as a loop
+// that reads x.name, y, x.date, z does. "distinct" autoreleases a new
+// object every time, as an enumeration does; coalescing can only cost
+// time there. "replay" switches among the three every few dozen
+// autoreleases, with pools pushed and popped up to 4 deep.
+// Columns are ns per autorelease, ns per release at pop, pool pages at
+// the high-water mark, and slots used per autorelease.
+//
+// Every object must be released exactly as many times as it was
+// autoreleased.
+
+#include "bench.h"
+#include "objc-autorelease-coalesce-engine.h"
+
+enum { PageSlots = 505, Batch = 128, Objects = 1000 };
+
+struct Page {
+    Page *parent;
+    Page *child;
+    uintptr_t *next;
+    uintptr_t slots[PageSlots];
+};
+
+struct HostObject {
+    uint64_t autoreleases;
+    uint64_t releases;
+};
+
+class HostPool {
+    std::vector<Page *> pages;
+    Page *hot;
+    unsigned window;
+
+ public:
+    uint64_t slotsUsed = 0;
+    uint64_t popNs = 0;
+
+    explicit HostPool(unsigned coalesce) : window(coalesce) {
+        pages.push_back(new Page{nullptr, nullptr, nullptr, {}});
+        hot = pages[0];
+        hot->next = hot->slots;
+    }
+    ~HostPool() { for (Page *p : pages) delete p; }
+
+    size_t pageCount() const { return pages.size(); }
+
+    // autoreleaseFast()
+    uintptr_t *add(uintptr_t value) {
+        if (window  &&  value) {
+            uintptr_t *next = hot->next;
+            uintptr_t *entry = objc::autorelease_coalesce
+                (hot->slots, &hot->next, hot->slots + PageSlots, window, value);
+            slotsUsed += hot->next - next;
+            if (entry) return entry;
+        }
+        if (hot->next == hot->slots + PageSlots) {
+            if (!hot->child) {
+                Page *child = new Page{hot, nullptr, nullptr, {}};
+                child->next = child->slots;
+                hot->child = child;
+                pages.push_back(child);
+            }
+            hot = hot->child;
+        }
+        slotsUsed++;
+        *hot->next = value;
+        return hot->next++;
+    }
+
+    // releaseUntil()
+    void pop(uintptr_t *stop) {
+        uint64_t start = nanoseconds();
+        Page *page = hot;
+        while (stop < page->slots  ||  stop >= page->slots + PageSlots) {
+            page = page->parent;
+        }
+        while (page->next != stop) {
+            while (hot->next == hot->slots) hot = hot->parent;
+            uintptr_t *floor = (hot == page) ? stop : hot->slots;
+            uintptr_t batch[Batch];
+            size_t count = objc::autorelease_take(floor, &hot->next,
+                                                  batch, Batch);
+            // objc_releaseMany()
+            for (size_t i = 0; i < count; ) {
+                size_t run = 1;
+                while (i + run < count  &&  batch[i + run] == batch[i]) run++;
+                if (batch[i]) ((HostObject *)batch[i])->releases += run;
+                i += run;
+            }
+        }
+        hot = page;
+        popNs += nanoseconds() - start;
+    }
+};
+
+enum Profile { Getter, Interleaved, Distinct, Replay };
+static const char *profileNames[] = {
+    "getter", "interleaved", "distinct", "replay"
+};
+
+// A trace entry: an object index to autorelease, or a push or pop.
+enum { Push = -1, Pop = -2 };
+
+static std::vector<int> makeTrace(Profile profile, size_t autoreleases)
+{
+    BenchRandom rng(profile + 1);
+    BenchZipf zipf(Objects, 1.0);
+    std::vector<int> trace;
+    trace.push_back(Push);
+    unsigned depth = 1;
+    size_t n = 0;
+    int fresh = Objects;  // distinct objects come after the shared ones
+    Profile current = profile == Replay ? Getter : profile;
+
+    while (n < autoreleases) {
+        if (profile == Replay) {
+            current = (Profile)rng.below(3);
+            if (depth < 4  &&  rng.below(4) == 0) {
+                trace.push_back(Push);
+                depth++;
+            } else if (depth > 1  &&  rng.below(3) == 0) {
+                trace.push_back(Pop);
+                depth--;
+            }
+        }
+        unsigned burst = 1 + rng.below(48);
+        switch (current) {
+        case Getter: {
+            int obj = (int)zipf.next(rng);
+            for (unsigned i = 0; i < burst; i++) trace.push_back(obj);
+            n += burst;
+            break;
+        }
+        case Interleaved: {
+            int obj = (int)zipf.next(rng);
+            for (unsigned i = 0; i < burst; i++) {
+                trace.push_back(obj);
+                for (unsigned j = 1 + rng.below(2); j > 0; j--) {
+                    trace.push_back(fresh++);
+                }
+            }
+            n += burst * 3;
+            break;
+        }
+        default:
+            for (unsigned i = 0; i < burst; i++) trace.push_back(fresh++);
+            n += burst;
+            break;
+        }
+    }
+    while (depth--) trace.push_back(Pop);
+    return trace;
+}
+
+static void run(Profile profile, unsigned window, size_t autoreleases,
+                size_t rounds)
+{
+    std::vector<int> trace = makeTrace(profile, autoreleases);
+    int objectCount = Objects;
+    for (int e : trace) objectCount = std::max(objectCount, e + 1);
+    std::vector<HostObject> objects(objectCount);
+
+    uint64_t addNs = 0, popNs = 0, adds = 0, slots = 0;
+    size_t pages = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        for (HostObject& obj : objects) obj = HostObject{0, 0};
+        HostPool pool(window);
+        std::vector<uintptr_t *> tokens;
+
+        uint64_t start = nanoseconds();
+        for (int e : trace) {
+            if (e == Push) {
+                tokens.push_back(pool.add(0));
+            } else if (e == Pop) {
+                pool.pop(tokens.back());
+                tokens.pop_back();
+            } else {
+                objects[e].autoreleases++;
+                pool.add((uintptr_t)&objects[e]);
+                adds++;
+            }
+        }
+        uint64_t elapsed = nanoseconds() - start;
+        addNs += elapsed - pool.popNs;
+        popNs += pool.popNs;
+        slots += pool.slotsUsed;
+        pages = pool.pageCount();
+
+        for (HostObject& obj : objects) {
+            if (obj.releases != obj.autoreleases) {
+                benchfail("%s: %llu releases of %llu autoreleases",
+                          profileNames[profile],
+                          (unsigned long long)obj.releases,
+                          (unsigned long long)obj.autoreleases);
+            }
+        }
+    }
+
+    char label[32];
+    if (window) snprintf(label, sizeof(label), "top %u", window);
+    else snprintf(label, sizeof(label), "off");
+    printf("%-11s %-6s %6.2f ns/autorelease  %6.2f ns/release  "
+           "%5zu pages  %5.3f slots/autorelease\n",
+           profileNames[profile], label, (double)addNs / adds,
+           (double)popNs / adds, pages, (double)slots / adds);
+}
+
+int main()
+{
+    size_t autoreleases = 200000;
+    size_t rounds = benchscale(40);
+    for (Profile p : { Getter, Interleaved, Distinct, Replay }) {
+        for (unsigned window : { 0u, 1u, 4u, 16u }) {
+            run(p, window, autoreleases, rounds);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+// bench.h
+// Common definitions for trivial host benchmark harness.
+//
+// Benchmarks in this directory compile the runtime's portable engine
+// headers (runtime/objc-*-engine.h and friends) on a host machine,
+// without Mach, the messengers, or the rest of libobjc.
+//
+// Environment:
+//   BENCH_SCALE=<float>  multiply iteration counts (default 1)
+//   VERBOSE=1            print extra progress information
+
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Output
+
+static inline void benchfail(const char *msg, ...) __attribute__((noreturn));
+static inline void benchfail(const char *msg, ...)
+{
+    fprintf(stderr, "BAD: ");
+    va_list v;
+    va_start(v, msg);
+    vfprintf(stderr, msg, v);
+    va_end(v);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+#define benchassert(cond) \
+    ((void) (((cond) != 0) ? (void)0 : \
+             benchfail("failed assertion '%s' at %s:%u", \
+                       #cond, __FILE__, __LINE__)))
+
+static inline void benchprintf(const char *msg, ...)
+{
+    static int verbose = -1;
+    if (verbose < 0) {
+        const char *env = getenv("VERBOSE");
+        verbose = env ? atoi(env) : 0;
+    }
+    if (verbose < 1) return;
+
+    va_list v;
+    va_start(v, msg);
+    vfprintf(stderr, msg, v);
+    va_end(v);
+}
+
+
+// Timing and scale
+
+static inline uint64_t nanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Scale an iteration count by $BENCH_SCALE.
+static inline size_t benchscale(size_t count)
+{
+    static double scale = -1;
+    if (scale < 0) {
+        const char *env = getenv("BENCH_SCALE");
+        scale = env ? atof(env) : 1.0;
+        if (scale <= 0) scale = 1.0;
+    }
+    size_t result = (size_t)(count * scale);
+    return result ? result : 1;
+}
+
+// Keep the optimizer from discarding a computed value.
+template <typename T>
+static inline void benchkeep(const T& value)
+{
+    __asm__ __volatile__("" : : "g"(value) : "memory");
+}
+
+
+// Random numbers (xorshift64*). Deterministic for a given seed.
+
+class BenchRandom {
+    uint64_t state;
+ public:
+    BenchRandom(uint64_t seed = 0x9e3779b97f4a7c15ull)
+        : state(seed ? seed : 1) { }
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dull;
+    }
+
+    // Uniform in [0, bound).
+    uint32_t below(uint32_t bound) {
+        return (uint32_t)(((next() >> 32) * (uint64_t)bound) >> 32);
+    }
+};
+
+
+// Zipf-distributed indexes in [0, count). s=0 is uniform.
+
+class BenchZipf {
+    std::vector<double> cdf;
+ public:
+    BenchZipf(size_t count, double s) : cdf(count) {
+        double sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += 1.0 / pow((double)(i + 1), s);
+            cdf[i] = sum;
+        }
+        for (auto& c : cdf) c /= sum;
+    }
+
+    size_t next(BenchRandom& rng) {
+        double u = (double)(rng.next() >> 11) / (double)(1ull << 53);
+        return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    }
+};
+
+
+// Histogram of small non-negative integers such as probe lengths.
+// Values up to MaxExact are counted exactly; larger ones share a bucket.
+
+class BenchHistogram {
+    enum { MaxExact = 16 };
+    uint64_t counts[MaxExact + 2];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+
+ public:
+    BenchHistogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = sum = max = 0;
+    }
+
+    void add(uint64_t value) {
+        counts[value <= MaxExact ? value : MaxExact + 1]++;
+        total++;
+        sum += value;
+        if (value > max) max = value;
+    }
+
+    void merge(const BenchHistogram& other) {
+        for (size_t i = 0; i < MaxExact + 2; i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        if (other.max > max) max = other.max;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return max; }
+    double mean() const { return total ? (double)sum / total : 0; }
+
+    // Prints "label: mean M max N | 1:..% 2:..% ... >16:..%"
+    // Buckets that are empty are omitted.
+    void print(const char *label) const {
+        printf("%s: mean %.2f max %llu |", label, mean(),
+               (unsigned long long)max);
+        for (size_t i = 0; i < MaxExact + 2; i++) {
+            if (!counts[i]) continue;
+            double pct = 100.0 * counts[i] / total;
+            if (i <= MaxExact) printf(" %zu:%.1f%%", i, pct);
+            else printf(" >%d:%.1f%%", MaxExact, pct);
+        }
+        printf("\n");
+    }
+};
+
+
+// Latency recorder for nanosecond-scale samples.
+// Keeps every sample so percentiles are exact; use for modest counts.
+
+class BenchLatency {
+    std::vector<uint64_t> samples;
+ public:
+    void add(uint64_t ns) { samples.push_back(ns); }
+    void merge(const BenchLatency& other) {
+        samples.insert(samples.end(),
+                       other.samples.begin(), other.samples.end());
+    }
+    size_t count() const { return samples.size(); }
+
+    uint64_t percentile(double p) {
+        if (samples.empty()) return 0;
+        std::sort(samples.begin(), samples.end());
+        size_t i = (size_t)(p / 100.0 * (samples.size() - 1));
+        return samples[i];
+    }
+
+    // Prints "label: n N p50 X p99 Y p99.9 Z max W (ns)"
+    void print(const char *label) {
+        printf("%s: n %zu p50 %llu p99 %llu p99.9 %llu max %llu (ns)\n",
+               label, count(),
+               (unsigned long long)percentile(50),
+               (unsigned long long)percentile(99),
+               (unsigned long long)percentile(99.9),
+               (unsigned long long)percentile(100));
+    }
+};
+
+
+// Selector-like keys. Real SELs are addresses of packed, unaligned
+// C strings in __objc_methname, so the low bits seen by cache_hash
+// are not uniformly distributed. BenchSelectors imitates that layout.
+
+class BenchSelectors {
+    std::vector<char> storage;
+    std::vector<const char *> names;
+ public:
+    // Synthetic names of varying length.
+    explicit BenchSelectors(size_t count, uint64_t seed = 1) {
+        BenchRandom rng(seed);
+        std::vector<size_t> offsets;
+        for (size_t i = 0; i < count; i++) {
+            char buf[64];
+            int len = snprintf(buf, sizeof(buf), "sel%zu", i);
+            unsigned pad = rng.below(24);
+            offsets.push_back(storage.size());
+            storage.insert(storage.end(), buf, buf + len);
+            storage.insert(storage.end(), pad, ':');
+            storage.push_back('\0');
+        }
+        for (size_t off : offsets) names.push_back(&storage[off]);
+    }
+
+    // Selectors with the given names, de-duplicated by the caller.
+    explicit BenchSelectors(const std::vector<std::string>& list) {
+        std::vector<size_t> offsets;
+        for (auto& name : list) {
+            offsets.push_back(storage.size());
+            storage.insert(storage.end(), name.begin(), name.end());
+            storage.push_back('\0');
+        }
+        for (size_t off : offsets) names.push_back(&storage[off]);
+    }
+
+    size_t count() const { return names.size(); }
+    uintptr_t operator [] (size_t i) const { return (uintptr_t)names[i]; }
+    const char *name(size_t i) const { return names[i]; }
+};
+
+
+// Run fn(threadIndex) on count threads that start together.
+// Returns wall-clock nanoseconds from the start signal until
+// the last thread finishes.
+
+template <typename Fn>
+static uint64_t benchthreads(unsigned count, Fn fn)
+{
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < count; i++) {
+        threads.emplace_back([&, i]{
+            ready++;
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            fn(i);
+        });
+    }
+    while (ready.load() != count) std::this_thread::yield();
+    uint64_t start = nanoseconds();
+    go.store(true, std::memory_order_release);
+    for (auto& t : threads) t.join();
+    return nanoseconds() - start;
+}
+
+#endif
@@ -0,0 +1,169 @@
+// cache-engine.cpp
+// Replay selector streams through HostCache under several cache
+// policies and report lookup cost, probe lengths, and resizes.
+//
+// usage: cache-engine [msgSends-file ...]
+//
+// With no arguments, replays synthetic streams only. Each file argument
+// is a message log written by instrumentObjcMessageSends() (one
+// "+|- Class ImplementingClass selector" line per message) and is
+// replayed as a recorded stream. Receiver class and +/- select the
+// cache; the selector is the key.
+
+#include "hostcache.h"
+
+#include <unordered_map>
+
+struct Message {
+    uint32_t cls;
+    uint32_t sel;
+};
+
+struct Workload {
+    std::string name;
+    uint32_t classCount;
+    BenchSelectors *selectors;
+    std::vector<Message> stream;
+};
+
+struct Policy {
+    const char *name;
+    objc::cache_policy_t policy;
+};
+
+static const Policy policies[] = {
+    { "default (4, x2, 3/4)", objc::cache_policy_default },
+    { "init 2",               { 2, 1, 3, 4, 1 << 16, 3 } },
+    { "init 8",               { 8, 1, 3, 4, 1 << 16, 3 } },
+    { "init 16",              { 16, 1, 3, 4, 1 << 16, 3 } },
+    { "grow x4",              { 4, 2, 3, 4, 1 << 16, 3 } },
+    { "load 1/2",             { 4, 1, 1, 2, 1 << 16, 3 } },
+    { "load 7/8",             { 8, 1, 7, 8, 1 << 16, 3 } },
+    { "limit 1024",           { 4, 1, 3, 4, 1024, 3 } },
+};
+
+
+// Synthetic stream: classes are chosen by Zipf(1.0); each class
+// draws from its own window of the selector pool by Zipf(s).
+static Workload *
+synthetic(const char *name, uint32_t classCount, uint32_t selsPerClass,
+          double s, size_t count)
+{
+    Workload *w = new Workload;
+    w->name = name;
+    w->classCount = classCount;
+    size_t poolSize = std::max<size_t>(selsPerClass * 4, 1024);
+    w->selectors = new BenchSelectors(poolSize);
+
+    BenchRandom rng(classCount * 7919 + selsPerClass);
+    BenchZipf classZipf(classCount, 1.0);
+    BenchZipf selZipf(selsPerClass, s);
+    std::vector<uint32_t> base(classCount);
+    for (auto& b : base) b = rng.below((uint32_t)(poolSize - selsPerClass));
+
+    w->stream.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t cls = (uint32_t)classZipf.next(rng);
+        uint32_t sel = base[cls] + (uint32_t)selZipf.next(rng);
+        w->stream.push_back(Message{cls, sel});
+    }
+    return w;
+}
+
+
+// Recorded stream from an instrumentObjcMessageSends() log.
+static Workload *
+recorded(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) benchfail("can't open %s", path);
+
+    std::unordered_map<std::string, uint32_t> classes;
+    std::unordered_map<std::string, uint32_t> sels;
+    std::vector<std::string> selNames;
+    Workload *w = new Workload;
+    w->name = path;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        char kind, cls[512], impl[512], sel[512];
+        if (4 != sscanf(line, "%c %511s %511s %511s", &kind, cls, impl, sel)) {
+            continue;
+        }
+        if (kind != '+'  &&  kind != '-') continue;
+
+        std::string clsKey = std::string(1, kind) + cls;
+        auto c = classes.emplace(clsKey, (uint32_t)classes.size()).first;
+        auto s = sels.find(sel);
+        if (s == sels.end()) {
+            s = sels.emplace(sel, (uint32_t)selNames.size()).first;
+            selNames.push_back(sel);
+        }
+        w->stream.push_back(Message{c->second, s->second});
+    }
+    fclose(f);
+
+    if (w->stream.empty()) benchfail("no messages in %s", path);
+    w->classCount = (uint32_t)classes.size();
+    w->selectors = new BenchSelectors(selNames);
+    return w;
+}
+
+
+static void
+replay(Workload *w, const Policy& p)
+{
+    std::vector<HostCache> caches(w->classCount);
+    HostCacheStats stats;
+    const BenchSelectors& sels = *w->selectors;
+
+    // Cold: every class starts with an empty cache.
+    // Lookups and fills are timed together, as they are in the runtime.
+    uint64_t start = nanoseconds();
+    for (const Message& m : w->stream) {
+        uintptr_t key = sels[m.sel];
+        benchkeep(caches[m.cls].lookupOrFill(key, key, p.policy, &stats));
+    }
+    uint64_t cold = nanoseconds() - start;
+
+    // Warm: replay again without statistics. Mostly hits.
+    start = nanoseconds();
+    for (const Message& m : w->stream) {
+        benchkeep(caches[m.cls].lookup(sels[m.sel]));
+    }
+    uint64_t warm = nanoseconds() - start;
+
+    size_t bytes = 0;
+    for (auto& c : caches) bytes += c.bytes();
+
+    double n = (double)w->stream.size();
+    printf("  %-22s cold %6.2f ns/lookup  warm %6.2f ns/lookup  "
+           "hit %5.1f%%  allocs %llu  expansions %llu  bytes %zu\n",
+           p.name, cold / n, warm / n,
+           100.0 * stats.hits / n,
+           (unsigned long long)stats.allocations,
+           (unsigned long long)stats.expansions, bytes);
+    stats.probes.print("    probes");
+}
+
+
+int main(int argc, char **argv)
+{
+    for (auto& p : policies) benchassert(p.policy.isValid());
+
+    size_t count = benchscale(2000000);
+    std::vector<Workload *> workloads;
+    workloads.push_back(synthetic("few selectors per class", 2048, 8, 1.0, count));
+    workloads.push_back(synthetic("zipf", 256, 200, 1.1, count));
+    workloads.push_back(synthetic("megamorphic root", 4, 4000, 0.8, count));
+    for (int i = 1; i < argc; i++) workloads.push_back(recorded(argv[i]));
+
+    for (Workload *w : workloads) {
+        printf("%s: %u classes, %zu selectors, %zu lookups\n",
+               w->name.c_str(), w->classCount,
+               w->selectors->count(), w->stream.size());
+        for (auto& p : policies) replay(w, p);
+    }
+
+    return 0;
+}
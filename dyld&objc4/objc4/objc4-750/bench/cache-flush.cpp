@@ -0,0 +1,227 @@
+// cache-flush.cpp
+// Replay flush-heavy message streams through HostCache under several
+// cache sizing policies and report memory against miss rate.
+//
+// usage: cache-flush
+//
+// Flushes stand in for cache_erase_nolock(), which runs for every
+// class below one that gains methods (category loading) and for every
+// class on _objc_flush_caches(nil). Swizzling one selector can instead
+// evict just that selector (cache_evict_nolock()); the "swizzle"
+// workload compares the two.
+// Memory is the bytes held by non-empty caches, sampled every
+// SampleInterval messages; the shared empty caches are not counted.
+
+#include "hostcache.h"
+
+struct Policy {
+    const char *name;
+    objc::cache_policy_t policy;
+};
+
+static const Policy policies[] = {
+    { "default",                objc::cache_policy_default },
+    { "old (no limit, keep)",   { 4, 1, 3, 4, 0, 0 } },
+    { "never shrink",           { 4, 1, 3, 4, 1 << 16, 0 } },
+    { "shrink at 1/2",          { 4, 1, 3, 4, 1 << 16, 1 } },
+    { "shrink at 1/4",          { 4, 1, 3, 4, 1 << 16, 2 } },
+    { "limit 4096",             { 4, 1, 3, 4, 4096, 3 } },
+};
+
+enum { SampleInterval = 1024 };
+
+struct Message {
+    uint32_t cls;
+    uint32_t sel;
+};
+
+// A flush of `count` classes starting at `first` before message `at`.
+// count == 0 flushes every class. A swizzle of selector `sel` may
+// evict just that selector instead.
+struct Flush {
+    size_t at;
+    uint32_t first;
+    uint32_t count;
+    uint32_t sel;
+};
+
+enum { NoSel = ~0u };
+
+struct Workload {
+    const char *name;
+    uint32_t classCount;
+    BenchSelectors *selectors;
+    std::vector<Message> stream;
+    std::vector<Flush> flushes;
+};
+
+
+// Classes chosen by Zipf(1.0), each drawing from its own window of
+// selsPerClass selectors by Zipf(s). After phaseAt messages, every
+// class narrows to its first narrowTo selectors.
+static void
+generate(Workload *w, uint32_t selsPerClass, double s, size_t count,
+         size_t phaseAt = 0, uint32_t narrowTo = 0)
+{
+    size_t poolSize = std::max<size_t>(selsPerClass * 4, 1024);
+    w->selectors = new BenchSelectors(poolSize);
+
+    BenchRandom rng(w->classCount * 7919 + selsPerClass);
+    BenchZipf classZipf(w->classCount, 1.0);
+    BenchZipf selZipf(selsPerClass, s);
+    BenchZipf narrowZipf(narrowTo ? narrowTo : 1, s);
+    std::vector<uint32_t> base(w->classCount);
+    for (auto& b : base) b = rng.below((uint32_t)(poolSize - selsPerClass));
+
+    w->stream.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t cls = (uint32_t)classZipf.next(rng);
+        bool narrow = phaseAt  &&  i >= phaseAt;
+        uint32_t sel = base[cls] + (uint32_t)
+            (narrow ? narrowZipf.next(rng) : selZipf.next(rng));
+        w->stream.push_back(Message{cls, sel});
+    }
+}
+
+// Every class flushed every `interval` messages.
+static void
+flushAll(Workload *w, size_t interval)
+{
+    for (size_t at = interval; at < w->stream.size(); at += interval) {
+        w->flushes.push_back(Flush{at, 0, 0, NoSel});
+    }
+}
+
+// One of the hottest selectors swizzled every `interval` messages,
+// like method_exchangeImplementations() on a root class method.
+static void
+swizzle(Workload *w, size_t interval)
+{
+    BenchRandom rng((uint32_t)interval);
+    for (size_t at = interval; at < w->stream.size(); at += interval) {
+        uint32_t sel = w->stream[at - 1 - rng.below(64)].sel;
+        w->flushes.push_back(Flush{at, 0, 0, sel});
+    }
+}
+
+// A random run of `count` classes flushed every `interval` messages,
+// like a category attached to a class with `count` subclasses.
+static void
+flushSome(Workload *w, size_t interval, uint32_t count)
+{
+    BenchRandom rng((uint32_t)interval);
+    for (size_t at = interval; at < w->stream.size(); at += interval) {
+        uint32_t first = rng.below(w->classCount - count + 1);
+        w->flushes.push_back(Flush{at, first, count, NoSel});
+    }
+}
+
+
+static void
+replay(const Workload *w, const Policy& p, bool evict = false)
+{
+    std::vector<HostCache> caches(w->classCount);
+    HostCacheStats stats;
+    const BenchSelectors& sels = *w->selectors;
+
+    size_t nextFlush = 0;
+    double byteSum = 0;
+    size_t byteSamples = 0;
+    size_t peakBytes = 0;
+
+    uint64_t start = nanoseconds();
+    for (size_t i = 0; i < w->stream.size(); i++) {
+        while (nextFlush < w->flushes.size()  &&
+               w->flushes[nextFlush].at == i)
+        {
+            const Flush& f = w->flushes[nextFlush++];
+            uint32_t end = f.count ? f.first + f.count : w->classCount;
+            for (uint32_t c = f.count ? f.first : 0; c < end; c++) {
+                if (evict  &&  f.sel != NoSel) {
+                    caches[c].evict(sels[f.sel], &stats);
+                } else {
+                    caches[c].flush(p.policy, &stats);
+                }
+            }
+        }
+
+        const Message& m = w->stream[i];
+        uintptr_t key = sels[m.sel];
+        benchkeep(caches[m.cls].lookupOrFill(key, key, p.policy, &stats));
+
+        if (i % SampleInterval == 0) {
+            size_t bytes = 0;
+            for (auto& c : caches) bytes += c.bytes();
+            byteSum += bytes;
+            byteSamples++;
+            peakBytes = std::max(peakBytes, bytes);
+        }
+    }
+    uint64_t ns = nanoseconds() - start;
+
+    double n = (double)w->stream.size();
+    printf("  %-22s %6.2f ns/msg  miss %5.2f%%  expansions %6llu  "
+           "shrinks %6llu  mean %8.0f KB  peak %8.0f KB\n",
+           p.name, ns / n, 100.0 * stats.misses / n,
+           (unsigned long long)stats.expansions,
+           (unsigned long long)stats.shrinks,
+           byteSum / byteSamples / 1024.0, peakBytes / 1024.0);
+    if (evict) {
+        printf("    evicted %llu entries, kept %llu that flushes "
+               "would have erased\n",
+               (unsigned long long)stats.evictions,
+               (unsigned long long)stats.retained);
+    }
+}
+
+
+int main()
+{
+    for (auto& p : policies) benchassert(p.policy.isValid());
+
+    size_t count = benchscale(4000000);
+    std::vector<Workload *> workloads;
+
+    // Swizzling at runtime: everything flushed often.
+    Workload *w = new Workload{"flush all", 512, nullptr, {}, {}};
+    generate(w, 64, 1.0, count);
+    flushAll(w, 20000);
+    workloads.push_back(w);
+
+    // Categories loaded over time: a few classes flushed very often.
+    w = new Workload{"flush subtrees", 512, nullptr, {}, {}};
+    generate(w, 64, 1.0, count);
+    flushSome(w, 2000, 32);
+    workloads.push_back(w);
+
+    // Launch touches many selectors, then the app settles down.
+    w = new Workload{"phase change", 512, nullptr, {}, {}};
+    generate(w, 512, 0.9, count, count / 4, 16);
+    flushAll(w, 50000);
+    workloads.push_back(w);
+
+    // A hot selector swizzled over and over.
+    w = new Workload{"swizzle", 512, nullptr, {}, {}};
+    generate(w, 64, 1.0, count);
+    swizzle(w, 20000);
+    workloads.push_back(w);
+
+    // A few root classes that receive nearly every selector.
+    w = new Workload{"megamorphic root", 4, nullptr, {}, {}};
+    generate(w, 40000, 0.6, count);
+    flushAll(w, 500000);
+    workloads.push_back(w);
+
+    for (Workload *w : workloads) {
+        printf("%s: %u classes, %zu selectors, %zu messages, %zu flushes\n",
+               w->name, w->classCount, w->selectors->count(),
+               w->stream.size(), w->flushes.size());
+        for (auto& p : policies) replay(w, p);
+        bool swizzles = false;
+        for (auto& f : w->flushes) swizzles |= (f.sel != NoSel);
+        if (swizzles) replay(w, Policy{"default, evict", 
+                                       objc::cache_policy_default}, true);
+    }
+
+    return 0;
+}
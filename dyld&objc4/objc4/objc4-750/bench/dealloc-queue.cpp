@@ -0,0 +1,252 @@
+// dealloc-queue.cpp
+// Release objects whose teardown is costly on the releasing thread, as
+// rootDealloc() does, and by handing them to reaper threads through
+// objc-dealloc-queue-engine.h, as it does for classes that implement
+// +_deallocsInBackground.
+//
+// usage: dealloc-queue
+//
+// Each HostObject owns a graph of malloc'd nodes that its teardown
+// frees, standing in for ivars released by .cxx_destruct. The releasing
+// thread allocates and releases objects in a loop; its release latency
+// is the time rootDealloc() would take. Pushes and pops take no lock;
+// reapers sleep on a mutex and condition variable standing in for
+// DeferredDeallocLock, and only a push into an empty queue wakes one.
+//
+// "sync" tears every object down at once. "deferred" queues it for 2
+// reapers. "shared" is "deferred" with 4 releasing threads sharing
+// the queue. "bounded" gives the queue room for only 256 objects, so
+// that the releasing thread outruns the reapers and does the teardown
+// of the objects the queue refuses itself; the queue must never hold
+// more than that. "pressure" sets memory pressure halfway through,
+// which drains the queue on the releasing thread and refuses
+// everything after.
+// Reclaim latency is the time from release until a reaper finished the
+// teardown, from the queue's log2 histogram.
+//
+// Every object must be torn down exactly once.
+
+#include "bench.h"
+#include "objc-dealloc-queue-engine.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+using objc::DeallocQueue;
+using objc::DeallocQueueCell;
+using objc::DeallocQueueItem;
+
+enum { Reapers = 2, ReaperBatch = 64 };
+
+struct Node {
+    Node *next;
+    char payload[48];
+};
+
+struct HostObject {
+    Node *graph;
+    size_t bytes;
+    std::atomic<unsigned> teardowns;
+
+    explicit HostObject(unsigned nodes) : graph(nullptr), teardowns(0) {
+        for (unsigned i = 0; i < nodes; i++) {
+            Node *n = (Node *)malloc(sizeof(Node));
+            n->next = graph;
+            memset(n->payload, (int)i, sizeof(n->payload));
+            graph = n;
+        }
+        bytes = sizeof(*this) + nodes * sizeof(Node);
+    }
+
+    // object_dispose(): frees the graph; the object itself is freed
+    // by the run so that teardowns can be checked.
+    void teardown() {
+        if (teardowns++ != 0) benchfail("torn down twice");
+        Node *n = graph;
+        while (n) {
+            Node *next = n->next;
+            free(n);
+            n = next;
+        }
+        graph = nullptr;
+    }
+};
+
+struct HostDeallocQueue {
+    std::mutex lock;
+    std::condition_variable cond;
+    DeallocQueue queue;
+    std::vector<DeallocQueueCell> storage;
+    std::vector<std::thread> reapers;
+    std::atomic<bool> stopping{false};
+
+    HostDeallocQueue(size_t limit, size_t maxBytes) : storage(limit) {
+        queue.init(storage.data(), limit, maxBytes);
+        for (unsigned i = 0; i < Reapers; i++) {
+            reapers.emplace_back([this]{ reap(); });
+        }
+    }
+
+    ~HostDeallocQueue() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto& t : reapers) t.join();
+    }
+
+    // deferred_dealloc_take()
+    size_t take(DeallocQueueItem *batch) {
+        size_t count = 0;
+        while (count < ReaperBatch  &&  queue.pop(&batch[count])) count++;
+        return count;
+    }
+
+    // deferred_dealloc_wait()
+    bool wait() {
+        std::unique_lock<std::mutex> l(lock);
+        if (!queue.empty()  ||  stopping) return false;
+        do cond.wait(l); while (queue.empty()  &&  !stopping);
+        return true;
+    }
+
+    void dispose(DeallocQueueItem *batch, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            ((HostObject *)batch[i].object)->teardown();
+            queue.reclaimed(batch[i], nanoseconds());
+        }
+    }
+
+    // deferred_dealloc_reaper()
+    void reap() {
+        DeallocQueueItem batch[ReaperBatch];
+        while (true) {
+            size_t count = take(batch);
+            if (count == 0) {
+                if (stopping  &&  queue.empty()) return;
+                if (!wait()) std::this_thread::yield();
+                continue;
+            }
+            if (count == ReaperBatch) {
+                std::lock_guard<std::mutex> l(lock);
+                cond.notify_one();
+            }
+            dispose(batch, count);
+        }
+    }
+
+    // deferDealloc()
+    bool defer(HostObject *obj) {
+        bool wasEmpty;
+        if (queue.push(obj, obj->bytes, nanoseconds(), &wasEmpty) != 
+            DeallocQueue::Queued) 
+        {
+            return false;
+        }
+        if (wasEmpty) {
+            std::lock_guard<std::mutex> l(lock);
+            cond.notify_one();
+        }
+        return true;
+    }
+
+    // _objc_setDeferredDeallocUnderPressure()
+    void setPressure(bool underPressure) {
+        queue.setPressure(underPressure);
+        if (!underPressure) return;
+        DeallocQueueItem batch[ReaperBatch];
+        size_t count;
+        while ((count = take(batch))) dispose(batch, count);
+    }
+};
+
+enum Mode { Sync, Deferred, Shared, Bounded, Pressure };
+
+// The lower bound of the histogram bucket holding percentile p.
+static uint64_t histogramPercentile(const DeallocQueue::Stats& stats, double p)
+{
+    uint64_t total = stats.reclaimed.load();
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < DeallocQueue::HistogramBuckets; i++) {
+        seen += stats.latencyHistogram[i].load();
+        if (total  &&  seen >= p / 100.0 * total) return i ? 1ull << i : 0;
+    }
+    return 0;
+}
+
+static void run(const char *label, Mode mode, unsigned nodes, size_t count)
+{
+    size_t limit = mode == Bounded ? 256 : 4096;
+    size_t maxBytes = 16*1024*1024;
+
+    std::vector<HostObject *> objects(count);
+    for (auto& obj : objects) obj = new HostObject(nodes);
+
+    std::unique_ptr<HostDeallocQueue> q;
+    if (mode != Sync) q.reset(new HostDeallocQueue(limit, maxBytes));
+
+    // Each releasing thread releases every threads'th object.
+    unsigned threads = mode == Shared ? 4 : 1;
+    std::vector<BenchLatency> latencies(threads);
+    uint64_t start = nanoseconds();
+    benchthreads(threads, [&](unsigned t) {
+        for (size_t i = t; i < count; i += threads) {
+            if (mode == Pressure  &&  i == count / 2) q->setPressure(true);
+            HostObject *obj = objects[i];
+            uint64_t t0 = nanoseconds();
+            if (!q  ||  !q->defer(obj)) obj->teardown();
+            latencies[t].add(nanoseconds() - t0);
+        }
+    });
+    uint64_t elapsed = nanoseconds() - start;
+    BenchLatency release;
+    for (auto& l : latencies) release.merge(l);
+
+    char title[128];
+    snprintf(title, sizeof(title), "%-8s %3u nodes: release", label, nodes);
+    release.print(title);
+    printf("%-8s %3u nodes: releasing threads %.1f ns/object\n",
+           label, nodes, (double)elapsed / count);
+
+    if (q) {
+        auto& stats = q->queue.statistics();
+        while (stats.reclaimed.load() != stats.deferred.load()) {
+            std::this_thread::yield();
+        }
+        printf("%-8s %3u nodes: %llu deferred, %llu refused, "
+               "max depth %llu (%llu KB), reclaim p50 >= %llu p99 >= %llu "
+               "(ns)\n", label, nodes,
+               (unsigned long long)stats.deferred.load(),
+               (unsigned long long)stats.refused.load(),
+               (unsigned long long)stats.maxDepth.load(),
+               (unsigned long long)stats.maxBytes.load() / 1024,
+               (unsigned long long)histogramPercentile(stats, 50),
+               (unsigned long long)histogramPercentile(stats, 99));
+        benchassert(stats.maxDepth.load() <= limit);
+        benchassert(stats.maxBytes.load() <= maxBytes);
+        if (mode == Pressure) benchassert(stats.deferred.load() <= count / 2);
+        q.reset();
+    }
+
+    for (auto obj : objects) {
+        if (obj->teardowns != 1) benchfail("%s: object torn down %u times",
+                                           label, obj->teardowns.load());
+        delete obj;
+    }
+}
+
+int main()
+{
+    size_t count = benchscale(200000);
+    for (unsigned nodes : { 16u, 256u }) {
+        size_t n = nodes > 16 ? count / 8 : count;
+        run("sync", Sync, nodes, n);
+        run("deferred", Deferred, nodes, n);
+        run("shared", Shared, nodes, n);
+        run("bounded", Bounded, nodes, n);
+        run("pressure", Pressure, nodes, n);
+    }
+    return 0;
+}
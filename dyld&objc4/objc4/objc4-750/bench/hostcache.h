@@ -0,0 +1,182 @@
+// hostcache.h
+// A host-side method cache built from runtime/objc-cache-engine.h.
+//
+// HostCache follows cache_t's algorithm: probe with cache_probe(),
+// grow and shrink with cache_policy_t, drop old contents on
+// reallocation, and start every class on a shared read-only empty
+// cache. It has no messenger, so it is driven directly by the
+// benchmarks.
+
+#ifndef HOSTCACHE_H
+#define HOSTCACHE_H
+
+#include "bench.h"
+#include "objc-cache-engine.h"
+
+#if __arm64__
+static constexpr objc::CacheScan host_cache_scan = objc::CacheScan::Decrement;
+#else
+static constexpr objc::CacheScan host_cache_scan = objc::CacheScan::Increment;
+#endif
+
+typedef uint32_t host_mask_t;
+typedef uintptr_t host_key_t;
+
+// Like bucket_t::EvictedKey.
+static const host_key_t host_evicted_key = 2;
+
+struct HostBucket {
+    host_key_t _key;
+    uintptr_t _imp;
+
+    host_key_t key() const { return _key; }
+    uintptr_t imp() const { return _imp; }
+    void set(host_key_t newKey, uintptr_t newImp) {
+        _key = newKey;
+        _imp = newImp;
+    }
+};
+
+struct HostCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t allocations = 0;   // reallocations including the first one
+    uint64_t expansions = 0;    // reallocations that grew capacity
+    uint64_t flushes = 0;       // non-empty caches erased
+    uint64_t shrinks = 0;       // flushes that reduced capacity
+    uint64_t evictions = 0;     // entries evicted by selector
+    uint64_t retained = 0;      // entries evictions kept that flushes erase
+    BenchHistogram probes;      // buckets examined per lookup
+
+    void merge(const HostCacheStats& other) {
+        hits += other.hits;
+        misses += other.misses;
+        allocations += other.allocations;
+        expansions += other.expansions;
+        flushes += other.flushes;
+        shrinks += other.shrinks;
+        evictions += other.evictions;
+        retained += other.retained;
+        probes.merge(other.probes);
+    }
+};
+
+class HostCache {
+    HostBucket *_buckets;
+    host_mask_t _mask;
+    host_mask_t _occupied;
+
+    static HostBucket *emptyBuckets() {
+        static HostBucket empty[1];
+        return empty;
+    }
+
+ public:
+    HostCache() : _buckets(emptyBuckets()), _mask(0), _occupied(0) { }
+    ~HostCache() { if (canBeFreed()) free(_buckets); }
+    HostCache(const HostCache&) = delete;
+    HostCache& operator = (const HostCache&) = delete;
+
+    host_mask_t capacity() const { return _mask ? _mask+1 : 0; }
+    host_mask_t occupied() const { return _occupied; }
+    bool isConstantEmptyCache() const { return _buckets == emptyBuckets(); }
+    bool canBeFreed() const { return !isConstantEmptyCache(); }
+    size_t bytes() const {
+        return canBeFreed() ? capacity() * sizeof(HostBucket) : 0;
+    }
+
+    // Like cache_getImp(). Returns 0 on a miss.
+    uintptr_t lookup(host_key_t key, BenchHistogram *probes = nullptr) const {
+        // The runtime's empty buckets match the mask; these don't.
+        if (isConstantEmptyCache()) {
+            if (probes) probes->add(1);
+            return 0;
+        }
+        uint32_t count;
+        HostBucket *b =
+            objc::cache_probe<host_cache_scan>(_buckets, _mask, key, &count);
+        if (probes) probes->add(count);
+        return (b  &&  b->key() == key) ? b->imp() : 0;
+    }
+
+    void reallocate(host_mask_t oldCapacity, host_mask_t newCapacity,
+                    HostCacheStats *stats)
+    {
+        if (canBeFreed()) free(_buckets);
+        _buckets = (HostBucket *)calloc(newCapacity, sizeof(HostBucket));
+        _mask = newCapacity - 1;
+        _occupied = 0;
+        if (stats) {
+            stats->allocations++;
+            if (newCapacity > oldCapacity  &&  oldCapacity) stats->expansions++;
+        }
+    }
+
+    // Like cache_fill_nolock(), with the policy as a parameter.
+    void fill(host_key_t key, uintptr_t imp,
+              const objc::cache_policy_t& policy, HostCacheStats *stats)
+    {
+        host_mask_t newOccupied = _occupied + 1;
+        host_mask_t cap = capacity();
+        if (isConstantEmptyCache()) {
+            reallocate(cap, cap ?: policy.initCapacity, stats);
+        }
+        else if (policy.canFill(newOccupied, cap)) {
+            // use it as-is
+        }
+        else {
+            reallocate(cap, policy.expandedCapacity(cap, ~(host_mask_t)0),
+                       stats);
+        }
+
+        HostBucket *b = objc::cache_probe<host_cache_scan>(_buckets, _mask, key);
+        benchassert(b);
+        if (b->key() == 0) _occupied++;
+        b->set(key, imp);
+    }
+
+    // Like cache_erase_nolock(): back to the shared empty cache,
+    // keeping the capacity the policy chooses for the next fill.
+    void flush(const objc::cache_policy_t& policy, HostCacheStats *stats) {
+        host_mask_t cap = capacity();
+        if (cap == 0  ||  _occupied == 0) return;
+        host_mask_t newCapacity = policy.flushedCapacity(cap, _occupied);
+        free(_buckets);
+        _buckets = emptyBuckets();
+        _mask = newCapacity - 1;
+        _occupied = 0;
+        if (stats) {
+            stats->flushes++;
+            if (newCapacity < cap) stats->shrinks++;
+        }
+    }
+
+    // Like cache_evict_nolock(): remove key, keep everything else.
+    void evict(host_key_t key, HostCacheStats *stats) {
+        if (_occupied == 0) return;
+        HostBucket *b = objc::cache_probe<host_cache_scan>(_buckets, _mask, key);
+        bool evicted = (b  &&  b->key() == key);
+        if (evicted) b->set(host_evicted_key, b->imp());
+        if (stats) {
+            stats->evictions += evicted;
+            stats->retained += _occupied - evicted;
+        }
+    }
+
+    // Like cache_getImp() followed by lookUpImpOrForward()'s cache_fill().
+    uintptr_t lookupOrFill(host_key_t key, uintptr_t imp,
+                           const objc::cache_policy_t& policy,
+                           HostCacheStats *stats)
+    {
+        uintptr_t result = lookup(key, stats ? &stats->probes : nullptr);
+        if (result) {
+            if (stats) stats->hits++;
+            return result;
+        }
+        if (stats) stats->misses++;
+        fill(key, imp, policy, stats);
+        return imp;
+    }
+};
+
+#endif
@@ -0,0 +1,166 @@
+// method-index.cpp
+// Compare getMethodNoSuper_nolock()'s list-by-list binary search with
+// a method_index_tt, for classes with 1 to 50 categories.
+//
+// usage: method-index
+//
+// Each class has one base method list and some number of category
+// lists, all sorted by selector address as fixupMethodList() leaves
+// them. Some category methods override base methods. Lookups are half
+// hits and half misses, because a method search runs on every class
+// of the superclass chain and misses in all but one of them.
+// Every index result is checked against list search.
+
+#include "bench.h"
+#include "objc-method-index-engine.h"
+
+struct HostMethod {
+    uintptr_t name;
+    const char *types;
+    uintptr_t imp;
+};
+
+typedef objc::method_index_tt<uintptr_t, const HostMethod> HostMethodIndex;
+
+struct HostClass {
+    // Search order: newest category first, base methods last.
+    std::vector<std::vector<HostMethod>> lists;
+    std::vector<uintptr_t> hits;
+
+    size_t methodCount() const {
+        size_t result = 0;
+        for (auto& list : lists) result += list.size();
+        return result;
+    }
+
+    // Like getMethodNoSuper_nolock() without an index.
+    const HostMethod *search(uintptr_t sel) const {
+        for (auto& list : lists) {
+            const HostMethod *m = objc::sorted_method_search
+                (list.data(), (uint32_t)list.size(), sel);
+            if (m) return m;
+        }
+        return nullptr;
+    }
+
+    HostMethodIndex *buildIndex() const {
+        HostMethodIndex *index =
+            HostMethodIndex::create((uint32_t)methodCount());
+        for (auto& list : lists) {
+            for (auto& m : list) index->insert(m.name, &m);
+        }
+        return index;
+    }
+};
+
+static HostClass *
+makeClass(const BenchSelectors& sels, BenchRandom& rng,
+          unsigned baseCount, unsigned categories, unsigned perCategory)
+{
+    HostClass *cls = new HostClass;
+    cls->lists.resize(categories + 1);
+
+    // Selectors [0, half) may be implemented; [half, count) never are.
+    uint32_t half = (uint32_t)sels.count() / 2;
+    auto addMethod = [&](std::vector<HostMethod>& list, uintptr_t sel) {
+        list.push_back(HostMethod{sel, "v16@0:8", rng.next()});
+        cls->hits.push_back(sel);
+    };
+
+    for (unsigned i = 0; i < baseCount; i++) {
+        addMethod(cls->lists[categories], sels[rng.below(half)]);
+    }
+    for (unsigned c = 0; c < categories; c++) {
+        for (unsigned i = 0; i < perCategory; i++) {
+            // One in four category methods overrides a base method.
+            uintptr_t sel = (i % 4 == 0)
+                ? cls->lists[categories][rng.below(baseCount)].name
+                : sels[rng.below(half)];
+            addMethod(cls->lists[c], sel);
+        }
+    }
+
+    for (auto& list : cls->lists) {
+        std::stable_sort(list.begin(), list.end(),
+                         [](const HostMethod& a, const HostMethod& b) {
+                             return a.name < b.name;
+                         });
+    }
+    return cls;
+}
+
+static void
+run(unsigned categories, const BenchSelectors& sels, size_t lookups)
+{
+    enum { ClassCount = 64, BaseCount = 64, PerCategory = 8 };
+
+    BenchRandom rng(categories + 1);
+    std::vector<HostClass *> classes;
+    for (unsigned i = 0; i < ClassCount; i++) {
+        classes.push_back(makeClass(sels, rng, BaseCount,
+                                    categories, PerCategory));
+    }
+
+    // Lookup stream: class, selector.
+    uint32_t half = (uint32_t)sels.count() / 2;
+    std::vector<std::pair<uint32_t, uintptr_t>> stream;
+    stream.reserve(lookups);
+    for (size_t i = 0; i < lookups; i++) {
+        uint32_t c = rng.below(ClassCount);
+        auto& hits = classes[c]->hits;
+        uintptr_t sel = (i & 1)
+            ? hits[rng.below((uint32_t)hits.size())]
+            : sels[half + rng.below(half)];
+        stream.push_back({c, sel});
+    }
+
+    uint64_t start = nanoseconds();
+    for (auto& l : stream) benchkeep(classes[l.first]->search(l.second));
+    uint64_t listNs = nanoseconds() - start;
+
+    start = nanoseconds();
+    std::vector<HostMethodIndex *> indexes;
+    for (HostClass *cls : classes) indexes.push_back(cls->buildIndex());
+    uint64_t buildNs = nanoseconds() - start;
+
+    start = nanoseconds();
+    for (auto& l : stream) benchkeep(indexes[l.first]->find(l.second));
+    uint64_t indexNs = nanoseconds() - start;
+
+    size_t bytes = 0;
+    for (auto& l : stream) {
+        if (indexes[l.first]->find(l.second) !=
+            classes[l.first]->search(l.second))
+        {
+            benchfail("index disagrees with list search");
+        }
+    }
+    for (HostMethodIndex *index : indexes) {
+        bytes += index->byteSize();
+        free(index);
+    }
+
+    double n = (double)lookups;
+    printf("  %2u categories  %4zu methods  list search %6.2f ns  "
+           "index %6.2f ns  build %7.0f ns/class  index %6zu bytes/class\n",
+           categories, classes[0]->methodCount(),
+           listNs / n, indexNs / n, (double)buildNs / ClassCount,
+           bytes / ClassCount);
+
+    for (HostClass *cls : classes) delete cls;
+}
+
+
+int main()
+{
+    static const unsigned categoryCounts[] = { 1, 2, 5, 10, 20, 50 };
+
+    BenchSelectors sels(16384);
+    size_t lookups = benchscale(2000000);
+
+    printf("method search: 64 classes, 64 base methods, "
+           "8 methods per category, %zu lookups\n", lookups);
+    for (unsigned c : categoryCounts) run(c, sels, lookups);
+
+    return 0;
+}
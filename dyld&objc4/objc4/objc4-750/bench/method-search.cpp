@@ -0,0 +1,166 @@
+// method-search.cpp
+// Compare findMethodInSortedMethodList()'s binary search over method_t
+// with sel_shadow_t's kernels, for sorted lists of 4 to 4096 methods.
+//
+// usage: method-search
+//
+// Built twice on x86_64: method-search has the SSE2 and scalar kernels,
+// method-search-avx2 adds the AVX2 kernel.
+//
+// Each list size gets enough lists to spill out of L1, so lookups see
+// realistic cache misses. Half the lookups are misses. Every kernel's
+// answer is checked against the binary search.
+
+#include "bench.h"
+#include "objc-method-index-engine.h"
+
+struct HostMethod {
+    uintptr_t name;
+    const char *types;
+    uintptr_t imp;
+};
+
+using objc::SelSearchKernel;
+using objc::sel_shadow_t;
+
+struct List {
+    std::vector<HostMethod> methods;
+    sel_shadow_t *shadow;
+};
+
+struct Lookup {
+    uint32_t list;
+    uintptr_t sel;
+};
+
+enum { BatchSize = 16 };
+
+static const char *kernelName(SelSearchKernel k)
+{
+    switch (k) {
+    case SelSearchKernel::Scalar: return "scalar";
+    case SelSearchKernel::SSE2:   return "sse2";
+    case SelSearchKernel::AVX2:   return "avx2";
+    }
+    return "?";
+}
+
+template <SelSearchKernel Kernel>
+static void
+runKernel(const std::vector<List>& lists, const std::vector<Lookup>& lookups)
+{
+    uint64_t start = nanoseconds();
+    for (auto& l : lookups) {
+        benchkeep(lists[l.list].shadow->template find<Kernel>(l.sel));
+    }
+    uint64_t single = nanoseconds() - start;
+
+    // Batches of BatchSize selectors against one list,
+    // as for a respondsToSelector: sweep or addMethods().
+    std::vector<uintptr_t> keys(BatchSize);
+    std::vector<int32_t> found(BatchSize);
+    uint64_t batchNs = 0;
+    for (size_t i = 0; i + BatchSize <= lookups.size(); i += BatchSize) {
+        const List& list = lists[lookups[i].list];
+        for (unsigned j = 0; j < BatchSize; j++) keys[j] = lookups[i+j].sel;
+
+        start = nanoseconds();
+        list.shadow->template findMany<Kernel>(keys.data(), BatchSize,
+                                               found.data());
+        batchNs += nanoseconds() - start;
+
+        for (unsigned j = 0; j < BatchSize; j++) {
+            const HostMethod *m = objc::sorted_method_search
+                (list.methods.data(), (uint32_t)list.methods.size(), keys[j]);
+            int32_t expected = m ? (int32_t)(m - list.methods.data()) : -1;
+            if (found[j] != expected) benchfail("batch search disagrees");
+        }
+    }
+
+    for (auto& l : lookups) {
+        const List& list = lists[l.list];
+        const HostMethod *m = objc::sorted_method_search
+            (list.methods.data(), (uint32_t)list.methods.size(), l.sel);
+        int32_t expected = m ? (int32_t)(m - list.methods.data()) : -1;
+        if (list.shadow->template find<Kernel>(l.sel) != expected) {
+            benchfail("%s search disagrees", kernelName(Kernel));
+        }
+    }
+
+    double n = (double)lookups.size();
+    printf(" %s %6.2f (batch %6.2f)", kernelName(Kernel),
+           single / n, batchNs / n);
+}
+
+static void
+run(uint32_t size, const BenchSelectors& sels, size_t lookupCount)
+{
+    BenchRandom rng(size);
+    uint32_t listCount = std::max<uint32_t>(1, 65536 / size);
+    uint32_t half = (uint32_t)sels.count() / 2;
+
+    std::vector<List> lists(listCount);
+    for (auto& list : lists) {
+        for (uint32_t i = 0; i < size; i++) {
+            list.methods.push_back(HostMethod{sels[rng.below(half)],
+                                              "v16@0:8", rng.next()});
+        }
+        std::stable_sort(list.methods.begin(), list.methods.end(),
+                         [](const HostMethod& a, const HostMethod& b) {
+                             return a.name < b.name;
+                         });
+        list.shadow = sel_shadow_t::create(nullptr, list.methods.data(), size);
+    }
+
+    std::vector<Lookup> lookups;
+    lookups.reserve(lookupCount);
+    for (size_t i = 0; i < lookupCount; i++) {
+        uint32_t l = rng.below(listCount);
+        uintptr_t sel = (i & 1)
+            ? lists[l].methods[rng.below(size)].name
+            : sels[half + rng.below(half)];
+        lookups.push_back(Lookup{l, sel});
+    }
+
+    uint64_t start = nanoseconds();
+    for (auto& l : lookups) {
+        const List& list = lists[l.list];
+        benchkeep(objc::sorted_method_search
+                  (list.methods.data(), (uint32_t)list.methods.size(), l.sel));
+    }
+    uint64_t binary = nanoseconds() - start;
+
+    printf("  %4u methods  ns/lookup: method_t %6.2f |", size,
+           binary / (double)lookupCount);
+    runKernel<SelSearchKernel::Scalar>(lists, lookups);
+#if __x86_64__  &&  __SSE2__
+    runKernel<SelSearchKernel::SSE2>(lists, lookups);
+#endif
+#if __x86_64__  &&  __AVX2__
+    runKernel<SelSearchKernel::AVX2>(lists, lookups);
+#endif
+    printf("\n");
+
+    for (auto& list : lists) free(list.shadow);
+}
+
+
+int main()
+{
+#if __x86_64__  &&  __AVX2__
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("skipped: this CPU has no AVX2\n");
+        return 0;
+    }
+#endif
+
+    BenchSelectors sels(65536);
+    size_t lookups = benchscale(2000000);
+
+    printf("sorted method list search (default kernel %s), %zu lookups\n",
+           kernelName(objc::sel_search_kernel), lookups);
+    for (uint32_t size = 4; size <= 4096; size *= 2) run(size, sels, lookups);
+
+    return 0;
+}
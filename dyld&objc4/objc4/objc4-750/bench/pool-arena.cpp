@@ -0,0 +1,232 @@
+// pool-arena.cpp
+// Fill an autorelease pool with a million objects and pop it, with pages
+// of different sizes allocated one at a time, as AutoreleasePoolPage
+// does by default, and taken from objc-pool-arena-engine.h, as it does
+// with OBJC_POOL_ARENA=n.
+//
+// usage: pool-arena
+//
+// HostPool links its pages like AutoreleasePoolPage and kills the empty
+// ones after a pop, so every round allocates and frees all but the
+// first page again. "malloc" allocates each page with posix_memalign().
+// "arena" takes pages from arenas reserved with mmap(), the first one
+// page and each after twice the one before, up to 1 GB, and keeps 4
+// freed pages resident in each, as OBJC_POOL_ARENA does with madvise()
+// discarding the rest. Emptied arenas stay for the next round, and are
+// unmapped with the first. "huge" reserves 1 GB arenas and asks for transparent huge
+// pages with MADV_HUGEPAGE, standing in for superpages on Darwin; the
+// host's /sys/kernel/mm/transparent_hugepage settings decide whether
+// it gets any.
+// Columns are ns per autorelease, counting the pop, resident memory
+// above the starting point with the pool full and after the pop, and
+// the most address space the arenas reserved at once.
+
+#include "bench.h"
+#include "objc-pool-arena-engine.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using objc::PoolArena;
+
+static size_t residentBytes()
+{
+    // Linux only; elsewhere the RSS columns read 0.
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long size = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+enum Backing { Malloc, Arena, Huge };
+static const char *backingNames[] = { "malloc", "arena", "huge" };
+
+struct Page {
+    Page *parent;
+    Page *child;
+    uintptr_t *next;
+    PoolArena *arena;  // nullptr if allocated alone
+    uintptr_t *end;
+
+    uintptr_t *begin() { return (uintptr_t *)(this + 1); }
+};
+
+static const size_t ArenaLimit = 1ULL << 30;
+
+class HostPool {
+    size_t pageSize;
+    Backing backing;
+    Page *hot;
+    size_t reserved = 0;
+
+ public:
+    size_t reused = 0;  // discarded arena pages taken again
+    size_t maxReserved = 0;
+
+ private:
+    // newPoolArena()
+    PoolArena *newArena(PoolArena *prev) {
+        size_t bytes = pageSize;
+        if (prev) bytes = std::min(prev->regionBytes() * 2, ArenaLimit);
+        if (backing == Huge) bytes = ArenaLimit;
+        void *region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+        if (region == MAP_FAILED) benchfail("mmap failed");
+#ifdef MADV_HUGEPAGE
+        if (backing == Huge) madvise(region, bytes, MADV_HUGEPAGE);
+#endif
+        PoolArena *arena = new PoolArena;
+        arena->init(region, bytes, pageSize, 4 * pageSize);
+        reserved += bytes;
+        maxReserved = std::max(maxReserved, reserved);
+        return arena;
+    }
+
+    // destroyPoolArenas()
+    void destroyArenas(PoolArena *arena) {
+        while (arena) {
+            PoolArena *next = arena->next;
+            reserved -= arena->regionBytes();
+            munmap(arena->region(), arena->regionBytes());
+            delete arena;
+            arena = next;
+        }
+    }
+
+    Page *newPage(Page *parent) {
+        PoolArena *arena = nullptr;
+        if (backing != Malloc) arena = parent ? parent->arena : newArena(nullptr);
+        bool reuse;
+        void *mem = arena ? arena->take(&reuse) : nullptr;
+        if (!mem  &&  arena) {
+            if (!arena->next) arena->next = newArena(arena);
+            arena = arena->next;
+            mem = arena->take(&reuse);
+        }
+        // MADV_DONTNEED needs no MADV_FREE_REUSE to pair with; count them.
+        if (mem  &&  reuse) reused++;
+        if (!mem  &&  posix_memalign(&mem, pageSize, pageSize)) {
+            benchfail("no memory");
+        }
+        Page *page = (Page *)mem;
+        page->parent = parent;
+        page->child = nullptr;
+        page->next = page->begin();
+        page->end = (uintptr_t *)((char *)mem + pageSize);
+        page->arena = arena;
+        if (parent) parent->child = page;
+        return page;
+    }
+
+    void deletePage(Page *page) {
+        PoolArena *arena = page->arena;
+        if (!arena) return free(page);
+        if (!arena->isTop(page)) benchfail("arena page freed out of order");
+        void *discard;
+        if (size_t bytes = arena->give(page, &discard)) {
+            madvise(discard, bytes, MADV_DONTNEED);
+        }
+        if (!page->parent) destroyArenas(arena);
+    }
+
+    // AutoreleasePoolPage::kill()
+    void kill(Page *page) {
+        Page *last = page;
+        while (last->child) last = last->child;
+        Page *dead;
+        do {
+            dead = last;
+            last = last->parent;
+            if (last) last->child = nullptr;
+            deletePage(dead);
+        } while (dead != page);
+    }
+
+ public:
+    HostPool(Backing b, size_t page) : pageSize(page), backing(b) {
+        hot = newPage(nullptr);
+    }
+
+    ~HostPool() {
+        Page *cold = hot;
+        while (cold->parent) cold = cold->parent;
+        kill(cold);
+    }
+
+    uintptr_t *add(uintptr_t value) {
+        if (hot->next == hot->end) {
+            hot = hot->child ? hot->child : newPage(hot);
+        }
+        *hot->next = value;
+        return hot->next++;
+    }
+
+    // AutoreleasePoolPage::pop(), releasing every object.
+    uint64_t pop(uintptr_t *stop, Page *page) {
+        uint64_t sum = 0;
+        while (page->next != stop) {
+            while (hot->next == hot->begin()) hot = hot->parent;
+            sum += *--hot->next;
+        }
+        hot = page;
+        if (page->child) {
+            if (page->next - page->begin() < (page->end - page->begin()) / 2) {
+                kill(page->child);
+            } else if (page->child->child) {
+                kill(page->child->child);
+            }
+        }
+        return sum;
+    }
+
+    Page *hotPage() const { return hot; }
+};
+
+static void run(Backing backing, size_t pageSize, size_t objects,
+                size_t rounds)
+{
+    size_t before = residentBytes();
+    uint64_t elapsed = 0;
+    size_t fullRss = 0;
+    uint64_t expected = (uint64_t)objects * (objects + 1) / 2;
+    {
+        HostPool pool(backing, pageSize);
+        for (size_t r = 0; r < rounds; r++) {
+            uint64_t start = nanoseconds();
+            Page *page = pool.hotPage();
+            uintptr_t *token = pool.add(0);
+            for (size_t i = 1; i <= objects; i++) pool.add(i);
+            if (r == 0) fullRss = residentBytes();
+            uint64_t sum = pool.pop(token, page);
+            elapsed += nanoseconds() - start;
+            if (sum != expected) benchfail("lost an object");
+        }
+        size_t afterRss = residentBytes();
+        // Each round's pop discards all but 4 freed pages, and the next 
+        // round takes them again.
+        if (backing != Malloc  &&  rounds > 1) benchassert(pool.reused > 0);
+        printf("%-6s %4zu KB pages: %6.2f ns/autorelease  "
+               "%7.1f MB resident full  %7.1f MB after pop  "
+               "%7.1f MB reserved\n",
+               backingNames[backing], pageSize / 1024,
+               (double)elapsed / rounds / objects,
+               (double)(fullRss > before ? fullRss - before : 0) / (1 << 20),
+               (double)(afterRss > before ? afterRss - before : 0) / (1 << 20),
+               (double)pool.maxReserved / (1 << 20));
+    }
+}
+
+int main()
+{
+    size_t objects = 1000000;
+    size_t rounds = benchscale(40);
+    for (size_t pageSize : { 4096, 16384, 65536 }) {
+        run(Malloc, pageSize, objects, rounds);
+        run(Arena, pageSize, objects, rounds);
+    }
+    run(Huge, 65536, objects, rounds);
+    return 0;
+}
@@ -0,0 +1,244 @@
+// pool-drain.cpp
+// Pop an autorelease pool holding 100000 objects one slot at a time, as
+// AutoreleasePoolPage::releaseUntil() does by default, and a batch of up
+// to 128 slots at a time through objc_releaseMany()'s path, as it does
+// with OBJC_BATCHED_POOL_DRAIN.
+//
+// usage: pool-drain
+//
+// The pool is a list of 4 KB pages, 512 slots each, with the hot page
+// in a thread-local variable. The default drain reads the hot page,
+// takes one slot, scribbles it, and calls objc_release() for it. The
+// batched one takes the top of the hot page, most recent first, and
+// drops nil and tagged pointers with bulk_rc_filter(). It then releases
+// each run of one object with a single update, and deallocates after
+// the batch.
+// HostObject's isa is retain-many.cpp's: nonpointer, with an 8-bit
+// extra_rc at the top.
+//
+// "distinct" holds 100000 objects that the pop deallocates. "retained"
+// holds objects that something else also retains, so the pop only
+// decrements. "repeated" holds 1000 objects 100 times each in a row,
+// like objects autoreleased in a loop. "mixed" is retained objects, a
+// fifth of them tagged pointers, with a pool boundary every 64 slots.
+// Columns are pop latency and ns per slot.
+
+#include "bench.h"
+#include "objc-bulk-rc-engine.h"
+
+static const uint64_t Nonpointer = 1;
+static const uint64_t DeallocatingBit = 1ULL << 54;
+static const uint64_t RC_ONE = 1ULL << 56;
+static const uintptr_t TagMask = 1;
+static const uint8_t SCRIBBLE = 0xA3;
+
+enum { PageSlots = 512, Batch = 128 };
+
+struct alignas(16) HostObject {
+    std::atomic<uint64_t> isa;
+    unsigned deallocs;
+
+    void dealloc() { deallocs++; }
+
+    // rootRelease_inline(), for nonpointer isa with no side table.
+    bool release() {
+        uint64_t old = isa.load(std::memory_order_relaxed);
+        uint64_t value;
+        do {
+            if ((old >> 56) == 0) {
+                if (old & DeallocatingBit) benchfail("overreleased");
+                value = old | DeallocatingBit;
+            } else {
+                value = old - RC_ONE;
+            }
+        } while (!isa.compare_exchange_weak(old, value,
+                                            std::memory_order_release));
+        return value & DeallocatingBit;
+    }
+
+    // rootReleaseMany_inline()
+    bool releaseMany(uint64_t count) {
+        uint64_t old = isa.load(std::memory_order_relaxed);
+        uint64_t value;
+        do {
+            uint64_t extra = old >> 56;
+            if (extra >= count) {
+                value = old - count * RC_ONE;
+            } else if (extra + 1 == count  &&  !(old & DeallocatingBit)) {
+                value = (old & ~(0xffULL << 56)) | DeallocatingBit;
+            } else {
+                benchfail("overreleased");
+            }
+        } while (!isa.compare_exchange_weak(old, value,
+                                            std::memory_order_release));
+        return value & DeallocatingBit;
+    }
+};
+
+// objc_release()
+__attribute__((noinline))
+static void releaseOne(uintptr_t p)
+{
+    if (!p  ||  (p & TagMask)) return;
+    HostObject *obj = (HostObject *)p;
+    if (obj->release()) obj->dealloc();
+}
+
+// objc_releaseMany() and objc_object::releaseMany()
+__attribute__((noinline))
+static void releaseMany(const uintptr_t *objects, size_t count)
+{
+    uintptr_t batch[Batch];
+    HostObject *dealloc[Batch];
+    size_t live = objc::bulk_rc_filter(objects, count, TagMask, batch);
+    size_t deallocCount = 0;
+    for (size_t i = 0; i < live; ) {
+        size_t run = objc::bulk_rc_run_length(batch + i, live - i);
+        HostObject *obj = (HostObject *)batch[i];
+        i += run;
+        if (run > 1 ? obj->releaseMany(run) : obj->release()) {
+            dealloc[deallocCount++] = obj;
+        }
+    }
+    for (size_t i = 0; i < deallocCount; i++) dealloc[i]->dealloc();
+}
+
+struct Page {
+    Page *parent;
+    Page *child;
+    uintptr_t *next;
+    uintptr_t slots[PageSlots];
+
+    bool empty() const { return next == slots; }
+};
+
+static thread_local Page *HotPage;
+
+class HostPool {
+    std::vector<Page *> pages;
+
+ public:
+    HostPool() {
+        pages.push_back(new Page{nullptr, nullptr, nullptr, {}});
+        pages[0]->next = pages[0]->slots;
+        HotPage = pages[0];
+    }
+    ~HostPool() { for (Page *p : pages) delete p; }
+
+    uintptr_t *add(uintptr_t value) {
+        Page *page = HotPage;
+        if (page->next == page->slots + PageSlots) {
+            if (!page->child) {
+                Page *child = new Page{page, nullptr, nullptr, {}};
+                child->next = child->slots;
+                page->child = child;
+                pages.push_back(child);
+            }
+            page = HotPage = page->child;
+        }
+        *page->next = value;
+        return page->next++;
+    }
+
+    // releaseUntil().
+    static void releaseOneAtATime(Page *page, uintptr_t *stop) {
+        while (page->next != stop) {
+            Page *hot = HotPage;
+            while (hot->empty()) hot = HotPage = hot->parent;
+            uintptr_t obj = *--hot->next;
+            memset((void *)hot->next, SCRIBBLE, sizeof(*hot->next));
+            releaseOne(obj);
+        }
+        HotPage = page;
+    }
+
+    // releaseUntil() with OBJC_BATCHED_POOL_DRAIN.
+    static void releaseBatched(Page *page, uintptr_t *stop) {
+        while (page->next != stop) {
+            Page *hot = HotPage;
+            while (hot->empty()) hot = HotPage = hot->parent;
+            uintptr_t *start = (hot == page) ? stop : hot->slots;
+            if (hot->next - start > Batch) start = hot->next - Batch;
+            size_t count = hot->next - start;
+            uintptr_t batch[Batch];
+            for (size_t i = 0; i < count; i++) {
+                batch[i] = hot->next[-1 - (ptrdiff_t)i];
+            }
+            hot->next = start;
+            releaseMany(batch, count);
+        }
+        HotPage = page;
+    }
+};
+
+enum Profile { Distinct, Retained, Repeated, Mixed };
+static const char *profileNames[] = {
+    "distinct", "retained", "repeated", "mixed"
+};
+
+static void run(Profile profile, bool batched, size_t slots, size_t rounds)
+{
+    size_t objectCount = profile == Repeated ? slots / 100 : slots;
+    std::vector<HostObject> objects(objectCount);
+    BenchRandom rng(slots);
+    BenchLatency latency;
+    uint64_t total = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        uint64_t extra = (profile == Distinct) ? 0 : 1;
+        uint64_t refs = (profile == Repeated) ? 100 - 1 + extra : extra;
+        for (HostObject& obj : objects) {
+            obj.isa.store(Nonpointer | (refs << 56), std::memory_order_relaxed);
+            obj.deallocs = 0;
+        }
+
+        HostPool pool;
+        uintptr_t *token = pool.add(0);
+        for (size_t i = 0; i < slots; i++) {
+            if (profile == Repeated) {
+                pool.add((uintptr_t)&objects[i / 100]);
+            } else if (profile == Mixed  &&  i % 64 == 0) {
+                pool.add(0);  // a nested pool's boundary
+            } else if (profile == Mixed  &&  rng.below(5) == 0) {
+                pool.add(((uintptr_t)rng.below(1 << 20) << 4) | TagMask);
+            } else {
+                pool.add((uintptr_t)&objects[i]);
+            }
+        }
+
+        Page *page = (Page *)((uintptr_t)token - offsetof(Page, slots));
+        uint64_t start = nanoseconds();
+        if (batched) HostPool::releaseBatched(page, token);
+        else HostPool::releaseOneAtATime(page, token);
+        uint64_t elapsed = nanoseconds() - start;
+        latency.add(elapsed);
+        total += elapsed;
+
+        for (HostObject& obj : objects) {
+            uint64_t isa = obj.isa.load(std::memory_order_relaxed);
+            if (profile == Distinct) {
+                if (obj.deallocs != 1) benchfail("not deallocated");
+            } else if (profile != Mixed  &&  (obj.deallocs  ||  isa >> 56)) {
+                benchfail("wrong retain count");
+            }
+        }
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%-8s %-7s pop", profileNames[profile],
+             batched ? "batched" : "one");
+    latency.print(label);
+    printf("%-8s %-7s %.2f ns/slot\n", profileNames[profile],
+           batched ? "batched" : "one", (double)total / rounds / slots);
+}
+
+int main()
+{
+    size_t slots = 100000;
+    size_t rounds = benchscale(100);
+    for (Profile p : { Distinct, Retained, Repeated, Mixed }) {
+        run(p, false, slots, rounds);
+        run(p, true, slots, rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+// pool-pages.cpp
+// Push an autorelease pool, autorelease a burst of objects, and pop it,
+// over and over, allocating pool pages from malloc every time as
+// AutoreleasePoolPage::operator new did, and from objc-page-cache-engine.h.
+//
+// usage: pool-pages
+//
+// HostPool is a stack of 4 KB pages linked like AutoreleasePoolPage's,
+// and its pop() keeps or kills empty child pages with the same
+// hysteresis as AutoreleasePoolPage::pop(). The pool starts a quarter
+// full, so a burst of more than three quarters of a page crosses into
+// a new page, and a pop back to less than half full kills it.
+//
+// "malloc" allocates and frees every page. "cache" keeps 4 free pages
+// per thread and 16 global, the runtime's defaults. Bursts of 1.5 and
+// 3 pages fit in the thread cache; 12 pages spill into the global pool
+// and, beyond it, back to malloc. The last case runs 4 threads at once
+// with 12-page bursts, sharing the global pool.
+// Columns are ns per push/pop, pages allocated from malloc per
+// push/pop, and the most pages the caches held.
+
+#include "bench.h"
+#include "objc-page-cache-engine.h"
+
+#include <mutex>
+
+using objc::PageCache;
+using objc::PageCacheThread;
+
+enum { PageSize = 4096 };
+
+static PageCache Cache;
+static std::mutex CacheLock;
+static bool UseCache;
+static std::atomic<uint64_t> Mallocs;
+
+static void *allocPage(PageCacheThread& t)
+{
+    if (UseCache) {
+        if (void *page = Cache.take(t)) return page;
+        void *page;
+        {
+            std::lock_guard<std::mutex> lock(CacheLock);
+            page = Cache.takeGlobal(&t);
+        }
+        if (page) return page;
+        Cache.allocated();
+    }
+    Mallocs++;
+    void *page;
+    if (posix_memalign(&page, PageSize, PageSize)) benchfail("no memory");
+    return page;
+}
+
+static void freePages(objc::FreePage *list)
+{
+    size_t count = 0;
+    while (list) {
+        objc::FreePage *next = list->next;
+        free(list);
+        list = next;
+        count++;
+    }
+    Cache.freed(count);
+}
+
+static void freePage(PageCacheThread& t, void *page)
+{
+    if (UseCache) {
+        if (Cache.put(t, page)) return;
+        objc::FreePage *overflow;
+        {
+            std::lock_guard<std::mutex> lock(CacheLock);
+            overflow = Cache.putGlobal(&t, page);
+        }
+        return freePages(overflow);
+    }
+    free(page);
+}
+
+struct Page {
+    Page *parent;
+    Page *child;
+    uintptr_t *next;
+
+    static const size_t Count = (PageSize - 3 * sizeof(void *)) / sizeof(uintptr_t);
+    uintptr_t slots[Count];
+
+    bool full() const { return next == slots + Count; }
+    bool empty() const { return next == slots; }
+    bool lessThanHalfFull() const { return next - slots < (ptrdiff_t)Count / 2; }
+};
+static_assert(sizeof(Page) <= PageSize, "page too big");
+
+class HostPool {
+    PageCacheThread cache = {};
+    Page *hot;
+
+    Page *newPage(Page *parent) {
+        Page *page = (Page *)allocPage(cache);
+        page->parent = parent;
+        page->child = nullptr;
+        page->next = page->slots;
+        if (parent) parent->child = page;
+        return page;
+    }
+
+    // AutoreleasePoolPage::kill()
+    void kill(Page *page) {
+        Page *last = page;
+        while (last->child) last = last->child;
+        Page *dead;
+        do {
+            dead = last;
+            last = last->parent;
+            if (last) last->child = nullptr;
+            freePage(cache, dead);
+        } while (dead != page);
+    }
+
+ public:
+    HostPool() { hot = newPage(nullptr); }
+    ~HostPool() {
+        Page *cold = hot;
+        while (cold->parent) cold = cold->parent;
+        kill(cold);
+        // _destroyPoolPageCache()
+        if (UseCache) {
+            objc::FreePage *overflow;
+            {
+                std::lock_guard<std::mutex> lock(CacheLock);
+                overflow = Cache.flush(cache);
+            }
+            freePages(overflow);
+        }
+    }
+
+    uintptr_t *add(uintptr_t value) {
+        if (hot->full()) {
+            hot = hot->child ? hot->child : newPage(hot);
+        }
+        uintptr_t *slot = hot->next;
+        *hot->next++ = value;
+        return slot;
+    }
+
+    // AutoreleasePoolPage::pop(), with releaseUntil() releasing nothing.
+    void pop(uintptr_t *stop) {
+        Page *page = (Page *)((uintptr_t)stop & ~(uintptr_t)(PageSize - 1));
+        while (hot != page) {
+            hot->next = hot->slots;
+            hot = hot->parent;
+        }
+        page->next = stop;
+        if (page->child) {
+            if (page->lessThanHalfFull()) kill(page->child);
+            else if (page->child->child) kill(page->child->child);
+        }
+    }
+};
+
+static double bursts(HostPool& pool, size_t objects, size_t iterations)
+{
+    uint64_t start = nanoseconds();
+    for (size_t i = 0; i < iterations; i++) {
+        uintptr_t *token = pool.add(0);
+        for (size_t j = 0; j < objects; j++) pool.add(j + 1);
+        pool.pop(token);
+    }
+    return (double)(nanoseconds() - start) / iterations;
+}
+
+static void run(const char *label, bool useCache, double pages,
+                unsigned threads, size_t iterations)
+{
+    UseCache = useCache;
+    Cache.init(useCache ? 4 : 0, useCache ? 16 : 0);
+    Mallocs = 0;
+    size_t objects = (size_t)(pages * Page::Count);
+
+    std::atomic<uint64_t> totalNs{0};
+    benchthreads(threads, [&](unsigned) {
+        HostPool pool;
+        // Start a quarter full.
+        for (size_t i = 0; i < Page::Count / 4; i++) pool.add(i + 1);
+        double ns = bursts(pool, objects, iterations);
+        totalNs += (uint64_t)ns;
+    });
+
+    auto& s = Cache.statistics();
+    printf("%-7s %4.1f pages x%u: %9.1f ns/pop  %6.3f mallocs/pop  "
+           "max cached %llu\n", label, pages, threads,
+           (double)totalNs / threads,
+           (double)Mallocs / ((double)iterations * threads),
+           (unsigned long long)s.maxCached.load());
+    if (useCache) {
+        // Everything the pools freed went back to malloc or is cached.
+        benchassert(s.cached.load() <= 16);
+        benchassert(s.allocated.load() == Mallocs.load());
+    }
+}
+
+int main()
+{
+    size_t iterations = benchscale(200000);
+    for (double pages : { 1.5, 3.0, 12.0 }) {
+        size_t n = (size_t)(iterations / pages);
+        run("malloc", false, pages, 1, n);
+        run("cache", true, pages, 1, n);
+    }
+    run("malloc", false, 12.0, 4, iterations / 48);
+    run("cache", true, 12.0, 4, iterations / 48);
+    return 0;
+}
@@ -0,0 +1,241 @@
+// reclaim.cpp
+// Free replaced method caches the old way - once 32KB of garbage has
+// piled up and no thread is in a cache lookup at the same instant - and
+// with quiescent-state reclamation, which frees each block once every
+// thread has announced a quiescent state or been vouched for.
+//
+// usage: reclaim
+//
+// Readers stand in for threads sending messages. Each lookup loads one
+// class's buckets pointer and reads the buckets, with a flag set for
+// the duration in place of objc_msgSend's PC range. Every few lookups
+// a reader "calls into the runtime" and announces a quiescent state.
+// Idle threads are registered but never run, like threads parked in
+// the kernel. One writer replaces random classes' buckets, like cache
+// expansions and flushes.
+//
+// Reclaimed blocks are poisoned and quarantined instead of freed, so a
+// reader that sees a block reclaimed under it fails the benchmark.
+// Reading another thread's flag stands in for thread_get_state() and
+// is counted as "pc reads".
+
+#include "bench.h"
+#include "objc-epoch.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+
+enum {
+    ClassCount = 256,
+    BlockWords = 64,            // a 32-bucket cache
+    BlockBytes = (BlockWords + 1) * sizeof(uintptr_t),
+    Threshold = 32 * 1024,      // like garbage_threshold
+    QuarantineCount = 4096,
+};
+
+static const uintptr_t Magic = 0x0bc0ffee;
+static const unsigned char Poison = 0xdd;
+
+enum class Mode { Threshold, Quiescent, QuiescentNoVouch };
+
+static const char *modeName(Mode m)
+{
+    switch (m) {
+    case Mode::Threshold:        return "threshold (old)";
+    case Mode::Quiescent:        return "quiescent";
+    case Mode::QuiescentNoVouch: return "quiescent, no vouching";
+    }
+    return "?";
+}
+
+// One cache line each, like EpochRecord.
+struct Reader {
+    std::atomic<uint32_t> inLookup{0};
+    objc::EpochRecord *record = nullptr;
+    char pad[64 - 2 * sizeof(void *)];
+};
+
+struct Run {
+    Mode mode;
+    std::atomic<uintptr_t *> classes[ClassCount];
+    std::vector<std::unique_ptr<Reader>> readers;
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0};
+
+    // Guarded by lock.
+    std::mutex lock;
+    objc::EpochDomain epochs;
+    objc::EpochGarbage garbage;
+    std::deque<uintptr_t *> quarantine;
+    BenchLatency latency;
+    size_t peakPending = 0;
+    uint64_t pcReads = 0;
+    uint64_t collections = 0;
+
+    explicit Run(Mode m) : mode(m) {
+        for (auto& c : classes) c.store(newBlock());
+    }
+
+    ~Run() {
+        for (auto& c : classes) free(c.load());
+        garbage.collect([](uintptr_t) { return true; }, 0,
+                        [](void *p, size_t) { free(p); });
+        for (uintptr_t *b : quarantine) free(b);
+    }
+
+    static uintptr_t *newBlock() {
+        auto b = (uintptr_t *)malloc(BlockBytes);
+        for (unsigned i = 0; i < BlockWords; i++) b[i] = Magic;
+        return b;
+    }
+
+    // The last word, which readers never read, holds the retire time.
+    void dispose(void *p) {
+        auto b = (uintptr_t *)p;
+        latency.add(nanoseconds() - b[BlockWords]);
+        memset(b, Poison, BlockBytes);
+        quarantine.push_back(b);
+        if (quarantine.size() > QuarantineCount) {
+            free(quarantine.front());
+            quarantine.pop_front();
+        }
+    }
+
+    // Like _thread_in_critical().
+    bool vouch(const Reader& r) {
+        pcReads++;
+        return r.inLookup.load(std::memory_order_seq_cst) == 0;
+    }
+
+    // Like cache_collect(false). Call with lock held.
+    void collect() {
+        bool full = garbage.pendingBytes() >= Threshold;
+        auto disposeFn = [this](void *p, size_t) { dispose(p); };
+
+        if (mode == Mode::Threshold) {
+            if (!full) return;
+            for (auto& r : readers) {
+                if (!vouch(*r)) return;
+            }
+            collections++;
+            garbage.collect([](uintptr_t) { return true; }, 0, disposeFn);
+            return;
+        }
+
+        auto vouchFn = [this](objc::EpochRecord *record) {
+            return vouch(*(Reader *)record->owner.load());
+        };
+        if (full  &&  mode == Mode::Quiescent) {
+            epochs.tryAdvance(vouchFn);
+            epochs.tryAdvance(vouchFn);
+        } else {
+            epochs.tryAdvance();
+            epochs.tryAdvance();
+        }
+        if (garbage.collect(epochs, disposeFn)) collections++;
+    }
+
+    void write(size_t replacements, BenchRandom& rng) {
+        for (size_t i = 0; i < replacements; i++) {
+            uintptr_t *old = classes[rng.below(ClassCount)]
+                .exchange(newBlock(), std::memory_order_seq_cst);
+            old[BlockWords] = (uintptr_t)nanoseconds();
+
+            std::lock_guard<std::mutex> guard(lock);
+            garbage.retire(old, BlockBytes, epochs.current());
+            collect();
+            peakPending = std::max(peakPending, garbage.pendingBytes());
+        }
+    }
+
+    void read(Reader& r, unsigned quiescentEvery, BenchRandom& rng) {
+        uint64_t count = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            for (unsigned i = 0; i < quiescentEvery; i++) {
+                r.inLookup.store(1, std::memory_order_seq_cst);
+                uintptr_t *b = classes[rng.below(ClassCount)]
+                    .load(std::memory_order_seq_cst);
+                for (unsigned j = 0; j < 4; j++) {
+                    if (b[rng.below(BlockWords)] != Magic) {
+                        benchfail("buckets reclaimed while in use");
+                    }
+                }
+                r.inLookup.store(0, std::memory_order_release);
+            }
+            count += quiescentEvery;
+            epochs.quiescent(r.record);
+        }
+        lookups.fetch_add(count, std::memory_order_relaxed);
+    }
+};
+
+static void
+run(Mode mode, unsigned readerCount, unsigned idleCount,
+    unsigned quiescentEvery, size_t replacements)
+{
+    Run r(mode);
+    unsigned total = readerCount + idleCount;
+    for (unsigned i = 0; i < total; i++) {
+        r.readers.emplace_back(new Reader);
+        Reader& reader = *r.readers.back();
+        reader.record = r.epochs.acquireRecord();
+        reader.record->owner.store((uintptr_t)&reader);
+        r.epochs.enter(reader.record);
+    }
+
+    uint64_t ns = benchthreads(1 + total, [&](unsigned t) {
+        BenchRandom rng(t + 1);
+        if (t == 0) {
+            r.write(replacements, rng);
+            r.stop.store(true);
+        } else if (t <= readerCount) {
+            r.read(*r.readers[t - 1], quiescentEvery, rng);
+        } else {
+            while (!r.stop.load()) usleep(1000);
+        }
+    });
+
+    size_t pending = r.garbage.pendingBytes();
+    printf("  %-24s %2u readers  %2u idle  %5.1f Mlookups/s  "
+           "%6.1f Kreplacements/s  collections %6llu  pc reads %8llu  "
+           "peak pending %6zu KB  left %6zu KB\n",
+           modeName(mode), readerCount, idleCount,
+           r.lookups.load() * 1000.0 / ns, replacements * 1e6 / ns,
+           (unsigned long long)r.collections,
+           (unsigned long long)r.pcReads,
+           r.peakPending / 1024, pending / 1024);
+    if (r.latency.count()) {
+        r.latency.print("    reclaim latency");
+    } else {
+        printf("    reclaim latency: nothing reclaimed\n");
+    }
+}
+
+
+int main()
+{
+    static const Mode modes[] = {
+        Mode::Threshold, Mode::Quiescent, Mode::QuiescentNoVouch
+    };
+    struct Config { unsigned readers, idle, quiescentEvery; };
+    static const Config configs[] = {
+        { 1, 0, 64 },
+        { 4, 0, 64 },
+        { 4, 16, 64 },
+        { 4, 16, 4096 },
+    };
+
+    size_t replacements = benchscale(200000);
+    printf("reclaim: %u classes, %zu-byte caches, %zu replacements\n",
+           ClassCount, (size_t)BlockBytes, replacements);
+    for (const Config& c : configs) {
+        printf("quiescent state every %u lookups\n", c.quiescentEvery);
+        for (Mode m : modes) {
+            run(m, c.readers, c.idle, c.quiescentEvery, replacements);
+        }
+    }
+
+    return 0;
+}
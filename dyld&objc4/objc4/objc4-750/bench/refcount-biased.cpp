@@ -0,0 +1,320 @@
+// refcount-biased.cpp
+// Retain and release with the compare-and-swap loop on the isa that
+// rootRetain() and rootRelease() use, and with the biased counts of
+// objc-biased-refcount-engine.h.
+//
+// usage: refcount-biased
+//
+// "single thread" is the case biased counting is for: a thread
+// allocates short-lived objects, retains and releases each a few
+// times as code that passes it around does, and releases it.
+//
+// "other threads" is its cost: objects allocated by one thread are
+// retained and released by others. Each object is handed off to its
+// owner once, and every operation after that is an atomic update of
+// the shared count, like the isa's.
+//
+// "handoff" passes every object a producer allocates to a consumer
+// thread, which releases the last reference. The producer drains its
+// handoff list at each allocation, as biased_rc_init() does, and never
+// pops a pool. Once it has allocated everything it waits, without
+// draining, for the consumer to finish: the objects still alive then
+// are the ones an idle owner strands, which must be no more than the
+// limit that biased_rc_init() puts on unmerged objects, 256 here. It
+// then exits, which merges the rest. Every object must be deallocated
+// exactly once.
+//
+// The owner is found in a thread_local, as the runtime finds it with
+// tls_get_direct().
+
+#include "bench.h"
+#include "objc-biased-refcount-engine.h"
+
+static const uint64_t RC_ONE = 1ULL << 56;
+static const uint64_t DeallocatingBit = 1ULL << 54;
+
+enum class Mode { Isa, Biased };
+
+static const char *modeName(Mode m)
+{
+    return m == Mode::Isa ? "isa CAS (old)" : "biased";
+}
+
+struct HostObject {
+    std::atomic<uint64_t> isa;
+    objc::BiasedRC rc;
+    std::atomic<unsigned> deallocs;
+};
+
+static std::atomic<uint64_t> Deallocs{0};
+
+static void deallocate(HostObject *obj)
+{
+    if (obj->deallocs++ != 0) benchfail("deallocated twice");
+    Deallocs++;
+}
+
+struct Traits {
+    static objc::BiasedRC *rc(void *object) {
+        return &((HostObject *)object)->rc;
+    }
+    static void dealloc(void *object) { deallocate((HostObject *)object); }
+    static void overreleased(void *) { benchfail("overreleased"); }
+};
+typedef objc::BiasedRefcounts<Traits> Biased;
+static Biased BiasedRCs;
+
+static thread_local objc::BiasedRCOwner *Self;
+
+static objc::BiasedRCOwner *self()
+{
+    if (!Self) Self = BiasedRCs.acquireOwner();
+    return Self;
+}
+
+static void threadExit()
+{
+    if (Self) BiasedRCs.exitOwner(Self);
+    Self = nullptr;
+}
+
+// BiasedRCLimit. handoff() lowers it below its ring's size.
+static size_t Limit = 4096;
+
+// biased_rc_init()
+static HostObject *alloc(Mode mode)
+{
+    HostObject *obj = new HostObject;
+    obj->isa.store(0, std::memory_order_relaxed);
+    obj->deallocs.store(0, std::memory_order_relaxed);
+    if (mode == Mode::Biased) {
+        objc::BiasedRCOwner *owner = self();
+        Biased::drainIfNeeded(owner);
+        if (Biased::unmerged(owner) >= Limit) owner = nullptr;
+        Biased::init(&obj->rc, owner);
+    }
+    return obj;
+}
+
+// Like rootRetain()'s fast path.
+static inline void retain(Mode mode, HostObject *obj)
+{
+    if (mode == Mode::Isa) {
+        uint64_t old = obj->isa.load(std::memory_order_relaxed);
+        while (!obj->isa.compare_exchange_weak(old, old + RC_ONE,
+                                               std::memory_order_relaxed))
+            ;
+        return;
+    }
+    if (obj->rc.ownedBy(Self)) {
+        obj->rc.retainOwned();
+        return;
+    }
+    if (Biased::retainShared(obj, &obj->rc, false) != Biased::Done) {
+        benchfail("retain failed");
+    }
+}
+
+// Like rootRelease(). Returns true if the object was deallocated.
+static inline bool release(Mode mode, HostObject *obj)
+{
+    if (mode == Mode::Isa) {
+        uint64_t old = obj->isa.load(std::memory_order_relaxed);
+        uint64_t value;
+        do {
+            if ((old >> 56) == 0) {
+                if (old & DeallocatingBit) benchfail("overreleased");
+                value = old | DeallocatingBit;
+            } else {
+                value = old - RC_ONE;
+            }
+        } while (!obj->isa.compare_exchange_weak(old, value,
+                                                 std::memory_order_release));
+        if (!(value & DeallocatingBit)) return false;
+        deallocate(obj);
+        return true;
+    }
+
+    Biased::Result r;
+    if (obj->rc.ownedBy(Self)) {
+        if (obj->rc.releaseOwned()) return false;
+        r = Biased::mergeOwned(&obj->rc);
+    } else {
+        r = Biased::releaseShared(obj, &obj->rc);
+    }
+    if (r == Biased::Overreleased) benchfail("overreleased");
+    if (r != Biased::Last) return false;
+    deallocate(obj);
+    return true;
+}
+
+
+static void singleThread(Mode mode, size_t count, size_t rounds)
+{
+    Deallocs = 0;
+    std::vector<HostObject *> objects;
+    for (size_t i = 0; i < count; i++) objects.push_back(alloc(mode));
+
+    uint64_t start = nanoseconds();
+    for (size_t r = 0; r < rounds; r++) {
+        for (HostObject *obj : objects) {
+            retain(mode, obj);
+            retain(mode, obj);
+            if (release(mode, obj)  ||  release(mode, obj)) {
+                benchfail("deallocated while retained");
+            }
+        }
+    }
+    uint64_t elapsed = nanoseconds() - start;
+    for (HostObject *obj : objects) {
+        if (!release(mode, obj)) benchfail("not deallocated");
+        delete obj;
+    }
+
+    // Whole lifetimes: allocate, pass around, release.
+    uint64_t lifeStart = nanoseconds();
+    size_t lives = count * rounds / 8;
+    for (size_t i = 0; i < lives; i++) {
+        HostObject *obj = alloc(mode);
+        for (int k = 0; k < 3; k++) retain(mode, obj);
+        for (int k = 0; k < 3; k++) release(mode, obj);
+        if (!release(mode, obj)) benchfail("not deallocated");
+        delete obj;
+    }
+    uint64_t lifeElapsed = nanoseconds() - lifeStart;
+
+    if (Deallocs != count + lives) benchfail("lost a dealloc");
+    printf("    %-14s %6.2f ns/op   %6.1f ns per object lifetime\n",
+           modeName(mode), (double)elapsed / (count * rounds * 4),
+           (double)lifeElapsed / lives);
+}
+
+
+static void otherThreads(Mode mode, unsigned threads, size_t count,
+                         size_t rounds)
+{
+    Deallocs = 0;
+    std::vector<HostObject *> objects;
+    for (size_t i = 0; i < count; i++) objects.push_back(alloc(mode));
+
+    uint64_t elapsed = benchthreads(threads, [&](unsigned t) {
+        BenchRandom rng(t + 1);
+        for (size_t r = 0; r < rounds; r++) {
+            HostObject *obj = objects[rng.below((uint32_t)count)];
+            retain(mode, obj);
+            if (release(mode, obj)) benchfail("deallocated while retained");
+        }
+        threadExit();
+    });
+
+    // The owner's pool pop.
+    if (mode == Mode::Biased) Biased::drainIfNeeded(Self);
+    for (HostObject *obj : objects) {
+        if (!release(mode, obj)) benchfail("not deallocated");
+        delete obj;
+    }
+    if (Deallocs != count) benchfail("lost a dealloc");
+
+    printf("    %-14s %2u threads  %6.2f ns/op\n", modeName(mode), threads,
+           (double)elapsed / (rounds * threads * 2));
+}
+
+
+// Single producer, single consumer.
+struct Ring {
+    enum { Size = 1024 };
+    HostObject *slots[Size];
+    std::atomic<size_t> head{0}, tail{0};
+
+    void put(HostObject *obj) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        while (t - head.load(std::memory_order_acquire) == Size) {
+            std::this_thread::yield();
+        }
+        slots[t % Size] = obj;
+        tail.store(t + 1, std::memory_order_release);
+    }
+    HostObject *get() {
+        size_t h = head.load(std::memory_order_relaxed);
+        while (tail.load(std::memory_order_acquire) == h) {
+            std::this_thread::yield();
+        }
+        HostObject *obj = slots[h % Size];
+        head.store(h + 1, std::memory_order_release);
+        return obj;
+    }
+};
+
+static void handoff(Mode mode, size_t count)
+{
+    Deallocs = 0;
+    Ring ring;
+    std::vector<HostObject *> all(count);
+    std::atomic<bool> consumed{false};
+    size_t stranded = 0;
+    Limit = 256;
+
+    uint64_t elapsed = benchthreads(2, [&](unsigned t) {
+        if (t == 0) {
+            for (size_t i = 0; i < count; i++) {
+                HostObject *obj = alloc(mode);
+                all[i] = obj;
+                retain(mode, obj);
+                if (release(mode, obj)) benchfail("deallocated while retained");
+                ring.put(obj);  // the consumer takes this reference
+            }
+            while (!consumed.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            stranded = count - Deallocs;
+            threadExit();
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                HostObject *obj = ring.get();
+                retain(mode, obj);
+                if (release(mode, obj)) benchfail("deallocated while retained");
+                release(mode, obj);
+            }
+            threadExit();
+            consumed.store(true, std::memory_order_release);
+        }
+    });
+
+    if (Deallocs != count) {
+        benchfail("%llu of %zu objects deallocated",
+                  (unsigned long long)Deallocs.load(), count);
+    }
+    for (HostObject *obj : all) delete obj;
+
+    printf("    %-14s %6.1f ns per object", modeName(mode),
+           (double)elapsed / count);
+    if (mode == Mode::Biased) printf("   %zu stranded by the idle owner", stranded);
+    printf("\n");
+    if (stranded > Limit) benchfail("%zu objects stranded", stranded);
+    Limit = 4096;
+}
+
+
+int main()
+{
+    size_t rounds = benchscale(2000);
+    printf("refcount biased: retain and release of short-lived objects\n");
+
+    printf("  single thread: 1024 objects, 2 retains and 2 releases each\n");
+    for (Mode m : { Mode::Isa, Mode::Biased }) singleThread(m, 1024, rounds);
+
+    printf("  other threads: 1024 objects allocated by one thread, "
+           "retained and released by others\n");
+    for (unsigned threads : { 1u, 4u }) {
+        for (Mode m : { Mode::Isa, Mode::Biased }) {
+            otherThreads(m, threads, 1024, rounds * 512 / threads);
+        }
+    }
+
+    printf("  handoff: objects allocated by one thread, "
+           "released by another\n");
+    for (Mode m : { Mode::Isa, Mode::Biased }) handoff(m, rounds * 64);
+
+    threadExit();
+    return 0;
+}
@@ -0,0 +1,350 @@
+// refcount-map.cpp
+// SideTable's RefcountMap, a DenseMap with quadratic probing and
+// tombstones, against objc-swissmap-engine.h's SwissMap, which probes
+// a group of control bytes at a time.
+//
+// usage: refcount-map
+//
+// Keys are disguised object addresses hashed with ptr_hash(), as
+// DenseMapInfo<DisguisedPtr<objc_object>> does, and values are side
+// table retain counts with zero values purgeable. HostDenseMap is
+// llvm-DenseMap.h's lookup, insertion, growth and erase, which can't
+// be built without the runtime. SwissMap runs with the compile-time
+// group kernel (SSE2 or NEON) and with the scalar one, which probes
+// 8 control bytes in a 64-bit word.
+//
+// For each size, "insert" adds that many objects, "hit" and "miss"
+// look up present and absent objects as sidetable_retainCount() does,
+// and "erase" removes them all in random order. "churn" then keeps
+// the table at that size while objects leave it and others arrive,
+// as objects are deallocated and others overflow; DenseMap's
+// tombstones pile up until it rehashes. "rr" is sidetable_retain()
+// and sidetable_release() of present objects. "bytes/entry" is the
+// table's memory after inserting, over the entry count.
+
+#include "bench.h"
+#include "objc-swissmap-engine.h"
+
+static inline uint32_t ptr_hash(uint64_t key)
+{
+    key ^= key >> 4;
+    key *= 0x8a970be7488fda55;
+    key ^= __builtin_bswap64(key);
+    return (uint32_t)key;
+}
+
+// Like DisguisedPtr<objc_object>.
+struct Disguised {
+    uintptr_t value;
+    Disguised() : value(0) { }
+    explicit Disguised(uintptr_t ptr) : value(-ptr) { }
+    uintptr_t ptr() const { return -value; }
+    bool operator==(const Disguised& other) const {
+        return value == other.value;
+    }
+};
+
+// Like DenseMapInfo<DisguisedPtr<T>>.
+struct KeyInfo {
+    static Disguised getEmptyKey() { return Disguised((uintptr_t)-1); }
+    static Disguised getTombstoneKey() { return Disguised((uintptr_t)-2); }
+    static unsigned getHashValue(const Disguised& key) {
+        return ptr_hash(key.ptr());
+    }
+    static bool isEqual(const Disguised& a, const Disguised& b) {
+        return a == b;
+    }
+};
+
+static const size_t RC_ONE = 4;  // SIDE_TABLE_RC_ONE
+
+
+// DenseMap<DisguisedPtr<objc_object>, size_t, true>.
+class HostDenseMap {
+    typedef std::pair<Disguised, size_t> BucketT;
+    enum { MIN_BUCKETS = 4, MIN_COMPACT = 1024 };
+
+    BucketT *Buckets = nullptr;
+    unsigned NumEntries = 0;
+    unsigned NumTombstones = 0;
+    unsigned NumBuckets = 0;
+
+    static unsigned NextPowerOf2(unsigned A) {
+        A |= (A >> 1);
+        A |= (A >> 2);
+        A |= (A >> 4);
+        A |= (A >> 8);
+        A |= (A >> 16);
+        return A + 1;
+    }
+
+    bool LookupBucketFor(const Disguised& Val, BucketT *&FoundBucket) const {
+        if (NumBuckets == 0) {
+            FoundBucket = nullptr;
+            return false;
+        }
+        BucketT *FoundTombstone = nullptr;
+        const Disguised EmptyKey = KeyInfo::getEmptyKey();
+        const Disguised TombstoneKey = KeyInfo::getTombstoneKey();
+        unsigned BucketNo = KeyInfo::getHashValue(Val) & (NumBuckets-1);
+        unsigned ProbeAmt = 1;
+        while (1) {
+            BucketT *ThisBucket = Buckets + BucketNo;
+            if (KeyInfo::isEqual(Val, ThisBucket->first)) {
+                FoundBucket = ThisBucket;
+                return true;
+            }
+            if (KeyInfo::isEqual(ThisBucket->first, EmptyKey)) {
+                FoundBucket = FoundTombstone ? FoundTombstone : ThisBucket;
+                return false;
+            }
+            if (KeyInfo::isEqual(ThisBucket->first, TombstoneKey)  &&
+                !FoundTombstone)
+            {
+                FoundTombstone = ThisBucket;
+            }
+            if (ThisBucket->second == 0  &&  !FoundTombstone) {
+                FoundTombstone = ThisBucket;
+            }
+            if (ProbeAmt > NumBuckets) benchfail("hash table corrupted");
+            BucketNo += ProbeAmt++;
+            BucketNo &= (NumBuckets-1);
+        }
+    }
+
+    void initEmpty() {
+        NumEntries = 0;
+        NumTombstones = 0;
+        for (unsigned i = 0; i < NumBuckets; i++) {
+            Buckets[i].first = KeyInfo::getEmptyKey();
+        }
+    }
+
+    void grow(unsigned AtLeast) {
+        BucketT *OldBuckets = Buckets;
+        unsigned OldNumBuckets = NumBuckets;
+        NumBuckets = std::max<unsigned>(MIN_BUCKETS, NextPowerOf2(AtLeast));
+        Buckets = (BucketT *)operator new(sizeof(BucketT) * NumBuckets);
+        initEmpty();
+        for (unsigned i = 0; i < OldNumBuckets; i++) {
+            BucketT& B = OldBuckets[i];
+            if (KeyInfo::isEqual(B.first, KeyInfo::getEmptyKey())  ||
+                KeyInfo::isEqual(B.first, KeyInfo::getTombstoneKey())  ||
+                B.second == 0)
+            {
+                continue;
+            }
+            BucketT *Dest;
+            LookupBucketFor(B.first, Dest);
+            *Dest = B;
+            NumEntries++;
+        }
+        operator delete(OldBuckets);
+    }
+
+    // Only ever called here with no entries.
+    void shrink_and_clear() {
+        operator delete(Buckets);
+        Buckets = nullptr;
+        NumBuckets = 0;
+        NumEntries = 0;
+        NumTombstones = 0;
+    }
+
+    void compact() {
+        if (NumEntries == 0) {
+            shrink_and_clear();
+        }
+        else if (NumBuckets / 16 > NumEntries  &&  NumBuckets > MIN_COMPACT) {
+            grow(NumEntries * 2);
+        }
+    }
+
+    BucketT *InsertIntoBucket(const Disguised& Key, BucketT *TheBucket) {
+        unsigned NewNumEntries = NumEntries + 1;
+        if (NewNumEntries*4 >= NumBuckets*3) {
+            grow(NumBuckets * 2);
+            LookupBucketFor(Key, TheBucket);
+        }
+        if (NumBuckets-(NewNumEntries+NumTombstones) <= NumBuckets/8) {
+            grow(NumBuckets);
+            LookupBucketFor(Key, TheBucket);
+        }
+        if (KeyInfo::isEqual(TheBucket->first, KeyInfo::getEmptyKey())) {
+            NumEntries++;
+        } else if (KeyInfo::isEqual(TheBucket->first,
+                                    KeyInfo::getTombstoneKey())) {
+            NumEntries++;
+            NumTombstones--;
+        }
+        TheBucket->first = Key;
+        TheBucket->second = 0;
+        return TheBucket;
+    }
+
+ public:
+    typedef BucketT *iterator;
+
+    ~HostDenseMap() { operator delete(Buckets); }
+
+    iterator end() { return Buckets + NumBuckets; }
+    unsigned size() const { return NumEntries; }
+
+    iterator find(const Disguised& Val) {
+        BucketT *B;
+        return LookupBucketFor(Val, B) ? B : end();
+    }
+
+    size_t& operator[](const Disguised& Key) {
+        BucketT *B;
+        if (LookupBucketFor(Key, B)) return B->second;
+        return InsertIntoBucket(Key, B)->second;
+    }
+
+    bool erase(const Disguised& Val) {
+        BucketT *B;
+        if (!LookupBucketFor(Val, B)) return false;
+        B->first = KeyInfo::getTombstoneKey();
+        NumEntries--;
+        NumTombstones++;
+        compact();
+        return true;
+    }
+
+    size_t getMemorySize() const { return NumBuckets * sizeof(BucketT); }
+};
+
+template <objc::SwissKernel Kernel>
+using HostSwissMap = objc::SwissMap<Disguised, size_t, true, KeyInfo, Kernel>;
+
+template <typename Map> struct MapName;
+template <> struct MapName<HostDenseMap> {
+    static const char *get() { return "DenseMap"; }
+};
+template <> struct MapName<HostSwissMap<objc::SwissKernel::Scalar>> {
+    static const char *get() { return "SwissMap scalar"; }
+};
+#if __x86_64__  &&  __SSE2__
+template <> struct MapName<HostSwissMap<objc::SwissKernel::SSE2>> {
+    static const char *get() { return "SwissMap SSE2"; }
+};
+#elif __arm64__  ||  __aarch64__
+template <> struct MapName<HostSwissMap<objc::SwissKernel::NEON>> {
+    static const char *get() { return "SwissMap NEON"; }
+};
+#endif
+
+
+// Heap-like addresses: 16-byte aligned, clustered in a few regions.
+static std::vector<uintptr_t> objects(size_t count, uint64_t seed)
+{
+    BenchRandom rng(seed);
+    std::vector<uintptr_t> result;
+    result.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t region = 0x600000000000ull + ((uintptr_t)rng.below(8) << 32);
+        result.push_back(region + ((uintptr_t)rng.below(1u << 28) << 4));
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    for (size_t i = result.size(); i > 1; i--) {
+        std::swap(result[i-1], result[rng.below((uint32_t)i)]);
+    }
+    return result;
+}
+
+static double per(uint64_t elapsed, size_t ops)
+{
+    return (double)elapsed / (ops ? ops : 1);
+}
+
+template <typename Map>
+static void run(size_t count, size_t rounds)
+{
+    std::vector<uintptr_t> live = objects(count * 2, count);
+    count = live.size() / 2;
+    std::vector<uintptr_t> absent(live.begin() + count, live.end());
+    live.resize(count);
+
+    uint64_t insertTime = 0, hitTime = 0, missTime = 0, rrTime = 0;
+    uint64_t eraseTime = 0, churnTime = 0;
+    size_t found = 0;
+    size_t bytes = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        Map map;
+        uint64_t t0 = nanoseconds();
+        for (uintptr_t obj : live) map[Disguised(obj)] = RC_ONE;
+        uint64_t t1 = nanoseconds();
+        for (uintptr_t obj : live) {
+            found += (map.find(Disguised(obj)) != map.end());
+        }
+        uint64_t t2 = nanoseconds();
+        for (uintptr_t obj : absent) {
+            found += (map.find(Disguised(obj)) != map.end());
+        }
+        uint64_t t3 = nanoseconds();
+        // sidetable_retain(), then sidetable_release().
+        for (uintptr_t obj : live) map[Disguised(obj)] += RC_ONE;
+        for (uintptr_t obj : live) {
+            auto it = map.find(Disguised(obj));
+            if (it == map.end()) benchfail("key lost");
+            it->second -= RC_ONE;
+        }
+        uint64_t t4 = nanoseconds();
+        if (map.size() != count) benchfail("size %u, expected %zu",
+                                           (unsigned)map.size(), count);
+        bytes = map.getMemorySize();
+
+        // Churn: replace each object with an absent one, and back.
+        for (size_t i = 0; i < count; i++) {
+            if (!map.erase(Disguised(live[i]))) benchfail("key lost");
+            map[Disguised(absent[i])] = RC_ONE;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!map.erase(Disguised(absent[i]))) benchfail("key lost");
+            map[Disguised(live[i])] = RC_ONE;
+        }
+        uint64_t t5 = nanoseconds();
+        for (uintptr_t obj : live) {
+            if (!map.erase(Disguised(obj))) benchfail("key lost");
+        }
+        uint64_t t6 = nanoseconds();
+        if (map.size() != 0) benchfail("not empty");
+
+        insertTime += t1 - t0;
+        hitTime += t2 - t1;
+        missTime += t3 - t2;
+        rrTime += t4 - t3;
+        churnTime += t5 - t4;
+        eraseTime += t6 - t5;
+    }
+    if (found != count * rounds) benchfail("lookup mismatch");
+
+    size_t ops = count * rounds;
+    printf("    %-16s insert %5.1f  hit %5.1f  miss %5.1f  rr %5.1f  "
+           "churn %5.1f  erase %5.1f ns   bytes/entry %5.1f\n",
+           MapName<Map>::get(), per(insertTime, ops), per(hitTime, ops),
+           per(missTime, ops), per(rrTime, 2 * ops), per(churnTime, 2 * ops),
+           per(eraseTime, ops), (double)bytes / count);
+}
+
+
+int main()
+{
+    printf("refcount map: RefcountMap operations, ns per operation\n");
+    for (size_t count : { (size_t)12, (size_t)100, (size_t)1000,
+                          (size_t)20000, (size_t)300000 })
+    {
+        size_t rounds = std::max<size_t>(benchscale(4000000) / count, 1);
+        printf("  %zu objects, %zu rounds\n", count, rounds);
+        run<HostDenseMap>(count, rounds);
+        run<HostSwissMap<objc::SwissKernel::Scalar>>(count, rounds);
+#if __x86_64__  &&  __SSE2__
+        run<HostSwissMap<objc::SwissKernel::SSE2>>(count, rounds);
+#elif __arm64__  ||  __aarch64__
+        run<HostSwissMap<objc::SwissKernel::NEON>>(count, rounds);
+#endif
+    }
+    return 0;
+}
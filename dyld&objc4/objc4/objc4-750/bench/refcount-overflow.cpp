@@ -0,0 +1,381 @@
+// refcount-overflow.cpp
+// Retain and release of one heavily shared object from many threads,
+// with the inline count's overflow spilling half of it to the side
+// table as rootRetain() does by default, and moving all of it to an
+// out-of-line counter from objc-refcount-engine.h, as it does when
+// the runtime is built with SUPPORT_RC_OVERFLOW_COUNTERS=1.
+//
+// usage: refcount-overflow
+//
+// HostObject's isa is x86_64's: an 8-bit extra_rc in the top bits,
+// with has_sidetable_rc and deallocating below it, so the inline count
+// overflows at 256 and an overflow moves 128 to the side table. The
+// side table is a locked map like SideTable's refcnts. The retain and
+// release paths are rootRetain() and rootRelease() with their
+// overflow and underflow handling.
+//
+// The object starts out retained `base` times, as a singleton or an
+// interned string would be. Each thread then retains it `batch` times
+// and releases it as many, as code that stores it into a collection
+// and empties the collection later does. Batches of 1 never leave the
+// inline count; larger ones cross the side table boundary over and
+// over. "locks/op" is side table lock acquisitions per operation.
+//
+// Afterwards the count must be `base` again, and releasing the object
+// that many times must deallocate it exactly once, on the last one.
+//
+// "spike" then retains each of 1024 objects, four times as many as
+// there are counters, past the inline limit and releases it back to
+// one, one object after another on each thread, as a burst of
+// collection inserts does. A count that falls back to RC_HALF returns
+// inline and frees its counter, so every object should find one free,
+// and only a counter pool shared by threads spiking at once sends some
+// objects to the side table. Each object must end with its count
+// inline.
+
+#include "bench.h"
+#include "objc-refcount-engine.h"
+
+#include <mutex>
+#include <unordered_map>
+
+static const uint64_t RC_ONE = 1ULL << 56;
+static const uint64_t RC_HALF = 1ULL << 7;
+static const uint64_t RC_MAX = RC_HALF * 2 - 1;
+static const uint64_t HasSidetableRC = 1ULL << 55;
+static const uint64_t DeallocatingBit = 1ULL << 54;
+
+enum class Mode { SideTable, Counter };
+
+static const char *modeName(Mode m)
+{
+    return m == Mode::SideTable ? "side table (old)" : "out-of-line counter";
+}
+
+static inline uint64_t extraRC(uint64_t isa) { return isa >> 56; }
+
+static objc::RefcountCounters<256> Counters;
+static std::atomic<uint64_t> CounterOverflows{0};
+static std::atomic<uint64_t> SideTableOverflows{0};
+
+struct SideTable {
+    std::mutex lock;
+    std::unordered_map<uintptr_t, size_t> refcnts;
+    std::atomic<uint64_t> locks{0};
+};
+
+struct HostObject {
+    std::atomic<uint64_t> isa{0};
+    std::atomic<unsigned> deallocs{0};
+    SideTable *table;
+    Mode mode;
+
+    void sidetableLock() {
+        table->lock.lock();
+        table->locks.fetch_add(1, std::memory_order_relaxed);
+    }
+    void sidetableUnlock() { table->lock.unlock(); }
+
+    size_t counterIndex(uint64_t isa) const { return extraRC(isa); }
+
+    bool usesCounter(uint64_t isa) const {
+        return mode == Mode::Counter  &&  (isa & HasSidetableRC)  &&
+            Counters.owns(counterIndex(isa), (uintptr_t)this);
+    }
+
+    // Like rc_counter_overflow(): move the whole count to a counter.
+    // Returns false if there is none free or the isa changed.
+    bool overflowToCounter(bool *full) {
+        size_t index = Counters.alloc((uintptr_t)this, RC_MAX + 2);
+        if (index == Counters.None) {
+            *full = true;
+            return false;
+        }
+        uint64_t oldisa = isa.load(std::memory_order_relaxed);
+        if (extraRC(oldisa) == RC_MAX  &&  !(oldisa & HasSidetableRC)) {
+            uint64_t newisa = (oldisa & ~(RC_MAX * RC_ONE)) |
+                (index * RC_ONE) | HasSidetableRC;
+            if (isa.compare_exchange_strong(oldisa, newisa,
+                                            std::memory_order_relaxed))
+            {
+                CounterOverflows.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        Counters.free(index);
+        return false;
+    }
+
+    // Like rc_counter_return(): move a count of RC_HALF or less back
+    // into the isa and free the counter.
+    void returnToIsa(size_t index) {
+        uint64_t count;
+        if (!Counters.freezeBelow(index, (uintptr_t)this, RC_HALF, &count)) {
+            return;
+        }
+        uint64_t oldisa = isa.load(std::memory_order_relaxed);
+        uint64_t newisa;
+        do {
+            if (!(oldisa & HasSidetableRC)  ||  counterIndex(oldisa) != index) {
+                benchfail("isa changed under a frozen counter");
+            }
+            newisa = (oldisa & ~(RC_MAX * RC_ONE) & ~HasSidetableRC) |
+                ((count - 1) * RC_ONE);
+        } while (!isa.compare_exchange_weak(oldisa, newisa,
+                                            std::memory_order_release));
+        Counters.freeReturned(index);
+    }
+
+    void retainSlow() {
+        bool sideTableLocked = false;
+        bool transcribeToSideTable;
+        bool counterFull = false;
+        uint64_t oldisa, newisa;
+     retry:
+        oldisa = isa.load(std::memory_order_relaxed);
+        do {
+            transcribeToSideTable = false;
+            newisa = oldisa;
+            if (usesCounter(newisa)) {
+                if (sideTableLocked) sidetableUnlock();
+                sideTableLocked = false;
+                if (Counters.retain(counterIndex(newisa), (uintptr_t)this)
+                    == Counters.Done)
+                {
+                    return;
+                }
+                // The count went back to the isa.
+                goto retry;
+            }
+            if (extraRC(newisa) == RC_MAX) {
+                if (mode == Mode::Counter  &&  !counterFull  &&
+                    !(newisa & HasSidetableRC))
+                {
+                    if (overflowToCounter(&counterFull)) return;
+                    goto retry;
+                }
+                if (!sideTableLocked) sidetableLock();
+                sideTableLocked = true;
+                transcribeToSideTable = true;
+                if (mode == Mode::Counter) {
+                    SideTableOverflows.fetch_add(1, std::memory_order_relaxed);
+                }
+                newisa = (newisa & ~(RC_MAX * RC_ONE)) |
+                    (RC_HALF * RC_ONE) | HasSidetableRC;
+            } else {
+                newisa += RC_ONE;
+            }
+        } while (!isa.compare_exchange_weak(oldisa, newisa,
+                                            std::memory_order_relaxed));
+        if (transcribeToSideTable) table->refcnts[(uintptr_t)this] += RC_HALF;
+        if (sideTableLocked) sidetableUnlock();
+    }
+
+    void retain() {
+        uint64_t oldisa = isa.load(std::memory_order_relaxed);
+        do {
+            // The fast path leaves objects with side table counts to
+            // the slow path when they may use a counter.
+            if (mode == Mode::Counter  &&  (oldisa & HasSidetableRC)) {
+                return retainSlow();
+            }
+            if (extraRC(oldisa) == RC_MAX) return retainSlow();
+        } while (!isa.compare_exchange_weak(oldisa, oldisa + RC_ONE,
+                                            std::memory_order_relaxed));
+    }
+
+    bool releaseSlow() {
+        bool sideTableLocked = false;
+        uint64_t oldisa, newisa;
+     retry:
+        oldisa = isa.load(std::memory_order_relaxed);
+        do {
+            newisa = oldisa;
+            if (usesCounter(newisa)) {
+                if (sideTableLocked) sidetableUnlock();
+                sideTableLocked = false;
+                size_t index = counterIndex(newisa);
+                uint64_t remaining;
+                switch (Counters.release(index, (uintptr_t)this, &remaining)) {
+                case Counters.Done:
+                    if (remaining > 0  &&  remaining <= RC_HALF) {
+                        returnToIsa(index);
+                    }
+                    return false;
+                case Counters.Last:
+                    deallocs++;
+                    return true;
+                case Counters.MovedAway:
+                    goto retry;
+                default:
+                    benchfail("overreleased");
+                }
+            }
+            if (extraRC(newisa) == 0) goto underflow;
+            newisa -= RC_ONE;
+        } while (!isa.compare_exchange_weak(oldisa, newisa,
+                                            std::memory_order_release));
+        if (sideTableLocked) sidetableUnlock();
+        return false;
+
+     underflow:
+        if (newisa & HasSidetableRC) {
+            if (!sideTableLocked) {
+                sidetableLock();
+                sideTableLocked = true;
+                goto retry;
+            }
+            size_t& side = table->refcnts[(uintptr_t)this];
+            size_t borrowed = std::min<size_t>(side, RC_HALF);
+            side -= borrowed;
+            if (borrowed > 0) {
+                newisa = (oldisa & ~(RC_MAX * RC_ONE)) |
+                    ((borrowed - 1) * RC_ONE);
+                if (!isa.compare_exchange_strong(oldisa, newisa,
+                                                 std::memory_order_release))
+                {
+                    side += borrowed;
+                    goto retry;
+                }
+                sidetableUnlock();
+                return false;
+            }
+        }
+        if (oldisa & DeallocatingBit) benchfail("overrelease");
+        newisa = oldisa | DeallocatingBit;
+        if (!isa.compare_exchange_strong(oldisa, newisa)) goto retry;
+        if (sideTableLocked) sidetableUnlock();
+        deallocs++;
+        return true;
+    }
+
+    bool release() {
+        uint64_t oldisa = isa.load(std::memory_order_relaxed);
+        do {
+            if (mode == Mode::Counter  &&  (oldisa & HasSidetableRC)) {
+                return releaseSlow();
+            }
+            if (extraRC(oldisa) == 0) return releaseSlow();
+        } while (!isa.compare_exchange_weak(oldisa, oldisa - RC_ONE,
+                                            std::memory_order_release));
+        return false;
+    }
+
+    uint64_t retainCount() {
+        uint64_t bits = isa.load();
+        if (usesCounter(bits)) return Counters.count(counterIndex(bits));
+        std::lock_guard<std::mutex> guard(table->lock);
+        uint64_t rc = 1 + extraRC(bits);
+        if (bits & HasSidetableRC) rc += table->refcnts[(uintptr_t)this];
+        return rc;
+    }
+
+    // Like clearDeallocating().
+    void clear() {
+        uint64_t bits = isa.load();
+        if (usesCounter(bits)) Counters.free(counterIndex(bits));
+        table->refcnts.erase((uintptr_t)this);
+    }
+};
+
+static void
+run(Mode mode, unsigned threads, size_t base, size_t batch, size_t ops)
+{
+    SideTable table;
+    // Other objects on the stripe.
+    for (uintptr_t i = 1; i <= 64; i++) table.refcnts[i * 16] = 1000;
+
+    HostObject obj;
+    obj.table = &table;
+    obj.mode = mode;
+    for (size_t i = 1; i < base; i++) obj.retain();
+    table.locks = 0;
+
+    size_t rounds = std::max<size_t>(ops / threads / (2 * batch), 1);
+    uint64_t elapsed = benchthreads(threads, [&](unsigned) {
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < batch; i++) obj.retain();
+            for (size_t i = 0; i < batch; i++) {
+                if (obj.release()) benchfail("deallocated while retained");
+            }
+        }
+    });
+    uint64_t total = (uint64_t)rounds * threads * batch * 2;
+    uint64_t locks = table.locks;
+
+    if (obj.retainCount() != base) {
+        benchfail("retain count %llu, expected %zu",
+                  (unsigned long long)obj.retainCount(), base);
+    }
+    for (size_t i = 1; i < base; i++) {
+        if (obj.release()) benchfail("deallocated early");
+    }
+    if (!obj.release()  ||  obj.deallocs != 1) benchfail("not deallocated");
+    obj.clear();
+
+    printf("    %-20s %2u threads  batch %4zu  %6.1f ns/op  "
+           "locks/op %.4f\n", modeName(mode), threads, batch,
+           (double)elapsed / total, (double)locks / total);
+}
+
+static void runSpike(unsigned threads, size_t peak, size_t rounds)
+{
+    enum { Objects = 1024 };
+    SideTable table;
+    std::vector<HostObject> objects(Objects);
+    for (HostObject& obj : objects) {
+        obj.table = &table;
+        obj.mode = Mode::Counter;
+    }
+    CounterOverflows = 0;
+    SideTableOverflows = 0;
+
+    uint64_t elapsed = benchthreads(threads, [&](unsigned t) {
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t o = t; o < Objects; o += threads) {
+                HostObject& obj = objects[o];
+                for (size_t i = 1; i < peak; i++) obj.retain();
+                for (size_t i = 1; i < peak; i++) {
+                    if (obj.release()) benchfail("deallocated while retained");
+                }
+            }
+        }
+    });
+    uint64_t total = (uint64_t)rounds * Objects * (peak - 1) * 2;
+
+    for (HostObject& obj : objects) {
+        uint64_t bits = obj.isa.load();
+        if (obj.usesCounter(bits)) benchfail("count stayed in its counter");
+        if (obj.retainCount() != 1) benchfail("wrong retain count");
+        if (!obj.release()  ||  obj.deallocs != 1) benchfail("not deallocated");
+        obj.clear();
+    }
+    uint64_t overflows = CounterOverflows + SideTableOverflows;
+    // One thread takes each counter back before it moves on.
+    if (threads == 1) benchassert(SideTableOverflows == 0);
+
+    printf("    spike %4zu          %2u threads  %6.1f ns/op  "
+           "%5.1f%% of overflows to a counter  locks/op %.4f\n",
+           peak, threads, (double)elapsed / total,
+           overflows ? 100.0 * CounterOverflows / overflows : 0.0,
+           (double)table.locks / total);
+}
+
+
+int main()
+{
+    size_t ops = benchscale(4000000);
+    size_t base = 1000;
+    printf("refcount overflow: one object retained %zu times, "
+           "then retained and released in batches\n", base);
+    for (size_t batch : { (size_t)1, (size_t)64, (size_t)512 }) {
+        for (unsigned threads : { 1u, 4u, 16u }) {
+            for (Mode m : { Mode::SideTable, Mode::Counter }) {
+                run(m, threads, base, batch, ops);
+            }
+        }
+    }
+    size_t rounds = std::max<size_t>(ops / (1024 * 1024), 1);
+    for (unsigned threads : { 1u, 4u, 16u }) runSpike(threads, 512, rounds);
+    return 0;
+}
@@ -0,0 +1,405 @@
+// retain-many.cpp
+// Retain and release every element of an array one objc_retain() or
+// objc_release() at a time, and with objc_retainMany() and
+// objc_releaseMany()'s batching from objc-bulk-rc-engine.h.
+//
+// usage: retain-many
+//
+// HostObject's isa is x86_64's: a nonpointer bit, and an 8-bit
+// extra_rc in the top bits with deallocating below it. Raw isa objects
+// keep their whole count in a striped side table, a spinlock and a
+// std::unordered_map per stripe standing in for SideTable's refcnts.
+// Tagged pointers have the low bit set, as on x86_64.
+//
+// "objects" is an array of 10000 nonpointer objects, as an NSArray
+// copy retains. "tagged" makes a quarter of them tagged pointers.
+// "raw isa" is objects whose counts are all in the side table, as with
+// OBJC_DISABLE_NONPOINTER_ISA. With the 64 stripes of a large machine
+// the batch locks each object's stripe as objc_retain() would; with 8
+// it sorts its objects by stripe and takes each stripe's lock once
+// (bulk_rc_should_group()). That matters most when other threads want
+// the same locks, as in the last case, where 4 threads retain and
+// release the same array. Columns are ns per element per thread, and
+// side table lock acquisitions per element.
+//
+// Every object has the same class, so the batch checks it for RR
+// overrides once, where objc_retain() checks every object.
+//
+// Afterwards one more release of each array must deallocate each
+// object exactly once; the batch sends its deallocs after the last
+// release.
+
+#include "bench.h"
+#include "objc-bulk-rc-engine.h"
+#include "objc-stripe-engine.h"
+
+#include <unordered_map>
+
+static const uint64_t Nonpointer = 1;
+static const uint64_t DeallocatingBit = 1ULL << 54;
+static const uint64_t RC_ONE = 1ULL << 56;
+static const uintptr_t TagMask = 1;
+
+enum { MaxStripes = 64, Batch = 128 };
+static unsigned Stripes = MaxStripes;
+
+struct HostSideTable {
+    std::atomic<bool> locked{false};
+    uint64_t acquires = 0;
+    std::unordered_map<uintptr_t, size_t> refcnts;
+    char pad[64];  // keep neighbouring locks off one cache line
+
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        acquires++;
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+static HostSideTable SideTables[MaxStripes];
+
+static unsigned stripeFor(const void *obj)
+{
+    return objc::stripe_index((uintptr_t)obj, Stripes);
+}
+
+struct HostClass {
+    bool customRR;
+};
+
+static const HostClass PlainClass = { false };
+
+struct alignas(16) HostObject {
+    std::atomic<uint64_t> isa;
+    const HostClass *cls;
+    std::atomic<unsigned> deallocs;
+
+    void dealloc() {
+        if (deallocs++ != 0) benchfail("deallocated twice");
+    }
+
+    // Like sidetable_retain() and sidetable_release() with the
+    // stripe locked. Returns true if the object should be deallocated.
+    void sidetableRetainNolock(HostSideTable& table) {
+        table.refcnts[(uintptr_t)this] += 1;
+    }
+    bool sidetableReleaseNolock(HostSideTable& table) {
+        size_t& rc = table.refcnts[(uintptr_t)this];
+        if (rc == 0) {
+            rc = (size_t)-1;  // deallocating
+            return true;
+        }
+        if (rc == (size_t)-1) benchfail("overreleased");
+        rc--;
+        return false;
+    }
+
+    // Like rootRetain_inline() and rootRelease_inline().
+    bool retainInline() {
+        uint64_t old = isa.load(std::memory_order_relaxed);
+        do {
+            if (!(old & Nonpointer)  ||  (old >> 56) == 0xff) return false;
+        } while (!isa.compare_exchange_weak(old, old + RC_ONE,
+                                            std::memory_order_relaxed));
+        return true;
+    }
+    bool releaseInline(bool *shouldDealloc) {
+        uint64_t old = isa.load(std::memory_order_relaxed);
+        uint64_t value;
+        do {
+            if (!(old & Nonpointer)) return false;
+            if ((old >> 56) == 0) {
+                if (old & DeallocatingBit) benchfail("overreleased");
+                value = old | DeallocatingBit;
+            } else {
+                value = old - RC_ONE;
+            }
+        } while (!isa.compare_exchange_weak(old, value,
+                                            std::memory_order_release));
+        *shouldDealloc = (value & DeallocatingBit);
+        return true;
+    }
+
+    // Like sidetable_retain() and sidetable_release().
+    void sidetableRetain() {
+        HostSideTable& table = SideTables[stripeFor(this)];
+        table.lock();
+        sidetableRetainNolock(table);
+        table.unlock();
+    }
+    bool sidetableRelease() {
+        HostSideTable& table = SideTables[stripeFor(this)];
+        table.lock();
+        bool shouldDealloc = sidetableReleaseNolock(table);
+        table.unlock();
+        return shouldDealloc;
+    }
+
+    // Like rootRetain() and rootRelease(), with sidetable_retain() and
+    // sidetable_release() for raw isa objects.
+    void rootRetain() {
+        if (retainInline()) return;
+        if (isa.load(std::memory_order_relaxed) & Nonpointer) {
+            benchfail("inline count overflowed");
+        }
+        sidetableRetain();
+    }
+    void rootRelease() {
+        bool shouldDealloc;
+        if (!releaseInline(&shouldDealloc)) {
+            shouldDealloc = sidetableRelease();
+        }
+        if (shouldDealloc) dealloc();
+    }
+};
+
+
+// objc_retain() and objc_release(), which callers reach through a
+// call into libobjc.
+
+__attribute__((noinline))
+static void retainOne(uintptr_t p)
+{
+    if (!p) return;
+    if (p & TagMask) return;
+    HostObject *obj = (HostObject *)p;
+    if (obj->cls->customRR) benchfail("no overrides here");
+    obj->rootRetain();
+}
+
+__attribute__((noinline))
+static void releaseOne(uintptr_t p)
+{
+    if (!p) return;
+    if (p & TagMask) return;
+    HostObject *obj = (HostObject *)p;
+    if (obj->cls->customRR) benchfail("no overrides here");
+    obj->rootRelease();
+}
+
+
+// objc_object::retainMany() and releaseMany().
+
+template <typename Fn>
+static void forEachStripeLocked(objc::BulkRCStripeEntry *entries,
+                                size_t count, Fn fn)
+{
+    objc::bulk_rc_group_by_stripe<Batch>(entries, count, Stripes);
+    for (size_t i = 0; i < count; ) {
+        unsigned stripe = entries[i].stripe;
+        HostSideTable& table = SideTables[stripe];
+        table.lock();
+        do {
+            fn((HostObject *)entries[i].object, table);
+        } while (++i < count  &&  entries[i].stripe == stripe);
+        table.unlock();
+    }
+}
+
+static void retainMany(HostObject **objects, size_t count)
+{
+    objc::BulkRCStripeEntry locked[Batch];
+    size_t lockedCount = 0;
+    const HostClass *defaultRR = nullptr;
+    bool group = objc::bulk_rc_should_group(Batch, Stripes);
+    for (size_t i = 0; i < count; i++) {
+        HostObject *obj = objects[i];
+        if (obj->cls != defaultRR) {
+            if (obj->cls->customRR) benchfail("no overrides here");
+            defaultRR = obj->cls;
+        }
+        if (obj->retainInline()) continue;
+        if (obj->isa.load(std::memory_order_relaxed) & Nonpointer) {
+            benchfail("inline count overflowed");
+        }
+        if (!group) {
+            obj->sidetableRetain();
+            continue;
+        }
+        locked[lockedCount++] = { stripeFor(obj), (uintptr_t)obj };
+    }
+    forEachStripeLocked(locked, lockedCount,
+                        [](HostObject *obj, HostSideTable& table) {
+        obj->sidetableRetainNolock(table);
+    });
+}
+
+static void releaseMany(HostObject **objects, size_t count)
+{
+    objc::BulkRCStripeEntry locked[Batch];
+    size_t lockedCount = 0;
+    HostObject *dealloc[Batch];
+    size_t deallocCount = 0;
+    const HostClass *defaultRR = nullptr;
+    bool group = objc::bulk_rc_should_group(Batch, Stripes);
+    for (size_t i = 0; i < count; i++) {
+        HostObject *obj = objects[i];
+        if (obj->cls != defaultRR) {
+            if (obj->cls->customRR) benchfail("no overrides here");
+            defaultRR = obj->cls;
+        }
+        bool shouldDealloc;
+        if (obj->releaseInline(&shouldDealloc)) {
+            if (shouldDealloc) dealloc[deallocCount++] = obj;
+            continue;
+        }
+        if (!group) {
+            if (obj->sidetableRelease()) dealloc[deallocCount++] = obj;
+            continue;
+        }
+        locked[lockedCount++] = { stripeFor(obj), (uintptr_t)obj };
+    }
+    forEachStripeLocked(locked, lockedCount,
+                        [&](HostObject *obj, HostSideTable& table) {
+        if (obj->sidetableReleaseNolock(table)) {
+            dealloc[deallocCount++] = obj;
+        }
+    });
+    for (size_t i = 0; i < deallocCount; i++) dealloc[i]->dealloc();
+}
+
+template <objc::BulkRCKernel Kernel, typename Fn>
+static void forEachBatch(const uintptr_t *objects, size_t count, Fn fn)
+{
+    uintptr_t batch[Batch];
+    while (count > 0) {
+        size_t n = std::min(count, (size_t)Batch);
+        size_t live = objc::bulk_rc_filter<Kernel>(objects, n, TagMask, batch);
+        fn((HostObject **)batch, live);
+        objects += n;
+        count -= n;
+    }
+}
+
+
+enum class Mode { One, ManyScalar, ManySIMD };
+
+static const char *modeName(Mode m)
+{
+    switch (m) {
+    case Mode::One:        return "one at a time (old)";
+    case Mode::ManyScalar: return "retainMany scalar";
+    case Mode::ManySIMD:
+        return objc::bulk_rc_kernel == objc::BulkRCKernel::SSE2
+            ? "retainMany SSE2" : "retainMany NEON";
+    }
+    return "?";
+}
+
+template <objc::BulkRCKernel Kernel>
+static void retainAll(Mode mode, const std::vector<uintptr_t>& array)
+{
+    if (mode == Mode::One) {
+        for (uintptr_t p : array) retainOne(p);
+    } else {
+        forEachBatch<Kernel>(array.data(), array.size(), retainMany);
+    }
+}
+
+template <objc::BulkRCKernel Kernel>
+static void releaseAll(Mode mode, const std::vector<uintptr_t>& array)
+{
+    if (mode == Mode::One) {
+        for (uintptr_t p : array) releaseOne(p);
+    } else {
+        forEachBatch<Kernel>(array.data(), array.size(), releaseMany);
+    }
+}
+
+static uint64_t lockAcquires()
+{
+    uint64_t total = 0;
+    for (HostSideTable& table : SideTables) total += table.acquires;
+    return total;
+}
+
+
+template <objc::BulkRCKernel Kernel>
+static void run(Mode mode, bool raw, unsigned taggedPercent,
+                unsigned threads, size_t count, size_t rounds)
+{
+    std::vector<HostObject> objects(count);
+    std::vector<uintptr_t> array;
+    BenchRandom rng(count + taggedPercent);
+    for (HostObject& obj : objects) {
+        obj.isa.store(raw ? 0 : Nonpointer, std::memory_order_relaxed);
+        obj.cls = &PlainClass;
+        obj.deallocs.store(0, std::memory_order_relaxed);
+        array.push_back((uintptr_t)&obj);
+        while (rng.below(100) < taggedPercent) {
+            array.push_back(((uintptr_t)rng.below(1 << 20) << 4) | TagMask);
+        }
+    }
+    for (size_t i = array.size(); i > 1; i--) {
+        std::swap(array[i-1], array[rng.below((uint32_t)i)]);
+    }
+    size_t elements = array.size();
+
+    uint64_t locksBefore = lockAcquires();
+    std::atomic<uint64_t> retainTime{0}, releaseTime{0};
+    benchthreads(threads, [&](unsigned) {
+        uint64_t retains = 0, releases = 0;
+        for (size_t r = 0; r < rounds; r++) {
+            uint64_t start = nanoseconds();
+            retainAll<Kernel>(mode, array);
+            uint64_t mid = nanoseconds();
+            releaseAll<Kernel>(mode, array);
+            releases += nanoseconds() - mid;
+            retains += mid - start;
+        }
+        retainTime += retains;
+        releaseTime += releases;
+    });
+    uint64_t locks = lockAcquires() - locksBefore;
+
+    // The last release deallocates everything.
+    releaseAll<Kernel>(mode, array);
+    for (HostObject& obj : objects) {
+        if (obj.deallocs != 1) benchfail("%s: not deallocated", modeName(mode));
+    }
+    for (HostSideTable& table : SideTables) table.refcnts.clear();
+
+    size_t ops = elements * rounds * threads;
+    printf("    %-20s retain %6.2f   release %6.2f ns   locks/element %5.3f\n",
+           modeName(mode), (double)retainTime / ops,
+           (double)releaseTime / ops, (double)locks / (ops * 2));
+}
+
+static void runAll(bool raw, unsigned taggedPercent, unsigned threads,
+                   size_t count, size_t rounds)
+{
+    run<objc::BulkRCKernel::Scalar>(Mode::One, raw, taggedPercent,
+                                    threads, count, rounds);
+    run<objc::BulkRCKernel::Scalar>(Mode::ManyScalar, raw, taggedPercent,
+                                    threads, count, rounds);
+    if (objc::bulk_rc_kernel != objc::BulkRCKernel::Scalar) {
+        run<objc::bulk_rc_kernel>(Mode::ManySIMD, raw, taggedPercent,
+                                  threads, count, rounds);
+    }
+}
+
+
+int main()
+{
+    size_t count = 10000;
+    size_t rounds = benchscale(2000);
+    printf("retain many: retain and release of every array element, "
+           "%zu objects\n", count);
+
+    printf("  objects\n");
+    runAll(false, 0, 1, count, rounds);
+    printf("  tagged: a quarter are tagged pointers\n");
+    runAll(false, 25, 1, count * 3 / 4, rounds);
+    printf("  raw isa: counts in the side table, 64 stripes\n");
+    runAll(true, 0, 1, count, rounds / 8);
+    Stripes = 8;
+    printf("  raw isa, 8 stripes\n");
+    runAll(true, 0, 1, count, rounds / 8);
+    printf("  raw isa, 8 stripes, 4 threads retaining and releasing "
+           "the same array\n");
+    runAll(true, 0, 4, count, rounds / 32);
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+// sidetable.cpp
+// Spread objects over SideTable stripes with StripedMap's hash and
+// with objc::stripe_index(), and run sidetable_retain/release and
+// storeWeak traffic against 8 to 1024 stripes.
+//
+// usage: sidetable
+//
+// Balance: objects from malloc, and objects packed at a fixed stride
+// as a zone allocator lays them out, are counted per stripe.
+// Each column is the fullest stripe over the mean.
+//
+// Throughput: every thread retains and releases random objects from a
+// shared set, as objects with side-table refcounts do, and moves weak
+// variables between random objects, which locks two stripes. The
+// stripe's contents are a std::unordered_map standing in for
+// RefcountMap and weak_table_t; only the locking is the runtime's.
+// Contended acquisitions are counted as SideTable::lock() counts them.
+
+#include "bench.h"
+#include "objc-stripe-engine.h"
+
+#include <memory>
+#include <unordered_map>
+
+static const unsigned stripeCounts[] = { 8, 64, 256, 1024 };
+static const unsigned threadCounts[] = { 1, 4, 16, 64 };
+
+enum class Hash { Legacy, Mixed };
+
+static const char *hashName(Hash h)
+{
+    return h == Hash::Legacy ? "StripedMap" : "stripe_index";
+}
+
+static unsigned stripeFor(Hash h, uintptr_t addr, unsigned count)
+{
+    return h == Hash::Legacy ? objc::stripe_index_legacy(addr, count)
+                             : objc::stripe_index(addr, count);
+}
+
+
+// Balance
+
+static void
+balance(const char *name, const std::vector<uintptr_t>& objects)
+{
+    printf("  %-22s", name);
+    for (unsigned count : stripeCounts) {
+        for (Hash h : { Hash::Legacy, Hash::Mixed }) {
+            std::vector<uint32_t> load(count);
+            for (uintptr_t obj : objects) load[stripeFor(h, obj, count)]++;
+            double mean = (double)objects.size() / count;
+            uint32_t worst = *std::max_element(load.begin(), load.end());
+            printf("  %4u %s %5.2f", count,
+                   h == Hash::Legacy ? "old" : "new", worst / mean);
+        }
+    }
+    printf("\n");
+}
+
+
+// Throughput
+
+struct HostSideTable {
+    std::atomic<bool> locked{false};
+    uint64_t acquires = 0;
+    uint64_t contentions = 0;
+    std::unordered_map<uintptr_t, size_t> refcnts;
+    std::unordered_map<uintptr_t, std::vector<uintptr_t *>> weak;
+    char pad[64];  // keep neighbouring locks off one cache line
+
+    bool tryLock() {
+        return !locked.exchange(true, std::memory_order_acquire);
+    }
+    void lock() {
+        bool contended = !tryLock();
+        if (contended) {
+            while (!tryLock()) std::this_thread::yield();
+        }
+        acquires++;
+        contentions += contended;
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+struct HostSideTables {
+    Hash hash;
+    unsigned count;
+    std::unique_ptr<HostSideTable[]> tables;
+
+    HostSideTables(Hash h, unsigned n)
+        : hash(h), count(n), tables(new HostSideTable[n]) { }
+
+    HostSideTable& operator [] (uintptr_t obj) {
+        return tables[stripeFor(hash, obj, count)];
+    }
+
+    // Like SideTable::lockTwo().
+    static void lockTwo(HostSideTable *a, HostSideTable *b) {
+        if (a < b) { a->lock(); b->lock(); }
+        else { b->lock(); if (a != b) a->lock(); }
+    }
+    static void unlockTwo(HostSideTable *a, HostSideTable *b) {
+        a->unlock();
+        if (a != b) b->unlock();
+    }
+};
+
+// Like sidetable_retain() followed by sidetable_release().
+static void
+retainRelease(HostSideTables& tables, uintptr_t obj)
+{
+    HostSideTable& t = tables[obj];
+    t.lock();
+    t.refcnts[obj] += 4;
+    t.unlock();
+
+    t.lock();
+    t.refcnts[obj] -= 4;
+    t.unlock();
+}
+
+// Like storeWeak() moving *location from oldObj to newObj.
+static void
+moveWeak(HostSideTables& tables, uintptr_t *location,
+         uintptr_t oldObj, uintptr_t newObj)
+{
+    HostSideTable *oldTable = &tables[oldObj];
+    HostSideTable *newTable = &tables[newObj];
+    HostSideTables::lockTwo(oldTable, newTable);
+
+    auto& referrers = oldTable->weak[oldObj];
+    auto it = std::find(referrers.begin(), referrers.end(), location);
+    if (it == referrers.end()) benchfail("weak referrer lost");
+    *it = referrers.back();
+    referrers.pop_back();
+    newTable->weak[newObj].push_back(location);
+    *location = newObj;
+
+    HostSideTables::unlockTwo(oldTable, newTable);
+}
+
+static void
+throughput(Hash hash, unsigned count, unsigned threads,
+           const std::vector<uintptr_t>& objects, size_t opsPerThread)
+{
+    HostSideTables tables(hash, count);
+    uint32_t objectCount = (uint32_t)objects.size();
+
+    // Each thread owns some weak variables, initially pointing at
+    // random objects.
+    enum { WeakPerThread = 16 };
+    std::vector<uintptr_t> weakVars(threads * WeakPerThread);
+    BenchRandom setup(count);
+    for (auto& w : weakVars) {
+        w = objects[setup.below(objectCount)];
+        tables[w].weak[w].push_back(&w);
+    }
+
+    uint64_t ns = benchthreads(threads, [&](unsigned t) {
+        BenchRandom rng(t + 1);
+        uintptr_t *mine = &weakVars[t * WeakPerThread];
+        for (size_t i = 0; i < opsPerThread; i++) {
+            uintptr_t obj = objects[rng.below(objectCount)];
+            if (i % 4 == 3) {
+                uintptr_t *location = &mine[rng.below(WeakPerThread)];
+                moveWeak(tables, location, *location, obj);
+            } else {
+                retainRelease(tables, obj);
+            }
+        }
+    });
+
+    uint64_t acquires = 0, contentions = 0, hottest = 0;
+    for (unsigned i = 0; i < count; i++) {
+        acquires += tables.tables[i].acquires;
+        contentions += tables.tables[i].contentions;
+        hottest = std::max(hottest, tables.tables[i].contentions);
+    }
+    double ops = (double)opsPerThread * threads;
+    printf("  %-12s %4u stripes %3u threads  %7.2f Mops/s  "
+           "contended %6.3f%%  hottest stripe %5.1f%% of contention\n",
+           hashName(hash), count, threads, ops / ns * 1000.0,
+           100.0 * contentions / acquires,
+           contentions ? 100.0 * hottest / contentions : 0.0);
+}
+
+
+int main()
+{
+    // Objects as malloc places them: mixed sizes, interleaved.
+    BenchRandom rng(42);
+    std::vector<void *> blocks;
+    std::vector<uintptr_t> mallocObjects;
+    static const size_t sizes[] = { 16, 32, 48, 64, 96, 128, 256 };
+    for (unsigned i = 0; i < 65536; i++) {
+        void *p = malloc(sizes[rng.below(7)]);
+        blocks.push_back(p);
+        mallocObjects.push_back((uintptr_t)p);
+    }
+
+    // Objects packed at a fixed stride. Only their addresses are used.
+    // Page-aligned strides are large or page-sized allocations.
+    printf("stripe balance: fullest stripe / mean\n");
+    balance("malloc", mallocObjects);
+    enum { SlabSize = 64 * 1024 * 1024 };
+    uintptr_t base = 0x100000000ull;
+    for (size_t stride : { 16, 32, 64, 512, 1024, 4096, 16384 }) {
+        std::vector<uintptr_t> packed;
+        size_t n = std::min<size_t>(65536, SlabSize / stride);
+        for (size_t i = 0; i < n; i++) packed.push_back(base + i*stride);
+        char name[32];
+        snprintf(name, sizeof(name), "%zu-byte stride", stride);
+        balance(name, packed);
+    }
+
+    // A shared working set of hot objects.
+    std::vector<uintptr_t> hot(mallocObjects.begin(),
+                               mallocObjects.begin() + 4096);
+    size_t ops = benchscale(2000000);
+    printf("sidetable_retain/release and storeWeak, 4096 objects, "
+           "%zu operations\n", ops);
+    for (unsigned threads : threadCounts) {
+        for (unsigned count : stripeCounts) {
+            for (Hash h : { Hash::Legacy, Hash::Mixed }) {
+                throughput(h, count, threads, hot,
+                           std::max<size_t>(ops / threads, 1));
+            }
+        }
+    }
+
+    for (void *p : blocks) free(p);
+    return 0;
+}
@@ -0,0 +1,229 @@
+// weak-churn.cpp
+// Probe lengths of the weak table and of out-of-line referrer sets
+// under churn, with the linear probing they used before and with the
+// Robin Hood insertion and backward-shift deletion of
+// objc-robinhood-engine.h.
+//
+// usage: weak-churn
+//
+// Each table is filled to a fixed load, then churned: a random key is
+// removed and a new one inserted, as objects with weak references are
+// deallocated and allocated, or as weak variables move between objects.
+// The live count stays below the 3/4 grow threshold, so neither table
+// is ever rebuilt, as in a process whose weak table has reached its
+// working size.
+//
+// The old tables removed a key by nilling its slot. A later lookup
+// cannot stop at that hole, so every lookup was bounded only by the
+// longest displacement ever inserted, which churn keeps raising until
+// a miss scans most of the table. "hit" is the probe count of lookups
+// of live keys, as weak_unregister() does, and "miss" of keys that are
+// not there, as storeWeak() of an object without weak references and
+// the lookup of a moved referrer do.
+
+#include "bench.h"
+#include "objc-robinhood-engine.h"
+
+static inline uint32_t ptr_hash(uint64_t key)
+{
+    key ^= key >> 4;
+    key *= 0x8a970be7488fda55;
+    key ^= __builtin_bswap64(key);
+    return (uint32_t)key;
+}
+
+// Slots inspected by lookups.
+static uint64_t probes;
+
+struct KeyTraits {
+    typedef uintptr_t Slot;
+    typedef uintptr_t Key;
+    static bool empty(const uintptr_t& s) { probes++; return s == 0; }
+    static uintptr_t key(const uintptr_t& s) { return s; }
+    static uintptr_t hash(uintptr_t k) { return ptr_hash(k); }
+    static void move(uintptr_t& dst, const uintptr_t& src) { dst = src; }
+    static void swap(uintptr_t& a, uintptr_t& b) { std::swap(a, b); }
+    static void clear(uintptr_t& s) { s = 0; }
+};
+typedef objc::RobinHood<KeyTraits> Probe;
+
+// Like weak_entry_insert(), weak_entry_for_referent() and
+// remove_referrer() before Robin Hood.
+struct LegacyTable {
+    static const char *name() { return "linear, nil on remove (old)"; }
+
+    std::vector<uintptr_t> slots;
+    size_t mask;
+    uintptr_t maxDisplacement = 0;
+
+    LegacyTable(size_t n) : slots(n), mask(n - 1) { }
+
+    void insert(uintptr_t k) {
+        size_t index = ptr_hash(k) & mask;
+        size_t displacement = 0;
+        while (slots[index]) {
+            index = (index + 1) & mask;
+            displacement++;
+        }
+        slots[index] = k;
+        maxDisplacement = std::max(maxDisplacement, displacement);
+    }
+
+    size_t find(uintptr_t k) {
+        size_t index = ptr_hash(k) & mask;
+        for (size_t displacement = 0; ; index = (index + 1) & mask) {
+            probes++;
+            if (slots[index] == k) return index;
+            if (++displacement > maxDisplacement) return Probe::NotFound;
+        }
+    }
+
+    void erase(uintptr_t k) {
+        size_t index = find(k);
+        if (index == Probe::NotFound) benchfail("key lost");
+        slots[index] = 0;
+    }
+};
+
+// Like the same functions now.
+struct RobinHoodTable {
+    static const char *name() { return "Robin Hood, backward shift"; }
+
+    std::vector<uintptr_t> slots;
+    size_t mask;
+    uintptr_t maxDisplacement = 0;
+
+    RobinHoodTable(size_t n) : slots(n), mask(n - 1) { }
+
+    void insert(uintptr_t k) {
+        if (!Probe::insert(slots.data(), mask, k, &maxDisplacement)) {
+            benchfail("table full");
+        }
+    }
+
+    size_t find(uintptr_t k) {
+        return Probe::find(slots.data(), mask, maxDisplacement, k);
+    }
+
+    void erase(uintptr_t k) {
+        size_t index = find(k);
+        if (index == Probe::NotFound) benchfail("key lost");
+        Probe::erase(slots.data(), mask, index);
+    }
+};
+
+// Object addresses are 16-byte aligned, weak variables 8-byte aligned.
+struct Keys {
+    BenchRandom rng;
+    uintptr_t base;
+    unsigned align;
+    Keys(uint64_t seed, unsigned a)
+        : rng(seed), base(0x600000000000ull), align(a) { }
+    uintptr_t next() { return base + (uintptr_t)rng.below(1u << 30) * align; }
+};
+
+template <typename Table>
+static void sample(Table& table, const std::vector<uintptr_t>& live,
+                   Keys& keys, const char *when)
+{
+    std::vector<uintptr_t> absent(live.size());
+    for (uintptr_t& k : absent) k = keys.next() | 1;  // never a live key
+
+    BenchHistogram hit, miss;
+    for (uintptr_t k : live) {
+        probes = 0;
+        if (table.find(k) == Probe::NotFound) benchfail("key lost");
+        hit.add(probes);
+    }
+    for (uintptr_t k : absent) {
+        probes = 0;
+        if (table.find(k) != Probe::NotFound) benchfail("found a missing key");
+        miss.add(probes);
+    }
+
+    // Timed separately, so the clock is not read per lookup.
+    // The best of a few passes, to ride out preemption.
+    uint64_t hitTime = UINT64_MAX, missTime = UINT64_MAX;
+    size_t found = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        uint64_t t0 = nanoseconds();
+        for (uintptr_t k : live) found += (table.find(k) != Probe::NotFound);
+        uint64_t t1 = nanoseconds();
+        for (uintptr_t k : absent) found += (table.find(k) != Probe::NotFound);
+        uint64_t t2 = nanoseconds();
+        hitTime = std::min(hitTime, t1 - t0);
+        missTime = std::min(missTime, t2 - t1);
+    }
+    benchkeep(found);
+
+    char label[96];
+    snprintf(label, sizeof(label), "      %-6s hit  %5.1f ns", when,
+             (double)hitTime / live.size());
+    hit.print(label);
+    snprintf(label, sizeof(label), "      %-6s miss %5.1f ns", when,
+             (double)missTime / live.size());
+    miss.print(label);
+}
+
+template <typename Table>
+static void run(size_t size, double load, size_t rounds, unsigned align)
+{
+    Table table(size);
+    Keys keys(size * 31 + (size_t)(load * 100), align);
+    std::vector<uintptr_t> live;
+
+    size_t count = (size_t)(size * load);
+    while (live.size() < count) {
+        uintptr_t k = keys.next();
+        if (table.find(k) != Probe::NotFound) continue;
+        table.insert(k);
+        live.push_back(k);
+    }
+
+    printf("    %s\n", Table::name());
+    sample(table, live, keys, "before");
+
+    BenchRandom rng(size);
+    uint64_t start = nanoseconds();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < count; i++) {
+            size_t victim = rng.below((uint32_t)live.size());
+            table.erase(live[victim]);
+            uintptr_t k;
+            do {
+                k = keys.next();
+            } while (table.find(k) != Probe::NotFound);
+            table.insert(k);
+            live[victim] = k;
+        }
+    }
+    uint64_t elapsed = nanoseconds() - start;
+
+    sample(table, live, keys, "after");
+    printf("      churn %.1f ns per remove and insert, "
+           "max displacement %zu\n",
+           (double)elapsed / (rounds * count), (size_t)table.maxDisplacement);
+}
+
+static void compare(const char *what, size_t size, double load,
+                    size_t rounds, unsigned align)
+{
+    printf("  %s: %zu slots, %.0f%% full, %zu rounds of churn\n",
+           what, size, load * 100, rounds);
+    run<LegacyTable>(size, load, rounds, align);
+    run<RobinHoodTable>(size, load, rounds, align);
+}
+
+
+int main()
+{
+    printf("weak churn: probes per lookup (histogram of slots inspected)\n");
+    size_t rounds = std::max<size_t>(benchscale(64), 4);
+    for (double load : { 0.5, 0.7 }) {
+        compare("weak table", 4096, load, rounds, 16);
+    }
+    for (double load : { 0.5, 0.7 }) {
+        compare("referrer set", 64, load, rounds * 16, 8);
+    }
+    return 0;
+}
@@ -0,0 +1,370 @@
+// weak-clear.cpp
+// Deallocate an object with a huge number of weak references, nilling
+// them all under the side table lock as weak_clear_no_lock() used to,
+// and detached from the table in batches as weak_clear_detached() does.
+//
+// usage: weak-clear
+//
+// Each round registers every weak variable with one heavy object, then
+// deallocates it while other threads work on the same stripe:
+//
+// Neighbours move their own weak variables between other objects that
+// hash to the stripe, like storeWeak(). Their latency is the time from
+// asking for the stripe lock to letting it go, and is what a long clear
+// under the lock stalls.
+//
+// A destroyer destroys random weak variables of the heavy object while
+// it is being cleared, like objc_destroyWeak() for a variable whose
+// storage is about to be freed, and then reuses the storage by writing
+// the heavy object's address into it. The clear must never touch a
+// variable after it was destroyed, so every reused variable must still
+// hold that address afterwards.
+//
+// A reader loads the weak variables that are never destroyed. The heavy
+// object is poisoned once dealloc returns, and reaching it after that
+// fails the benchmark, as a dangling weak pointer would.
+//
+// The referrer set is an open-addressed table like weak_entry_t's.
+//
+// The stress run sleeps between batches so that the destroyer and the
+// neighbours get in while the clear is under way, even on one CPU.
+
+#include "bench.h"
+
+#include <memory>
+#include <unordered_map>
+
+enum {
+    Batch = 1024,                // like WEAK_CLEAR_BATCH
+    NeighbourObjects = 64,
+    NeighbourVars = 16,          // per neighbour thread
+    NeighbourThreads = 2,
+};
+
+enum class Mode { Locked, Batched };
+
+static const char *modeName(Mode m)
+{
+    return m == Mode::Locked ? "under stripe lock (old)" : "detached, batched";
+}
+
+static const uint64_t Live = 0x11feb0a7;
+static const uint64_t Poison = 0xdddddddddddddddd;
+
+struct HostObject {
+    std::atomic<uint64_t> magic{Live};
+};
+
+typedef std::atomic<HostObject *> WeakVar;
+
+struct SpinLock {
+    std::atomic<bool> locked{false};
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+// Like weak_entry_t's out-of-line referrers: linear probing, removal
+// by nilling the slot, lookups bounded by the longest displacement.
+struct RefSet {
+    std::vector<WeakVar *> slots;
+    size_t count = 0;
+    size_t maxDisplacement = 0;
+
+    static size_t hash(WeakVar *v) {
+        return (size_t)(((uintptr_t)v * 0x9e3779b97f4a7c15ull) >> 32);
+    }
+
+    void insert(WeakVar *v) {
+        if (count + 1 > slots.size() * 3 / 4) grow();
+        size_t mask = slots.size() - 1;
+        size_t i = hash(v) & mask, d = 0;
+        while (slots[i]) { i = (i + 1) & mask; d++; }
+        slots[i] = v;
+        count++;
+        maxDisplacement = std::max(maxDisplacement, d);
+    }
+
+    bool remove(WeakVar *v) {
+        if (slots.empty()) return false;
+        size_t mask = slots.size() - 1;
+        size_t i = hash(v) & mask;
+        for (size_t d = 0; d <= maxDisplacement; d++) {
+            if (slots[i] == v) {
+                slots[i] = nullptr;
+                count--;
+                return true;
+            }
+            i = (i + 1) & mask;
+        }
+        return false;
+    }
+
+    void grow() {
+        std::vector<WeakVar *> old(std::max<size_t>(slots.size() * 2, 8));
+        old.swap(slots);
+        count = 0;
+        maxDisplacement = 0;
+        for (WeakVar *v : old) if (v) insert(v);
+    }
+};
+
+// Like weak_detached_t.
+struct Detached {
+    HostObject *referent;
+    RefSet refs;
+};
+
+struct Run {
+    Mode mode;
+    bool stress;
+
+    // The stripe. detached is guarded by lock, and a detached entry's
+    // refs by clearLock.
+    SpinLock lock;
+    std::unordered_map<HostObject *, RefSet> weak;
+    Detached *detached = nullptr;
+    SpinLock clearLock;
+
+    std::unique_ptr<HostObject[]> neighbours{new HostObject[NeighbourObjects]};
+    std::unique_ptr<WeakVar[]> neighbourVars;
+    std::unique_ptr<WeakVar[]> heavyVars;
+    std::unique_ptr<std::atomic<bool>[]> reused;
+    size_t heavyCount;
+
+    std::atomic<HostObject *> heavy{nullptr};
+    std::atomic<bool> clearing{false};
+    std::atomic<bool> destroying{false};
+    std::atomic<bool> reading{false};
+    std::atomic<bool> stop{false};
+
+    BenchLatency neighbourLatency[NeighbourThreads];
+    BenchLatency deallocLatency;
+    BenchLatency lockLatency;
+    uint64_t destroyed = 0;
+    uint64_t loads = 0;
+
+    Run(Mode m, size_t n, bool s)
+        : mode(m), stress(s),
+          neighbourVars(new WeakVar[NeighbourThreads * NeighbourVars]),
+          heavyVars(new WeakVar[n]), reused(new std::atomic<bool>[n]),
+          heavyCount(n)
+    {
+        for (unsigned i = 0; i < NeighbourThreads * NeighbourVars; i++) {
+            HostObject *obj = &neighbours[i % NeighbourObjects];
+            neighbourVars[i].store(obj);
+            weak[obj].insert(&neighbourVars[i]);
+        }
+    }
+
+    // Like storeWeak(). Call with lock held.
+    void unregister(HostObject *obj, WeakVar *var) {
+        auto it = weak.find(obj);
+        if (it != weak.end()) {
+            if (!it->second.remove(var)) benchfail("weak referrer lost");
+            if (it->second.count == 0) weak.erase(it);
+        } else if (detached  &&  detached->referent == obj) {
+            clearLock.lock();
+            if (!detached->refs.remove(var)) benchfail("weak referrer lost");
+            clearLock.unlock();
+        } else {
+            benchfail("weak entry lost");
+        }
+    }
+
+    void clearRange(HostObject *obj, const std::vector<WeakVar *>& slots,
+                    size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++) {
+            if (!slots[i]) continue;
+            HostObject *expected = obj;
+            slots[i]->compare_exchange_strong(expected, nullptr);
+        }
+    }
+
+    // Like clearDeallocating().
+    void dealloc(HostObject *obj) {
+        uint64_t start = nanoseconds();
+        lock.lock();
+        uint64_t locked = nanoseconds();
+        auto it = weak.find(obj);
+        if (mode == Mode::Locked) {
+            const auto& slots = it->second.slots;
+            clearRange(obj, slots, 0, slots.size());
+            weak.erase(it);
+            lock.unlock();
+            lockLatency.add(nanoseconds() - locked);
+        } else {
+            Detached *d = new Detached{obj, std::move(it->second)};
+            weak.erase(it);
+            detached = d;
+            lock.unlock();
+            lockLatency.add(nanoseconds() - locked);
+
+            size_t size = d->refs.slots.size();
+            for (size_t begin = 0; begin < size; begin += Batch) {
+                clearLock.lock();
+                clearRange(obj, d->refs.slots, begin,
+                           std::min<size_t>(begin + Batch, size));
+                clearLock.unlock();
+                if (stress) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(1));
+                }
+            }
+
+            lock.lock();
+            detached = nullptr;
+            lock.unlock();
+            delete d;
+        }
+        deallocLatency.add(nanoseconds() - start);
+    }
+
+    void setUp(HostObject *obj) {
+        lock.lock();
+        RefSet& refs = weak[obj];
+        for (size_t i = 0; i < heavyCount; i++) {
+            heavyVars[i].store(obj);
+            reused[i].store(false);
+            refs.insert(&heavyVars[i]);
+        }
+        lock.unlock();
+    }
+
+    void check(HostObject *obj) {
+        for (size_t i = 0; i < heavyCount; i++) {
+            HostObject *value = heavyVars[i].load();
+            if (reused[i].load() ? value != obj : value != nullptr) {
+                benchfail("weak variable %zu wrongly %s", i,
+                          value ? "left set" : "nilled after destroy");
+            }
+        }
+    }
+
+    // The heavy object's vars in the upper half can be destroyed.
+    size_t destroyable() const { return heavyCount / 2; }
+
+    void neighbour(unsigned t) {
+        BenchRandom rng(t + 1);
+        WeakVar *mine = &neighbourVars[t * NeighbourVars];
+        while (!stop.load(std::memory_order_relaxed)) {
+            WeakVar *var = &mine[rng.below(NeighbourVars)];
+            HostObject *obj = &neighbours[rng.below(NeighbourObjects)];
+            uint64_t start = nanoseconds();
+            lock.lock();
+            HostObject *old = var->load(std::memory_order_relaxed);
+            unregister(old, var);
+            weak[obj].insert(var);
+            var->store(obj, std::memory_order_release);
+            lock.unlock();
+            neighbourLatency[t].add(nanoseconds() - start);
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    }
+
+    void destroyer() {
+        BenchRandom rng(99);
+        while (!stop.load(std::memory_order_relaxed)) {
+            destroying.store(true);
+            if (!clearing.load()) {
+                destroying.store(false);
+                std::this_thread::yield();
+                continue;
+            }
+            HostObject *obj = heavy.load();
+            size_t i = destroyable() + rng.below((uint32_t)destroyable());
+            if (reused[i].load()) {
+                destroying.store(false);
+                continue;
+            }
+            lock.lock();
+            if (heavyVars[i].load() == obj) {
+                unregister(obj, &heavyVars[i]);
+                heavyVars[i].store(nullptr);
+            }
+            lock.unlock();
+            // The storage is someone else's now.
+            reused[i].store(true);
+            heavyVars[i].store(obj);
+            destroyed++;
+            destroying.store(false);
+            std::this_thread::sleep_for(std::chrono::microseconds(1));
+        }
+    }
+
+    void reader() {
+        BenchRandom rng(7);
+        while (!stop.load(std::memory_order_relaxed)) {
+            // Like a weak load epoch: dealloc does not poison the
+            // object while a load that may have read it is running.
+            reading.store(true);
+            HostObject *obj = heavyVars[rng.below((uint32_t)destroyable())]
+                .load();
+            if (obj  &&  obj->magic.load() != Live) {
+                benchfail("weak load reached a deallocated object");
+            }
+            reading.store(false);
+            loads++;
+            if (loads % 64 == 0) std::this_thread::yield();
+        }
+    }
+
+    void deallocator(unsigned rounds) {
+        std::unique_ptr<HostObject[]> objects(new HostObject[rounds]);
+        for (unsigned r = 0; r < rounds; r++) {
+            HostObject *obj = &objects[r];
+            setUp(obj);
+            heavy.store(obj);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            clearing.store(true);
+            dealloc(obj);
+            clearing.store(false);
+            while (destroying.load()  ||  reading.load()) {
+                std::this_thread::yield();
+            }
+            obj->magic.store(Poison);
+            check(obj);
+        }
+        stop.store(true);
+    }
+};
+
+static void
+run(Mode mode, size_t referrers, unsigned rounds, bool stress = false)
+{
+    Run r(mode, referrers, stress);
+    benchthreads(3 + NeighbourThreads, [&](unsigned t) {
+        if (t == 0) r.deallocator(rounds);
+        else if (t == 1) r.destroyer();
+        else if (t == 2) r.reader();
+        else r.neighbour(t - 3);
+    });
+
+    printf("  %-24s %7zu weak references  destroyed during clear %6llu  "
+           "loads %9llu\n", stress ? "stress" : modeName(mode), referrers,
+           (unsigned long long)r.destroyed, (unsigned long long)r.loads);
+    r.deallocLatency.print("    dealloc          ");
+    r.lockLatency.print("    stripe lock held ");
+    for (unsigned i = 1; i < NeighbourThreads; i++) {
+        r.neighbourLatency[0].merge(r.neighbourLatency[i]);
+    }
+    r.neighbourLatency[0].print("    neighbour storeWeak");
+}
+
+
+int main()
+{
+    unsigned rounds = (unsigned)std::max<size_t>(benchscale(16), 2);
+    printf("weak clear: %u deallocations each, %d neighbour threads "
+           "on the same stripe\n", rounds, NeighbourThreads);
+    for (size_t referrers : { (size_t)4096, (size_t)100000 }) {
+        for (Mode m : { Mode::Locked, Mode::Batched }) {
+            run(m, referrers, rounds);
+        }
+    }
+    run(Mode::Batched, 100000, rounds, true);
+    return 0;
+}
@@ -0,0 +1,364 @@
+// weak-entry.cpp
+// Weak table memory and speed with each weak_entry_t layout that
+// WEAK_ENTRY_SIZE selects: the original 40-byte entry with 4 inline
+// referrers, and 64- and 128-byte entries with 7 and 15.
+//
+// usage: weak-entry
+//
+// HostWeakTable<N> is weak_table_t with N inline referrers: the same
+// open-addressed table of entries hashed with ptr_hash(), the same
+// out-of-line referrer hash that starts at 8 slots and doubles at 3/4
+// full, and the out-of-line marker in the low bits of
+// inline_referrers[1]. Referrers are stored undisguised, which changes
+// nothing here because their low bits are zero either way. Tables of
+// 64- and 128-byte entries are aligned to the entry size, as
+// weak_entries_alloc() does.
+//
+// Each workload gives every object a number of weak references drawn
+// from a distribution, registers them all in random order, looks each
+// one up as unregistering it would, unregisters half of them, and
+// clears the objects as dealloc does. "bytes/ref" counts the entry
+// table and out-of-line referrer tables at their allocated sizes,
+// divided by the weak references registered at the peak. "spilled" is
+// the share of objects whose referrers went out of line, each costing
+// a malloc and a pointer chase on every lookup of a referrer.
+
+#include "bench.h"
+
+#include <memory>
+
+static inline uint32_t ptr_hash(uint64_t key)
+{
+    key ^= key >> 4;
+    key *= 0x8a970be7488fda55;
+    key ^= __builtin_bswap64(key);
+    return (uint32_t)key;
+}
+
+enum { OutOfLine = 2 };
+
+template <unsigned N>
+struct HostEntry {
+    uintptr_t referent;
+    union {
+        struct {
+            uintptr_t *referrers;
+            uintptr_t out_of_line_ness : 2;
+            uintptr_t num_refs : 62;
+            uintptr_t mask;
+            uintptr_t max_hash_displacement;
+        };
+        uintptr_t inline_referrers[N];
+    };
+
+    bool out_of_line() const { return out_of_line_ness == OutOfLine; }
+    size_t tableSize() const { return mask ? mask + 1 : 0; }
+};
+
+template <unsigned N>
+struct HostWeakTable {
+    typedef HostEntry<N> Entry;
+
+    Entry *entries = nullptr;
+    size_t count = 0;
+    uintptr_t mask = 0;
+    uintptr_t maxDisplacement = 0;
+    size_t referrerBytes = 0;
+
+    ~HostWeakTable() {
+        for (size_t i = 0; entries  &&  i <= mask; i++) {
+            if (entries[i].referent  &&  entries[i].out_of_line()) {
+                free(entries[i].referrers);
+            }
+        }
+        free(entries);
+    }
+
+    size_t bytes() const {
+        return (entries ? (mask + 1) * sizeof(Entry) : 0) + referrerBytes;
+    }
+
+    uintptr_t *allocReferrers(size_t n) {
+        referrerBytes += n * sizeof(uintptr_t);
+        return (uintptr_t *)calloc(n, sizeof(uintptr_t));
+    }
+    void freeReferrers(Entry *e) {
+        referrerBytes -= e->tableSize() * sizeof(uintptr_t);
+        free(e->referrers);
+    }
+
+    static Entry *allocEntries(size_t n) {
+        void *p;
+        if (sizeof(Entry) > 40) {
+            if (posix_memalign(&p, sizeof(Entry), n * sizeof(Entry))) {
+                benchfail("posix_memalign");
+            }
+            memset(p, 0, n * sizeof(Entry));
+        } else {
+            p = calloc(n, sizeof(Entry));
+        }
+        return (Entry *)p;
+    }
+
+    // Like grow_refs_and_insert().
+    void grow(Entry *e, uintptr_t ref) {
+        size_t oldSize = e->tableSize();
+        size_t newSize = 8;
+        while (newSize < oldSize * 2) newSize *= 2;
+        size_t n = e->num_refs;
+        uintptr_t *old = e->referrers;
+        e->mask = newSize - 1;
+        e->referrers = allocReferrers(newSize);
+        e->num_refs = 0;
+        e->max_hash_displacement = 0;
+        for (size_t i = 0; i < oldSize  &&  n > 0; i++) {
+            if (old[i]) { append(e, old[i]); n--; }
+        }
+        append(e, ref);
+        referrerBytes -= oldSize * sizeof(uintptr_t);
+        free(old);
+    }
+
+    // Like append_referrer().
+    void append(Entry *e, uintptr_t ref) {
+        if (!e->out_of_line()) {
+            for (unsigned i = 0; i < N; i++) {
+                if (!e->inline_referrers[i]) {
+                    e->inline_referrers[i] = ref;
+                    return;
+                }
+            }
+            uintptr_t *spill = allocReferrers(N);
+            for (unsigned i = 0; i < N; i++) spill[i] = e->inline_referrers[i];
+            e->referrers = spill;
+            e->num_refs = N;
+            e->out_of_line_ness = OutOfLine;
+            e->mask = N - 1;
+            e->max_hash_displacement = 0;
+        }
+        if (e->num_refs >= e->tableSize() * 3 / 4) return grow(e, ref);
+        size_t index = ptr_hash(ref) & e->mask, d = 0;
+        while (e->referrers[index]) {
+            d++;
+            index = (index + 1) & e->mask;
+        }
+        if (d > e->max_hash_displacement) e->max_hash_displacement = d;
+        e->referrers[index] = ref;
+        e->num_refs++;
+    }
+
+    // Like remove_referrer().
+    bool removeReferrer(Entry *e, uintptr_t ref) {
+        if (!e->out_of_line()) {
+            for (unsigned i = 0; i < N; i++) {
+                if (e->inline_referrers[i] == ref) {
+                    e->inline_referrers[i] = 0;
+                    return true;
+                }
+            }
+            return false;
+        }
+        size_t index = ptr_hash(ref) & e->mask, d = 0;
+        while (e->referrers[index] != ref) {
+            index = (index + 1) & e->mask;
+            if (++d > e->max_hash_displacement) return false;
+        }
+        e->referrers[index] = 0;
+        e->num_refs--;
+        return true;
+    }
+
+    bool empty(const Entry *e) const {
+        if (e->out_of_line()) return e->num_refs == 0;
+        for (unsigned i = 0; i < N; i++) {
+            if (e->inline_referrers[i]) return false;
+        }
+        return true;
+    }
+
+    void insertEntry(const Entry& e) {
+        size_t index = ptr_hash(e.referent) & mask, d = 0;
+        while (entries[index].referent) {
+            index = (index + 1) & mask;
+            d++;
+        }
+        memcpy((void *)&entries[index], &e, sizeof(e));
+        count++;
+        if (d > maxDisplacement) maxDisplacement = d;
+    }
+
+    void resize(size_t newSize) {
+        size_t oldSize = entries ? mask + 1 : 0;
+        Entry *old = entries;
+        entries = allocEntries(newSize);
+        mask = newSize - 1;
+        maxDisplacement = 0;
+        count = 0;
+        for (size_t i = 0; i < oldSize; i++) {
+            if (old[i].referent) insertEntry(old[i]);
+        }
+        free(old);
+    }
+
+    // Like weak_entry_for_referent().
+    Entry *find(uintptr_t referent) {
+        if (!entries) return nullptr;
+        size_t index = ptr_hash(referent) & mask, d = 0;
+        while (entries[index].referent != referent) {
+            index = (index + 1) & mask;
+            if (++d > maxDisplacement) return nullptr;
+        }
+        return &entries[index];
+    }
+
+    void removeEntry(Entry *e) {
+        if (e->out_of_line()) freeReferrers(e);
+        memset((void *)e, 0, sizeof(*e));
+        count--;
+        size_t size = mask + 1;
+        if (size >= 1024  &&  size / 16 >= count) resize(size / 8);
+    }
+
+    void registerRef(uintptr_t referent, uintptr_t ref) {
+        if (Entry *e = find(referent)) return append(e, ref);
+        if (count >= (entries ? mask + 1 : 0) * 3 / 4) {
+            resize(entries ? (mask + 1) * 2 : 64);
+        }
+        Entry e;
+        memset((void *)&e, 0, sizeof(e));
+        e.referent = referent;
+        e.inline_referrers[0] = ref;
+        insertEntry(e);
+    }
+
+    void unregisterRef(uintptr_t referent, uintptr_t ref) {
+        Entry *e = find(referent);
+        if (!e  ||  !removeReferrer(e, ref)) benchfail("referrer lost");
+        if (empty(e)) removeEntry(e);
+    }
+
+    // Like weak_clear_no_lock(), with the referrers counted
+    // instead of nilled.
+    size_t clear(uintptr_t referent) {
+        Entry *e = find(referent);
+        if (!e) return 0;
+        const uintptr_t *refs = e->out_of_line() ? e->referrers
+                                                 : e->inline_referrers;
+        size_t n = e->out_of_line() ? e->tableSize() : N;
+        size_t live = 0;
+        for (size_t i = 0; i < n; i++) live += (refs[i] != 0);
+        removeEntry(e);
+        return live;
+    }
+};
+
+struct Ref { uintptr_t referent, referrer; };
+
+struct Workload {
+    const char *name;
+    // Weak reference counts and their weights.
+    std::vector<std::pair<unsigned, unsigned>> mix;
+    std::vector<Ref> refs;
+    std::vector<uintptr_t> objects;
+};
+
+static void
+generate(Workload& w, size_t totalRefs)
+{
+    BenchRandom rng(totalRefs + w.mix.size());
+    unsigned weightSum = 0;
+    for (auto& m : w.mix) weightSum += m.second;
+
+    // Fake 16-byte-aligned addresses. Objects and variables are
+    // interleaved the way a heap would interleave them.
+    uintptr_t next = 0x100000000ull;
+    while (w.refs.size() < totalRefs) {
+        unsigned pick = rng.below(weightSum), i = 0;
+        while (pick >= w.mix[i].second) pick -= w.mix[i++].second;
+        unsigned lo = i ? w.mix[i-1].first + 1 : 1;
+        unsigned n = lo + rng.below(w.mix[i].first - lo + 1);
+        uintptr_t obj = next;
+        next += 16 * (1 + rng.below(8));
+        w.objects.push_back(obj);
+        for (unsigned r = 0; r < n; r++) {
+            w.refs.push_back(Ref{obj, next});
+            next += 16 * (1 + rng.below(4));
+        }
+    }
+    for (size_t i = w.refs.size() - 1; i > 0; i--) {
+        std::swap(w.refs[i], w.refs[rng.below((uint32_t)(i + 1))]);
+    }
+}
+
+template <unsigned N>
+static void
+measure(const Workload& w)
+{
+    HostWeakTable<N> table;
+    size_t n = w.refs.size();
+
+    uint64_t t0 = nanoseconds();
+    for (const Ref& r : w.refs) table.registerRef(r.referent, r.referrer);
+    uint64_t t1 = nanoseconds();
+    size_t bytes = table.bytes();
+    size_t spilled = 0;
+    for (size_t i = 0; i <= table.mask; i++) {
+        spilled += table.entries[i].referent  &&  
+            table.entries[i].out_of_line();
+    }
+
+    size_t found = 0;
+    for (const Ref& r : w.refs) {
+        auto *e = table.find(r.referent);
+        found += (e != nullptr);
+    }
+    uint64_t t2 = nanoseconds();
+    if (found != n) benchfail("entry lost");
+
+    for (size_t i = 0; i < n; i += 2) {
+        table.unregisterRef(w.refs[i].referent, w.refs[i].referrer);
+    }
+    uint64_t t3 = nanoseconds();
+
+    size_t cleared = 0;
+    for (uintptr_t obj : w.objects) cleared += table.clear(obj);
+    uint64_t t4 = nanoseconds();
+    if (cleared != n / 2) benchfail("cleared %zu of %zu", cleared, n / 2);
+    if (table.count != 0) benchfail("entries left over");
+
+    printf("  %3zu-byte entry, %2u inline  %6.2f bytes/ref  "
+           "spilled %5.1f%%  register %6.1f  lookup %5.1f  "
+           "unregister %6.1f  clear %6.1f ns/ref\n",
+           sizeof(typename HostWeakTable<N>::Entry), N,
+           (double)bytes / n, 100.0 * spilled / w.objects.size(),
+           (double)(t1 - t0) / n, (double)(t2 - t1) / n,
+           (double)(t3 - t2) / (n / 2), (double)(t4 - t3) / (n / 2));
+}
+
+
+int main()
+{
+    static_assert(sizeof(HostEntry<4>) == 40, "original layout");
+    static_assert(sizeof(HostEntry<7>) == 64, "one cache line");
+    static_assert(sizeof(HostEntry<15>) == 128, "two cache lines");
+
+    size_t total = benchscale(2000000);
+    std::vector<Workload> workloads = {
+        // Nearly every weakly-referenced object has one weak reference.
+        { "mostly single", { {1, 90}, {4, 8}, {16, 2} }, {}, {} },
+        // Spilled entries mostly hold 5-16 weak references.
+        { "profile", { {1, 70}, {4, 15}, {16, 12}, {64, 3} }, {}, {} },
+        // Delegates and observers: many objects with a handful each.
+        { "observers", { {4, 40}, {16, 60} }, {}, {} },
+    };
+
+    for (Workload& w : workloads) {
+        generate(w, total);
+        printf("%s: %zu objects, %zu weak references\n",
+               w.name, w.objects.size(), w.refs.size());
+        measure<4>(w);
+        measure<7>(w);
+        measure<15>(w);
+    }
+    return 0;
+}
@@ -0,0 +1,539 @@
+// weak.cpp
+// Stress and throughput for the weak reference protocol:
+// objc_loadWeakRetained(), storeWeak() and weak_clear_no_lock() on
+// dealloc, the old way and the lock-free way that
+// OBJC_LOCKFREE_WEAK_LOAD turns on.
+//
+// usage: weak
+//
+// Old: loads lock the object's stripe and re-check the variable.
+// Stores lock the old and new objects' stripes together and retry if
+// the variable changed. Deallocated objects are freed at once.
+//
+// Lock-free: loads read the variable and try-retain the object inside
+// an epoch. Stores hold the variable's location lock and lock the new
+// and old stripes one after the other. Dealloc compares-and-swaps each
+// weak variable to nil, and weakly-referenced objects are retired and
+// freed once the epoch has moved past every load in progress. As in
+// weak_free(), a thread advances the epoch and collects only after
+// every 64 objects it retires. "collections" counts those, against
+// the objects retired.
+//
+// Every thread loads random shared weak variables, stores objects it
+// holds strong references to into random weak variables, and replaces
+// those strong references with new objects, which deallocates the old
+// objects and clears their weak variables. Objects are HostObjects
+// with a refcount and deallocating bit in one word, like a nonpointer
+// isa. The stripe's weak table is a std::unordered_map standing in for
+// weak_table_t.
+//
+// Freed objects are poisoned and quarantined before being freed for
+// real, so a load that reaches freed memory fails the benchmark.
+// Afterwards every variable must be registered with the object it
+// holds, and every registration must match a variable.
+//
+// The stress runs use a few objects and variables, and yield inside
+// the windows where the protocols race - between reading a variable
+// and retaining its object, and between registering a variable with
+// its new object and unregistering it from its old one - so that
+// threads interleave there even on one CPU.
+
+#include "bench.h"
+#include "objc-epoch.h"
+#include "objc-stripe-engine.h"
+
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
+enum {
+    StripeCount = 64,
+    QuarantineCount = 256,     // per thread
+    CollectCount = 64,         // WEAK_COLLECT_COUNT
+};
+
+enum class Mode { Locked, LockFree };
+
+static const char *modeName(Mode m)
+{
+    return m == Mode::Locked ? "old (lockTwo)" : "lock-free load";
+}
+
+static const uint64_t Live = 0x11feb0a7;
+static const unsigned char Poison = 0xdd;
+
+// Like the nonpointer isa bits rootTryRetain() and rootRelease() use.
+struct HostObject {
+    enum : uint64_t { Deallocating = 1, WeaklyReferenced = 2, RCOne = 4 };
+    std::atomic<uint64_t> bits;
+    uint64_t magic;
+};
+
+typedef std::atomic<HostObject *> WeakVar;
+
+struct SpinLock {
+    std::atomic<bool> locked{false};
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+struct HostSideTable {
+    SpinLock lock;
+    std::unordered_map<HostObject *, std::vector<WeakVar *>> weak;
+    char pad[64];
+};
+
+// Like WeakLocationLocks and weakMoves.
+struct LocationStripe {
+    SpinLock lock;
+    std::atomic<uint32_t> moves{0};
+    char pad[64];
+};
+
+struct ThreadState {
+    BenchRandom rng;
+    objc::EpochRecord *record = nullptr;
+    objc::EpochGarbage garbage;
+    std::deque<void *> quarantine;
+    uint64_t retired = 0;
+    uint64_t collections = 0;
+    unsigned sinceCollect = 0;
+    char pad[64];
+};
+
+struct Run {
+    Mode mode;
+    std::unique_ptr<HostSideTable[]> tables{new HostSideTable[StripeCount]};
+    std::unique_ptr<LocationStripe[]> locations{new LocationStripe[StripeCount]};
+    std::unique_ptr<WeakVar[]> vars;
+    unsigned varCount;
+    std::unique_ptr<std::atomic<HostObject *>[]> slots;  // strong references
+    unsigned slotCount;
+    bool stress;
+    std::vector<std::unique_ptr<ThreadState>> threads;
+    objc::EpochDomain epochs;
+    std::atomic<uint64_t> warnings{0};
+    std::atomic<uint64_t> retries{0};
+
+    Run(Mode m, unsigned vc, unsigned sc, unsigned threadCount, bool st)
+        : mode(m), vars(new WeakVar[vc]), varCount(vc), 
+          slots(new std::atomic<HostObject *>[sc]), slotCount(sc), stress(st)
+    {
+        for (unsigned i = 0; i < threadCount; i++) {
+            threads.emplace_back(new ThreadState);
+            threads.back()->rng = BenchRandom(i + 1);
+            threads.back()->record = epochs.acquireRecord();
+        }
+    }
+
+    // A place where another thread's operation can race with ours.
+    // Sleeping, unlike yielding, reliably lets other threads run.
+    void window(ThreadState& ts) {
+        if (stress  &&  ts.rng.below(8) == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(1));
+        }
+    }
+
+    HostSideTable& tableFor(HostObject *obj) {
+        return tables[objc::stripe_index((uintptr_t)obj, StripeCount)];
+    }
+    LocationStripe& stripeFor(WeakVar *location) {
+        return locations[objc::stripe_index((uintptr_t)location,
+                                            StripeCount)];
+    }
+
+    static HostObject *newObject() {
+        auto obj = (HostObject *)malloc(sizeof(HostObject));
+        new (&obj->bits) std::atomic<uint64_t>(HostObject::RCOne);
+        obj->magic = Live;
+        return obj;
+    }
+
+    static void check(HostObject *obj) {
+        if (obj->magic != Live) benchfail("weak load reached a freed object");
+    }
+
+    static bool tryRetain(HostObject *obj) {
+        uint64_t b = obj->bits.load(std::memory_order_relaxed);
+        do {
+            if (b & HostObject::Deallocating) return false;
+        } while (!obj->bits.compare_exchange_weak(b, b + HostObject::RCOne,
+                                                  std::memory_order_acquire));
+        return true;
+    }
+
+    void release(ThreadState& ts, HostObject *obj) {
+        uint64_t b = obj->bits.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t rc = b / HostObject::RCOne;
+            uint64_t next = (rc == 1)
+                ? ((b - HostObject::RCOne) | HostObject::Deallocating)
+                : b - HostObject::RCOne;
+            if (obj->bits.compare_exchange_weak(b, next,
+                                                std::memory_order_acq_rel))
+            {
+                if (rc == 1) dealloc(ts, obj);
+                return;
+            }
+        }
+    }
+
+
+    // Weak table, with the object's stripe locked.
+
+    // Like weak_register_no_lock() and setWeaklyReferenced_nolock().
+    HostObject *registerWeak(HostSideTable& t, HostObject *obj,
+                             WeakVar *location) {
+        if (obj->bits.load() & HostObject::Deallocating) return nullptr;
+        t.weak[obj].push_back(location);
+        obj->bits.fetch_or(HostObject::WeaklyReferenced);
+        return obj;
+    }
+
+    // Like weak_unregister_no_lock() and weak_unregister_moved_no_lock().
+    void unregisterWeak(HostSideTable& t, HostObject *obj,
+                        WeakVar *location, bool complain) {
+        auto it = t.weak.find(obj);
+        if (it == t.weak.end()) return;
+        auto& referrers = it->second;
+        auto r = std::find(referrers.begin(), referrers.end(), location);
+        if (r == referrers.end()) {
+            if (complain) warnings++;
+            return;
+        }
+        *r = referrers.back();
+        referrers.pop_back();
+        if (referrers.empty()) t.weak.erase(it);
+    }
+
+    // Like weak_clear_no_lock().
+    void clearWeak(HostSideTable& t, HostObject *obj) {
+        auto it = t.weak.find(obj);
+        if (it == t.weak.end()) return;
+        for (WeakVar *location : it->second) {
+            if (mode == Mode::Locked) {
+                if (location->load() == obj) location->store(nullptr);
+                else if (location->load()) warnings++;
+            } else {
+                HostObject *value = obj;
+                if (!location->compare_exchange_strong(value, nullptr)  &&
+                    value  &&  stripeFor(location).moves.load() == 0)
+                {
+                    warnings++;
+                }
+            }
+        }
+        t.weak.erase(it);
+    }
+
+
+    // Runtime entry points.
+
+    void dispose(ThreadState& ts, void *p) {
+        memset(p, Poison, sizeof(HostObject));
+        ts.quarantine.push_back(p);
+        if (ts.quarantine.size() > QuarantineCount) {
+            free(ts.quarantine.front());
+            ts.quarantine.pop_front();
+        }
+    }
+
+    void collect(ThreadState& ts) {
+        ts.sinceCollect = 0;
+        epochs.tryAdvance();
+        epochs.tryAdvance();
+        ts.garbage.collect(epochs,
+                           [&](void *p, size_t) { dispose(ts, p); });
+    }
+
+    // Like clearDeallocating() and object_dispose().
+    void dealloc(ThreadState& ts, HostObject *obj) {
+        bool weaklyReferenced =
+            obj->bits.load() & HostObject::WeaklyReferenced;
+        if (weaklyReferenced) {
+            HostSideTable& t = tableFor(obj);
+            t.lock.lock();
+            clearWeak(t, obj);
+            t.lock.unlock();
+        }
+        window(ts);
+
+        // Like weak_free().
+        if (mode == Mode::Locked  ||  !weaklyReferenced) {
+            dispose(ts, obj);
+            return;
+        }
+        ts.garbage.retire(obj, sizeof(HostObject), epochs.current());
+        ts.retired++;
+        if (++ts.sinceCollect >= CollectCount) {
+            collect(ts);
+            ts.collections++;
+        }
+    }
+
+    // Like objc_loadWeakRetained().
+    HostObject *load(ThreadState& ts, WeakVar *location) {
+        if (mode == Mode::LockFree) {
+            objc::EpochGuard guard(epochs, ts.record);
+            HostObject *obj = location->load(std::memory_order_acquire);
+            if (!obj) return nullptr;
+            window(ts);
+            check(obj);
+            bool retained = tryRetain(obj);
+            check(obj);
+            return retained ? obj : nullptr;
+        }
+
+        for (;;) {
+            HostObject *obj = location->load(std::memory_order_acquire);
+            if (!obj) return nullptr;
+            window(ts);
+            HostSideTable& t = tableFor(obj);
+            t.lock.lock();
+            if (location->load() != obj) {
+                t.lock.unlock();
+                retries++;
+                continue;
+            }
+            check(obj);
+            bool retained = tryRetain(obj);
+            t.lock.unlock();
+            return retained ? obj : nullptr;
+        }
+    }
+
+    // Like storeWeak<DoHaveOld, DoHaveNew>().
+    void store(ThreadState& ts, WeakVar *location, HostObject *newObj) {
+        if (mode == Mode::Locked) storeLocked(ts, location, newObj);
+        else storeLockFree(ts, location, newObj);
+    }
+
+    void storeLocked(ThreadState& ts, WeakVar *location, HostObject *newObj) {
+        for (;;) {
+            HostObject *oldObj = location->load();
+            window(ts);
+            HostSideTable *oldTable = oldObj ? &tableFor(oldObj) : nullptr;
+            HostSideTable *newTable = newObj ? &tableFor(newObj) : nullptr;
+            lockTwo(oldTable, newTable);
+            if (location->load() != oldObj) {
+                unlockTwo(oldTable, newTable);
+                retries++;
+                continue;
+            }
+            if (oldObj) unregisterWeak(*oldTable, oldObj, location, true);
+            HostObject *value =
+                newObj ? registerWeak(*newTable, newObj, location) : nullptr;
+            location->store(value, std::memory_order_release);
+            unlockTwo(oldTable, newTable);
+            return;
+        }
+    }
+
+    void storeLockFree(ThreadState& ts, WeakVar *location, 
+                       HostObject *newObj) {
+        LocationStripe& stripe = stripeFor(location);
+        stripe.lock.lock();
+
+        HostObject *oldObj = location->load();
+        window(ts);
+        HostSideTable *oldTable = oldObj ? &tableFor(oldObj) : nullptr;
+        HostSideTable *newTable = newObj ? &tableFor(newObj) : nullptr;
+
+        if (!oldTable  ||  !newTable  ||  oldTable == newTable) {
+            HostSideTable *t = oldTable ? oldTable : newTable;
+            if (t) t->lock.lock();
+            if (oldTable  &&  location->load() == oldObj) {
+                unregisterWeak(*t, oldObj, location, true);
+            }
+            HostObject *value =
+                newObj ? registerWeak(*t, newObj, location) : nullptr;
+            location->store(value, std::memory_order_release);
+            if (t) t->lock.unlock();
+        } else {
+            stripe.moves.fetch_add(1, std::memory_order_relaxed);
+
+            newTable->lock.lock();
+            HostObject *value = registerWeak(*newTable, newObj, location);
+            location->store(value, std::memory_order_release);
+            newTable->lock.unlock();
+            window(ts);
+
+            oldTable->lock.lock();
+            unregisterWeak(*oldTable, oldObj, location, false);
+            oldTable->lock.unlock();
+
+            stripe.moves.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        stripe.lock.unlock();
+    }
+
+    static void lockTwo(HostSideTable *a, HostSideTable *b) {
+        if (!a || !b) {
+            if (a) a->lock.lock();
+            if (b) b->lock.lock();
+        } else if (a < b) {
+            a->lock.lock(); b->lock.lock();
+        } else {
+            b->lock.lock(); if (a != b) a->lock.lock();
+        }
+    }
+    static void unlockTwo(HostSideTable *a, HostSideTable *b) {
+        if (a) a->lock.unlock();
+        if (b  &&  b != a) b->lock.unlock();
+    }
+
+
+    void verify() {
+        size_t registrations = 0;
+        for (unsigned i = 0; i < StripeCount; i++) {
+            for (auto& e : tables[i].weak) {
+                for (WeakVar *location : e.second) {
+                    if (location->load() != e.first) {
+                        benchfail("stale weak registration");
+                    }
+                    registrations++;
+                }
+            }
+        }
+        size_t held = 0;
+        for (unsigned i = 0; i < varCount; i++) {
+            HostObject *obj = vars[i].load();
+            if (!obj) continue;
+            check(obj);
+            held++;
+        }
+        if (held != registrations) benchfail("unregistered weak variable");
+        if (warnings.load()) benchfail("weak table warnings");
+    }
+
+    // Deallocating every object must nil every variable.
+    void teardown() {
+        verify();
+        ThreadState& ts = *threads[0];
+        for (unsigned i = 0; i < slotCount; i++) {
+            release(ts, slots[i].exchange(nullptr));
+        }
+        for (unsigned i = 0; i < varCount; i++) {
+            if (vars[i].load()) benchfail("weak variable not cleared");
+        }
+        verify();
+        for (auto& t : threads) {
+            while (t->garbage.pendingCount()) collect(*t);
+            for (void *p : t->quarantine) free(p);
+            t->garbage.freeStorage();
+        }
+    }
+};
+
+
+struct Mix { unsigned load, store; };   // percent; the rest replace
+
+struct Config {
+    Mix mix;
+    unsigned varCount;
+    unsigned slotCount;
+    unsigned threadCount;
+    bool stress;
+};
+
+static void
+run(Mode mode, const Config& c, size_t opsPerThread)
+{
+    Run r(mode, c.varCount, c.slotCount, c.threadCount, c.stress);
+    ThreadState& setup = *r.threads[0];
+    for (unsigned i = 0; i < c.slotCount; i++) {
+        r.slots[i].store(Run::newObject());
+    }
+    for (unsigned i = 0; i < c.varCount; i++) {
+        HostObject *obj = r.slots[setup.rng.below(c.slotCount)].load();
+        r.vars[i].store(nullptr);
+        r.store(setup, &r.vars[i], obj);
+    }
+
+    std::vector<BenchLatency> loadLatency(c.threadCount);
+    uint64_t ns = benchthreads(c.threadCount, [&](unsigned t) {
+        ThreadState& ts = *r.threads[t];
+        BenchRandom& rng = ts.rng;
+        // Only this thread replaces its own strong references.
+        unsigned slotsEach = c.slotCount / c.threadCount;
+        unsigned mine = t * slotsEach;
+        for (size_t i = 0; i < opsPerThread; i++) {
+            unsigned op = rng.below(100);
+            WeakVar *var = &r.vars[rng.below(c.varCount)];
+            if (op < c.mix.load) {
+                uint64_t start = (i % 64 == 0) ? nanoseconds() : 0;
+                HostObject *obj = r.load(ts, var);
+                if (start) loadLatency[t].add(nanoseconds() - start);
+                if (obj) r.release(ts, obj);
+            } else if (op < c.mix.load + c.mix.store) {
+                r.store(ts, var, r.slots[mine + rng.below(slotsEach)].load());
+            } else {
+                HostObject *obj = Run::newObject();
+                r.release(ts, r.slots[mine + rng.below(slotsEach)]
+                          .exchange(obj));
+            }
+        }
+    });
+
+    uint64_t retired = 0, collections = 0;
+    for (auto& t : r.threads) {
+        retired += t->retired;
+        collections += t->collections;
+    }
+    for (unsigned t = 1; t < c.threadCount; t++) {
+        loadLatency[0].merge(loadLatency[t]);
+    }
+
+    double ops = (double)opsPerThread * c.threadCount;
+    printf("  %-15s %4u vars %2u threads  %7.2f Mops/s  "
+           "retries %7llu  collections %6llu for %7llu frees\n",
+           modeName(mode), c.varCount, c.threadCount, ops / ns * 1000.0,
+           (unsigned long long)r.retries.load(),
+           (unsigned long long)collections, (unsigned long long)retired);
+    if (!c.stress) loadLatency[0].print("    load latency");
+
+    r.teardown();
+}
+
+
+int main()
+{
+    static const Mix mixes[] = { { 95, 4 }, { 70, 20 } };
+    static const unsigned varCounts[] = { 8, 4096 };
+    static const unsigned threadCounts[] = { 1, 2, 4, 8 };
+    enum { SlotCount = 4096 };
+
+    size_t ops = benchscale(400000);
+
+    printf("weak stress: 16 objects, 16 weak variables, "
+           "60%% loads, 30%% stores, 10%% replacements\n");
+    for (unsigned threads : { 2, 4, 8 }) {
+        Config c = { { 60, 30 }, 16, 16, threads, true };
+        for (Mode m : { Mode::Locked, Mode::LockFree }) {
+            run(m, c, std::max<size_t>(ops / 8 / threads, 1));
+        }
+    }
+
+    printf("weak throughput: %u objects, %zu operations per configuration\n",
+           (unsigned)SlotCount, ops);
+    for (const Mix& mix : mixes) {
+        for (unsigned varCount : varCounts) {
+            printf("%u%% loads, %u%% stores, %u%% replacements, "
+                   "%u weak variables\n", mix.load, mix.store,
+                   100 - mix.load - mix.store, varCount);
+            for (unsigned threads : threadCounts) {
+                Config c = { mix, varCount, SlotCount, threads, false };
+                for (Mode m : { Mode::Locked, Mode::LockFree }) {
+                    run(m, c, std::max<size_t>(ops / threads, 1));
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -26,6 +26,13 @@
 
 #include "objc-weak.h"
 #include "llvm-DenseMap.h"
+#include "objc-bulk-rc-engine.h"
+#include "objc-dealloc-queue-engine.h"
+#include "objc-pool-arena-engine.h"
+#if SUPPORT_AUTORELEASE_COALESCING
+#   include "objc-autorelease-coalesce-engine.h"
+#endif
+#include "objc-refcount-engine.h"
 #include "NSObject.h"
 
 #include <malloc/malloc.h>
@@ -40,6 +47,7 @@
 #include <Block.h>
 #include <map>
 #include <execinfo.h>
+#include <pthread/qos.h>
 
 @interface NSInvocation
 - (SEL)selector;
@@ -94,7 +102,11 @@ struct SideTable {
     RefcountMap refcnts;
     weak_table_t weak_table;
 
-    SideTable() {
+    // Contention telemetry. Updated with slock held.
+    uint64_t acquires;
+    uint64_t contentions;
+
+    SideTable() : acquires(0), contentions(0) {
         memset(&weak_table, 0, sizeof(weak_table));
     }
 
@@ -102,75 +114,60 @@ struct SideTable {
         _objc_fatal("Do not delete SideTable.");
     }
 
-    void lock() { slock.lock(); }
+    // Counting contention costs nothing when the lock is free: 
+    // tryLock() is the same atomic operation lock() starts with.
+    void lock() {
+        bool contended = !slock.tryLock();
+        if (contended) slock.lock();
+        acquires++;
+        contentions += contended;
+    }
     void unlock() { slock.unlock(); }
     void forceReset() { slock.forceReset(); }
-
-    // Address-ordered lock discipline for a pair of side tables.
-
-    template<HaveOld, HaveNew>
-    static void lockTwo(SideTable *lock1, SideTable *lock2);
-    template<HaveOld, HaveNew>
-    static void unlockTwo(SideTable *lock1, SideTable *lock2);
 };
 
 
-template<>
-void SideTable::lockTwo<DoHaveOld, DoHaveNew>
-    (SideTable *lock1, SideTable *lock2)
-{
-    spinlock_t::lockTwo(&lock1->slock, &lock2->slock);
-}
-
-template<>
-void SideTable::lockTwo<DoHaveOld, DontHaveNew>
-    (SideTable *lock1, SideTable *)
-{
-    lock1->lock();
-}
-
-template<>
-void SideTable::lockTwo<DontHaveOld, DoHaveNew>
-    (SideTable *, SideTable *lock2)
-{
-    lock2->lock();
-}
-
-template<>
-void SideTable::unlockTwo<DoHaveOld, DoHaveNew>
-    (SideTable *lock1, SideTable *lock2)
-{
-    spinlock_t::unlockTwo(&lock1->slock, &lock2->slock);
-}
-
-template<>
-void SideTable::unlockTwo<DoHaveOld, DontHaveNew>
-    (SideTable *lock1, SideTable *)
-{
-    lock1->unlock();
-}
-
-template<>
-void SideTable::unlockTwo<DontHaveOld, DoHaveNew>
-    (SideTable *, SideTable *lock2)
-{
-    lock2->unlock();
-}
+// The stripe count is chosen at startup from the CPU count, at least 
+// the count StripedMap would use. OBJC_SIDE_TABLE_STRIPES=n overrides it.
+#if TARGET_OS_IPHONE && !TARGET_OS_SIMULATOR
+enum { SideTableMinStripes = 8, SideTableMaxStripes = 64 };
+#else
+enum { SideTableMinStripes = 64, SideTableMaxStripes = 1024 };
+#endif
 
+typedef ScalableStripedMap<SideTable, SideTableMaxStripes> SideTableMap;
 
 // We cannot use a C++ static initializer to initialize SideTables because
 // libc calls us before our C++ initializers run. We also don't want a global 
 // pointer to this struct because of the extra indirection.
 // Do it the hard way.
-alignas(StripedMap<SideTable>) static uint8_t 
-    SideTableBuf[sizeof(StripedMap<SideTable>)];
+alignas(SideTableMap) static uint8_t SideTableBuf[sizeof(SideTableMap)];
 
-static void SideTableInit() {
-    new (SideTableBuf) StripedMap<SideTable>();
+static SideTableMap& SideTables() {
+    return *reinterpret_cast<SideTableMap*>(SideTableBuf);
 }
 
-static StripedMap<SideTable>& SideTables() {
-    return *reinterpret_cast<StripedMap<SideTable>*>(SideTableBuf);
+static void SideTablePrintStatistics(void);
+
+static void SideTableInit() {
+    unsigned count = 0;
+
+    // Like environ_init(), ignore the environment when setuid or setgid.
+    const char *env = issetugid() ? nil : getenv("OBJC_SIDE_TABLE_STRIPES");
+    if (env) {
+        long n = strtol(env, nil, 10);
+        if (n > 0) count = (unsigned)n;
+    }
+
+    SideTables().init(count, SideTableMinStripes);
+
+    if (PrintSideTables) {
+        _objc_inform("SIDETABLES: %u stripes", SideTables().count());
+        atexit(&SideTablePrintStatistics);
+    }
+    if (PrintWeakClears) {
+        atexit(&weak_print_statistics);
+    }
 }
 
 // anonymous namespace
@@ -216,6 +213,69 @@ void SideTableLocksSucceedLocks(StripedMap<spinlock_t>& oldlocks) {
     }
 }
 
+
+/***********************************************************************
+* Side table statistics.
+* Per-stripe lock acquisitions, contended acquisitions, and contents, 
+* so that hot stripes can be found. OBJC_PRINT_SIDE_TABLES logs the 
+* stripe count at startup and the most contended stripes at exit.
+**********************************************************************/
+unsigned _objc_getSideTableStatistics(objc_side_table_stripe_statistics *stats,
+                                      unsigned count)
+{
+    SideTableMap& tables = SideTables();
+    unsigned stripes = tables.count();
+    for (unsigned i = 0; i < stripes  &&  i < count; i++) {
+        SideTable& table = tables.stripe(i);
+        table.slock.lock();
+        stats[i].acquires = table.acquires;
+        stats[i].contentions = table.contentions;
+        stats[i].refcounts = table.refcnts.size();
+        stats[i].weakEntries = table.weak_table.num_entries;
+        table.slock.unlock();
+    }
+    return stripes;
+}
+
+static void SideTablePrintStatistics(void)
+{
+    enum { Busiest = 8 };
+
+    unsigned count = SideTables().count();
+    auto stats = (objc_side_table_stripe_statistics *)
+        calloc(count, sizeof(objc_side_table_stripe_statistics));
+    _objc_getSideTableStatistics(stats, count);
+
+    uint64_t acquires = 0, contentions = 0;
+    for (unsigned i = 0; i < count; i++) {
+        acquires += stats[i].acquires;
+        contentions += stats[i].contentions;
+    }
+    _objc_inform("SIDETABLES: %u stripes, %llu acquisitions, "
+                 "%llu contended (%.2f%%)", count, 
+                 (unsigned long long)acquires, 
+                 (unsigned long long)contentions, 
+                 acquires ? 100.0 * contentions / acquires : 0.0);
+
+    // Selection of the busiest stripes, most contended first.
+    for (unsigned n = 0; n < Busiest  &&  n < count; n++) {
+        unsigned best = n;
+        for (unsigned i = n + 1; i < count; i++) {
+            if (stats[i].contentions > stats[best].contentions) best = i;
+        }
+        if (stats[best].contentions == 0) break;
+        std::swap(stats[n], stats[best]);
+        _objc_inform("SIDETABLES:   %llu contended of %llu acquisitions, "
+                     "%llu refcounts, %llu weak entries", 
+                     (unsigned long long)stats[n].contentions, 
+                     (unsigned long long)stats[n].acquires, 
+                     (unsigned long long)stats[n].refcounts, 
+                     (unsigned long long)stats[n].weakEntries);
+    }
+
+    free(stats);
+}
+
 //
 // The -fobjc-arc flag causes the compiler to issue calls to objc_{retain/release/autorelease/retain_block}
 //
@@ -252,6 +312,25 @@ objc_storeStrong(id *location, id obj)
 }
 
 
+// Stores to one __weak variable are serialized by its location lock. 
+// Side table locks are taken one at a time while it is held.
+StripedMap<spinlock_t> WeakLocationLocks;
+
+// __weak variables are read without a lock by objc_loadWeakRetained() 
+// and compared-and-swapped to nil by weak_clear_no_lock().
+static ALWAYS_INLINE id 
+weakLoad(id *location)
+{
+    return __atomic_load_n(location, __ATOMIC_ACQUIRE);
+}
+
+static ALWAYS_INLINE void 
+weakPublish(id *location, id value)
+{
+    __atomic_store_n(location, value, __ATOMIC_RELEASE);
+}
+
+
 // Update a weak variable.
 // If HaveOld is true, the variable has an existing value 
 //   that needs to be cleaned up. This value might be nil.
@@ -263,6 +342,30 @@ objc_storeStrong(id *location, id obj)
 enum CrashIfDeallocating {
     DontCrashIfDeallocating = false, DoCrashIfDeallocating = true
 };
+
+// Registers the variable with newObj and stores newObj into it.
+// Call with newTable locked, so that newObj cannot finish deallocating 
+// between the check for deallocation and the store.
+template <CrashIfDeallocating crashIfDeallocating>
+static objc_object *
+registerAndPublish(SideTable *newTable, id *location, objc_object *newObj)
+{
+    newObj = (objc_object *)
+        weak_register_no_lock(&newTable->weak_table, (id)newObj, location, 
+                              crashIfDeallocating);
+    // weak_register_no_lock returns nil if weak store should be rejected
+
+    // Set is-weakly-referenced bit in refcount table.
+    // weak_free() relies on it being set before the store.
+    if (newObj  &&  !newObj->isTaggedPointer()) {
+        newObj->setWeaklyReferenced_nolock();
+    }
+
+    // Do not set *location anywhere else. That would introduce a race.
+    weakPublish(location, (id)newObj);
+    return newObj;
+}
+
 template <HaveOld haveOld, HaveNew haveNew,
           CrashIfDeallocating crashIfDeallocating>
 static id 
@@ -275,29 +378,14 @@ storeWeak(id *location, objc_object *newObj)
     id oldObj;
     SideTable *oldTable;
     SideTable *newTable;
+    spinlock_t& locationLock = WeakLocationLocks[location];
 
-    // Acquire locks for old and new values.
-    // Order by lock address to prevent lock ordering problems. 
-    // Retry if the old value changes underneath us.
+    // With the location lock held, the old value can change underneath 
+    // us only by being cleared to nil when the old object deallocates.
  retry:
-    if (haveOld) {
-        oldObj = *location;
-        oldTable = &SideTables()[oldObj];
-    } else {
-        oldTable = nil;
-    }
-    if (haveNew) {
-        newTable = &SideTables()[newObj];
-    } else {
-        newTable = nil;
-    }
+    locationLock.lock();
 
-    SideTable::lockTwo<haveOld, haveNew>(oldTable, newTable);
-
-    if (haveOld  &&  *location != oldObj) {
-        SideTable::unlockTwo<haveOld, haveNew>(oldTable, newTable);
-        goto retry;
-    }
+    oldObj = haveOld ? *location : nil;
 
     // Prevent a deadlock between the weak reference machinery
     // and the +initialize machinery by ensuring that no 
@@ -307,7 +395,7 @@ storeWeak(id *location, objc_object *newObj)
         if (cls != previouslyInitializedClass  &&  
             !((objc_class *)cls)->isInitialized()) 
         {
-            SideTable::unlockTwo<haveOld, haveNew>(oldTable, newTable);
+            locationLock.unlock();
             _class_initialize(_class_getNonMetaClass(cls, (id)newObj));
 
             // If this class is finished with +initialize then we're good.
@@ -322,31 +410,46 @@ storeWeak(id *location, objc_object *newObj)
         }
     }
 
-    // Clean up old value, if any.
-    if (haveOld) {
-        weak_unregister_no_lock(&oldTable->weak_table, oldObj, location);
-    }
-
-    // Assign new value, if any.
-    if (haveNew) {
-        newObj = (objc_object *)
-            weak_register_no_lock(&newTable->weak_table, (id)newObj, location, 
-                                  crashIfDeallocating);
-        // weak_register_no_lock returns nil if weak store should be rejected
+    oldTable = oldObj ? &SideTables()[oldObj] : nil;
+    newTable = haveNew ? &SideTables()[newObj] : nil;
 
-        // Set is-weakly-referenced bit in refcount table.
-        if (newObj  &&  !newObj->isTaggedPointer()) {
-            newObj->setWeaklyReferenced_nolock();
+    if (!oldTable  ||  !newTable  ||  oldTable == newTable) {
+        // One stripe: unregister and register under one lock.
+        SideTable *table = oldTable ? oldTable : newTable;
+        if (table) {
+            table->lock();
+            // Skip the old value if it was cleared before we locked.
+            if (oldTable  &&  *location == oldObj) {
+                weak_unregister_no_lock(&table->weak_table, oldObj, location);
+            }
+            if (haveNew) {
+                newObj = registerAndPublish<crashIfDeallocating>
+                    (table, location, newObj);
+            }
+            table->unlock();
         }
-
-        // Do not set *location anywhere else. That would introduce a race.
-        *location = (id)newObj;
     }
     else {
-        // No new value. The storage is not changed.
+        // Two stripes, locked one at a time. The variable is registered 
+        // with newObj before it holds newObj, and with oldObj until it 
+        // no longer holds oldObj, so clearing either object finds it.
+        weak_move_begin(location);
+
+        newTable->lock();
+        newObj = registerAndPublish<crashIfDeallocating>
+            (newTable, location, newObj);
+        newTable->unlock();
+
+        // oldObj may have deallocated since we read it, 
+        // and its address may be in use by a new object.
+        oldTable->lock();
+        weak_unregister_moved_no_lock(&oldTable->weak_table, oldObj, location);
+        oldTable->unlock();
+
+        weak_move_end(location);
     }
-    
-    SideTable::unlockTwo<haveOld, haveNew>(oldTable, newTable);
+
+    locationLock.unlock();
 
     return (id)newObj;
 }
@@ -457,6 +560,38 @@ objc_destroyWeak(id *location)
   So we now don't touch the storage until deallocation completes.
 */
 
+// Lock-free case, with OBJC_LOCKFREE_WEAK_LOAD. An object with default 
+// RR and a nonpointer isa can be retained without its side table lock: 
+// rootTryRetain() fails once dealloc has begun, and weak_free() keeps 
+// the memory around until this load is done with it. Objects freed 
+// some other way than object_dispose(), such as objc_destructInstance() 
+// followed by free(), get no such grace period, which is why this is 
+// not the default.
+// Returns false if the caller must take the lock.
+static ALWAYS_INLINE bool 
+loadWeakRetainedLockFree(id *location, id *result)
+{
+    objc::EpochRecord *record = weak_load_begin();
+
+    bool done = true;
+    id obj = weakLoad(location);
+    if (!obj  ||  obj->isTaggedPointer()) {
+        *result = obj;
+    }
+    else if (obj->hasNonpointerIsa()  &&  !obj->ISA()->hasCustomRR()) {
+        // We know +initialize is complete because
+        // default-RR can never be set before then.
+        assert(obj->ISA()->isInitialized());
+        *result = obj->rootTryRetain() ? obj : nil;
+    }
+    else {
+        done = false;
+    }
+
+    weak_load_end(record);
+    return done;
+}
+
 id
 objc_loadWeakRetained(id *location)
 {
@@ -465,10 +600,15 @@ objc_loadWeakRetained(id *location)
     Class cls;
 
     SideTable *table;
+
+    if (slowpath(LockFreeWeakLoad)  &&  
+        loadWeakRetainedLockFree(location, &result))
+    {
+        return result;
+    }
     
  retry:
-    // fixme std::atomic this load
-    obj = *location;
+    obj = weakLoad(location);
     if (!obj) return nil;
     if (obj->isTaggedPointer()) return obj;
     
@@ -585,6 +725,9 @@ objc_moveWeak(id *dst, id *src)
      and deleted as necessary. 
    Thread-local storage points to the hot page, where newly autoreleased 
      objects are stored. 
+   With OBJC_AUTORELEASE_COALESCING, a pointer may be followed by a 
+     count of its repeated autoreleases, an odd word. 
+     See objc-autorelease-coalesce-engine.h.
 **********************************************************************/
 
 // Set this to 1 to mprotect() autorelease pool contents
@@ -597,6 +740,105 @@ objc_moveWeak(id *dst, id *src)
 BREAKPOINT_FUNCTION(void objc_autoreleaseNoPool(id obj));
 BREAKPOINT_FUNCTION(void objc_autoreleasePoolInvalid(const void *token));
 
+// Free pool pages kept for reuse. See objc-page-cache-engine.h.
+// OBJC_POOL_PAGE_CACHE=n sets each thread's cache depth, 0 to keep 
+// no free pages; OBJC_POOL_PAGE_CACHE_GLOBAL=n sets the global pool's.
+mutex_t PoolPageCacheLock;
+static objc::PageCache PoolPageCache;
+enum { PoolPageCacheDepth = 4, PoolPageCacheGlobal = 16 };
+
+#if SUPPORT_AUTORELEASE_COALESCING
+// OBJC_AUTORELEASE_COALESCING=n looks for a repeat of an autoreleased 
+// object among the top n entries of the hot page. 0, the default, is off.
+static unsigned AutoreleaseCoalescing;
+enum { MaxAutoreleaseCoalescing = 16 };
+#endif
+
+// Autorelease pool arenas. See objc-pool-arena-engine.h.
+// OBJC_POOL_ARENA=n takes each thread's pool pages from arenas of up 
+// to n MB; 0, the default, allocates each page on its own. A thread's 
+// first arena is one page, and each that follows it is twice the size 
+// of the one before, until the thread's first arena empties. OBJC_POOL_ARENA_SUPERPAGES backs the arenas with 
+// superpages where the system has them. Superpages are wired, so they 
+// are never discarded, and every such arena is n MB.
+static size_t PoolArenaBytes;
+static size_t PoolArenaKeepBytes;
+enum { MaxPoolArenaMB = 4096 };
+
+// An arena for the pages after those of prev, which is out of them, 
+// or for a thread's first page if prev is nil.
+static objc::PoolArena *newPoolArena(objc::PoolArena *prev, size_t pageSize)
+{
+    if (!PoolArenaBytes) return nil;
+
+    size_t bytes = pageSize;
+    if (prev) {
+        bytes = prev->regionBytes() * 2;
+        if (bytes > PoolArenaBytes) bytes = PoolArenaBytes;
+    }
+
+    vm_address_t region = 0;
+    kern_return_t kr = KERN_FAILURE;
+    bool superpages = false;
+#ifdef VM_FLAGS_SUPERPAGE_SIZE_ANY
+    if (PoolArenaSuperpages) {
+        kr = vm_map(mach_task_self(), &region, PoolArenaBytes, pageSize - 1, 
+                    VM_FLAGS_ANYWHERE | VM_FLAGS_SUPERPAGE_SIZE_ANY, 
+                    MEMORY_OBJECT_NULL, 0, FALSE, 
+                    VM_PROT_DEFAULT, VM_PROT_ALL, VM_INHERIT_DEFAULT);
+        superpages = (kr == KERN_SUCCESS);
+    }
+#endif
+    if (superpages) bytes = PoolArenaBytes;
+    if (kr != KERN_SUCCESS) {
+        kr = vm_map(mach_task_self(), &region, bytes, pageSize - 1, 
+                    VM_FLAGS_ANYWHERE, MEMORY_OBJECT_NULL, 0, FALSE, 
+                    VM_PROT_DEFAULT, VM_PROT_ALL, VM_INHERIT_DEFAULT);
+    }
+    if (kr != KERN_SUCCESS) return nil;
+
+    objc::PoolArena *arena = (objc::PoolArena *)malloc(sizeof(*arena));
+    arena->init((void *)region, bytes, pageSize, 
+                superpages ? bytes : PoolArenaKeepBytes);
+    return arena;
+}
+
+// Destroys arena and the arenas after it.
+static void destroyPoolArenas(objc::PoolArena *arena)
+{
+    while (arena) {
+        objc::PoolArena *next = arena->next;
+        vm_deallocate(mach_task_self(), (vm_address_t)arena->region(), 
+                      arena->regionBytes());
+        free(arena);
+        arena = next;
+    }
+}
+
+static void freePoolPages(objc::FreePage *list)
+{
+    size_t count = 0;
+    while (list) {
+        objc::FreePage *next = list->next;
+        free(list);
+        list = next;
+        count++;
+    }
+    PoolPageCache.freed(count);
+}
+
+// Called by _objc_pthread_destroyspecific() when a thread exits.
+void _destroyPoolPageCache(objc::PageCacheThread *cache)
+{
+    if (!cache->head) return;
+    objc::FreePage *overflow;
+    {
+        mutex_locker_t lock(PoolPageCacheLock);
+        overflow = PoolPageCache.flush(*cache);
+    }
+    freePoolPages(overflow);
+}
+
 namespace {
 
 struct magic_t {
@@ -644,28 +886,95 @@ class AutoreleasePoolPage
 #   define POOL_BOUNDARY nil
     static pthread_key_t const key = AUTORELEASE_POOL_KEY;
     static uint8_t const SCRIBBLE = 0xA3;  // 0xA3A3A3A3 after releasing
-    static size_t const SIZE = 
-#if PROTECT_AUTORELEASEPOOL
-        PAGE_MAX_SIZE;  // must be multiple of vm page size
-#else
-        PAGE_MAX_SIZE;  // size and alignment, power of 2
-#endif
-    static size_t const COUNT = SIZE / sizeof(id);
+    // Size and alignment, a power of 2 and a multiple of the vm page size.
+    // PAGE_MAX_SIZE unless OBJC_POOL_PAGE_SIZE says otherwise; set once 
+    // by init().
+    static size_t SIZE;
+    enum { MaxSize = 1024*1024 };
 
     magic_t const magic;
     id *next;
     pthread_t const thread;
     AutoreleasePoolPage * const parent;
     AutoreleasePoolPage *child;
+    objc::PoolArena * const arena;  // nil if the page was allocated alone
     uint32_t const depth;
     uint32_t hiwat;
 
     // SIZE-sizeof(*this) bytes of contents follow
 
-    static void * operator new(size_t size) {
+    // A new page after parent, from parent's arena if it has room, 
+    // or from a new arena if it has none or this is the thread's 
+    // first page.
+    static AutoreleasePoolPage *newPage(AutoreleasePoolPage *parent) 
+    {
+        objc::PoolArena *arena = 
+            parent ? parent->arena : newPoolArena(nil, SIZE);
+        bool reuse;
+        void *page = arena ? arena->take(&reuse) : nil;
+        if (!page  &&  arena) {
+            if (!arena->next) arena->next = newPoolArena(arena, SIZE);
+            arena = arena->next;
+            page = arena ? arena->take(&reuse) : nil;
+        }
+        if (page  &&  reuse) madvise(page, SIZE, MADV_FREE_REUSE);
+        if (!page) {
+            arena = nil;
+            page = allocPage();
+        }
+        return new (page) AutoreleasePoolPage(parent, arena);
+    }
+
+    static void deletePage(AutoreleasePoolPage *page) 
+    {
+        objc::PoolArena *arena = page->arena;
+        bool first = !page->parent;
+        page->~AutoreleasePoolPage();
+        if (!arena) return freePage(page);
+
+        // give() would lose track of every page above this one.
+        if (!arena->isTop(page)) {
+            _objc_fatal("autorelease pool page %p freed out of order "
+                        "from its arena", (void*)page);
+        }
+        void *discard;
+        if (size_t bytes = arena->give(page, &discard)) {
+            madvise(discard, bytes, MADV_FREE_REUSABLE);
+        }
+        // Emptied arenas stay for the next deep pool, until the 
+        // thread's first page goes, and every page after it with it.
+        if (first) destroyPoolArenas(arena);
+    }
+
+    static void *allocPage() {
+        if (PoolPageCache.threadDepth()) {
+            _objc_pthread_data *data = _objc_fetch_pthread_data(true);
+            objc::PageCacheThread *cache = data ? &data->poolPageCache : nil;
+            void *page = cache ? PoolPageCache.take(*cache) : nil;
+            if (page) return page;
+            {
+                mutex_locker_t lock(PoolPageCacheLock);
+                page = PoolPageCache.takeGlobal(cache);
+            }
+            if (page) return page;
+        }
+        PoolPageCache.allocated();
         return malloc_zone_memalign(malloc_default_zone(), SIZE, SIZE);
     }
-    static void operator delete(void * p) {
+    static void freePage(void * p) {
+        if (PoolPageCache.threadDepth()) {
+            // Don't create pthread data for a thread that is exiting.
+            _objc_pthread_data *data = _objc_fetch_pthread_data(false);
+            objc::PageCacheThread *cache = data ? &data->poolPageCache : nil;
+            if (cache  &&  PoolPageCache.put(*cache, p)) return;
+            objc::FreePage *overflow;
+            {
+                mutex_locker_t lock(PoolPageCacheLock);
+                overflow = PoolPageCache.putGlobal(cache, p);
+            }
+            return freePoolPages(overflow);
+        }
+        PoolPageCache.freed(1);
         return free(p);
     }
 
@@ -683,9 +992,10 @@ class AutoreleasePoolPage
 #endif
     }
 
-    AutoreleasePoolPage(AutoreleasePoolPage *newParent) 
+    AutoreleasePoolPage(AutoreleasePoolPage *newParent, 
+                        objc::PoolArena *newArena) 
         : magic(), next(begin()), thread(pthread_self()),
-          parent(newParent), child(nil), 
+          parent(newParent), child(nil), arena(newArena), 
           depth(parent ? 1+parent->depth : 0), 
           hiwat(parent ? parent->hiwat : 0)
     { 
@@ -765,6 +1075,36 @@ class AutoreleasePoolPage
         return (next - begin() < (end() - begin()) / 2);
     }
 
+    // How many releases a pool slot holds: 1 for an object, 
+    // or the repeats in a repeat slot that follows one.
+    static size_t slotReleases(id slot) {
+#if SUPPORT_AUTORELEASE_COALESCING
+        if (objc::AutoreleaseRepeats::is((uintptr_t)slot)) {
+            return objc::AutoreleaseRepeats::count((uintptr_t)slot);
+        }
+#endif
+        return 1;
+    }
+
+#if SUPPORT_AUTORELEASE_COALESCING
+    static bool isRepeatSlot(id slot) {
+        return objc::AutoreleaseRepeats::is((uintptr_t)slot);
+    }
+
+    // Counts obj as a repeat of one of the top entries, if it can.
+    id *coalesce(id obj)
+    {
+        unprotect();
+        uintptr_t *top = (uintptr_t *)next;
+        uintptr_t *entry = objc::autorelease_coalesce
+            ((uintptr_t *)begin(), &top, (uintptr_t *)end(), 
+             AutoreleaseCoalescing, (uintptr_t)obj);
+        next = (id *)top;
+        protect();
+        return (id *)entry;
+    }
+#endif
+
     id *add(id obj)
     {
         assert(!full());
@@ -780,6 +1120,42 @@ class AutoreleasePoolPage
         releaseUntil(begin());
     }
 
+    // Releases up to a batch of objects from the top of this page, 
+    // down to floor. See OBJC_BATCHED_POOL_DRAIN.
+    void releaseBatch(id *floor) 
+    {
+        // Objects autoreleased while the batch is released land where 
+        // the batch was, and go in the next batch.
+        enum { Batch = objc_object::RetainManyBatch };
+        id *top = next;
+
+        // Most recently autoreleased first, as before. 
+        // objc_releaseMany() skips pool boundaries, which are nil.
+        id batch[Batch];
+        unprotect();
+#if SUPPORT_AUTORELEASE_COALESCING
+        // An entry's repeats count against the batch, and an entry 
+        // with more than fit is left with the rest.
+        uintptr_t *start = (uintptr_t *)top;
+        size_t count = objc::autorelease_take
+            ((uintptr_t *)floor, &start, (uintptr_t *)batch, Batch);
+        next = (id *)start;
+#else
+        if (top - floor > Batch) floor = top - Batch;
+        size_t count = top - floor;
+        for (size_t i = 0; i < count; i++) {
+            batch[i] = top[-1 - (ptrdiff_t)i];
+        }
+        next = floor;
+#endif
+#if DEBUG
+        memset((void*)next, SCRIBBLE, (top - next) * sizeof(*top));
+#endif
+        protect();
+
+        objc_releaseMany(batch, count);
+    }
+
     void releaseUntil(id *stop) 
     {
         // Not recursive: we don't want to blow out the stack 
@@ -796,9 +1172,26 @@ class AutoreleasePoolPage
                 setHotPage(page);
             }
 
+            if (BatchedPoolDrain) {
+                page->releaseBatch((page == this) ? stop : page->begin());
+                continue;
+            }
+
             page->unprotect();
+#if SUPPORT_AUTORELEASE_COALESCING
+            // An entry with repeats gives up one of them and stays.
+            id obj;
+            uintptr_t *top = (uintptr_t *)page->next;
+            objc::autorelease_take((uintptr_t *)page->begin(), &top, 
+                                   (uintptr_t *)&obj, 1);
+            if ((id *)top != page->next) {
+                memset(top, SCRIBBLE, (uint8_t *)page->next - (uint8_t *)top);
+                page->next = (id *)top;
+            }
+#else
             id obj = *--page->next;
             memset((void*)page->next, SCRIBBLE, sizeof(*page->next));
+#endif
             page->protect();
 
             if (obj != POOL_BOUNDARY) {
@@ -832,7 +1225,7 @@ class AutoreleasePoolPage
                 page->child = nil;
                 page->protect();
             }
-            delete deathptr;
+            deletePage(deathptr);
         } while (deathptr != this);
     }
 
@@ -922,6 +1315,13 @@ class AutoreleasePoolPage
     static inline id *autoreleaseFast(id obj)
     {
         AutoreleasePoolPage *page = hotPage();
+#if SUPPORT_AUTORELEASE_COALESCING
+        if (slowpath(AutoreleaseCoalescing)  &&  page  &&  
+            obj != POOL_BOUNDARY)
+        {
+            if (id *dest = page->coalesce(obj)) return dest;
+        }
+#endif
         if (page && !page->full()) {
             return page->add(obj);
         } else if (page) {
@@ -942,7 +1342,7 @@ class AutoreleasePoolPage
 
         do {
             if (page->child) page = page->child;
-            else page = new AutoreleasePoolPage(page);
+            else page = newPage(page);
         } while (page->full());
 
         setHotPage(page);
@@ -985,7 +1385,7 @@ class AutoreleasePoolPage
         // We are pushing an object or a non-placeholder'd pool.
 
         // Install the first page.
-        AutoreleasePoolPage *page = new AutoreleasePoolPage(nil);
+        AutoreleasePoolPage *page = newPage(nil);
         setHotPage(page);
         
         // Push a boundary on behalf of the previously-placeholder'd pool.
@@ -1119,6 +1519,76 @@ public:
         int r __unused = pthread_key_init_np(AutoreleasePoolPage::key, 
                                              AutoreleasePoolPage::tls_dealloc);
         assert(r == 0);
+
+        // Page-per-pool debugging wants fresh pages.
+        unsigned depth = PoolPageCacheDepth;
+        size_t global = PoolPageCacheGlobal;
+        bool useEnv = !issetugid();
+        const char *env = useEnv ? getenv("OBJC_POOL_PAGE_CACHE") : nil;
+        if (env) {
+            long n = strtol(env, nil, 10);
+            if (n >= 0) depth = (unsigned)n;
+        }
+        env = useEnv ? getenv("OBJC_POOL_PAGE_CACHE_GLOBAL") : nil;
+        if (env) {
+            long n = strtol(env, nil, 10);
+            if (n >= 0) global = (size_t)n;
+        }
+        if (depth == 0  ||  DebugPoolAllocation) depth = global = 0;
+        PoolPageCache.init(depth, global);
+
+        // Bigger pages mean fewer of them for a deep pool. Every page 
+        // has the same size, so that pageForPointer() stays a mask and 
+        // the page cache can give any page to any thread.
+        env = useEnv ? getenv("OBJC_POOL_PAGE_SIZE") : nil;
+        if (env) {
+            long n = strtol(env, nil, 10);
+            if (n > 0) {
+                size_t size = PAGE_MAX_SIZE;
+                while (size < (size_t)n  &&  size < MaxSize) size *= 2;
+                SIZE = size;
+            }
+        }
+
+        env = useEnv ? getenv("OBJC_POOL_ARENA") : nil;
+        if (env  &&  !DebugPoolAllocation) {
+            long n = strtol(env, nil, 10);
+            if (n > MaxPoolArenaMB) n = MaxPoolArenaMB;
+            if (n > 0) {
+                // An arena's size is a whole number of pages.
+                PoolArenaBytes = ((size_t)n*1024*1024 + SIZE-1) & ~(SIZE-1);
+                // Keep freed pages resident as the page cache would.
+                PoolArenaKeepBytes = depth * SIZE;
+            }
+        }
+
+#if SUPPORT_AUTORELEASE_COALESCING
+        env = useEnv ? getenv("OBJC_AUTORELEASE_COALESCING") : nil;
+        if (env) {
+            long n = strtol(env, nil, 10);
+            if (n > MaxAutoreleaseCoalescing) n = MaxAutoreleaseCoalescing;
+            if (n > 0) AutoreleaseCoalescing = (unsigned)n;
+        }
+#endif
+
+        if (PrintPoolHiwat) {
+            _objc_inform("POOL HIGHWATER: pool pages of %zu bytes; "
+                         "page cache of %u pages per thread "
+                         "and %zu global", SIZE, depth, global);
+            if (PoolArenaBytes) {
+                _objc_inform("POOL HIGHWATER: pool arenas of up to %zu MB%s", 
+                             PoolArenaBytes / (1024*1024), 
+                             PoolArenaSuperpages ? " with superpages" : "");
+            }
+#if SUPPORT_AUTORELEASE_COALESCING
+            if (AutoreleaseCoalescing) {
+                _objc_inform("POOL HIGHWATER: repeated autoreleases "
+                             "coalesced over the top %u entries", 
+                             AutoreleaseCoalescing);
+            }
+#endif
+            atexit(&printPageCacheStatistics);
+        }
     }
 
     void print() 
@@ -1131,7 +1601,14 @@ public:
         for (id *p = begin(); p < next; p++) {
             if (*p == POOL_BOUNDARY) {
                 _objc_inform("[%p]  ################  POOL %p", p, p);
-            } else {
+            }
+#if SUPPORT_AUTORELEASE_COALESCING
+            else if (isRepeatSlot(*p)) {
+                _objc_inform("[%p]  ................  (+%zu)", 
+                             p, slotReleases(*p));
+            }
+#endif
+            else {
                 _objc_inform("[%p]  %#16lx  %s", 
                              p, (unsigned long)*p, object_getClassName(*p));
             }
@@ -1146,7 +1623,9 @@ public:
         AutoreleasePoolPage *page;
         ptrdiff_t objects = 0;
         for (page = coldPage(); page; page = page->child) {
-            objects += page->next - page->begin();
+            for (id *p = page->begin(); p < page->next; p++) {
+                objects += slotReleases(*p);
+            }
         }
         _objc_inform("%llu releases pending.", (unsigned long long)objects);
 
@@ -1170,7 +1649,8 @@ public:
         // Check and propagate high water mark
         // Ignore high water marks under 256 to suppress noise.
         AutoreleasePoolPage *p = hotPage();
-        uint32_t mark = p->depth*COUNT + (uint32_t)(p->next - p->begin());
+        uint32_t count = (uint32_t)(SIZE / sizeof(id));
+        uint32_t mark = p->depth*count + (uint32_t)(p->next - p->begin());
         if (mark > p->hiwat  &&  mark > 256) {
             for( ; p; p = p->parent) {
                 p->unprotect();
@@ -1181,6 +1661,7 @@ public:
             _objc_inform("POOL HIGHWATER: new high water mark of %u "
                          "pending releases for thread %p:", 
                          mark, pthread_self());
+            printPageCacheStatistics();
             
             void *stack[128];
             int count = backtrace(stack, sizeof(stack)/sizeof(stack[0]));
@@ -1192,9 +1673,30 @@ public:
         }
     }
 
+    static void printPageCacheStatistics()
+    {
+        auto& s = PoolPageCache.statistics();
+        uint64_t allocated = s.allocated.load(std::memory_order_relaxed);
+        uint64_t freed = s.freed.load(std::memory_order_relaxed);
+        uint64_t reused = s.reused.load(std::memory_order_relaxed);
+        uint64_t cached = s.cached.load(std::memory_order_relaxed);
+        uint64_t maxCached = s.maxCached.load(std::memory_order_relaxed);
+        _objc_inform("POOL HIGHWATER: %llu pool pages allocated, %llu "
+                     "allocations avoided by the page cache; %llu KB "
+                     "resident in pool pages, %llu KB of it cached "
+                     "(at most %llu KB)", 
+                     (unsigned long long)allocated, 
+                     (unsigned long long)reused, 
+                     (unsigned long long)((allocated - freed) * SIZE / 1024),
+                     (unsigned long long)(cached * SIZE / 1024), 
+                     (unsigned long long)(maxCached * SIZE / 1024));
+    }
+
 #undef POOL_BOUNDARY
 };
 
+size_t AutoreleasePoolPage::SIZE = PAGE_MAX_SIZE;
+
 // anonymous namespace
 };
 
@@ -1203,6 +1705,20 @@ public:
 * Slow paths for inline control
 **********************************************************************/
 
+// Finish clearing weak references that weak_clear_no_lock() 
+// left detached. Call without the side table lock.
+static void 
+weak_clear_finish(SideTable& table, weak_detached_t *detached)
+{
+    if (!detached) return;
+
+    weak_clear_detached(detached);
+
+    table.lock();
+    weak_detached_remove_no_lock(&table.weak_table, detached);
+    table.unlock();
+}
+
 #if SUPPORT_NONPOINTER_ISA
 
 NEVER_INLINE id 
@@ -1219,85 +1735,707 @@ objc_object::rootRelease_underflow(bool performDealloc)
 }
 
 
-// Slow path of clearDeallocating() 
-// for objects with nonpointer isa
-// that were ever weakly referenced 
-// or whose retain count ever overflowed to the side table.
-NEVER_INLINE void
-objc_object::clearDeallocating_slow()
-{
-    assert(isa.nonpointer  &&  (isa.weakly_referenced || isa.has_sidetable_rc));
-
-    SideTable& table = SideTables()[this];
-    table.lock();
-    if (isa.weakly_referenced) {
-        weak_clear_no_lock(&table.weak_table, (id)this);
-    }
-    if (isa.has_sidetable_rc) {
-        table.refcnts.erase(this);
-    }
-    table.unlock();
-}
+/***********************************************************************
+* Out-of-line retain counts.
+* An object whose isa.extra_rc overflows moves its whole retain count 
+* into one of these counters and keeps the counter's index in extra_rc, 
+* with has_sidetable_rc set. Every retain and release of it then goes 
+* through rootRetain_overflow() and rootRelease_underflow() to an atomic 
+* add or subtract on the counter. See objc-refcount-engine.h.
+* When releases take the count back down to RC_HALF the object returns 
+* it to extra_rc and frees the counter, so that the fixed pool of 
+* counters serves whichever objects are hot now, and the object gets 
+* the inline fast path back.
+* An object with has_sidetable_rc that owns no counter has its count in 
+* the side table as before, unless the isa that said so is stale and 
+* the count went back inline; see rc_counter_sidetable().
+**********************************************************************/
+#if SUPPORT_RC_OVERFLOW_COUNTERS
 
+static_assert(RC_OVERFLOW_COUNTERS <= RC_HALF*2, 
+              "counter index must fit in extra_rc");
+#if SUPPORT_BIASED_RC
+static_assert(RC_OVERFLOW_COUNTERS <= RC_BIASED, 
+              "counter index must not look like a biased retain count");
 #endif
 
-__attribute__((noinline,used))
-id 
-objc_object::rootAutorelease2()
+static objc::RefcountCounters<RC_OVERFLOW_COUNTERS> RcOverflowCounters;
+typedef decltype(RcOverflowCounters) RcCounters;
+
+bool
+objc_object::rc_counter_present(isa_t bits)
 {
-    assert(!isTaggedPointer());
-    return AutoreleasePoolPage::autorelease((id)this);
+    return RcOverflowCounters.owns(bits.extra_rc, (uintptr_t)this);
 }
 
 
-BREAKPOINT_FUNCTION(
-    void objc_overrelease_during_dealloc_error(void)
-);
-
-
-NEVER_INLINE
-bool 
-objc_object::overrelease_error()
+// Called when an isa had has_sidetable_rc but the object owned no counter.
+// That isa may have been read just before the count returned to extra_rc 
+// and the counter was freed. Loads the isa again into *bits and returns 
+// whether the retain count is in the side table after all. If so, 
+// rc_counter_returned(*returns) tells later whether it still may be.
+bool
+objc_object::rc_counter_sidetable(isa_t *bits, size_t *returns)
 {
-    _objc_inform_now_and_on_crash("%s object %p overreleased while already deallocating; break on objc_overrelease_during_dealloc_error to debug", object_getClassName((id)this), this);
-    objc_overrelease_during_dealloc_error();
-    return false;  // allow rootRelease() to tail-call this
+    *returns = RcOverflowCounters.returns();
+    bits->bits = isa.bits;
+    return bits->nonpointer  &&  bits->has_sidetable_rc  &&  
+        !rc_counter_present(*bits);
 }
 
 
-/***********************************************************************
-* Retain count operations for side table.
-**********************************************************************/
-
-
-#if DEBUG
-// Used to assert that an object is not present in the side table.
+// Returns true if a count returned inline since rc_counter_sidetable() 
+// set returns. Side table counts stay there, so if none has, an isa with 
+// has_sidetable_rc still means the side table.
 bool
-objc_object::sidetable_present()
+objc_object::rc_counter_returned(size_t returns)
 {
-    bool result = false;
-    SideTable& table = SideTables()[this];
-
-    table.lock();
+    return RcOverflowCounters.returns() != returns;
+}
 
-    RefcountMap::iterator it = table.refcnts.find(this);
-    if (it != table.refcnts.end()) result = true;
 
-    if (weak_is_registered_no_lock(&table.weak_table, (id)this)) result = true;
+// Called when extra_rc++ overflowed. Moves the whole retain count, 
+// including the retain being made, to a new counter. 
+// Returns false if the isa changed first, or if no counter is free or 
+// the object is deallocating, in which case *full is set and the caller 
+// should use the side table.
+bool
+objc_object::rc_counter_overflow(bool *full)
+{
+    // 1 + extra_rc + this retain
+    size_t index = RcOverflowCounters.alloc((uintptr_t)this, RC_HALF*2 + 1);
+    if (index == RcCounters::None) {
+        *full = true;
+        return false;
+    }
 
-    table.unlock();
+    isa_t oldisa = LoadExclusive(&isa.bits);
+    isa_t newisa = oldisa;
+    if (oldisa.nonpointer  &&  !oldisa.has_sidetable_rc  &&  
+        oldisa.extra_rc == RC_HALF*2 - 1)
+    {
+        if (oldisa.deallocating) {
+            ClearExclusive(&isa.bits);
+            *full = true;
+        } else {
+            newisa.extra_rc = index;
+            newisa.has_sidetable_rc = true;
+            if (StoreExclusive(&isa.bits, oldisa.bits, newisa.bits)) {
+                return true;
+            }
+        }
+    } else {
+        ClearExclusive(&isa.bits);
+    }
 
-    return result;
+    RcOverflowCounters.free(index);
+    return false;
 }
-#endif
 
-#if SUPPORT_NONPOINTER_ISA
 
-void 
-objc_object::sidetable_lock()
+// Returns false if the isa changed first.
+bool
+objc_object::rc_counter_retain(isa_t bits, bool tryRetain, id *result)
 {
-    SideTable& table = SideTables()[this];
-    table.lock();
+    RcCounters::Result r = tryRetain
+        ? RcOverflowCounters.tryRetain(bits.extra_rc, (uintptr_t)this)
+        : RcOverflowCounters.retain(bits.extra_rc, (uintptr_t)this);
+    if (r == RcCounters::MovedAway) return false;
+    *result = (r == RcCounters::Done) ? (id)this : nil;
+    return true;
+}
+
+
+// Called when a release left the counter with RC_HALF or fewer retains. 
+// Moves the count back into extra_rc and frees the counter. 
+// Does nothing if another thread got there first, or the count changed.
+void
+objc_object::rc_counter_return(isa_t bits)
+{
+    size_t index = bits.extra_rc;
+    uint64_t count;
+    if (!RcOverflowCounters.freezeBelow(index, (uintptr_t)this, 
+                                        RC_HALF, &count))
+    {
+        return;
+    }
+
+    // Retains and releases that reach the counter from now on 
+    // are redone with the new isa.
+    isa_t oldisa;
+    isa_t newisa;
+    do {
+        oldisa = LoadExclusive(&isa.bits);
+        newisa = oldisa;
+        if (!newisa.nonpointer) {
+            // changeIsa() moved the count to the side table. 
+            // The counter is freed when the object is.
+            ClearExclusive(&isa.bits);
+            return;
+        }
+        assert(newisa.has_sidetable_rc  &&  newisa.extra_rc == index);
+        newisa.extra_rc = count - 1;
+        newisa.has_sidetable_rc = false;
+    } while (!StoreReleaseExclusive(&isa.bits, oldisa.bits, newisa.bits));
+
+    RcOverflowCounters.freeReturned(index);
+}
+
+
+// Returns false if the isa changed first.
+// Otherwise *result is rootRelease()'s result.
+bool
+objc_object::rc_counter_release(isa_t bits, bool performDealloc, bool *result)
+{
+    uint64_t remaining;
+    switch (RcOverflowCounters.release(bits.extra_rc, (uintptr_t)this, 
+                                       &remaining)) 
+    {
+    case RcCounters::MovedAway:
+        return false;
+    case RcCounters::Overreleased:
+        *result = overrelease_error();
+        return true;
+    case RcCounters::Last:
+        break;
+    default:
+        if (remaining > 0  &&  remaining <= RC_HALF) rc_counter_return(bits);
+        *result = false;
+        return true;
+    }
+
+    // Really deallocate. 
+    // Mark the isa too, for rootIsDeallocating().
+    isa_t oldisa;
+    isa_t newisa;
+    do {
+        oldisa = LoadExclusive(&isa.bits);
+        newisa = oldisa;
+        if (!newisa.nonpointer) {
+            // changeIsa() moved the count, deallocating bit included.
+            ClearExclusive(&isa.bits);
+            break;
+        }
+        newisa.deallocating = true;
+    } while (!StoreExclusive(&isa.bits, oldisa.bits, newisa.bits));
+
+    __sync_synchronize();
+    if (performDealloc) {
+        ((void(*)(objc_object *, SEL))objc_msgSend)(this, SEL_dealloc);
+    }
+    *result = true;
+    return true;
+}
+
+
+uintptr_t
+objc_object::rc_counter_retainCount(isa_t bits)
+{
+    return RcOverflowCounters.count(bits.extra_rc);
+}
+
+
+// Called by changeIsa() with the side table locked, after the isa
+// became a raw pointer. Returns the whole retain count.
+size_t
+objc_object::rc_counter_freeze(isa_t bits, bool *isDeallocating)
+{
+    bool deallocating;
+    size_t rc = RcOverflowCounters.freeze(bits.extra_rc, &deallocating);
+    if (deallocating) *isDeallocating = true;
+    return rc;
+}
+
+#endif
+
+
+/***********************************************************************
+* Biased retain counts.
+* Instances of a class that implements +_usesBiasedRefcount keep an 
+* objc::BiasedRC at cls->biasedRCOffset(). biased_rc_init() sets 
+* has_sidetable_rc so that rootRetain() and rootRelease() look for it, 
+* and records the offset in extra_rc from RC_BIASED up, so that they 
+* find it without reading the class, and it stays put if the object's 
+* class changes. The thread that 
+* allocated the object retains and releases it with plain loads and 
+* stores; other threads hand it off to that thread, which merges it at 
+* its next autorelease pool pop or allocation of a biased object, when 
+* it releases its own last reference, or when it exits. A thread with 
+* BiasedRCLimit objects biased to it and not yet merged allocates new 
+* ones merged, so that a thread that stops doing all of those keeps 
+* at most that many objects alive for others. 
+* See objc-biased-refcount-engine.h.
+**********************************************************************/
+#if SUPPORT_BIASED_RC
+
+static size_t BiasedRCLimit = 4096;
+
+struct BiasedRCTraits {
+    static objc::BiasedRC *rc(void *object) {
+        objc_object *obj = (objc_object *)object;
+        return obj->biased_rc(obj->isa);
+    }
+    static void dealloc(void *object) {
+        ((objc_object *)object)->biased_rc_dealloc(true);
+    }
+    static void overreleased(void *object) {
+        ((objc_object *)object)->overrelease_error();
+    }
+};
+
+static objc::BiasedRefcounts<BiasedRCTraits> BiasedRCs;
+typedef decltype(BiasedRCs) BiasedCounts;
+
+static void biased_rc_thread_exit(void *value)
+{
+    if (!value) return;
+    // Releases after this point hand off to the exited record.
+    tls_set_direct(BIASED_RC_KEY, nil);
+    BiasedRCs.exitOwner((objc::BiasedRCOwner *)value);
+}
+
+static void BiasedRCInit()
+{
+    int r __unused = pthread_key_init_np(BIASED_RC_KEY, biased_rc_thread_exit);
+    assert(r == 0);
+
+    const char *env = !issetugid() ? getenv("OBJC_BIASED_RC_LIMIT") : nil;
+    if (env) {
+        long n = strtol(env, nil, 10);
+        if (n > 0) BiasedRCLimit = (size_t)n;
+    }
+}
+
+// Merges objects that other threads retained or released since the 
+// last call. Called at autorelease pool pop.
+static ALWAYS_INLINE void biased_rc_quiescent()
+{
+    BiasedCounts::drainIfNeeded(biased_rc_owner());
+    if (slowpath(BiasedRCs.hasOrphans())) BiasedRCs.drainOrphans();
+}
+
+void biased_rc_fork_child()
+{
+    BiasedRCs.forkChild(biased_rc_owner());
+}
+
+
+// Called by initIsa() for a new object of a class that uses a biased 
+// retain count. Biases it to this thread, and points newisa at it.
+void
+objc_object::biased_rc_init(Class cls, isa_t *newisa)
+{
+    objc::BiasedRCOwner *owner = biased_rc_owner();
+    if (slowpath(!owner)) {
+        owner = BiasedRCs.acquireOwner();
+        tls_set_direct(BIASED_RC_KEY, owner);
+    }
+    BiasedCounts::drainIfNeeded(owner);
+    if (slowpath(BiasedCounts::unmerged(owner) >= BiasedRCLimit)) {
+        owner = nil;  // starts out merged
+    }
+    BiasedCounts::init((objc::BiasedRC *)((uint8_t *)this + 
+                                          cls->biasedRCOffset()), owner);
+    newisa->has_sidetable_rc = true;
+    newisa->extra_rc = RC_BIASED + cls->biasedRCOffset() / BIASED_RC_ALIGN;
+}
+
+
+NEVER_INLINE id
+objc_object::biased_rc_retain_slow(objc::BiasedRC *rc, bool tryRetain)
+{
+    if (BiasedCounts::retainShared(this, rc, tryRetain) == BiasedCounts::Failed) {
+        return nil;
+    }
+    return (id)this;
+}
+
+
+NEVER_INLINE bool
+objc_object::biased_rc_release_slow(objc::BiasedRC *rc, bool performDealloc)
+{
+    BiasedCounts::Result r;
+    objc::BiasedRCOwner *owner = biased_rc_owner();
+    if (rc->ownedBy(owner)) {
+        // The owner's last reference. biased_rc_release() already 
+        // took the biased count to zero.
+        r = BiasedCounts::mergeOwned(rc);
+    } else {
+        r = BiasedCounts::releaseShared(this, rc);
+    }
+
+    if (r == BiasedCounts::Overreleased) return overrelease_error();
+    if (r != BiasedCounts::Last) return false;
+    return biased_rc_dealloc(performDealloc);
+}
+
+
+// The biased retain count reached zero. 
+// Mark the isa too, for rootIsDeallocating().
+bool
+objc_object::biased_rc_dealloc(bool performDealloc)
+{
+    isa_t oldisa;
+    isa_t newisa;
+    do {
+        oldisa = LoadExclusive(&isa.bits);
+        newisa = oldisa;
+        newisa.deallocating = true;
+    } while (!StoreExclusive(&isa.bits, oldisa.bits, newisa.bits));
+
+    __sync_synchronize();
+    if (performDealloc) {
+        ((void(*)(objc_object *, SEL))objc_msgSend)(this, SEL_dealloc);
+    }
+    return true;
+}
+
+#endif
+
+
+/***********************************************************************
+* Deferred deallocation.
+* rootDealloc() hands an object whose class implements 
+* +_deallocsInBackground, or one deallocated inside 
+* objc_autoreleasePoolPopDeferringDealloc(), to DeferredDeallocs 
+* instead of calling object_dispose(). Reaper threads, started when 
+* the first object is queued, call object_dispose() for it, so its 
+* .cxx_destruct and the release of its associated objects run there, 
+* along with the -dealloc of any ivar or associated object they 
+* release for the last time. When the queue refuses an object the 
+* releasing thread disposes of it as usual.
+* The queue takes no lock. Reapers sleep on DeferredDeallocLock only 
+* while it is empty, so only the push that makes it non-empty wakes 
+* one. See objc-dealloc-queue-engine.h.
+**********************************************************************/
+#if SUPPORT_DEFERRED_DEALLOC
+
+monitor_t DeferredDeallocLock;
+static objc::DeallocQueue DeferredDeallocs;
+static unsigned DeferredDeallocThreads = 2;  // reapers wanted
+static unsigned DeferredDeallocReapers;      // reapers running
+static size_t DeferredDeallocLimit = 4096;   // most objects queued
+// Set, with the lock held, once reapers have been started. 
+// Read without it.
+static std::atomic<bool> DeferredDeallocStarted;
+
+enum {
+    DeferredDeallocMaxBytes = 16*1024*1024,
+    DeferredDeallocBatch = 64
+};
+
+static void deferred_dealloc_print_statistics(void);
+
+static void DeferredDeallocInit()
+{
+    bool useEnv = !issetugid();
+    const char *env = useEnv ? getenv("OBJC_DEFERRED_DEALLOC_THREADS") : nil;
+    if (env) {
+        long n = strtol(env, nil, 10);
+        if (n > 0) DeferredDeallocThreads = (unsigned)n;
+    }
+    env = useEnv ? getenv("OBJC_DEFERRED_DEALLOC_LIMIT") : nil;
+    if (env) {
+        long n = strtol(env, nil, 10);
+        if (n > 0) DeferredDeallocLimit = (size_t)n;
+    }
+
+    // calloc()'s pages are not touched until objects are queued.
+    auto storage = (objc::DeallocQueueCell *)
+        calloc(DeferredDeallocLimit, sizeof(objc::DeallocQueueCell));
+    DeferredDeallocs.init(storage, storage ? DeferredDeallocLimit : 0, 
+                          DeferredDeallocMaxBytes);
+    DeferredDeallocLimit = DeferredDeallocs.limit();
+
+    if (PrintDeferredDealloc) {
+        _objc_inform("DEALLOC: %u reaper threads, at most %zu objects "
+                     "and %u bytes queued", DeferredDeallocThreads, 
+                     DeferredDeallocLimit, DeferredDeallocMaxBytes);
+        atexit(&deferred_dealloc_print_statistics);
+    }
+}
+
+// Takes up to DeferredDeallocBatch objects from the queue.
+static size_t deferred_dealloc_take(objc::DeallocQueueItem *batch)
+{
+    size_t count = 0;
+    while (count < DeferredDeallocBatch  &&  
+           DeferredDeallocs.pop(&batch[count])) 
+    {
+        count++;
+    }
+    return count;
+}
+
+// Sleeps until the queue is not empty. 
+// Returns false if it was not empty to begin with.
+static bool deferred_dealloc_wait()
+{
+    monitor_locker_t lock(DeferredDeallocLock);
+    if (!DeferredDeallocs.empty()) return false;
+    do {
+        DeferredDeallocLock.wait();
+    } while (DeferredDeallocs.empty());
+    return true;
+}
+
+static void deferred_dealloc_dispose(objc::DeallocQueueItem *batch, 
+                                     size_t count)
+{
+    // Teardown may autorelease.
+    void *pool = objc_autoreleasePoolPush();
+    for (size_t i = 0; i < count; i++) {
+        object_dispose((id)batch[i].object);
+        DeferredDeallocs.reclaimed(batch[i], nanoseconds());
+    }
+    objc_autoreleasePoolPop(pool);
+}
+
+static void *deferred_dealloc_reaper(void *arg __unused)
+{
+    // Objects this thread deallocates are not queued again.
+    tls_set_direct(DEFERRED_DEALLOC_KEY, (void *)-1);
+
+    objc::DeallocQueueItem batch[DeferredDeallocBatch];
+    while (true) {
+        size_t count = deferred_dealloc_take(batch);
+        if (count == 0) {
+            // Not empty but nothing to take: a push has claimed 
+            // the next cell and is about to fill it.
+            if (!deferred_dealloc_wait()) sched_yield();
+            continue;
+        }
+        if (count == DeferredDeallocBatch  &&  DeferredDeallocThreads > 1) {
+            // There may be more than one reaper can keep up with.
+            monitor_locker_t lock(DeferredDeallocLock);
+            DeferredDeallocLock.notify();
+        }
+        deferred_dealloc_dispose(batch, count);
+    }
+    return nil;
+}
+
+// Locking: DeferredDeallocLock must be held by the caller.
+static void deferred_dealloc_start_reapers()
+{
+    DeferredDeallocLock.assertLocked();
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_set_qos_class_np(&attr, QOS_CLASS_UTILITY, 0);
+    while (DeferredDeallocReapers < DeferredDeallocThreads) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, deferred_dealloc_reaper, nil)) {
+            // Don't try again for every object.
+            DeferredDeallocThreads = DeferredDeallocReapers;
+            break;
+        }
+        DeferredDeallocReapers++;
+    }
+    pthread_attr_destroy(&attr);
+    DeferredDeallocStarted.store(true, std::memory_order_release);
+}
+
+void deferred_dealloc_fork_child()
+{
+    // The child has none of the parent's reapers, and none of the 
+    // threads that were pushing or popping. Keep what they had queued, 
+    // and start new reapers for it now rather than with the next 
+    // object queued, which may never come.
+    DeferredDeallocReapers = 0;
+    DeferredDeallocStarted.store(false, std::memory_order_relaxed);
+    DeferredDeallocs.forkChild();
+    if (!DeferredDeallocs.empty()) {
+        monitor_locker_t lock(DeferredDeallocLock);
+        deferred_dealloc_start_reapers();
+    }
+}
+
+// Called by rootDealloc() after -dealloc, when shouldDeferDealloc().
+// Returns false if the caller must dispose of the object itself.
+NEVER_INLINE bool
+objc_object::deferDealloc()
+{
+    if (slowpath(!DeferredDeallocStarted.load(std::memory_order_acquire))) {
+        monitor_locker_t lock(DeferredDeallocLock);
+        if (!DeferredDeallocStarted.load(std::memory_order_relaxed)) {
+            deferred_dealloc_start_reapers();
+        }
+    }
+    if (slowpath(DeferredDeallocReapers == 0)) return false;
+
+    bool wasEmpty;
+    if (DeferredDeallocs.push(this, malloc_size(this), nanoseconds(), 
+                              &wasEmpty) != objc::DeallocQueue::Queued) 
+    {
+        return false;
+    }
+    if (wasEmpty) {
+        monitor_locker_t lock(DeferredDeallocLock);
+        DeferredDeallocLock.notify();
+    }
+    return true;
+}
+
+void _objc_setDeferredDeallocUnderPressure(bool underPressure)
+{
+    DeferredDeallocs.setPressure(underPressure);
+    if (!underPressure) return;
+
+    // Free what is queued now instead of waiting for the reapers.
+    objc::DeallocQueueItem batch[DeferredDeallocBatch];
+    size_t count;
+    while ((count = deferred_dealloc_take(batch))) {
+        deferred_dealloc_dispose(batch, count);
+    }
+}
+
+void _objc_getDeferredDeallocStatistics(objc_deferred_dealloc_statistics *stats)
+{
+    auto& s = DeferredDeallocs.statistics();
+    stats->deferred = s.deferred.load(std::memory_order_relaxed);
+    stats->reclaimed = s.reclaimed.load(std::memory_order_relaxed);
+    stats->refused = s.refused.load(std::memory_order_relaxed);
+    stats->depth = DeferredDeallocs.depth();
+    stats->maxDepth = s.maxDepth.load(std::memory_order_relaxed);
+    stats->bytes = DeferredDeallocs.bytes();
+    stats->maxBytes = s.maxBytes.load(std::memory_order_relaxed);
+    static_assert(OBJC_DEFERRED_DEALLOC_HISTOGRAM_BUCKETS == 
+                  objc::DeallocQueue::HistogramBuckets, 
+                  "deferred dealloc histogram size mismatch");
+    for (unsigned i = 0; i < OBJC_DEFERRED_DEALLOC_HISTOGRAM_BUCKETS; i++) {
+        stats->latencyHistogram[i] = 
+            s.latencyHistogram[i].load(std::memory_order_relaxed);
+    }
+}
+
+static void deferred_dealloc_print_statistics(void)
+{
+    objc_deferred_dealloc_statistics stats;
+    _objc_getDeferredDeallocStatistics(&stats);
+
+    _objc_inform("DEALLOC: %llu objects deferred, %llu reclaimed, "
+                 "%llu refused; queue held at most %llu objects "
+                 "and %llu bytes", 
+                 (unsigned long long)stats.deferred, 
+                 (unsigned long long)stats.reclaimed, 
+                 (unsigned long long)stats.refused, 
+                 (unsigned long long)stats.maxDepth, 
+                 (unsigned long long)stats.maxBytes);
+    if (stats.reclaimed == 0) return;
+
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    _objc_inform("DEALLOC:   at least       reclaimed");
+    for (unsigned i = 0; i < OBJC_DEFERRED_DEALLOC_HISTOGRAM_BUCKETS; i++) {
+        if (!stats.latencyHistogram[i]) continue;
+        double us = (double)(1ull << i) * timebase.numer / timebase.denom 
+            / 1000.0;
+        _objc_inform("DEALLOC:   %10.1f us  %12llu", i ? us : 0.0, 
+                     (unsigned long long)stats.latencyHistogram[i]);
+    }
+}
+
+#else
+
+void _objc_setDeferredDeallocUnderPressure(bool underPressure __unused)
+{
+}
+
+void _objc_getDeferredDeallocStatistics(objc_deferred_dealloc_statistics *stats)
+{
+    bzero(stats, sizeof(*stats));
+}
+
+#endif
+
+
+// Slow path of clearDeallocating() 
+// for objects with nonpointer isa
+// that were ever weakly referenced 
+// or whose retain count ever overflowed to the side table.
+NEVER_INLINE void
+objc_object::clearDeallocating_slow()
+{
+    assert(isa.nonpointer  &&  (isa.weakly_referenced || hasSideTableRC(isa)));
+
+    SideTable& table = SideTables()[this];
+    weak_detached_t *detached = nil;
+    table.lock();
+    if (isa.weakly_referenced) {
+        detached = weak_clear_no_lock(&table.weak_table, (id)this);
+    }
+    if (hasSideTableRC(isa)) {
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (rc_counter_present(isa)) RcOverflowCounters.free(isa.extra_rc);
+        else
+#endif
+        table.refcnts.erase(this);
+    }
+    table.unlock();
+    weak_clear_finish(table, detached);
+}
+
+#endif
+
+__attribute__((noinline,used))
+id 
+objc_object::rootAutorelease2()
+{
+    assert(!isTaggedPointer());
+    return AutoreleasePoolPage::autorelease((id)this);
+}
+
+
+BREAKPOINT_FUNCTION(
+    void objc_overrelease_during_dealloc_error(void)
+);
+
+
+NEVER_INLINE
+bool 
+objc_object::overrelease_error()
+{
+    _objc_inform_now_and_on_crash("%s object %p overreleased while already deallocating; break on objc_overrelease_during_dealloc_error to debug", object_getClassName((id)this), this);
+    objc_overrelease_during_dealloc_error();
+    return false;  // allow rootRelease() to tail-call this
+}
+
+
+/***********************************************************************
+* Retain count operations for side table.
+**********************************************************************/
+
+
+#if DEBUG
+// Used to assert that an object is not present in the side table.
+bool
+objc_object::sidetable_present()
+{
+    bool result = false;
+    SideTable& table = SideTables()[this];
+
+    table.lock();
+
+    RefcountMap::iterator it = table.refcnts.find(this);
+    if (it != table.refcnts.end()) result = true;
+
+    if (weak_is_registered_no_lock(&table.weak_table, (id)this)) result = true;
+
+    table.unlock();
+
+    return result;
+}
+#endif
+
+#if SUPPORT_NONPOINTER_ISA
+
+void 
+objc_object::sidetable_lock()
+{
+    SideTable& table = SideTables()[this];
+    table.lock();
 }
 
 void 
@@ -1415,13 +2553,21 @@ objc_object::sidetable_retain()
     SideTable& table = SideTables()[this];
     
     table.lock();
+    sidetable_retain_nolock(table);
+    table.unlock();
+
+    return (id)this;
+}
+
+
+// table is this object's stripe, and is locked.
+void
+objc_object::sidetable_retain_nolock(SideTable& table)
+{
     size_t& refcntStorage = table.refcnts[this];
     if (! (refcntStorage & SIDE_TABLE_RC_PINNED)) {
         refcntStorage += SIDE_TABLE_RC_ONE;
     }
-    table.unlock();
-
-    return (id)this;
 }
 
 
@@ -1537,9 +2683,23 @@ objc_object::sidetable_release(bool performDealloc)
 #endif
     SideTable& table = SideTables()[this];
 
+    table.lock();
+    bool do_dealloc = sidetable_release_nolock(table);
+    table.unlock();
+    if (do_dealloc  &&  performDealloc) {
+        ((void(*)(objc_object *, SEL))objc_msgSend)(this, SEL_dealloc);
+    }
+    return do_dealloc;
+}
+
+
+// table is this object's stripe, and is locked.
+// Returns true if the object should now be deallocated.
+bool
+objc_object::sidetable_release_nolock(SideTable& table)
+{
     bool do_dealloc = false;
 
-    table.lock();
     RefcountMap::iterator it = table.refcnts.find(this);
     if (it == table.refcnts.end()) {
         do_dealloc = true;
@@ -1551,10 +2711,6 @@ objc_object::sidetable_release(bool performDealloc)
     } else if (! (it->second & SIDE_TABLE_RC_PINNED)) {
         it->second -= SIDE_TABLE_RC_ONE;
     }
-    table.unlock();
-    if (do_dealloc  &&  performDealloc) {
-        ((void(*)(objc_object *, SEL))objc_msgSend)(this, SEL_dealloc);
-    }
     return do_dealloc;
 }
 
@@ -1567,15 +2723,22 @@ objc_object::sidetable_clearDeallocating()
     // clear any weak table items
     // clear extra retain count and deallocating bit
     // (fixme warn or abort if extra retain count == 0 ?)
+    weak_detached_t *detached = nil;
     table.lock();
     RefcountMap::iterator it = table.refcnts.find(this);
     if (it != table.refcnts.end()) {
         if (it->second & SIDE_TABLE_WEAKLY_REFERENCED) {
-            weak_clear_no_lock(&table.weak_table, (id)this);
+            detached = weak_clear_no_lock(&table.weak_table, (id)this);
         }
         table.refcnts.erase(it);
     }
     table.unlock();
+    weak_clear_finish(table, detached);
+
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+    // A counter left behind when changeIsa() moved the retain count.
+    RcOverflowCounters.forget((uintptr_t)this);
+#endif
 }
 
 
@@ -1629,6 +2792,220 @@ id objc_autorelease(id obj) { return [obj autorelease]; }
 #endif
 
 
+/***********************************************************************
+* Bulk retain/release entrypoints
+* objc_retainMany() and objc_releaseMany() retain or release each 
+* object in an array, as objc_retain() and objc_release() would one 
+* at a time, in batches of RetainManyBatch objects:
+* - Nil and tagged pointers are dropped first, several at a time.
+* - An object's class is checked for RR overrides only if it is not 
+*   the last class found to have none, so arrays of one class check 
+*   it once.
+* - Objects whose count is in the isa are updated lock-free, 
+*   with one update for a run of releases of the same object.
+* - Raw isa objects, whose counts are all in the side table, are 
+*   sorted by stripe so that each stripe's lock is taken once, when 
+*   there are few enough stripes for that to pay.
+* - Objects released to zero are sent -dealloc after the whole batch 
+*   is released, with no locks held.
+* Everything else - RR overrides, side table borrows and overflows, 
+* out-of-line and biased counts - takes the one-object path.
+**********************************************************************/
+
+#if __OBJC2__
+
+// Calls fn(object, table) for each entry, with its stripe locked.
+// entries are grouped by stripe first, so each stripe is locked once.
+template <typename Fn>
+static void
+forEachStripeLocked(objc::BulkRCStripeEntry *entries, size_t count, Fn fn)
+{
+    objc::bulk_rc_group_by_stripe<objc_object::RetainManyBatch>
+        (entries, count, SideTables().count());
+
+    for (size_t i = 0; i < count; ) {
+        unsigned stripe = entries[i].stripe;
+        SideTable& table = SideTables().stripe(stripe);
+        table.lock();
+        do {
+            fn((objc_object *)entries[i].object, table);
+        } while (++i < count  &&  entries[i].stripe == stripe);
+        table.unlock();
+    }
+}
+
+
+void
+objc_object::retainMany(objc_object **objects, size_t count)
+{
+    assert(count <= RetainManyBatch);
+    objc::BulkRCStripeEntry locked[RetainManyBatch];
+    size_t lockedCount = 0;
+    Class defaultRR = nil;
+    bool group = objc::bulk_rc_should_group(RetainManyBatch, 
+                                            SideTables().count());
+
+    for (size_t i = 0; i < count; i++) {
+        objc_object *obj = objects[i];
+        assert(!obj->isTaggedPointer());
+        Class cls = obj->ISA();
+        if (cls != defaultRR) {
+            if (slowpath(cls->hasCustomRR())) {
+                ((id(*)(objc_object *, SEL))objc_msgSend)(obj, SEL_retain);
+                continue;
+            }
+            defaultRR = cls;
+        }
+#if SUPPORT_NONPOINTER_ISA
+        if (fastpath(obj->rootRetain_inline())) continue;
+        if (obj->isa.nonpointer) {
+            obj->rootRetain();
+            continue;
+        }
+#endif
+        if (!group) {
+            obj->sidetable_retain();
+            continue;
+        }
+        locked[lockedCount++] = { SideTables().stripeIndex(obj), 
+                                  (uintptr_t)obj };
+    }
+
+    forEachStripeLocked(locked, lockedCount, 
+                        [](objc_object *obj, SideTable& table) {
+        obj->sidetable_retain_nolock(table);
+    });
+}
+
+
+void
+objc_object::releaseMany(objc_object **objects, size_t count)
+{
+    assert(count <= RetainManyBatch);
+    objc::BulkRCStripeEntry locked[RetainManyBatch];
+    size_t lockedCount = 0;
+    objc_object *dealloc[RetainManyBatch];
+    size_t deallocCount = 0;
+    Class defaultRR = nil;
+    bool group = objc::bulk_rc_should_group(RetainManyBatch, 
+                                            SideTables().count());
+
+    for (size_t i = 0; i < count; ) {
+        objc_object *obj = objects[i];
+        assert(!obj->isTaggedPointer());
+        // Repeats of one object in a row, as when it was autoreleased 
+        // in a loop, are released together when possible.
+        size_t run = objc::bulk_rc_run_length((uintptr_t *)objects + i, 
+                                              count - i);
+        i += run;
+        Class cls = obj->ISA();
+        if (cls != defaultRR) {
+            if (slowpath(cls->hasCustomRR())) {
+                for (size_t n = 0; n < run; n++) {
+                    ((void(*)(objc_object *, SEL))objc_msgSend)
+                        (obj, SEL_release);
+                }
+                continue;
+            }
+            defaultRR = cls;
+        }
+#if SUPPORT_NONPOINTER_ISA
+        bool shouldDealloc;
+        if (run > 1  &&  obj->rootReleaseMany_inline(run, &shouldDealloc)) {
+            if (slowpath(shouldDealloc)) dealloc[deallocCount++] = obj;
+            continue;
+        }
+#endif
+        for (size_t n = 0; n < run; n++) {
+#if SUPPORT_NONPOINTER_ISA
+            if (fastpath(obj->rootRelease_inline(&shouldDealloc))) {
+                if (slowpath(shouldDealloc)) dealloc[deallocCount++] = obj;
+                continue;
+            }
+            if (obj->isa.nonpointer) {
+                if (obj->rootReleaseShouldDealloc()) {
+                    dealloc[deallocCount++] = obj;
+                }
+                continue;
+            }
+#endif
+            if (!group) {
+                if (obj->sidetable_release(false)) {
+                    dealloc[deallocCount++] = obj;
+                }
+                continue;
+            }
+            locked[lockedCount++] = { SideTables().stripeIndex(obj), 
+                                      (uintptr_t)obj };
+        }
+    }
+
+    forEachStripeLocked(locked, lockedCount, 
+                        [&](objc_object *obj, SideTable& table) {
+        if (obj->sidetable_release_nolock(table)) {
+            dealloc[deallocCount++] = obj;
+        }
+    });
+
+    for (size_t i = 0; i < deallocCount; i++) {
+        ((void(*)(objc_object *, SEL))objc_msgSend)(dealloc[i], SEL_dealloc);
+    }
+}
+
+
+#if SUPPORT_TAGGED_POINTERS
+#   define RETAIN_MANY_SKIP_MASK _OBJC_TAG_MASK
+#else
+#   define RETAIN_MANY_SKIP_MASK 0
+#endif
+
+void
+objc_retainMany(id const *objects, size_t count)
+{
+    uintptr_t batch[objc_object::RetainManyBatch];
+
+    while (count > 0) {
+        size_t n = MIN(count, (size_t)objc_object::RetainManyBatch);
+        size_t live = objc::bulk_rc_filter((const uintptr_t *)objects, n, 
+                                           RETAIN_MANY_SKIP_MASK, batch);
+        objc_object::retainMany((objc_object **)batch, live);
+        objects += n;
+        count -= n;
+    }
+}
+
+
+void
+objc_releaseMany(id const *objects, size_t count)
+{
+    uintptr_t batch[objc_object::RetainManyBatch];
+
+    while (count > 0) {
+        size_t n = MIN(count, (size_t)objc_object::RetainManyBatch);
+        size_t live = objc::bulk_rc_filter((const uintptr_t *)objects, n, 
+                                           RETAIN_MANY_SKIP_MASK, batch);
+        objc_object::releaseMany((objc_object **)batch, live);
+        objects += n;
+        count -= n;
+    }
+}
+
+// OBJC2
+#else
+// not OBJC2
+
+
+void objc_retainMany(id const *objects, size_t count) {
+    for (size_t i = 0; i < count; i++) objc_retain(objects[i]);
+}
+void objc_releaseMany(id const *objects, size_t count) {
+    for (size_t i = 0; i < count; i++) objc_release(objects[i]);
+}
+
+
+#endif
+
+
 /***********************************************************************
 * Basic operations for root class implementations a.k.a. _objc_root*()
 **********************************************************************/
@@ -1837,6 +3214,28 @@ void
 objc_autoreleasePoolPop(void *ctxt)
 {
     AutoreleasePoolPage::pop(ctxt);
+#if __OBJC2__
+    // Nothing below the pool can be inside a cache lookup.
+    cache_quiescent();
+#endif
+#if SUPPORT_BIASED_RC
+    biased_rc_quiescent();
+#endif
+}
+
+void
+objc_autoreleasePoolPopDeferringDealloc(void *ctxt)
+{
+#if SUPPORT_DEFERRED_DEALLOC
+    intptr_t depth = (intptr_t)tls_get_direct(DEFERRED_DEALLOC_KEY);
+    if (depth >= 0  &&  !DisableDeferredDealloc) {
+        tls_set_direct(DEFERRED_DEALLOC_KEY, (void *)(depth + 1));
+        objc_autoreleasePoolPop(ctxt);
+        tls_set_direct(DEFERRED_DEALLOC_KEY, (void *)depth);
+        return;
+    }
+#endif
+    objc_autoreleasePoolPop(ctxt);
 }
 
 
@@ -1944,6 +3343,12 @@ void arr_init(void)
 {
     AutoreleasePoolPage::init();
     SideTableInit();
+#if SUPPORT_BIASED_RC
+    BiasedRCInit();
+#endif
+#if SUPPORT_DEFERRED_DEALLOC
+    DeferredDeallocInit();
+#endif
 }
 
 
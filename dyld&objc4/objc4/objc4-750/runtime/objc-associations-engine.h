@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-associations-engine.h
+* One object's associated objects, in a flat array.
+*
+* Most objects with associated objects have one or two of them, and
+* look them up far more often than they change them. A std::map spends
+* a node allocation on each association and a chain of pointer chases
+* on each lookup. AssociationFlatMap keeps the first InlineCount
+* associations in the map itself and the rest in one malloc'd array,
+* and finds a key with a linear scan of adjacent entries.
+*
+* Order is not kept: erase() moves the last entry into the hole.
+* The map does not move its entries while it is not being changed, and
+* is not thread-safe; its users hold the object's stripe lock.
+**********************************************************************/
+
+#ifndef _OBJC_ASSOCIATIONS_ENGINE_H
+#define _OBJC_ASSOCIATIONS_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+namespace objc {
+
+template <typename Value, unsigned InlineCount = 2>
+class AssociationFlatMap {
+ public:
+    struct Entry {
+        const void *key;
+        Value value;
+    };
+
+ private:
+    Entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    Entry inlineEntries[InlineCount];
+
+ public:
+    AssociationFlatMap()
+        : entries(inlineEntries), count(0), capacity(InlineCount) { }
+    ~AssociationFlatMap() {
+        if (entries != inlineEntries) free(entries);
+    }
+    AssociationFlatMap(const AssociationFlatMap&) = delete;
+    AssociationFlatMap& operator = (const AssociationFlatMap&) = delete;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    Entry *begin() { return entries; }
+    Entry *end() { return entries + count; }
+
+    // The value for key, or nullptr.
+    Value *find(const void *key) {
+        uint32_t i = indexOf(key);
+        return i < count ? &entries[i].value : nullptr;
+    }
+
+    // The value for key, added as Value() if there was none, in which
+    // case *inserted is set. Returns nullptr if there is no memory.
+    Value *insert(const void *key, bool *inserted) {
+        *inserted = false;
+        if (Value *value = find(key)) return value;
+        if (count == capacity  &&  !grow()) return nullptr;
+        entries[count] = Entry{key, Value()};
+        *inserted = true;
+        return &entries[count++].value;
+    }
+
+    // Removes key's value and returns it in *old, or returns false.
+    bool erase(const void *key, Value *old) {
+        uint32_t i = indexOf(key);
+        if (i == count) return false;
+        *old = entries[i].value;
+        entries[i] = entries[--count];
+        return true;
+    }
+
+ private:
+    uint32_t indexOf(const void *key) const {
+        uint32_t i = 0;
+        while (i < count  &&  entries[i].key != key) i++;
+        return i;
+    }
+
+    bool grow() {
+        uint32_t newCapacity = capacity * 2;
+        Entry *newEntries = (Entry *)malloc(newCapacity * sizeof(Entry));
+        if (!newEntries) return false;
+        for (uint32_t i = 0; i < count; i++) newEntries[i] = entries[i];
+        if (entries != inlineEntries) free(entries);
+        entries = newEntries;
+        capacity = newCapacity;
+        return true;
+    }
+};
+
+} // end namespace objc
+
+#endif
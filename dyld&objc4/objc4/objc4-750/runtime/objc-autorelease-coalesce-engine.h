@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-autorelease-coalesce-engine.h
+* Repeat counts in autorelease pool entries.
+*
+* A getter that returns [[x retain] autorelease], called in a loop,
+* fills the pool with the same object over and over: a slot each, and
+* a release each when the pool is popped. With coalescing on, an
+* autorelease of an object already among the top few entries of the
+* hot page adds to that entry's repeat count instead of taking a slot.
+* The search stops at a pool boundary, so a repeat is never moved into
+* an enclosing pool, and at the start of the page, so it never touches
+* a page but the hot one. The repeat is released in the same pop, up
+* to window slots later than it would have been.
+*
+* An object with repeats is followed by a repeat slot, which holds
+* its releases beyond the first as an odd word: (repeats << 1) | 1.
+* Objects are aligned and tagged pointers are never autoreleased, so
+* no object pointer is odd, and POOL_BOUNDARY is still nil. Every
+* other slot is the plain object pointer, so the object slot of an
+* entry never changes. The first repeat of an entry below the top
+* moves the slots above it up one to make room; they belong to at most
+* window entries, and are never a pool boundary.
+**********************************************************************/
+
+#ifndef _OBJC_AUTORELEASE_COALESCE_ENGINE_H
+#define _OBJC_AUTORELEASE_COALESCE_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace objc {
+
+struct AutoreleaseRepeats {
+    static const uintptr_t Max = ~(uintptr_t)0 >> 1;
+
+    static bool is(uintptr_t slot) { return slot & 1; }
+    static uintptr_t count(uintptr_t slot) { return slot >> 1; }
+    static uintptr_t slot(uintptr_t count) { return (count << 1) | 1; }
+};
+
+
+/***********************************************************************
+* autorelease_coalesce
+* Counts another autorelease of obj against its entry among the top
+* window entries of [floor, *top), if there is one above the topmost
+* pool boundary with room for another repeat. Its first repeat needs
+* a slot below end for the repeat slot, and moves *top up by one.
+* Returns obj's slot, or nullptr if obj needs a slot of its own.
+**********************************************************************/
+static inline uintptr_t *
+autorelease_coalesce(uintptr_t *floor, uintptr_t **top, uintptr_t *end,
+                     unsigned window, uintptr_t obj)
+{
+    uintptr_t *t = *top;
+    uintptr_t *p = t;
+    // obj is even, so it matches no repeat slot, 
+    // and repeat slots don't count against the window.
+    for (unsigned left = window; ; ) {
+        if (left == 0  ||  p == floor) return nullptr;
+        uintptr_t slot = *--p;
+        if (slot == obj) break;
+        if (slot == 0) return nullptr;  // POOL_BOUNDARY
+        left -= !AutoreleaseRepeats::is(slot);
+    }
+
+    if (p + 1 < t  &&  AutoreleaseRepeats::is(p[1])) {
+        uintptr_t count = AutoreleaseRepeats::count(p[1]);
+        if (count == AutoreleaseRepeats::Max) return nullptr;
+        p[1] = AutoreleaseRepeats::slot(count + 1);
+        return p;
+    }
+    if (t == end) return nullptr;
+    memmove(p + 2, p + 1, (t - (p + 1)) * sizeof(*p));
+    p[1] = AutoreleaseRepeats::slot(1);
+    *top = t + 1;
+    return p;
+}
+
+
+/***********************************************************************
+* autorelease_take
+* Moves the releases of the entries of [stop, *top) to out, most
+* recent first, each repeat as one more copy of its object, until out
+* holds max or the entries run out. *top moves down past the slots
+* freed. An entry with more repeats than fit has the ones that fit
+* taken from its count, and stays. Boundaries come out as 0.
+* stop is never between an object and its repeat slot.
+* Returns how many releases out holds.
+**********************************************************************/
+static inline size_t
+autorelease_take(uintptr_t *stop, uintptr_t **top, uintptr_t *out, size_t max)
+{
+    uintptr_t *p = *top;
+    size_t n = 0;
+    while (p > stop  &&  n < max) {
+        uintptr_t slot = p[-1];
+        uintptr_t obj = slot;
+        size_t count = 1;
+        if (AutoreleaseRepeats::is(slot)) {
+            obj = p[-2];
+            count += AutoreleaseRepeats::count(slot);
+        }
+        if (count > max - n) {
+            size_t left = count - (max - n);
+            count = max - n;
+            // One release left needs no repeat slot.
+            if (left > 1) p[-1] = AutoreleaseRepeats::slot(left - 1);
+            else p--;
+        } else {
+            p -= AutoreleaseRepeats::is(slot) ? 2 : 1;
+        }
+        while (count--) out[n++] = obj;
+    }
+    *top = p;
+    return n;
+}
+
+} // end namespace objc
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-biased-refcount-engine.h
+* Biased reference counting for objects that one thread uses.
+*
+* Most objects are only ever retained and released by the thread that
+* allocated them, yet every retain and release is an atomic
+* read-modify-write. A biased object instead keeps two counts:
+*   biased   retains made by its owner, the allocating thread, which
+*            updates it with plain loads and stores
+*   shared   retains made by every other thread, minus their releases,
+*            updated atomically. It may go below zero when other threads
+*            release references the owner made.
+* The object's retain count is their sum.
+*
+* The first time another thread retains or releases the object, it
+* sets HandedOff and pushes the object onto its owner's handoff list.
+* The owner drains that list at its next quiescent point: it adds the
+* biased count to the shared count, sets Merged and gives up the
+* object, whose count is shared from then on. The owner also merges
+* the object itself when its biased count reaches zero, and drains its
+* list then if the object is on it.
+*
+* An object whose last reference another thread releases is freed only
+* when its owner next drains, which an owner that blocks or spins may
+* not do for a long time. Its users bound that by biasing no more new
+* objects to an owner while unmerged() objects are still biased to it.
+*
+* Only a merged count can reach zero, and a handed off object is freed
+* by whoever drains it, never before, so the handoff list only holds
+* live objects. A thread that exits drains its list and marks its
+* record exited; whoever hands off to an exited owner drains the list
+* itself, which is safe because the owner can no longer count.
+**********************************************************************/
+
+#ifndef _OBJC_BIASED_REFCOUNT_ENGINE_H
+#define _OBJC_BIASED_REFCOUNT_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+namespace objc {
+
+// One per thread that allocates biased objects. Records are never
+// freed, only recycled once every object biased to them has merged.
+// Padded to a cache line so that handoffs to different threads
+// don't contend for the same line.
+struct BiasedRCOwner {
+    // Handed off objects, linked through BiasedRC::next.
+    std::atomic<void *> handoffs;
+    // Objects biased to this record, written only by its thread,
+    // and objects merged since.
+    std::atomic<uintptr_t> owned;
+    std::atomic<uintptr_t> merged;
+    BiasedRCOwner *next;
+    std::atomic<bool> inUse;
+    std::atomic<bool> exited;
+    char pad[64 - 4*sizeof(void *) - 2*sizeof(std::atomic<bool>)];
+
+    BiasedRCOwner()
+        : handoffs(nullptr), owned(0), merged(0), next(nullptr),
+          inUse(false), exited(false) { }
+};
+static_assert(sizeof(BiasedRCOwner) == 64,
+              "BiasedRCOwner should fill a cache line");
+
+
+// Kept inside each biased object.
+struct BiasedRC {
+    // nullptr once merged.
+    std::atomic<BiasedRCOwner *> owner;
+    // Written only by the owner, and read by others only once it
+    // has exited.
+    std::atomic<uintptr_t> biased;
+    // (count << Shift) | flags, count signed.
+    std::atomic<uintptr_t> shared;
+    // The next object on the owner's handoff list.
+    void *next;
+
+    enum : uintptr_t {
+        Merged       = 1,  // the whole count is shared
+        HandedOff    = 2,  // on the owner's handoff list
+        Deallocating = 4,
+        Shift        = 3,
+        One          = 1 << Shift,
+    };
+
+    static intptr_t count(uintptr_t word) {
+        return (intptr_t)word >> Shift;
+    }
+
+    bool ownedBy(const BiasedRCOwner *self) const {
+        return self  &&  owner.load(std::memory_order_relaxed) == self;
+    }
+
+    // Owner only.
+    void retainOwned() {
+        biased.store(biased.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    }
+
+    // Owner only. Returns false when that was the owner's last
+    // reference, after which the caller must call mergeOwned().
+    bool releaseOwned() {
+        uintptr_t b = biased.load(std::memory_order_relaxed) - 1;
+        biased.store(b, std::memory_order_relaxed);
+        return b != 0;
+    }
+
+    // Approximate unless called by the owner, like any retain count.
+    intptr_t retainCount() const {
+        uintptr_t word = shared.load(std::memory_order_relaxed);
+        intptr_t rc = count(word);
+        if (!(word & Merged)) rc += biased.load(std::memory_order_relaxed);
+        return rc;
+    }
+};
+
+
+// Traits supplies:
+//   static BiasedRC *rc(void *object);
+//   static void dealloc(void *object);      its count reached zero
+//   static void overreleased(void *object);
+template <typename Traits>
+class BiasedRefcounts {
+    std::atomic<BiasedRCOwner *> owners;
+    // Handoff lists of threads that did not survive fork().
+    std::atomic<void *> orphans;
+
+    static bool casShared(BiasedRC *rc, uintptr_t& old, uintptr_t value) {
+        return rc->shared.compare_exchange_weak(old, value,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_relaxed);
+    }
+
+    static void handOff(BiasedRCOwner *owner, void *object, BiasedRC *rc) {
+        void *head = owner->handoffs.load(std::memory_order_relaxed);
+        do {
+            rc->next = head;
+        } while (!owner->handoffs.compare_exchange_weak(head, object,
+                                                        std::memory_order_seq_cst,
+                                                        std::memory_order_relaxed));
+        // Pairs with exitOwner(): either it sees the object,
+        // or this sees that it exited.
+        if (owner->exited.load(std::memory_order_seq_cst)) drain(owner);
+    }
+
+ public:
+    enum Result {
+        Done,          // the operation took effect
+        Last,          // release took the count to zero; deallocate
+        Failed,        // tryRetain of a deallocating object
+        Overreleased,  // release of an object whose count was zero
+    };
+
+    constexpr BiasedRefcounts() : owners(nullptr), orphans(nullptr) { }
+
+    // Returns a record for the calling thread, reusing one whose
+    // thread exited and whose objects have all merged.
+    // Callers store it in thread-local storage.
+    BiasedRCOwner *acquireOwner() {
+        for (BiasedRCOwner *o = owners.load(std::memory_order_acquire);
+             o != nullptr;
+             o = o->next)
+        {
+            bool expected = false;
+            // Once owned == merged nothing can be biased to o again.
+            if (!o->inUse.load(std::memory_order_relaxed)  &&
+                o->owned.load(std::memory_order_acquire) ==
+                o->merged.load(std::memory_order_acquire)  &&
+                o->inUse.compare_exchange_strong(expected, true,
+                                                 std::memory_order_acquire))
+            {
+                o->exited.store(false, std::memory_order_seq_cst);
+                return o;
+            }
+        }
+
+        BiasedRCOwner *o = new BiasedRCOwner;
+        o->inUse.store(true, std::memory_order_relaxed);
+        BiasedRCOwner *head = owners.load(std::memory_order_relaxed);
+        do {
+            o->next = head;
+        } while (!owners.compare_exchange_weak(head, o,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+        return o;
+    }
+
+    // Called when the owning thread exits. Objects still biased to it
+    // stay alive; they are merged by whoever next hands one off.
+    void exitOwner(BiasedRCOwner *o) {
+        drain(o);
+        o->exited.store(true, std::memory_order_seq_cst);
+        drain(o);
+        o->inUse.store(false, std::memory_order_release);
+    }
+
+    // After fork() only the calling thread survives in the child.
+    // The others are marked exited without deallocating anything here;
+    // their handoff lists wait for drainOrphans().
+    void forkChild(BiasedRCOwner *self) {
+        for (BiasedRCOwner *o = owners.load(std::memory_order_acquire);
+             o != nullptr;
+             o = o->next)
+        {
+            if (o == self  ||  !o->inUse.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            o->exited.store(true, std::memory_order_relaxed);
+            void *object = o->handoffs.exchange(nullptr,
+                                                std::memory_order_relaxed);
+            while (object) {
+                BiasedRC *rc = Traits::rc(object);
+                void *next = rc->next;
+                rc->next = orphans.load(std::memory_order_relaxed);
+                orphans.store(object, std::memory_order_relaxed);
+                object = next;
+            }
+            o->inUse.store(false, std::memory_order_release);
+        }
+    }
+
+    bool hasOrphans() const {
+        return orphans.load(std::memory_order_relaxed) != nullptr;
+    }
+
+    void drainOrphans() {
+        drainList(orphans.exchange(nullptr, std::memory_order_acquire));
+    }
+
+    // owner is nullptr if the thread has no record, in which case
+    // the object starts out merged.
+    static void init(BiasedRC *rc, BiasedRCOwner *owner) {
+        rc->next = nullptr;
+        if (owner) {
+            rc->biased.store(1, std::memory_order_relaxed);
+            rc->shared.store(0, std::memory_order_relaxed);
+            owner->owned.store(owner->owned.load(std::memory_order_relaxed) + 1,
+                               std::memory_order_relaxed);
+        } else {
+            rc->biased.store(0, std::memory_order_relaxed);
+            rc->shared.store(BiasedRC::One | BiasedRC::Merged,
+                             std::memory_order_relaxed);
+        }
+        rc->owner.store(owner, std::memory_order_relaxed);
+    }
+
+    // Called by the owner after releaseOwned() returned false.
+    static Result mergeOwned(BiasedRC *rc) {
+        BiasedRCOwner *owner = rc->owner.load(std::memory_order_relaxed);
+        uintptr_t old = rc->shared.load(std::memory_order_relaxed);
+        uintptr_t value;
+        do {
+            value = old | BiasedRC::Merged;
+            // A handed off object is freed by whoever drains it.
+            if (BiasedRC::count(old) == 0  &&  !(old & BiasedRC::HandedOff)) {
+                value |= BiasedRC::Deallocating;
+            }
+        } while (!casShared(rc, old, value));
+        rc->owner.store(nullptr, std::memory_order_relaxed);
+        owner->merged.fetch_add(1, std::memory_order_release);
+        // Still on the handoff list, so only a drain may free it. 
+        // Don't leave that to the next quiescent point.
+        if ((value & BiasedRC::HandedOff)  &&  
+            drainList(owner->handoffs.exchange(nullptr, 
+                                               std::memory_order_acquire), 
+                      rc))
+        {
+            return Last;
+        }
+        return (value & BiasedRC::Deallocating) ? Last : Done;
+    }
+
+    // Objects biased to o that have not merged. Called by o's thread.
+    static uintptr_t unmerged(const BiasedRCOwner *o) {
+        return o->owned.load(std::memory_order_relaxed) -
+            o->merged.load(std::memory_order_relaxed);
+    }
+
+    // Retain by a thread other than the owner.
+    static Result retainShared(void *object, BiasedRC *rc, bool tryRetain) {
+        // Read before the update: the owner is cleared only after
+        // a Merged that this update would see.
+        BiasedRCOwner *owner = rc->owner.load(std::memory_order_acquire);
+        uintptr_t old = rc->shared.load(std::memory_order_relaxed);
+        uintptr_t value;
+        do {
+            if (tryRetain  &&
+                ((old & BiasedRC::Deallocating)  ||
+                 ((old & BiasedRC::Merged)  &&  BiasedRC::count(old) <= 0)))
+            {
+                return Failed;
+            }
+            value = old + BiasedRC::One;
+            if (!(old & (BiasedRC::Merged | BiasedRC::HandedOff))) {
+                value |= BiasedRC::HandedOff;
+            }
+        } while (!casShared(rc, old, value));
+        if (!(old & BiasedRC::HandedOff)  &&  (value & BiasedRC::HandedOff)) {
+            handOff(owner, object, rc);
+        }
+        return Done;
+    }
+
+    // Release by a thread other than the owner.
+    static Result releaseShared(void *object, BiasedRC *rc) {
+        BiasedRCOwner *owner = rc->owner.load(std::memory_order_acquire);
+        uintptr_t old = rc->shared.load(std::memory_order_relaxed);
+        uintptr_t value;
+        do {
+            if ((old & BiasedRC::Merged)  &&  BiasedRC::count(old) <= 0) {
+                return Overreleased;
+            }
+            value = old - BiasedRC::One;
+            if (!(old & (BiasedRC::Merged | BiasedRC::HandedOff))) {
+                value |= BiasedRC::HandedOff;
+            }
+            else if ((old & BiasedRC::Merged)  &&
+                     !(old & BiasedRC::HandedOff)  &&
+                     BiasedRC::count(value) == 0)
+            {
+                value |= BiasedRC::Deallocating;
+            }
+        } while (!casShared(rc, old, value));
+        if (!(old & BiasedRC::HandedOff)  &&  (value & BiasedRC::HandedOff)) {
+            handOff(owner, object, rc);
+            return Done;
+        }
+        if ((value & BiasedRC::Deallocating)  &&
+            !(old & BiasedRC::Deallocating))
+        {
+            return Last;
+        }
+        return Done;
+    }
+
+    // Merges every object handed off to o. Called by o's thread, or by
+    // anyone once it has exited. Deallocates those whose count is zero.
+    static void drain(BiasedRCOwner *o) {
+        drainList(o->handoffs.exchange(nullptr, std::memory_order_acquire));
+    }
+
+    // Drains o if anything was handed off to it.
+    static void drainIfNeeded(BiasedRCOwner *o) {
+        if (o  &&  o->handoffs.load(std::memory_order_relaxed)) drain(o);
+    }
+
+ private:
+    // Returns true if it found self's count at zero, 
+    // leaving the caller to deallocate it.
+    static bool drainList(void *object, const BiasedRC *self = nullptr) {
+        bool selfLast = false;
+        while (object) {
+            BiasedRC *rc = Traits::rc(object);
+            void *next = rc->next;
+            BiasedRCOwner *owner = rc->owner.load(std::memory_order_relaxed);
+            uintptr_t biased = rc->biased.load(std::memory_order_relaxed);
+            uintptr_t old = rc->shared.load(std::memory_order_relaxed);
+            uintptr_t value;
+            do {
+                value = old & ~(uintptr_t)BiasedRC::HandedOff;
+                if (!(old & BiasedRC::Merged)) {
+                    value = (value + biased * BiasedRC::One) | BiasedRC::Merged;
+                }
+                if (BiasedRC::count(value) <= 0) {
+                    value |= BiasedRC::Deallocating;
+                }
+            } while (!casShared(rc, old, value));
+
+            if (!(old & BiasedRC::Merged)) {
+                rc->owner.store(nullptr, std::memory_order_relaxed);
+                owner->merged.fetch_add(1, std::memory_order_release);
+            }
+            if (value & BiasedRC::Deallocating) {
+                if (BiasedRC::count(value) < 0) Traits::overreleased(object);
+                else if (rc == self) selfLast = true;
+                else Traits::dealloc(object);
+            }
+            object = next;
+        }
+        return selfLast;
+    }
+};
+
+} // end namespace objc
+
+#endif
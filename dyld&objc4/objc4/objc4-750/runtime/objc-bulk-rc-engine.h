@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-bulk-rc-engine.h
+* Batching for objc_retainMany() and objc_releaseMany().
+*
+* A batch is first stripped of nil and tagged pointers, a few words at
+* a time, so that the per-object loop that follows has no such tests.
+* Objects whose retain counts need the side table are then grouped by
+* stripe when there are few stripes, so that each stripe's lock is
+* taken once per batch instead of once per object. Repeats of one
+* object in a row are counted, so that their releases can be made at
+* once.
+**********************************************************************/
+
+#ifndef _OBJC_BULK_RC_ENGINE_H
+#define _OBJC_BULK_RC_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <utility>
+
+#if __x86_64__  &&  __SSE2__
+#   include <emmintrin.h>
+#elif __arm64__  ||  __aarch64__
+#   include <arm_neon.h>
+#endif
+
+namespace objc {
+
+enum class BulkRCKernel { Scalar, SSE2, NEON };
+
+#if __x86_64__  &&  __SSE2__
+static constexpr BulkRCKernel bulk_rc_kernel = BulkRCKernel::SSE2;
+#elif __arm64__  ||  __aarch64__
+static constexpr BulkRCKernel bulk_rc_kernel = BulkRCKernel::NEON;
+#else
+static constexpr BulkRCKernel bulk_rc_kernel = BulkRCKernel::Scalar;
+#endif
+
+
+/***********************************************************************
+* bulk_rc_filter
+* Copies the words of in[0, count) that are not zero and have no bit of
+* tagMask set to out, in order, and returns how many there are.
+* out may be in. Four words are tested at once, and copied as a block
+* when all of them are kept, which is the common case.
+**********************************************************************/
+template <BulkRCKernel Kernel = bulk_rc_kernel>
+static inline size_t
+bulk_rc_filter(const uintptr_t *in, size_t count, uintptr_t tagMask,
+               uintptr_t *out)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+#if __x86_64__  &&  __SSE2__
+    if (Kernel == BulkRCKernel::SSE2) {
+        // SSE2 has no 64-bit compare. A 64-bit lane is zero
+        // when both of its 32-bit halves are.
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i tag = _mm_set1_epi64x((long long)tagMask);
+        auto isZero = [&](__m128i v) {
+            __m128i z = _mm_cmpeq_epi32(v, zero);
+            return _mm_and_si128
+                (z, _mm_shuffle_epi32(z, _MM_SHUFFLE(2, 3, 0, 1)));
+        };
+        // Lanes that are zero or tagged.
+        auto skipped = [&](__m128i v) {
+            __m128i keep = _mm_andnot_si128
+                (isZero(v), isZero(_mm_and_si128(v, tag)));
+            return 3 ^ (unsigned)_mm_movemask_pd(_mm_castsi128_pd(keep));
+        };
+        for (; i + 4 <= count; i += 4) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(in + i));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(in + i + 2));
+            unsigned skip = skipped(lo) | (skipped(hi) << 2);
+            if (skip == 0) {
+                _mm_storeu_si128((__m128i *)(out + n), lo);
+                _mm_storeu_si128((__m128i *)(out + n + 2), hi);
+                n += 4;
+                continue;
+            }
+            uintptr_t w[4] = { in[i], in[i+1], in[i+2], in[i+3] };
+            for (unsigned j = 0; j < 4; j++) {
+                out[n] = w[j];
+                n += !(skip & (1 << j));
+            }
+        }
+    }
+#endif
+#if __arm64__  ||  __aarch64__
+    if (Kernel == BulkRCKernel::NEON) {
+        const uint64x2_t tag = vdupq_n_u64(tagMask);
+        auto kept = [&](uint64x2_t v) {
+            // Lanes that are nonzero and have no tag bit.
+            uint64x2_t k = vbicq_u64(vtstq_u64(v, v), vtstq_u64(v, tag));
+            return (unsigned)((vgetq_lane_u64(k, 0) & 1) |
+                              (vgetq_lane_u64(k, 1) & 2));
+        };
+        for (; i + 4 <= count; i += 4) {
+            uint64x2_t lo = vld1q_u64((const uint64_t *)(in + i));
+            uint64x2_t hi = vld1q_u64((const uint64_t *)(in + i + 2));
+            unsigned keep = kept(lo) | (kept(hi) << 2);
+            if (keep == 0xf) {
+                vst1q_u64((uint64_t *)(out + n), lo);
+                vst1q_u64((uint64_t *)(out + n + 2), hi);
+                n += 4;
+                continue;
+            }
+            uintptr_t w[4] = { in[i], in[i+1], in[i+2], in[i+3] };
+            for (unsigned j = 0; j < 4; j++) {
+                out[n] = w[j];
+                n += (keep >> j) & 1;
+            }
+        }
+    }
+#endif
+
+    // The scalar kernel, and the tail of the others.
+    // Stores every word and advances past the kept ones only.
+    for (; i < count; i++) {
+        uintptr_t w = in[i];
+        out[n] = w;
+        n += (w != 0)  &  ((w & tagMask) == 0);
+    }
+    return n;
+}
+
+
+/***********************************************************************
+* bulk_rc_run_length
+* How many times objects[0] appears at the start of objects[0, count),
+* which is not empty. An object autoreleased in a loop fills a run of
+* its pool; its releases can be made as one.
+**********************************************************************/
+static inline size_t
+bulk_rc_run_length(const uintptr_t *objects, size_t count)
+{
+    size_t run = 1;
+    while (run < count  &&  objects[run] == objects[0]) run++;
+    return run;
+}
+
+
+/***********************************************************************
+* bulk_rc_should_group
+* Whether sorting count side table objects by stripe saves more lock 
+* acquisitions than it costs. Uncontended, the sort costs about as much 
+* as a lock per object, so it pays only when most objects share their 
+* stripe with several others. Otherwise each stripe is locked for a run 
+* of its objects in array order.
+**********************************************************************/
+static inline bool
+bulk_rc_should_group(size_t count, unsigned stripeCount)
+{
+    return count >= 4 * (size_t)stripeCount;
+}
+
+
+/***********************************************************************
+* bulk_rc_group_by_stripe
+* Sorts entries by stripe, so that each stripe's objects are adjacent.
+* A comparison sort costs more than the lock acquisitions it saves;
+* this is a radix sort, one pass per 6 bits of stripe index, so two
+* passes at most for the largest side table. Stable.
+* count is at most MaxCount; stripes are less than stripeCount.
+**********************************************************************/
+struct BulkRCStripeEntry {
+    unsigned stripe;
+    uintptr_t object;
+};
+
+template <size_t MaxCount>
+static inline void
+bulk_rc_group_by_stripe(BulkRCStripeEntry *entries, size_t count,
+                        unsigned stripeCount)
+{
+    enum { RadixBits = 6, Radix = 1 << RadixBits };
+    if (count < 2) return;
+
+    BulkRCStripeEntry scratch[MaxCount];
+    BulkRCStripeEntry *from = entries;
+    BulkRCStripeEntry *to = scratch;
+    for (unsigned shift = 0; (stripeCount - 1) >> shift; shift += RadixBits) {
+        size_t start[Radix] = {};
+        for (size_t i = 0; i < count; i++) {
+            start[(from[i].stripe >> shift) & (Radix - 1)]++;
+        }
+        size_t total = 0;
+        for (unsigned d = 0; d < Radix; d++) {
+            size_t n = start[d];
+            start[d] = total;
+            total += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[start[(from[i].stripe >> shift) & (Radix - 1)]++] = from[i];
+        }
+        std::swap(from, to);
+    }
+    if (from != entries) memcpy(entries, from, count * sizeof(entries[0]));
+}
+
+} // end namespace objc
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-cache-engine.h
+* Method cache hashing, probing, and sizing policy.
+*
+* This is the part of objc-cache.mm that decides where a selector
+* lives in a method cache and when a method cache grows. It has no
+* dependencies on Mach, the messengers, or objc-private.h, so the
+* same code can be compiled on a host machine by bench/ and measured
+* with alternative policies.
+*
+* Nothing here enforces memory ordering. Publishing buckets to
+* objc_msgSend is still the job of cache_t::setBucketsAndMask()
+* and bucket_t::set().
+**********************************************************************/
+
+#ifndef _OBJC_CACHE_ENGINE_H
+#define _OBJC_CACHE_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace objc {
+
+/* Initial cache bucket count. INIT_CACHE_SIZE must be a power of two. */
+enum {
+    INIT_CACHE_SIZE_LOG2 = 2,
+    INIT_CACHE_SIZE      = (1 << INIT_CACHE_SIZE_LOG2)
+};
+
+
+// Cache scan direction. This must match the messengers.
+// Increment: scan increments and wraps at a special end-marking bucket.
+// Decrement: scan decrements. No end marker needed.
+enum class CacheScan { Increment, Decrement };
+
+template <typename Mask, typename Key>
+static inline Mask cache_hash(Key key, Mask mask)
+{
+    return (Mask)(key & mask);
+}
+
+template <CacheScan Scan, typename Mask>
+static inline Mask cache_next(Mask i, Mask mask)
+{
+    if (Scan == CacheScan::Increment) return (i+1) & mask;
+    else return i ? i-1 : mask;
+}
+
+
+/***********************************************************************
+* cache_probe
+* Returns the bucket containing key, or the empty bucket where key
+* would be inserted. Returns nullptr if every bucket was examined
+* without finding either, which means the cache is corrupt.
+* If outProbes is non-null it is set to the number of buckets examined.
+* Bucket must provide key(). Key 0 marks an empty bucket.
+**********************************************************************/
+template <CacheScan Scan, typename Bucket, typename Mask, typename Key>
+static inline Bucket *
+cache_probe(Bucket *b, Mask m, Key k, uint32_t *outProbes = nullptr)
+{
+    Mask begin = cache_hash(k, m);
+    Mask i = begin;
+    uint32_t probes = 0;
+    do {
+        probes++;
+        if (b[i].key() == 0  ||  b[i].key() == k) {
+            if (outProbes) *outProbes = probes;
+            return &b[i];
+        }
+    } while ((i = cache_next<Scan>(i, m)) != begin);
+
+    if (outProbes) *outProbes = probes;
+    return nullptr;
+}
+
+
+/***********************************************************************
+* cache_probe_count
+* Returns the number of buckets a lookup examines to find the key 
+* stored at bucket index, given that key's hash home.
+**********************************************************************/
+template <CacheScan Scan, typename Mask>
+static inline uint32_t cache_probe_count(Mask home, Mask index, Mask mask)
+{
+    if (Scan == CacheScan::Increment) return (uint32_t)((index - home) & mask) + 1;
+    else return (uint32_t)((home - index) & mask) + 1;
+}
+
+
+/***********************************************************************
+* cache_policy_t
+* Decides when a cache must grow, how big it becomes, and how big it
+* stays after a flush. The runtime uses cache_policy_default.
+* bench/ compares others.
+*
+* A flushed cache keeps its capacity, so a class that is flushed
+* often does not pay to regrow it. A cache that was mostly unused
+* when it was flushed shrinks by one growth step instead, so an idle
+* cache decays gradually while a busy one regrows at most once.
+*
+* A policy must always leave at least one empty bucket after a fill,
+* because cache scans stop only at a matching or empty bucket.
+* That requires initCapacity >= 2 and a maximum load below 1.
+**********************************************************************/
+struct cache_policy_t {
+    // Capacity of a cache's first real allocation. Power of two.
+    uint32_t initCapacity;
+    // Expansion multiplies capacity by (1 << growthLog2).
+    uint32_t growthLog2;
+    // A fill that would push occupancy past
+    // capacity / maxLoadDenominator * maxLoadNumerator expands first.
+    uint32_t maxLoadNumerator;
+    uint32_t maxLoadDenominator;
+    // Caches never grow past capacityLimit. A full cache at the limit
+    // is emptied and refilled instead. Power of two, or 0 for no limit.
+    uint32_t capacityLimit;
+    // A flush shrinks a cache whose entries would have fit in
+    // capacity >> shrinkLog2. 0 never shrinks.
+    uint32_t shrinkLog2;
+
+    // maxCapacity is what the cache's mask can represent.
+    constexpr uint32_t limit(uint32_t maxCapacity) const {
+        return (capacityLimit  &&  capacityLimit < maxCapacity)
+            ? capacityLimit : maxCapacity;
+    }
+
+    // Returns true if a cache of this capacity may hold newOccupied entries.
+    constexpr bool canFill(uint32_t newOccupied, uint32_t capacity) const {
+        return newOccupied <= capacity / maxLoadDenominator * maxLoadNumerator;
+    }
+
+    // Returns the capacity to use when a cache of oldCapacity is full.
+    // Returns oldCapacity if growing would pass the limit.
+    constexpr uint32_t expandedCapacity(uint32_t oldCapacity,
+                                        uint32_t maxCapacity) const {
+        return (oldCapacity == 0) ? initCapacity
+            : (oldCapacity > (limit(maxCapacity) >> growthLog2)) ? oldCapacity
+            : (oldCapacity << growthLog2);
+    }
+
+    // Smallest capacity that holds count entries without expanding,
+    // e.g. for presizing a cache whose contents are known in advance.
+    constexpr uint32_t capacityForCount(uint32_t count,
+                                        uint32_t maxCapacity) const {
+        uint32_t capacity = initCapacity;
+        while (!canFill(count, capacity)  &&
+               capacity <= (limit(maxCapacity) >> growthLog2))
+        {
+            capacity <<= growthLog2;
+        }
+        return capacity;
+    }
+
+    // Returns the capacity for a cache of this capacity that was 
+    // flushed while holding occupied entries.
+    constexpr uint32_t flushedCapacity(uint32_t capacity,
+                                       uint32_t occupied) const {
+        return (shrinkLog2 == 0  ||  capacity <= initCapacity) ? capacity
+            : (capacityForCount(occupied, capacity) > (capacity >> shrinkLog2))
+            ? capacity
+            : ((capacity >> growthLog2) > initCapacity)
+            ? (capacity >> growthLog2) : initCapacity;
+    }
+
+    constexpr bool isValid() const {
+        return initCapacity >= 2  &&
+            (initCapacity & (initCapacity - 1)) == 0  &&
+            growthLog2 >= 1  &&
+            maxLoadDenominator > 0  &&
+            maxLoadNumerator < maxLoadDenominator  &&
+            (capacityLimit == 0  ||
+             (capacityLimit >= initCapacity  &&
+              (capacityLimit & (capacityLimit - 1)) == 0));
+    }
+};
+
+// Double at 3/4 full, starting from INIT_CACHE_SIZE, up to 65536 
+// buckets. Halve a flushed cache whose entries would fit in an eighth.
+static constexpr cache_policy_t cache_policy_default =
+    { INIT_CACHE_SIZE, 1, 3, 4, 1 << 16, 3 };
+
+static_assert(cache_policy_default.isValid(),
+              "default cache policy must leave an empty bucket");
+
+} // end namespace objc
+
+#endif
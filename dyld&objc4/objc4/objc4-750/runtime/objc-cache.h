@@ -10,12 +10,22 @@ extern IMP cache_getImp(Class cls, SEL sel);
 
 extern void cache_fill(Class cls, SEL sel, IMP imp, id receiver);
 
+extern void cache_presize(Class cls, uint32_t count);
+
 extern void cache_erase_nolock(Class cls);
 
+extern bool cache_evict_nolock(Class cls, SEL sel);
+
 extern void cache_delete(Class cls);
 
 extern void cache_collect(bool collectALot);
 
+extern void cache_countMiss(Class cls);
+
+extern void cache_addContents_nolock(Class cls, struct objc_method_cache_statistics *stats);
+
+extern void cache_addCounters_nolock(Class cls, struct objc_method_cache_statistics *stats);
+
 __END_DECLS
 
 #endif
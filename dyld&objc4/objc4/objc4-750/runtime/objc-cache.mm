@@ -46,20 +46,21 @@
  * The memory is now only accessible to instances of objc_msgSend that 
  * were running when the memory was disconnected; any further calls to 
  * objc_msgSend will not see the garbage memory because the other data 
- * structures don't point to it anymore. The collecting_in_critical
- * function checks the PC of all threads and returns FALSE when all threads 
- * are found to be outside objc_msgSend. This means any call to objc_msgSend 
- * that could have had access to the garbage has finished or moved past the 
- * cache lookup stage, so it is safe to free the memory.
+ * structures don't point to it anymore. Garbage is freed once every 
+ * thread has passed a quiescent state - a point where it cannot be 
+ * inside a cache lookup - since the memory was disconnected 
+ * (see "Quiescent-state reclamation" below). This means any call to 
+ * objc_msgSend that could have had access to the garbage has finished 
+ * or moved past the cache lookup stage, so it is safe to free the memory.
  *
  * All functions that modify cache data or structures must acquire the 
  * cacheUpdateLock to prevent interference from concurrent modifications.
  * The function that frees cache garbage must acquire the cacheUpdateLock 
- * and use collecting_in_critical() to flush out cache readers.
+ * and wait for the grace period to flush out cache readers.
  * The cacheUpdateLock is also used to protect the custom allocator used 
  * for large method cache blocks.
  *
- * Cache readers (PC-checked by collecting_in_critical())
+ * Cache readers (covered by the grace period; PC-checked if lagging)
  * objc_msgSend*
  * cache_getImp
  *
@@ -70,6 +71,7 @@
  * bcopy               (only called from instrumented cache_expand)
  * flush_caches        (acquires lock)
  * cache_flush        (only called from cache_fill and flush_caches)
+ * cache_evict        (only called from flush_caches; rewrites one key)
  * cache_collect_free (only called from cache_expand and cache_flush)
  *
  * UNPROTECTED cache readers (NOT thread-safe; used for debug info only)
@@ -85,17 +87,11 @@
 
 #include "objc-private.h"
 #include "objc-cache.h"
-
-
-/* Initial cache bucket count. INIT_CACHE_SIZE must be a power of two. */
-enum {
-    INIT_CACHE_SIZE_LOG2 = 2,
-    INIT_CACHE_SIZE      = (1 << INIT_CACHE_SIZE_LOG2)
-};
+#include "objc-cache-engine.h"
+#include "objc-epoch.h"
 
 static void cache_collect_free(struct bucket_t *data, mask_t capacity);
 static int _collecting_in_critical(void);
-static void _garbage_make_room(void);
 
 
 /***********************************************************************
@@ -122,6 +118,66 @@ static void recordDeadCache(mask_t capacity)
     }
 }
 
+
+/***********************************************************************
+* Method cache statistics for _objc_getMethodCacheStatistics()
+* Aggregate counters are always kept. They are striped by thread so 
+* that threads filling caches at once rarely write the same line.
+* Per-class counters are kept only with OBJC_RECORD_CACHE_STATISTICS, 
+* and are allocated on the class's first counted event.
+*
+* objc_msgSend's hits are not counted; it has no instructions to spare. 
+* Probe lengths are computed from each cache's current contents instead.
+**********************************************************************/
+struct cache_stats_t {
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> fills;
+    std::atomic<uint64_t> expansions;
+    std::atomic<uint64_t> flushes;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> retained;
+
+    constexpr cache_stats_t() 
+        : misses(0), fills(0), expansions(0), flushes(0), 
+          evictions(0), retained(0) { }
+};
+
+typedef std::atomic<uint64_t> cache_stats_t::* cache_counter_t;
+
+static StripedMap<cache_stats_t> cacheStats;
+
+static cache_stats_t *classCacheStats(Class cls)
+{
+    if (!RecordCacheStatistics  ||  !cls->isRealized()) return nil;
+
+    class_rw_t *rw = cls->data();
+    cache_stats_t *stats = rw->cacheStats;
+    if (!stats) {
+        // Misses are counted without locks, so publish with a CAS.
+        stats = new (calloc(sizeof(cache_stats_t), 1)) cache_stats_t;
+        if (!OSAtomicCompareAndSwapPtrBarrier(nil, stats, 
+                                              (void * volatile *)&rw->cacheStats))
+        {
+            free(stats);
+            stats = rw->cacheStats;
+        }
+    }
+    return stats;
+}
+
+static void cache_count(Class cls, cache_counter_t counter, uint64_t n = 1)
+{
+    (cacheStats[pthread_self()].*counter).fetch_add(n, std::memory_order_relaxed);
+    if (cache_stats_t *stats = classCacheStats(cls)) {
+        (stats->*counter).fetch_add(n, std::memory_order_relaxed);
+    }
+}
+
+void cache_countMiss(Class cls)
+{
+    cache_count(cls, &cache_stats_t::misses);
+}
+
 /***********************************************************************
 * Pointers used by compiled class objects
 * These use asm to avoid conflicts with the compiler's internal declarations
@@ -156,17 +212,13 @@ asm("\n .section __TEXT,__const"
 // objc_msgSend has few registers available.
 // Cache scan increments and wraps at special end-marking bucket.
 #define CACHE_END_MARKER 1
-static inline mask_t cache_next(mask_t i, mask_t mask) {
-    return (i+1) & mask;
-}
+static constexpr objc::CacheScan cache_scan = objc::CacheScan::Increment;
 
 #elif __arm64__
 // objc_msgSend has lots of registers available.
 // Cache scan decrements. No end marker needed.
 #define CACHE_END_MARKER 0
-static inline mask_t cache_next(mask_t i, mask_t mask) {
-    return i ? i-1 : mask;
-}
+static constexpr objc::CacheScan cache_scan = objc::CacheScan::Decrement;
 
 #else
 #error unknown architecture
@@ -242,11 +294,10 @@ ldp(uintptr_t& onep, uintptr_t& twop, const void *srcp)
 
 // Class points to cache. SEL is key. Cache buckets store SEL+IMP.
 // Caches are never built in the dyld shared cache.
+// Hashing, probing, and sizing live in objc-cache-engine.h.
 
-static inline mask_t cache_hash(cache_key_t key, mask_t mask) 
-{
-    return (mask_t)(key & mask);
-}
+static constexpr objc::cache_policy_t cache_policy = 
+    objc::cache_policy_default;
 
 cache_t *getCache(Class cls) 
 {
@@ -417,6 +468,10 @@ bucket_t *allocateBuckets(mask_t newCapacity)
 #endif
 
 
+// Shared empty buckets allocated on the heap, indexed by log2(capacity).
+static bucket_t **emptyBucketsList = nil;
+static mask_t emptyBucketsListCount = 0;
+
 bucket_t *emptyBucketsForCapacity(mask_t capacity, bool allocate = true)
 {
     cacheUpdateLock.assertLocked();
@@ -429,9 +484,6 @@ bucket_t *emptyBucketsForCapacity(mask_t capacity, bool allocate = true)
     }
 
     // Use shared empty buckets allocated on the heap.
-    static bucket_t **emptyBucketsList = nil;
-    static mask_t emptyBucketsListCount = 0;
-    
     mask_t index = log2u(capacity);
 
     if (index >= emptyBucketsListCount) {
@@ -458,11 +510,24 @@ bucket_t *emptyBucketsForCapacity(mask_t capacity, bool allocate = true)
 }
 
 
+// A flushed cache may use shared empty buckets 
+// larger than its capacity. See cache_erase_nolock().
+static bool isEmptyBuckets(bucket_t *b)
+{
+    cacheUpdateLock.assertLocked();
+
+    if (b == (bucket_t *)&_objc_empty_cache) return true;
+    for (mask_t i = 0; i < emptyBucketsListCount; i++) {
+        if (b == emptyBucketsList[i]) return true;
+    }
+    return false;
+}
+
 bool cache_t::isConstantEmptyCache()
 {
     return 
         occupied() == 0  &&  
-        buckets() == emptyBucketsForCapacity(capacity(), false);
+        isEmptyBuckets(buckets());
 }
 
 bool cache_t::canBeFreed()
@@ -525,15 +590,8 @@ bucket_t * cache_t::find(cache_key_t k, id receiver)
 {
     assert(k != 0);
 
-    bucket_t *b = buckets();
-    mask_t m = mask();
-    mask_t begin = cache_hash(k, m);
-    mask_t i = begin;
-    do {
-        if (b[i].key() == 0  ||  b[i].key() == k) {
-            return &b[i];
-        }
-    } while ((i = cache_next(i, m)) != begin);
+    bucket_t *b = objc::cache_probe<cache_scan>(buckets(), mask(), k);
+    if (b) return b;
 
     // hack
     Class cls = (Class)((uintptr_t)this - offsetof(objc_class, cache));
@@ -546,13 +604,11 @@ void cache_t::expand()
     cacheUpdateLock.assertLocked();
     
     uint32_t oldCapacity = capacity();
-    uint32_t newCapacity = oldCapacity ? oldCapacity*2 : INIT_CACHE_SIZE;
-
-    if ((uint32_t)(mask_t)newCapacity != newCapacity) {
-        // mask overflow - can't grow further
-        // fixme this wastes one bit of mask
-        newCapacity = oldCapacity;
-    }
+    // If the mask would overflow or the policy's limit is reached, 
+    // the cache can't grow further. It is emptied instead.
+    // fixme this wastes one bit of mask
+    uint32_t newCapacity = 
+        cache_policy.expandedCapacity(oldCapacity, (mask_t)~(mask_t)0);
 
     reallocate(oldCapacity, newCapacity);
 }
@@ -577,14 +633,15 @@ static void cache_fill_nolock(Class cls, SEL sel, IMP imp, id receiver)
     mask_t capacity = cache->capacity();
     if (cache->isConstantEmptyCache()) {
         // Cache is read-only. Replace it.
-        cache->reallocate(capacity, capacity ?: INIT_CACHE_SIZE);
+        cache->reallocate(capacity, capacity ?: cache_policy.initCapacity);
     }
-    else if (newOccupied <= capacity / 4 * 3) {
+    else if (cache_policy.canFill(newOccupied, capacity)) {
         // Cache is less than 3/4 full. Use it as-is.
     }
     else {
         // Cache is too full. Expand it.
         cache->expand();
+        cache_count(cls, &cache_stats_t::expansions);
     }
 
     // Scan for the first unused slot and insert there.
@@ -593,8 +650,10 @@ static void cache_fill_nolock(Class cls, SEL sel, IMP imp, id receiver)
     bucket_t *bucket = cache->find(key, receiver);
     if (bucket->key() == 0) cache->incrementOccupied();
     bucket->set(key, imp);
+    cache_count(cls, &cache_stats_t::fills);
 }
 
+
 void cache_fill(Class cls, SEL sel, IMP imp, id receiver)
 {
 #if !DEBUG_TASK_THREADS
@@ -607,8 +666,28 @@ void cache_fill(Class cls, SEL sel, IMP imp, id receiver)
 }
 
 
+// Give an empty cache room for count entries so that filling them 
+// does not expand it. Used to preload caches from a cache profile.
+void cache_presize(Class cls, uint32_t count)
+{
+    mutex_locker_t lock(cacheUpdateLock);
+
+    cache_t *cache = getCache(cls);
+    if (!cache->isConstantEmptyCache()) return;
+
+    mask_t capacity = (mask_t)
+        cache_policy.capacityForCount(count, (mask_t)~(mask_t)0);
+    if (capacity > cache->capacity()) {
+        cache->reallocate(cache->capacity(), capacity);
+    }
+}
+
+
 // Reset this entire cache to the uncached lookup by reallocating it.
-// This must not shrink the cache - that breaks the lock-free scheme.
+// The buckets must not shrink - that breaks the lock-free scheme. 
+// The mask may: the empty buckets are sized for the old capacity, 
+// so a reader that still sees the old mask stays in bounds. 
+// The next fill then allocates only the smaller capacity.
 void cache_erase_nolock(Class cls)
 {
     cacheUpdateLock.assertLocked();
@@ -619,10 +698,71 @@ void cache_erase_nolock(Class cls)
     if (capacity > 0  &&  cache->occupied() > 0) {
         auto oldBuckets = cache->buckets();
         auto buckets = emptyBucketsForCapacity(capacity);
-        cache->setBucketsAndMask(buckets, capacity - 1); // also clears occupied
+        mask_t newCapacity = (mask_t)
+            cache_policy.flushedCapacity(capacity, cache->occupied());
+        if (PrintCaches  &&  newCapacity < capacity) {
+            _objc_inform("CACHES: shrinking %s%s from %u to %u buckets", 
+                         cls->nameForLogging(), 
+                         cls->isMetaClass() ? " (meta)" : "", 
+                         (unsigned)capacity, (unsigned)newCapacity);
+        }
+        // also clears occupied
+        cache->setBucketsAndMask(buckets, newCapacity - 1);
 
         cache_collect_free(oldBuckets, capacity);
         cache_collect(false);
+        cache_count(cls, &cache_stats_t::flushes);
+    }
+}
+
+
+// Remove sel from this cache and leave every other entry in place.
+// The bucket keeps EvictedKey until the cache is next reallocated.
+// The caller must prevent sel from being filled again with a stale 
+// IMP; the runtime holds runtimeLock for method changes and fills.
+// Returns true if sel was cached.
+bool cache_evict_nolock(Class cls, SEL sel)
+{
+    cacheUpdateLock.assertLocked();
+
+    cache_t *cache = getCache(cls);
+    mask_t occupied = cache->occupied();
+    if (occupied == 0) return false;
+
+    cache_key_t key = getKey(sel);
+    bucket_t *bucket = 
+        objc::cache_probe<cache_scan>(cache->buckets(), cache->mask(), key);
+    bool evicted = (bucket  &&  bucket->key() == key);
+    if (evicted) {
+        bucket->setKey(bucket_t::EvictedKey);
+        cache_count(cls, &cache_stats_t::evictions);
+    }
+    cache_count(cls, &cache_stats_t::retained, occupied - (evicted ? 1 : 0));
+    return evicted;
+}
+
+
+// Adds cls's current cache contents to *stats.
+void cache_addContents_nolock(Class cls, objc_method_cache_statistics *stats)
+{
+    cacheUpdateLock.assertLocked();
+
+    cache_t *cache = getCache(cls);
+    if (!cache->canBeFreed()) return;  // shared empty cache
+
+    bucket_t *buckets = cache->buckets();
+    mask_t mask = cache->mask();
+    stats->capacity += cache->capacity();
+    for (mask_t i = 0; i <= mask; i++) {
+        // Skip empty buckets, the end marker, and evicted entries.
+        cache_key_t key = buckets[i].key();
+        if (key <= bucket_t::EvictedKey) continue;
+
+        mask_t home = objc::cache_hash(key, mask);
+        uint32_t probes = objc::cache_probe_count<cache_scan>(home, i, mask);
+        stats->entries++;
+        stats->probes += probes;
+        if (probes > stats->maxProbes) stats->maxProbes = probes;
     }
 }
 
@@ -685,16 +825,44 @@ static uintptr_t _get_pc_for_thread(thread_t thread)
 
 #endif
 
+/***********************************************************************
+* _thread_in_critical.
+* Returns TRUE if thread is executing a cache-reading function, 
+* or if its PC cannot be read.
+**********************************************************************/
+extern "C" uintptr_t objc_entryPoints[];
+extern "C"  uintptr_t objc_exitPoints[];
+
+#if !TARGET_OS_WIN32
+static int _thread_in_critical(thread_t thread)
+{
+    // Find out where thread is executing
+    uintptr_t pc = _get_pc_for_thread (thread);
+
+    // Check for bad status, and if so, assume the worse (can't collect)
+    if (pc == PC_SENTINEL) return TRUE;
+        
+    // Check whether it is in the cache lookup code
+    for (int region = 0; objc_entryPoints[region] != 0; region++)
+    {
+        if ((pc >= objc_entryPoints[region]) &&
+            (pc <= objc_exitPoints[region])) 
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+#endif
+
 /***********************************************************************
 * _collecting_in_critical.
 * Returns TRUE if some thread is currently executing a cache-reading 
 * function. Collection of cache garbage is not allowed when a cache-
 * reading function is in progress because it might still be using 
 * the garbage memory.
+* Used only with OBJC_DISABLE_QUIESCENT_RECLAIM.
 **********************************************************************/
-extern "C" uintptr_t objc_entryPoints[];
-extern "C"  uintptr_t objc_exitPoints[];
-
 static int _collecting_in_critical(void)
 {
 #if TARGET_OS_WIN32
@@ -724,36 +892,16 @@ static int _collecting_in_critical(void)
     result = FALSE;
     for (count = 0; count < number; count++)
     {
-        int region;
-        uintptr_t pc;
-
         // Don't bother checking ourselves
         if (threads[count] == mythread)
             continue;
 
-        // Find out where thread is executing
-        pc = _get_pc_for_thread (threads[count]);
-
-        // Check for bad status, and if so, assume the worse (can't collect)
-        if (pc == PC_SENTINEL)
-        {
+        if (_thread_in_critical(threads[count])) {
             result = TRUE;
-            goto done;
-        }
-        
-        // Check whether it is in the cache lookup code
-        for (region = 0; objc_entryPoints[region] != 0; region++)
-        {
-            if ((pc >= objc_entryPoints[region]) &&
-                (pc <= objc_exitPoints[region])) 
-            {
-                result = TRUE;
-                goto done;
-            }
+            break;
         }
     }
 
- done:
     // Deallocate the port rights for the threads
     for (count = 0; count < number; count++) {
         mach_port_deallocate(mach_task_self (), threads[count]);
@@ -769,52 +917,110 @@ static int _collecting_in_critical(void)
 
 
 /***********************************************************************
-* _garbage_make_room.  Ensure that there is enough room for at least
-* one more ref in the garbage.
+* Quiescent-state reclamation.
+* Every thread is registered in cacheReaderEpochs from the moment it 
+* starts and stays inside its critical section until it exits 
+* (QSBR, see objc-epoch.h). It announces a quiescent state wherever 
+* it cannot be inside a cache lookup: at every method lookup and 
+* autorelease pool pop (cache_quiescent()). Garbage retired in epoch E 
+* is freed once the epoch reaches E+2.
+*
+* objc_msgSend itself announces nothing, and idle threads announce 
+* nothing at all. A thread that has not announced lately is vouched 
+* for by reading its PC, one thread at a time and only once enough 
+* garbage is waiting. No thread list is taken and no thread waits 
+* for any other.
+*
+* OBJC_DISABLE_QUIESCENT_RECLAIM restores the old collector, which 
+* checks every thread's PC before each collection.
 **********************************************************************/
+static objc::EpochDomain cacheReaderEpochs;
+static bool quiescentReclaim = false;
 
-// amount of memory represented by all refs in the garbage
-static size_t garbage_byte_size = 0;
-
-// do not empty the garbage until garbage_byte_size gets at least this big
-static size_t garbage_threshold = 32*1024;
+#if !TARGET_OS_WIN32
 
-// table of refs to free
-static bucket_t **garbage_refs = 0;
+static tls_key_t cache_reader_tls;
+static pthread_introspection_hook_t previousThreadHook;
 
-// current number of refs in garbage_refs
-static size_t garbage_count = 0;
+static void cacheReaderRegister(pthread_t thread)
+{
+    objc::EpochRecord *record = cacheReaderEpochs.acquireRecord();
+    record->owner.store(pthread_mach_thread_np(thread), 
+                        std::memory_order_relaxed);
+    cacheReaderEpochs.enter(record);
+    tls_set(cache_reader_tls, record);
+}
 
-// capacity of current garbage_refs
-static size_t garbage_max = 0;
+static void cacheReaderThreadHook(unsigned int event, pthread_t thread, 
+                                  void *addr, size_t size)
+{
+    if (event == PTHREAD_INTROSPECTION_THREAD_START) {
+        // Called on the new thread before it runs any code of its own.
+        cacheReaderRegister(thread);
+    }
+    else if (event == PTHREAD_INTROSPECTION_THREAD_TERMINATE) {
+        // Called on the exiting thread after its TSD destructors ran, 
+        // so the record is found by owner rather than by tls_get().
+        objc::EpochRecord *record = 
+            cacheReaderEpochs.findRecord(pthread_mach_thread_np(thread));
+        if (record) cacheReaderEpochs.releaseRecord(record);
+    }
 
-// capacity of initial garbage_refs
-enum {
-    INIT_GARBAGE_COUNT = 128
-};
+    if (previousThreadHook) previousThreadHook(event, thread, addr, size);
+}
 
-static void _garbage_make_room(void)
+// True if the record's thread cannot be inside a cache lookup now.
+static bool cacheReaderVouch(objc::EpochRecord *record)
 {
-    static int first = 1;
+    thread_t thread = (thread_t)record->owner.load(std::memory_order_relaxed);
+    if (thread == pthread_mach_thread_np(pthread_self())) return true;
+    return !_thread_in_critical(thread);
+}
 
-    // Create the collection table the first time it is needed
-    if (first)
-    {
-        first = 0;
-        garbage_refs = (bucket_t**)
-            malloc(INIT_GARBAGE_COUNT * sizeof(void *));
-        garbage_max = INIT_GARBAGE_COUNT;
-    }
+void cache_init()
+{
+    if (DisableQuiescentReclaim) return;
+
+    // Called from _objc_init, before any thread but this one exists. 
+    // Registering this thread now and every other one as it starts 
+    // covers them all.
+    cache_reader_tls = tls_create(nil);
+    cacheReaderRegister(pthread_self());
+    previousThreadHook = 
+        pthread_introspection_hook_install(&cacheReaderThreadHook);
+    quiescentReclaim = true;
+}
 
-    // Double the table if it is full
-    else if (garbage_count == garbage_max)
-    {
-        garbage_refs = (bucket_t**)
-            realloc(garbage_refs, garbage_max * 2 * sizeof(void *));
-        garbage_max *= 2;
-    }
+void cache_quiescent()
+{
+    if (!quiescentReclaim) return;
+    auto record = (objc::EpochRecord *)tls_get(cache_reader_tls);
+    if (record) cacheReaderEpochs.quiescent(record);
 }
 
+#else
+
+static bool cacheReaderVouch(objc::EpochRecord *record) { return false; }
+void cache_init() { }
+void cache_quiescent() { }
+
+#endif
+
+
+/***********************************************************************
+* Cache garbage.
+* Replaced buckets waiting for their grace period, with the time each 
+* was retired so that cache_collect() can report how long it took.
+**********************************************************************/
+
+static objc::EpochGarbage garbage;
+
+// The newest reader epoch in the garbage
+static uintptr_t garbage_reader_epoch = 0;
+
+// Do not check lagging threads' PCs until the garbage is this big
+static size_t garbage_threshold = 32*1024;
+
 
 /***********************************************************************
 * cache_collect_free.  Add the specified malloc'd memory to the list
@@ -829,28 +1035,53 @@ static void cache_collect_free(bucket_t *data, mask_t capacity)
 
     if (PrintCaches) recordDeadCache(capacity);
 
-    _garbage_make_room ();
-    garbage_byte_size += cache_t::bytesForCapacity(capacity);
-    garbage_refs[garbage_count++] = data;
+    garbage_reader_epoch = cacheReaderEpochs.current();
+    garbage.retire(data, cache_t::bytesForCapacity(capacity), 
+                   garbage_reader_epoch, nanoseconds());
 }
 
 
 /***********************************************************************
 * cache_collect.  Try to free accumulated dead caches.
-* collectALot tries harder to free memory.
+* Frees whatever has passed its grace period. This runs every time a 
+* cache is replaced, so garbage usually waits for the next replacement 
+* instead of until garbage_threshold bytes have piled up.
+* collectALot waits until all of it can be freed.
 * Cache locks: cacheUpdateLock must be held by the caller.
 **********************************************************************/
 void cache_collect(bool collectALot)
 {
     cacheUpdateLock.assertLocked();
 
-    // Done if the garbage is not full
-    if (garbage_byte_size < garbage_threshold  &&  !collectALot) {
-        return;
-    }
+    if (garbage.pendingCount() == 0) return;
+    bool full = garbage.pendingBytes() >= garbage_threshold;
 
     // Synchronize collection with objc_msgSend and other cache readers
-    if (!collectALot) {
+    if (quiescentReclaim) {
+        // This thread is not in a cache lookup.
+        cache_quiescent();
+
+        // Threads that announced a quiescent state cost nothing to 
+        // check. Reading a lagging thread's PC is dearer, so it waits 
+        // until the garbage is big enough to be worth it.
+        if (full  ||  collectALot) {
+            cacheReaderEpochs.tryAdvance(cacheReaderVouch);
+            cacheReaderEpochs.tryAdvance(cacheReaderVouch);
+        } else {
+            cacheReaderEpochs.tryAdvance();
+            cacheReaderEpochs.tryAdvance();
+        }
+        if (collectALot) {
+            // No excuses.
+            while (!cacheReaderEpochs.isSafe(garbage_reader_epoch)) {
+                cacheReaderEpochs.tryAdvance(cacheReaderVouch);
+            }
+        }
+    }
+    else if (!collectALot) {
+        // Done if the garbage is not full
+        if (!full) return;
+
         if (_collecting_in_critical ()) {
             // objc_msgSend (or other cache reader) is currently looking in
             // the cache and might still be using some garbage.
@@ -867,27 +1098,32 @@ void cache_collect(bool collectALot)
             ;
     }
 
-    // No cache readers in progress - garbage is now deletable
+    // Dispose of the garbage whose readers are done.
+    size_t pending = garbage.pendingBytes();
+    size_t freed = garbage.collect([](uintptr_t epoch) {
+        return !quiescentReclaim  ||  cacheReaderEpochs.isSafe(epoch);
+    }, nanoseconds(), [](void *dead, size_t) {
+        free(dead);
+    });
+
+    if (freed == 0) {
+        if (PrintCaches  &&  full) {
+            _objc_inform ("CACHES: not collecting; "
+                          "objc_msgSend in progress");
+        }
+        return;
+    }
 
     // Log our progress
     if (PrintCaches) {
+        const objc::EpochReclaimStats& r = garbage.stats();
         cache_collections++;
-        _objc_inform ("CACHES: COLLECTING %zu bytes (%zu allocations, %zu collections)", garbage_byte_size, cache_allocations, cache_collections);
-    }
-    
-    // Dispose all refs now in the garbage
-    // Erase each entry so debugging tools don't see stale pointers.
-    while (garbage_count--) {
-        auto dead = garbage_refs[garbage_count];
-        garbage_refs[garbage_count] = nil;
-        free(dead);
-    }
-    
-    // Clear the garbage count and total size indicator
-    garbage_count = 0;
-    garbage_byte_size = 0;
+        _objc_inform ("CACHES: COLLECTING %zu of %zu bytes (%zu allocations, %zu collections)", freed, pending, cache_allocations, cache_collections);
+        _objc_inform ("CACHES: reclaimed %llu caches, average wait %llu ns, longest %llu ns", 
+                      (unsigned long long)r.count, 
+                      (unsigned long long)(r.latencyTotal / r.count), 
+                      (unsigned long long)r.latencyMax);
 
-    if (PrintCaches) {
         size_t i;
         size_t total_count = 0;
         size_t total_size = 0;
@@ -912,6 +1148,39 @@ void cache_collect(bool collectALot)
 }
 
 
+// Adds cls's counters to *stats, or the aggregate counters 
+// and garbage sizes if cls is nil.
+void cache_addCounters_nolock(Class cls, objc_method_cache_statistics *stats)
+{
+    cacheUpdateLock.assertLocked();
+
+    auto add = [stats](const cache_stats_t& c) {
+        stats->misses += c.misses.load(std::memory_order_relaxed);
+        stats->fills += c.fills.load(std::memory_order_relaxed);
+        stats->expansions += c.expansions.load(std::memory_order_relaxed);
+        stats->flushes += c.flushes.load(std::memory_order_relaxed);
+        stats->evictions += c.evictions.load(std::memory_order_relaxed);
+        stats->retained += c.retained.load(std::memory_order_relaxed);
+    };
+
+    if (cls) {
+        if (cls->isRealized()  &&  cls->data()->cacheStats) {
+            add(*cls->data()->cacheStats);
+        }
+        return;
+    }
+
+    cacheStats.forEach(add);
+    const objc::EpochReclaimStats& r = garbage.stats();
+    stats->garbageBytes += garbage.pendingBytes();
+    stats->collectedBytes += r.bytes;
+    stats->reclaims += r.count;
+    stats->reclaimLatency += r.latencyTotal;
+    stats->maxReclaimLatency = 
+        std::max(stats->maxReclaimLatency, r.latencyMax);
+}
+
+
 /***********************************************************************
 * objc_task_threads
 * Replacement for task_threads(). Define DEBUG_TASK_THREADS to debug 
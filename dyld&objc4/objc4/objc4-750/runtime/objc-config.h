@@ -115,6 +115,63 @@
 #   define SUPPORT_NONPOINTER_ISA 1
 #endif
 
+// Define SUPPORT_RC_OVERFLOW_COUNTERS=1 to move the whole retain count of 
+// an object whose isa.extra_rc overflows into an out-of-line atomic counter 
+// (objc-refcount-engine.h), whose index is kept in extra_rc, instead of 
+// moving half of it into the side table. Retain and release of such an 
+// object never take the side table lock. Releases that take the count back 
+// down to RC_HALF return it to extra_rc and free the counter. While 
+// RC_OVERFLOW_COUNTERS objects have counters, further overflows use the 
+// side table as before.
+// This is still being evaluated against the side table (see 
+// bench/refcount-overflow), so it is off unless the build command 
+// turns it on, like OBJC_INSTRUMENTED below.
+// Indexed isa has room for too few counters to be worth it.
+#ifndef SUPPORT_RC_OVERFLOW_COUNTERS
+#   define SUPPORT_RC_OVERFLOW_COUNTERS 0
+#endif
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+#   if !SUPPORT_PACKED_ISA
+#       error SUPPORT_RC_OVERFLOW_COUNTERS requires SUPPORT_PACKED_ISA
+#   endif
+#   define RC_OVERFLOW_COUNTERS 128
+#endif
+
+// Define SUPPORT_BIASED_RC=1 to let classes that implement 
+// +_usesBiasedRefcount count their instances' retains in the instance 
+// itself, without atomics on the allocating thread 
+// (objc-biased-refcount-engine.h). Such objects set has_sidetable_rc 
+// so that retain and release take the out-of-line counter path, and 
+// keep extra_rc at RC_BIASED or above, which no side table or counter 
+// object uses (objc-private.h). hasSideTableRC() leaves them out, so 
+// they have no side table work at dealloc. It rides on 
+// SUPPORT_RC_OVERFLOW_COUNTERS, so it is off unless that is turned on.
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+#   define SUPPORT_BIASED_RC 1
+#else
+#   define SUPPORT_BIASED_RC 0
+#endif
+
+// Define SUPPORT_DEFERRED_DEALLOC=1 to let classes that implement 
+// +_deallocsInBackground, and autorelease pools popped with 
+// objc_autoreleasePoolPopDeferringDealloc(), leave object teardown 
+// after -dealloc to reaper threads (objc-dealloc-queue-engine.h).
+#if __OBJC2__  &&  !TARGET_OS_WIN32
+#   define SUPPORT_DEFERRED_DEALLOC 1
+#else
+#   define SUPPORT_DEFERRED_DEALLOC 0
+#endif
+
+// Define SUPPORT_AUTORELEASE_COALESCING=1 to let OBJC_AUTORELEASE_COALESCING
+// count repeated autoreleases of one object in a single autorelease pool
+// entry (objc-autorelease-coalesce-engine.h). The count is kept in a
+// slot after the entry's pointer.
+#if __LP64__
+#   define SUPPORT_AUTORELEASE_COALESCING 1
+#else
+#   define SUPPORT_AUTORELEASE_COALESCING 0
+#endif
+
 // Define SUPPORT_FIXUP=1 to repair calls sites for fixup dispatch.
 // Fixup messaging itself is no longer supported.
 // Be sure to edit objc-abi.h as well (objc_msgSend*_fixup)
@@ -162,6 +219,16 @@
 #   define SUPPORT_MESSAGE_LOGGING 1
 #endif
 
+// Define WEAK_ENTRY_SIZE to 64 or 128 to make each weak table entry that 
+// many bytes, aligned, with 7 or 15 inline weak references on LP64 
+// (15 or 31 on ILP32) before spilling to a malloc'd hash set. 0 keeps the 
+// original 5-word entry with 4 inline, which is smaller and faster when 
+// most weakly-referenced objects have one weak reference. 
+// bench/weak-entry measures each size.
+#ifndef WEAK_ENTRY_SIZE
+#   define WEAK_ENTRY_SIZE 0
+#endif
+
 // OBJC_INSTRUMENTED controls whether message dispatching is dynamically
 // monitored.  Monitoring introduces substantial overhead.
 // NOTE: To define this condition, do so in the build command, NOT by
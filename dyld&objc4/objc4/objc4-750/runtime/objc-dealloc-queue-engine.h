@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-dealloc-queue-engine.h
+* The queue of dying objects waiting for a background reaper thread.
+*
+* Tearing an object down - .cxx_destruct, which releases its ivars and
+* may tear down a whole object graph, then its associations and weak
+* references - can take a long time. A thread that must not stall can
+* leave that work to reaper threads. DeallocQueue is the hand-off: a
+* FIFO with a bound on both the objects and the bytes it holds. When
+* a push would pass either bound, or while memory is short, it refuses
+* the object and the releasing thread tears it down itself, so the
+* queue never holds more than its bounds however far the reapers fall
+* behind.
+*
+* The queue is a bounded ring that any number of threads may push to
+* and pop from at once without a lock. Each cell carries a sequence
+* number that says whether it is free or full for the current lap
+* around the ring, so a push claims a position with one compare-and-
+* swap and then fills its cell. push() reports when the queue was
+* empty before it, so that its users, whose consumers sleep only while
+* the queue is empty, wake one only then. Its statistics are atomic and
+* may be read at any time.
+**********************************************************************/
+
+#ifndef _OBJC_DEALLOC_QUEUE_ENGINE_H
+#define _OBJC_DEALLOC_QUEUE_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <initializer_list>
+
+namespace objc {
+
+struct DeallocQueueItem {
+    void *object;
+    size_t bytes;
+    uint64_t queuedAt;
+};
+
+// A cell's sequence is 2 * lap while it is free for a push in that lap 
+// of the ring, and 2 * lap + 1 once that push has filled it. Zeroed 
+// memory is a ring of free cells for lap 0.
+struct DeallocQueueCell {
+    std::atomic<size_t> sequence;
+    DeallocQueueItem item;
+};
+
+class DeallocQueue {
+ public:
+    enum { HistogramBuckets = 40 };
+
+    enum Result {
+        Queued,
+        Full,           // the queue holds its most objects
+        TooManyBytes,   // the queue holds its most bytes
+        UnderPressure,  // memory is short; nothing is queued
+    };
+
+    // Totals since init().
+    struct Stats {
+        std::atomic<uint64_t> deferred;
+        std::atomic<uint64_t> reclaimed;
+        std::atomic<uint64_t> refused;
+        std::atomic<uint64_t> maxDepth;
+        std::atomic<uint64_t> maxBytes;
+        // Time from push() to the end of the object's teardown.
+        std::atomic<uint64_t> latencyHistogram[HistogramBuckets];
+    };
+
+ private:
+    DeallocQueueCell *cells;
+    size_t capacity;    // a power of two, or 0
+    unsigned lapShift;  // log2(capacity)
+    size_t byteLimit;
+    std::atomic<bool> pressure;
+
+    // Pushers share one cache line and poppers another.
+    char pad0[64];
+    std::atomic<size_t> tail;       // next position to push
+    std::atomic<size_t> count;      // objects pushed or being pushed
+    std::atomic<size_t> byteCount;  // their bytes
+    char pad1[64 - 3*sizeof(size_t)];
+    std::atomic<size_t> head;       // next position to pop
+    char pad2[64 - sizeof(size_t)];
+    Stats stats;
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+    static void raise(std::atomic<uint64_t>& counter, uint64_t value) {
+        if (value > counter.load(std::memory_order_relaxed)) {
+            counter.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    DeallocQueueCell& cell(size_t pos) { return cells[pos & (capacity - 1)]; }
+    size_t lap(size_t pos) const { return pos >> lapShift; }
+
+    // Adds n to counter unless that would pass limit.
+    static bool reserve(std::atomic<size_t>& counter, size_t n, 
+                        size_t limit, size_t *old) 
+    {
+        size_t value = counter.load(std::memory_order_relaxed);
+        do {
+            if (value + n > limit) return false;
+        } while (!counter.compare_exchange_weak(value, value + n, 
+                                                std::memory_order_acquire, 
+                                                std::memory_order_relaxed));
+        *old = value;
+        return true;
+    }
+
+    Result refuse(Result result) {
+        add(stats.refused, 1);
+        return result;
+    }
+
+ public:
+    // Histogram bucket i counts times in [2^i, 2^(i+1));
+    // bucket 0 also counts 0, and the last bucket counts everything longer.
+    static unsigned histogramBucket(uint64_t time) {
+        unsigned bucket = time ? 63 - __builtin_clzll(time) : 0;
+        return bucket < HistogramBuckets ? bucket : HistogramBuckets - 1;
+    }
+
+    // storage has room for maxObjects cells, is zeroed, and lives as 
+    // long as the queue does. The queue uses the largest power of two 
+    // of them, and leaves them untouched until objects are queued.
+    void init(DeallocQueueCell *storage, size_t maxObjects, size_t maxBytes) {
+        cells = storage;
+        capacity = 0;
+        lapShift = 0;
+        if (maxObjects) {
+            lapShift = 63 - __builtin_clzll((unsigned long long)maxObjects);
+            capacity = (size_t)1 << lapShift;
+        }
+        byteLimit = maxBytes;
+        pressure.store(false, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+        byteCount.store(0, std::memory_order_relaxed);
+        head.store(0, std::memory_order_relaxed);
+
+        for (auto *counter : { &stats.deferred, &stats.reclaimed,
+                               &stats.refused, &stats.maxDepth,
+                               &stats.maxBytes })
+        {
+            counter->store(0, std::memory_order_relaxed);
+        }
+        for (auto& bucket : stats.latencyHistogram) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    size_t limit() const { return capacity; }
+    size_t depth() const { return count.load(std::memory_order_relaxed); }
+    size_t bytes() const { return byteCount.load(std::memory_order_relaxed); }
+    // Also not empty while a push is between claiming its position 
+    // and filling its cell; pop() finds nothing then.
+    bool empty() const { return depth() == 0; }
+    const Stats& statistics() const { return stats; }
+
+    // While memory is short every push() is refused.
+    void setPressure(bool underPressure) { 
+        pressure.store(underPressure, std::memory_order_relaxed);
+    }
+    bool underPressure() const { 
+        return pressure.load(std::memory_order_relaxed); 
+    }
+
+    // Sets *wasEmpty if the object was queued into an empty queue, 
+    // which is when a consumer sleeping until it is not empty 
+    // must be woken.
+    Result push(void *object, size_t bytes, uint64_t now, bool *wasEmpty) {
+        *wasEmpty = false;
+        if (underPressure()) return refuse(UnderPressure);
+
+        size_t oldBytes, oldCount;
+        if (!reserve(byteCount, bytes, byteLimit, &oldBytes)) {
+            return refuse(TooManyBytes);
+        }
+        if (!reserve(count, 1, capacity, &oldCount)) {
+            byteCount.fetch_sub(bytes, std::memory_order_relaxed);
+            return refuse(Full);
+        }
+
+        // count was below capacity, so the cell at tail is free unless 
+        // a pop of its last lap has not yet marked it so. Refuse then 
+        // rather than wait; that pop's count was in oldCount, so the 
+        // queue was not empty and nobody needs waking.
+        size_t pos = tail.load(std::memory_order_relaxed);
+        DeallocQueueCell *c;
+        while (true) {
+            c = &cell(pos);
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            if (seq == 2 * lap(pos)) {
+                if (tail.compare_exchange_weak(pos, pos + 1, 
+                                               std::memory_order_relaxed)) 
+                {
+                    break;
+                }
+            } else if (seq < 2 * lap(pos)) {
+                count.fetch_sub(1, std::memory_order_relaxed);
+                byteCount.fetch_sub(bytes, std::memory_order_relaxed);
+                return refuse(Full);
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        c->item = DeallocQueueItem{object, bytes, now};
+        c->sequence.store(2 * lap(pos) + 1, std::memory_order_release);
+
+        add(stats.deferred, 1);
+        raise(stats.maxDepth, oldCount + 1);
+        raise(stats.maxBytes, oldBytes + bytes);
+        *wasEmpty = oldCount == 0;
+        return Queued;
+    }
+
+    bool pop(DeallocQueueItem *item) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        DeallocQueueCell *c;
+        while (true) {
+            c = &cell(pos);
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            if (seq == 2 * lap(pos) + 1) {
+                if (head.compare_exchange_weak(pos, pos + 1, 
+                                               std::memory_order_relaxed)) 
+                {
+                    break;
+                }
+            } else if (seq < 2 * lap(pos) + 1) {
+                return false;  // empty, or the next push is unfinished
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        *item = c->item;
+        c->sequence.store(2 * (lap(pos) + 1), std::memory_order_release);
+        byteCount.fetch_sub(item->bytes, std::memory_order_relaxed);
+        count.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    // Called once item's object has been torn down.
+    void reclaimed(const DeallocQueueItem& item, uint64_t now) {
+        add(stats.reclaimed, 1);
+        add(stats.latencyHistogram[histogramBucket(now - item.queuedAt)], 1);
+    }
+
+    // Called in a fork child, where the threads that were pushing and 
+    // popping in the parent are gone. Keeps the objects whose push had 
+    // finished and that had not been popped, and forgets the pushes and 
+    // pops that were under way; the parent still finishes those.
+    void forkChild() {
+        size_t pos = head.load(std::memory_order_relaxed);
+        size_t end = tail.load(std::memory_order_relaxed);
+        if (end == 0) return;  // never used; leave the storage untouched
+
+        size_t kept = 0, keptBytes = 0;
+        for (size_t p = pos; p != end; p++) {
+            DeallocQueueCell& c = cell(p);
+            if (c.sequence.load(std::memory_order_relaxed) != 2 * lap(p) + 1) {
+                continue;
+            }
+            cell(pos + kept).item = c.item;
+            keptBytes += c.item.bytes;
+            kept++;
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            size_t p = pos + i;
+            cell(p).sequence.store(2 * lap(p) + (i < kept ? 1 : 0), 
+                                   std::memory_order_relaxed);
+        }
+        tail.store(pos + kept, std::memory_order_relaxed);
+        count.store(kept, std::memory_order_relaxed);
+        byteCount.store(keptBytes, std::memory_order_relaxed);
+    }
+};
+
+} // end namespace objc
+
+#endif
@@ -13,6 +13,8 @@ OPTION( PrintIvars,               OBJC_PRINT_IVAR_SETUP,           "log processi
 OPTION( PrintVtables,             OBJC_PRINT_VTABLE_SETUP,         "log processing of class vtables")
 OPTION( PrintVtableImages,        OBJC_PRINT_VTABLE_IMAGES,        "print vtable images showing overridden methods")
 OPTION( PrintCaches,              OBJC_PRINT_CACHE_SETUP,          "log processing of method caches")
+OPTION( RecordCacheProfile,       OBJC_RECORD_CACHE_PROFILE,       "write method cache contents to OBJC_CACHE_PROFILE at exit")
+OPTION( RecordCacheStatistics,    OBJC_RECORD_CACHE_STATISTICS,    "count method cache misses, fills, expansions, and flushes per class; write them to OBJC_CACHE_STATISTICS at exit")
 OPTION( PrintFuture,              OBJC_PRINT_FUTURE_CLASSES,       "log use of future classes for toll-free bridging")
 OPTION( PrintPreopt,              OBJC_PRINT_PREOPTIMIZATION,      "log preoptimization courtesy of dyld shared cache")
 OPTION( PrintCxxCtors,            OBJC_PRINT_CXX_CTORS,            "log calls to C++ ctors and dtors for instance variables")
@@ -21,7 +23,10 @@ OPTION( PrintExceptionThrow,      OBJC_PRINT_EXCEPTION_THROW,      "log backtrac
 OPTION( PrintAltHandlers,         OBJC_PRINT_ALT_HANDLERS,         "log processing of exception alt handlers")
 OPTION( PrintReplacedMethods,     OBJC_PRINT_REPLACED_METHODS,     "log methods replaced by category implementations")
 OPTION( PrintDeprecation,         OBJC_PRINT_DEPRECATION_WARNINGS, "warn about calls to deprecated runtime functions")
-OPTION( PrintPoolHiwat,           OBJC_PRINT_POOL_HIGHWATER,       "log high-water marks for autorelease pools")
+OPTION( PrintSideTables,          OBJC_PRINT_SIDE_TABLES,          "log side table stripe count (set with OBJC_SIDE_TABLE_STRIPES=n) and contention")
+OPTION( PrintWeakClears,          OBJC_PRINT_WEAK_CLEARS,          "log latency histograms for deallocations of objects with many weak references")
+OPTION( PrintDeferredDealloc,     OBJC_PRINT_DEFERRED_DEALLOC,     "log deferred deallocation queue depth and reclaim latency (set threads with OBJC_DEFERRED_DEALLOC_THREADS=n and queue size with OBJC_DEFERRED_DEALLOC_LIMIT=n)")
+OPTION( PrintPoolHiwat,           OBJC_PRINT_POOL_HIGHWATER,       "log high-water marks for autorelease pools, and autorelease pool page cache use (set with OBJC_POOL_PAGE_CACHE=n and OBJC_POOL_PAGE_CACHE_GLOBAL=n)")
 OPTION( PrintCustomRR,            OBJC_PRINT_CUSTOM_RR,            "log classes with un-optimized custom retain/release methods")
 OPTION( PrintCustomAWZ,           OBJC_PRINT_CUSTOM_AWZ,           "log classes with un-optimized custom allocWithZone methods")
 OPTION( PrintRawIsa,              OBJC_PRINT_RAW_ISA,              "log classes that require raw pointer isa fields")
@@ -42,3 +47,14 @@ OPTION( DisableTaggedPointers,    OBJC_DISABLE_TAGGED_POINTERS,    "disable tagg
 OPTION( DisableTaggedPointerObfuscation, OBJC_DISABLE_TAG_OBFUSCATION,    "disable obfuscation of tagged pointers")
 OPTION( DisableNonpointerIsa,     OBJC_DISABLE_NONPOINTER_ISA,     "disable non-pointer isa fields")
 OPTION( DisableInitializeForkSafety, OBJC_DISABLE_INITIALIZE_FORK_SAFETY, "disable safety checks for +initialize after fork")
+OPTION( DisableNegativeCache,     OBJC_DISABLE_NEGATIVE_CACHE,     "disable remembering selectors that classes do not respond to")
+OPTION( DisableMethodIndex,       OBJC_DISABLE_METHOD_INDEX,       "search method lists one by one instead of using per-class method indexes")
+OPTION( DisableQuiescentReclaim,  OBJC_DISABLE_QUIESCENT_RECLAIM,  "free replaced method caches only after checking every thread's PC, as before")
+OPTION( DisableCacheEviction,     OBJC_DISABLE_CACHE_EVICTION,     "flush whole method caches when one method changes instead of evicting its selector")
+OPTION( DisableBatchedWeakClear,  OBJC_DISABLE_BATCHED_WEAK_CLEAR,  "nil all weak references to a deallocating object under its side table lock")
+OPTION( DisableBiasedRC,          OBJC_DISABLE_BIASED_RC,          "ignore +_usesBiasedRefcount and count every object's retains in its isa")
+OPTION( DisableDeferredDealloc,   OBJC_DISABLE_DEFERRED_DEALLOC,   "ignore +_deallocsInBackground and objc_autoreleasePoolPopDeferringDealloc() and tear down every object on the releasing thread")
+
+OPTION( LockFreeWeakLoad,         OBJC_LOCKFREE_WEAK_LOAD,         "read weak references in objc_loadWeakRetained() without the side table lock; only safe if every weakly-referenced object is freed by object_dispose()")
+OPTION( BatchedPoolDrain,         OBJC_BATCHED_POOL_DRAIN,         "release autorelease pool contents a batch at a time through objc_releaseMany(); objects released to zero are deallocated after the rest of their batch is released")
+OPTION( PoolArenaSuperpages,      OBJC_POOL_ARENA_SUPERPAGES,      "back autorelease pool arenas (set with OBJC_POOL_ARENA=n MB) with superpages where available; superpages stay resident")
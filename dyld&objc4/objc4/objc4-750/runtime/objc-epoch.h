@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-epoch.h
+* Epoch-based reclamation of memory shared with lock-free readers.
+*
+* A thread brackets its use of shared memory with enter() and exit()
+* on its own EpochRecord. Memory that is unlinked while the global
+* epoch is E is "retired at E". It may be freed once the global epoch
+* reaches E+2: every critical section that could have seen it has
+* ended by then. tryAdvance() moves the epoch forward only when every
+* thread inside a critical section has observed the current epoch,
+* so no thread is ever stopped.
+*
+* Readers too hot to bracket every access can use quiescent states
+* instead (QSBR): the thread stays inside one long critical section
+* and calls quiescent() wherever it holds no shared pointers. A thread
+* that has not done so lately can be vouched for by the caller of
+* tryAdvance(), e.g. after checking where it is executing.
+**********************************************************************/
+
+#ifndef _OBJC_EPOCH_H
+#define _OBJC_EPOCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+namespace objc {
+
+// One per participating thread. Records are never freed, only
+// recycled by acquireRecord() after releaseRecord().
+// Padded to a cache line so critical sections on different threads
+// don't contend for the same line.
+struct EpochRecord {
+    // (epoch << 1) | 1 while inside a critical section, 0 otherwise.
+    std::atomic<uintptr_t> state;
+    std::atomic<bool> inUse;
+    EpochRecord *next;
+    // Identifies the owning thread to a tryAdvance() vouch function.
+    std::atomic<uintptr_t> owner;
+    char pad[64 - 3*sizeof(uintptr_t) - sizeof(void *)];
+
+    EpochRecord() : state(0), inUse(false), next(nullptr), owner(0) { }
+};
+static_assert(sizeof(EpochRecord) == 64, "EpochRecord should fill a cache line");
+
+
+class EpochDomain {
+    std::atomic<uintptr_t> epoch;
+    std::atomic<EpochRecord *> records;
+
+ public:
+    constexpr EpochDomain() : epoch(1), records(nullptr) { }
+
+    // Returns a record for the calling thread, reusing a released one
+    // if possible. Callers store it in thread-local storage.
+    EpochRecord *acquireRecord() {
+        for (EpochRecord *r = records.load(std::memory_order_acquire);
+             r != nullptr;
+             r = r->next)
+        {
+            bool expected = false;
+            if (!r->inUse.load(std::memory_order_relaxed)  &&
+                r->inUse.compare_exchange_strong(expected, true,
+                                                 std::memory_order_acquire))
+            {
+                return r;
+            }
+        }
+
+        EpochRecord *r = new EpochRecord;
+        r->inUse.store(true, std::memory_order_relaxed);
+        EpochRecord *head = records.load(std::memory_order_relaxed);
+        do {
+            r->next = head;
+        } while (!records.compare_exchange_weak(head, r,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+        return r;
+    }
+
+    // Called when the owning thread exits.
+    void releaseRecord(EpochRecord *r) {
+        r->state.store(0, std::memory_order_release);
+        r->inUse.store(false, std::memory_order_release);
+    }
+
+    // The record in use whose owner is owner, or nullptr.
+    // For threads that exit after their thread-local storage is gone.
+    EpochRecord *findRecord(uintptr_t owner) const {
+        for (EpochRecord *r = records.load(std::memory_order_acquire);
+             r != nullptr;
+             r = r->next)
+        {
+            if (r->inUse.load(std::memory_order_acquire)  &&  
+                r->owner.load(std::memory_order_relaxed) == owner) 
+            {
+                return r;
+            }
+        }
+        return nullptr;
+    }
+
+    void enter(EpochRecord *r) {
+        uintptr_t e = epoch.load(std::memory_order_relaxed);
+        r->state.store((e << 1) | 1, std::memory_order_relaxed);
+        // Order the announcement before any load of shared pointers.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void exit(EpochRecord *r) {
+        r->state.store(0, std::memory_order_release);
+    }
+
+    // QSBR: the calling thread holds no shared pointers loaded before 
+    // this call. It stays inside its critical section.
+    // Cheaper than enter(): the acquire load of the epoch orders the 
+    // thread's later loads after whatever unlinked the garbage.
+    void quiescent(EpochRecord *r) {
+        uintptr_t e = epoch.load(std::memory_order_acquire);
+        r->state.store((e << 1) | 1, std::memory_order_release);
+    }
+
+    uintptr_t current() const {
+        return epoch.load(std::memory_order_acquire);
+    }
+
+    // Advance the global epoch if every thread inside a critical
+    // section has observed the current one. Returns the epoch
+    // afterwards, which may have been advanced by another caller.
+    uintptr_t tryAdvance() {
+        return tryAdvance([](EpochRecord *) { return false; });
+    }
+
+    // Like tryAdvance(), but a thread that has not observed the current
+    // epoch still counts if vouch(record) returns true. vouch must only 
+    // return true if that thread holds no shared pointers right now, 
+    // so it is only for QSBR readers.
+    template <typename Vouch>
+    uintptr_t tryAdvance(Vouch vouch) {
+        uintptr_t e = epoch.load(std::memory_order_seq_cst);
+        for (EpochRecord *r = records.load(std::memory_order_acquire);
+             r != nullptr;
+             r = r->next)
+        {
+            uintptr_t s = r->state.load(std::memory_order_seq_cst);
+            if ((s & 1)  &&  (s >> 1) != e) {
+                if (!vouch(r)) return e;
+                // Announce for it. If it announced or left in the 
+                // meantime, it did so without old pointers too.
+                r->state.compare_exchange_strong(s, (e << 1) | 1,
+                                                 std::memory_order_seq_cst);
+            }
+        }
+        if (epoch.compare_exchange_strong(e, e + 1,
+                                          std::memory_order_seq_cst))
+        {
+            return e + 1;
+        }
+        return e;
+    }
+
+    // Returns true if memory retired at epoch `retired` can be freed.
+    bool isSafe(uintptr_t retired) const {
+        return current() >= retired + 2;
+    }
+};
+
+
+// Scoped critical section.
+class EpochGuard {
+    EpochDomain& domain;
+    EpochRecord *record;
+ public:
+    EpochGuard(EpochDomain& d, EpochRecord *r) : domain(d), record(r) {
+        domain.enter(record);
+    }
+    ~EpochGuard() { domain.exit(record); }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator = (const EpochGuard&) = delete;
+};
+
+
+/***********************************************************************
+* EpochGarbage
+* Memory waiting for its epoch to expire, oldest first.
+* Not thread-safe: callers serialize retire() and collect() with
+* their own lock. Because the lock orders retirements, their epochs 
+* never decrease, and collect() stops at the first entry that is not 
+* yet safe instead of examining all of them.
+*
+* Callers that pass the time to retire() and collect() get the 
+* reclamation latency - retirement to disposal - in stats().
+* Any monotonic clock will do; the unit is the caller's.
+**********************************************************************/
+struct EpochReclaimStats {
+    uint64_t count;         // entries disposed
+    uint64_t bytes;         // bytes disposed
+    uint64_t latencyTotal;  // sum of retire-to-dispose times
+    uint64_t latencyMax;
+};
+
+class EpochGarbage {
+    struct Entry {
+        void *ptr;
+        size_t bytes;
+        uintptr_t epoch;
+        uint64_t retiredAt;
+    };
+
+    Entry *entries;
+    size_t head;      // entries[head, count) are pending
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    EpochReclaimStats reclaimed;
+
+ public:
+    constexpr EpochGarbage()
+        : entries(nullptr), head(0), count(0), capacity(0), bytes(0), 
+          reclaimed{0, 0, 0, 0} { }
+
+    size_t pendingCount() const { return count - head; }
+    size_t pendingBytes() const { return bytes; }
+    const EpochReclaimStats& stats() const { return reclaimed; }
+
+    void retire(void *ptr, size_t size, uintptr_t epoch, uint64_t now = 0) {
+        if (count == capacity) {
+            if (head > 0) {
+                memmove(entries, entries + head, 
+                        (count - head) * sizeof(Entry));
+                count -= head;
+                head = 0;
+            } else {
+                capacity = capacity ? capacity * 2 : 128;
+                entries = (Entry *)realloc(entries, capacity * sizeof(Entry));
+            }
+        }
+        entries[count++] = Entry{ptr, size, epoch, now};
+        bytes += size;
+    }
+
+    // Calls dispose(ptr, bytes) for each entry, oldest first, until 
+    // isSafe(epoch) returns false. isSafe must never return true for 
+    // one epoch and false for an older one.
+    // Returns the number of bytes disposed.
+    template <typename Safe, typename Fn>
+    size_t collect(Safe isSafe, uint64_t now, Fn dispose) {
+        size_t freed = 0;
+        for ( ; head < count  &&  isSafe(entries[head].epoch); head++) {
+            Entry& e = entries[head];
+            dispose(e.ptr, e.bytes);
+            freed += e.bytes;
+            uint64_t latency = now - e.retiredAt;
+            reclaimed.count++;
+            reclaimed.latencyTotal += latency;
+            if (latency > reclaimed.latencyMax) {
+                reclaimed.latencyMax = latency;
+            }
+        }
+        if (head == count) head = count = 0;
+        bytes -= freed;
+        reclaimed.bytes += freed;
+        return freed;
+    }
+
+    // Calls dispose(ptr, bytes) for every entry whose epoch has expired
+    // in domain. Returns the number of bytes disposed.
+    template <typename Fn>
+    size_t collect(const EpochDomain& domain, Fn dispose, uint64_t now = 0) {
+        return collect([&domain](uintptr_t e) { return domain.isSafe(e); },
+                       now, dispose);
+    }
+
+    // Frees the entry array of garbage that is about to be discarded.
+    // Nothing may be pending.
+    void freeStorage() {
+        free(entries);
+        entries = nullptr;
+        head = count = capacity = 0;
+    }
+};
+
+} // end namespace objc
+
+#endif
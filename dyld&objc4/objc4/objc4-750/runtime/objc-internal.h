@@ -100,6 +100,116 @@ OBJC_EXPORT void
 instrumentObjcMessageSends(BOOL flag)
     OBJC_AVAILABLE(10.0, 2.0, 9.0, 1.0, 2.0);
 
+// Write the class and selector of every method cache entry to path.
+// A later launch with OBJC_CACHE_PROFILE=path presizes and fills 
+// those caches as the classes are realized and initialized.
+// Returns false if the file could not be written.
+OBJC_EXPORT bool
+_objc_writeMethodCacheProfile(const char * _Nonnull path)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+// Method cache counters and contents. 
+// See _objc_getMethodCacheStatistics().
+struct objc_method_cache_statistics {
+    uint64_t misses;          // lookups that missed the method cache
+    uint64_t fills;           // entries added
+    uint64_t expansions;      // caches grown because they were full
+    uint64_t flushes;         // caches erased because methods changed
+    uint64_t evictions;       // entries evicted for one changed selector
+    uint64_t retained;        // entries kept that a flush would have erased
+    uint64_t capacity;        // buckets now allocated
+    uint64_t entries;         // buckets now in use
+    uint64_t probes;          // buckets examined by one hit on every entry
+    uint64_t maxProbes;       // buckets examined by the slowest hit
+    uint64_t garbageBytes;    // replaced caches not yet freed (aggregate only)
+    uint64_t collectedBytes;  // replaced caches freed so far (aggregate only)
+    uint64_t reclaims;        // replaced caches freed so far (aggregate only)
+    uint64_t reclaimLatency;  // total time from replacement to free, in 
+                              // mach_absolute_time units (aggregate only)
+    uint64_t maxReclaimLatency; // longest such time (aggregate only)
+};
+
+// Fill *stats for cls's method cache, or for every method cache if 
+// cls is nil. Counters are totals since launch. The aggregate counters 
+// are always kept; per-class counters stay zero unless 
+// OBJC_RECORD_CACHE_STATISTICS is set. objc_msgSend's hits are not 
+// counted, but probes / entries is the average cost of a hit.
+OBJC_EXPORT void
+_objc_getMethodCacheStatistics(Class _Nullable cls, 
+                               struct objc_method_cache_statistics * _Nonnull stats)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+// Write method cache statistics to path as tab-separated values: 
+// a header line, the aggregate as class "*", then each class whose 
+// cache is in use or has counters. Returns false if the file could 
+// not be written.
+OBJC_EXPORT bool
+_objc_writeMethodCacheStatistics(const char * _Nonnull path)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+// Side table lock stripe statistics. Counters are totals since launch.
+struct objc_side_table_stripe_statistics {
+    uint64_t acquires;     // times the stripe's lock was taken
+    uint64_t contentions;  // acquisitions that found it already held
+    uint64_t refcounts;    // objects with retain counts in the stripe
+    uint64_t weakEntries;  // weakly-referenced objects in the stripe
+};
+
+// Fill stats for up to count stripes. Returns the number of stripes.
+OBJC_EXPORT unsigned
+_objc_getSideTableStatistics(struct objc_side_table_stripe_statistics * _Nullable stats,
+                             unsigned count)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+// Statistics for deallocations of objects with more than 1024 weak 
+// references. Counters are totals since launch. Times are in 
+// mach_absolute_time units; histogram bucket i counts times in 
+// [2^i, 2^(i+1)), bucket 0 also counts 0, and the last bucket 
+// counts everything longer.
+#define OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS 40
+struct objc_weak_clear_statistics {
+    uint64_t clears;      // such objects deallocated
+    uint64_t batched;     // of those, cleared without the side table lock
+    uint64_t referrers;   // weak variables they nilled
+    uint64_t batches;     // batches the batched clears took
+    uint64_t lockHistogram[OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS];
+                          // time the side table lock was held
+    uint64_t clearHistogram[OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS];
+                          // time until every weak variable was nilled
+};
+
+OBJC_EXPORT void
+_objc_getWeakClearStatistics(struct objc_weak_clear_statistics * _Nonnull stats)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+// Statistics for deferred deallocation. Counters are totals since 
+// launch, except depth and bytes. Times are in mach_absolute_time 
+// units, bucketed as for objc_weak_clear_statistics.
+#define OBJC_DEFERRED_DEALLOC_HISTOGRAM_BUCKETS 40
+struct objc_deferred_dealloc_statistics {
+    uint64_t deferred;   // objects queued for a reaper thread
+    uint64_t reclaimed;  // of those, torn down so far
+    uint64_t refused;    // objects torn down at once because the queue 
+                         // was full or memory was short
+    uint64_t depth;      // objects in the queue now
+    uint64_t maxDepth;   // most objects ever in the queue
+    uint64_t bytes;      // bytes of objects in the queue now
+    uint64_t maxBytes;   // most bytes ever in the queue
+    uint64_t latencyHistogram[OBJC_DEFERRED_DEALLOC_HISTOGRAM_BUCKETS];
+                         // time from release until teardown finished
+};
+
+OBJC_EXPORT void
+_objc_getDeferredDeallocStatistics(struct objc_deferred_dealloc_statistics * _Nonnull stats)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+// Tell the runtime whether memory is short. While it is, objects are 
+// torn down on the thread that releases them, and setting it tears 
+// down everything already queued on the calling thread.
+OBJC_EXPORT void
+_objc_setDeferredDeallocUnderPressure(bool underPressure)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
 // Initializer called by libSystem
 OBJC_EXPORT void
 _objc_init(void)
@@ -568,6 +678,34 @@ OBJC_EXPORT BOOL _class_isFutureClass(Class _Nullable cls)
     OBJC_AVAILABLE(10.9, 7.0, 9.0, 1.0, 2.0);
 
 
+// A class whose metaclass implements +_usesBiasedRefcount (with any 
+// implementation; it is never called) counts its instances' retains 
+// without atomics on the thread that allocated each instance. Retains 
+// and releases from other threads cost more, and are merged when the 
+// allocating thread next pops an autorelease pool, allocates another 
+// such instance, releases its own last reference, or exits, so an 
+// instance released last by another thread is deallocated then. A 
+// thread with OBJC_BIASED_RC_LIMIT (default 4096) instances not yet 
+// merged allocates new ones as if they were allocated elsewhere, which 
+// bounds what a thread that does none of those keeps alive. 
+// Subclasses inherit this. Instances may not change class to one that 
+// does not. OBJC_DISABLE_BIASED_RC=YES turns it off.
+
+// A class whose metaclass implements +_deallocsInBackground (with any 
+// implementation; it is never called) has its instances' teardown 
+// after -dealloc - C++ ivar destructors and ARC ivar releases, 
+// associated objects, weak references, and freeing the memory - 
+// done on a background thread instead of the releasing thread. 
+// -dealloc itself still runs on the releasing thread, but the ivars 
+// and associated objects are released on the background thread, so 
+// the -dealloc of any of them released for the last time runs there 
+// too. Subclasses inherit this. When too much is queued, or while 
+// memory is short (see _objc_setDeferredDeallocUnderPressure()), the 
+// releasing thread does the teardown itself. 
+// OBJC_DEFERRED_DEALLOC_THREADS and OBJC_DEFERRED_DEALLOC_LIMIT set the 
+// number of threads and the most objects queued, rounded down to a 
+// power of two; OBJC_DISABLE_DEFERRED_DEALLOC=YES turns it off.
+
 // API to only be called by root classes like NSObject or NSProxy
 
 OBJC_EXPORT
@@ -650,6 +788,14 @@ void
 objc_autoreleasePoolPop(void * _Nonnull context)
     OBJC_AVAILABLE(10.7, 5.0, 9.0, 1.0, 2.0);
 
+// Like objc_autoreleasePoolPop(), but objects the pop deallocates are 
+// torn down in the background as if their classes implemented 
+// +_deallocsInBackground.
+OBJC_EXPORT
+void
+objc_autoreleasePoolPopDeferringDealloc(void * _Nonnull context)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
 
 OBJC_EXPORT id _Nullable
 objc_alloc(Class _Nullable cls)
@@ -674,6 +820,19 @@ objc_autorelease(id _Nullable obj)
     __asm__("_objc_autorelease")
     OBJC_AVAILABLE(10.7, 5.0, 9.0, 1.0, 2.0);
 
+// Retain or release each of count objects, as objc_retain() and 
+// objc_release() would one at a time. Nil and tagged pointers are 
+// skipped. An object may appear more than once. Objects released 
+// to zero are deallocated before objc_releaseMany() returns, but not 
+// necessarily in array order.
+OBJC_EXPORT void
+objc_retainMany(id _Nullable const * _Nonnull objects, size_t count)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
+OBJC_EXPORT void
+objc_releaseMany(id _Nullable const * _Nonnull objects, size_t count)
+    OBJC_AVAILABLE(10.15, 13.0, 13.0, 6.0, 4.0);
+
 // Prepare a value at +1 for return through a +0 autoreleasing convention.
 OBJC_EXPORT id _Nullable
 objc_autoreleaseReturnValue(id _Nullable obj)
@@ -42,10 +42,16 @@ extern recursive_mutex_t loadMethodLock;
 extern mutex_t crashlog_lock;
 extern spinlock_t objcMsgLogLock;
 extern mutex_t AltHandlerDebugLock;
-extern mutex_t AssociationsManagerLock;
 extern StripedMap<spinlock_t> PropertyLocks;
 extern StripedMap<spinlock_t> StructLocks;
 extern StripedMap<spinlock_t> CppObjectLocks;
+extern StripedMap<spinlock_t> WeakLocationLocks;
+extern StripedMap<spinlock_t> WeakClearLocks;
+extern StripedMap<spinlock_t> AssociationsLocks;
+#if SUPPORT_DEFERRED_DEALLOC
+extern monitor_t DeferredDeallocLock;
+#endif
+extern mutex_t PoolPageCacheLock;
 
 // SideTable lock is buried awkwardly. Call a function to manipulate it.
 extern void SideTableLockAll();
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-method-index-engine.h
+* Method list search and the per-class method index.
+*
+* getMethodNoSuper_nolock() searches a class's method lists in order
+* and returns the first match, which is how category methods override
+* class methods. A class with many lists can instead build a
+* method_index_tt once: a flat open-addressed table from selector to
+* the method that list search would have found.
+*
+* A class with one large method list can instead keep a sel_shadow_t:
+* a copy of just that list's selectors, searched with SIMD compares
+* where available.
+**********************************************************************/
+
+#ifndef _OBJC_METHOD_INDEX_ENGINE_H
+#define _OBJC_METHOD_INDEX_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#if __x86_64__  &&  __AVX2__
+#   include <immintrin.h>
+#elif __x86_64__  &&  __SSE2__
+#   include <emmintrin.h>
+#endif
+
+namespace objc {
+
+/***********************************************************************
+* sorted_method_search
+* Binary search of count methods sorted by selector address.
+* Returns the *first* method with the given name, or nullptr.
+* Method must have a `name` field.
+**********************************************************************/
+template <typename Method, typename Key>
+static inline const Method *
+sorted_method_search(const Method *first, uint32_t count, Key key)
+{
+    const Method *base = first;
+    const Method *probe;
+    uintptr_t keyValue = (uintptr_t)key;
+
+    for ( ; count != 0; count >>= 1) {
+        probe = base + (count >> 1);
+
+        uintptr_t probeValue = (uintptr_t)probe->name;
+
+        if (keyValue == probeValue) {
+            // `probe` is a match.
+            // Rewind looking for the *first* occurrence of this value.
+            // This is required for correct category overrides.
+            while (probe > first && keyValue == (uintptr_t)probe[-1].name) {
+                probe--;
+            }
+            return probe;
+        }
+
+        if (keyValue > probeValue) {
+            base = probe + 1;
+            count--;
+        }
+    }
+
+    return nullptr;
+}
+
+
+/***********************************************************************
+* method_index_tt
+* Flat hash table from selector to method, built once from a class's
+* method lists and discarded whenever those lists change.
+* Keys are selectors; 0 marks an empty slot.
+* Not thread-safe: the runtime reads and writes it under runtimeLock.
+**********************************************************************/
+template <typename Key, typename Method>
+class method_index_tt {
+    struct entry {
+        Key key;
+        Method *method;
+    };
+
+    uint32_t mask;
+    uint32_t count;
+    entry entries[1];  // really mask+1 entries
+
+    // Selectors are addresses of packed strings.
+    // Multiply to spread their low bits.
+    static uint32_t hash(Key key) {
+        uint64_t k = (uint64_t)(uintptr_t)key;
+        return (uint32_t)((k * 0x9e3779b97f4a7c15ull) >> 32);
+    }
+
+    method_index_tt() = delete;
+
+ public:
+    // Room for methodCount entries at no more than half full.
+    static size_t byteSizeForCount(uint32_t methodCount) {
+        uint32_t capacity = 4;
+        while (capacity < methodCount * 2) capacity *= 2;
+        return sizeof(method_index_tt) + (capacity - 1) * sizeof(entry);
+    }
+
+    static method_index_tt *create(uint32_t methodCount) {
+        size_t size = byteSizeForCount(methodCount);
+        auto result = (method_index_tt *)calloc(size, 1);
+        result->mask =
+            (uint32_t)((size - sizeof(method_index_tt)) / sizeof(entry));
+        return result;
+    }
+
+    uint32_t capacity() const { return mask + 1; }
+    uint32_t size() const { return count; }
+    size_t byteSize() const {
+        return sizeof(method_index_tt) + mask * sizeof(entry);
+    }
+
+    // Adds key unless it is already present, so that inserting methods
+    // in search order keeps the first match. Returns false if present.
+    bool insert(Key key, Method *method) {
+        uint32_t i = hash(key) & mask;
+        while (entries[i].key) {
+            if (entries[i].key == key) return false;
+            i = (i + 1) & mask;
+        }
+        entries[i].key = key;
+        entries[i].method = method;
+        count++;
+        return true;
+    }
+
+    Method *find(Key key) const {
+        uint32_t i = hash(key) & mask;
+        while (entries[i].key) {
+            if (entries[i].key == key) return entries[i].method;
+            i = (i + 1) & mask;
+        }
+        return nullptr;
+    }
+};
+
+
+/***********************************************************************
+* sel_shadow_t
+* The selectors of one sorted method list, packed 8 bytes apart
+* instead of sizeof(method_t) apart, followed by Window zeros.
+*
+* find() narrows the search with a branchless binary search until the
+* first match, if any, lies in a window of Window selectors, then
+* compares the whole window at once. The kernel is chosen at compile
+* time: AVX2 (x86_64h) or SSE2 (x86_64), or scalar elsewhere.
+**********************************************************************/
+enum class SelSearchKernel { Scalar, SSE2, AVX2 };
+
+#if __x86_64__  &&  __AVX2__
+static constexpr SelSearchKernel sel_search_kernel = SelSearchKernel::AVX2;
+#elif __x86_64__  &&  __SSE2__
+static constexpr SelSearchKernel sel_search_kernel = SelSearchKernel::SSE2;
+#else
+static constexpr SelSearchKernel sel_search_kernel = SelSearchKernel::Scalar;
+#endif
+
+class sel_shadow_t {
+ public:
+    enum { Window = 8 };
+
+ private:
+    const void *source;
+    uint32_t count;
+    uint32_t reserved;
+    uintptr_t sels[Window];  // really count + Window
+
+    sel_shadow_t() = delete;
+
+    // Returns base such that the first selector >= key 
+    // is in [base, base + Window).
+    uint32_t window(uintptr_t key) const {
+        uint32_t base = 0;
+        uint32_t n = count;
+        while (n >= Window) {
+            uint32_t half = n / 2;
+            base = (sels[base + half] < key) ? base + half : base;
+            n -= half;
+        }
+        return base;
+    }
+
+    // Bit i is set if sels[base + i] == key.
+    template <SelSearchKernel Kernel>
+    uint32_t matches(uintptr_t key, uint32_t base) const {
+        const uintptr_t *w = &sels[base];
+#if __x86_64__  &&  __AVX2__
+        if (Kernel == SelSearchKernel::AVX2) {
+            __m256i k = _mm256_set1_epi64x((long long)key);
+            __m256i lo = _mm256_loadu_si256((const __m256i *)w);
+            __m256i hi = _mm256_loadu_si256((const __m256i *)(w + 4));
+            uint32_t mlo = (uint32_t)_mm256_movemask_pd
+                (_mm256_castsi256_pd(_mm256_cmpeq_epi64(lo, k)));
+            uint32_t mhi = (uint32_t)_mm256_movemask_pd
+                (_mm256_castsi256_pd(_mm256_cmpeq_epi64(hi, k)));
+            return mlo | (mhi << 4);
+        }
+#endif
+#if __x86_64__  &&  __SSE2__
+        if (Kernel == SelSearchKernel::SSE2) {
+            // SSE2 has no 64-bit compare. A 64-bit lane is equal 
+            // when both of its 32-bit halves are.
+            __m128i k = _mm_set1_epi64x((long long)key);
+            uint32_t result = 0;
+            for (unsigned i = 0; i < Window; i += 2) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(w + i));
+                __m128i eq = _mm_cmpeq_epi32(v, k);
+                eq = _mm_and_si128
+                    (eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+                result |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+            }
+            return result;
+        }
+#endif
+        uint32_t result = 0;
+        for (unsigned i = 0; i < Window; i++) {
+            result |= (uint32_t)(w[i] == key) << i;
+        }
+        return result;
+    }
+
+ public:
+    // Method must have a `name` field. The list must be sorted 
+    // and laid out with stride sizeof(Method).
+    template <typename Method>
+    static sel_shadow_t *create(const void *source, 
+                                const Method *first, uint32_t count) 
+    {
+        auto result = (sel_shadow_t *)calloc(byteSizeForCount(count), 1);
+        result->source = source;
+        result->count = count;
+        for (uint32_t i = 0; i < count; i++) {
+            result->sels[i] = (uintptr_t)first[i].name;
+        }
+        return result;
+    }
+
+    static size_t byteSizeForCount(uint32_t count) {
+        return sizeof(sel_shadow_t) + count * sizeof(uintptr_t);
+    }
+
+    // The method list this shadows.
+    const void *list() const { return source; }
+    uint32_t size() const { return count; }
+    size_t byteSize() const { return byteSizeForCount(count); }
+
+    // Index of the first selector equal to key, or -1. key must not be 0.
+    template <SelSearchKernel Kernel = sel_search_kernel>
+    int32_t find(uintptr_t key) const {
+        uint32_t base = window(key);
+        uint32_t m = matches<Kernel>(key, base);
+        return m ? (int32_t)(base + __builtin_ctz(m)) : -1;
+    }
+
+    // outIndexes[i] = find(keys[i]). The searches run in lockstep, 
+    // one level of the binary search at a time for the whole batch, 
+    // so their memory loads overlap instead of waiting on each other.
+    template <SelSearchKernel Kernel = sel_search_kernel>
+    void findMany(const uintptr_t *keys, uint32_t n, 
+                  int32_t *outIndexes) const 
+    {
+        const uint32_t Lanes = 16;
+        uint32_t bases[Lanes];
+
+        for (uint32_t start = 0; start < n; start += Lanes) {
+            uint32_t lanes = (n - start < Lanes) ? n - start : Lanes;
+            const uintptr_t *k = keys + start;
+
+            for (uint32_t i = 0; i < lanes; i++) bases[i] = 0;
+            for (uint32_t len = count; len >= Window; ) {
+                uint32_t half = len / 2;
+                for (uint32_t i = 0; i < lanes; i++) {
+                    bases[i] = (sels[bases[i] + half] < k[i]) 
+                        ? bases[i] + half : bases[i];
+                }
+                len -= half;
+            }
+            for (uint32_t i = 0; i < lanes; i++) {
+                uint32_t m = matches<Kernel>(k[i], bases[i]);
+                outIndexes[start + i] = 
+                    m ? (int32_t)(bases[i] + __builtin_ctz(m)) : -1;
+            }
+        }
+    }
+};
+
+} // end namespace objc
+
+#endif
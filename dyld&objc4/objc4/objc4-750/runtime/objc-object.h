@@ -146,6 +146,21 @@ objc_object::isExtTaggedPointer()
 #endif
 
 
+#if SUPPORT_DEFERRED_DEALLOC
+
+// DEFERRED_DEALLOC_KEY is the depth of objc_autoreleasePoolPopDeferringDealloc() 
+// calls on this thread, or -1 on a reaper thread, which never defers.
+inline bool
+objc_object::shouldDeferDealloc()
+{
+    intptr_t depth = (intptr_t)tls_get_direct(DEFERRED_DEALLOC_KEY);
+    if (depth != 0) return depth > 0;
+    return ISA()->defersDealloc();
+}
+
+#endif
+
+
 #if SUPPORT_NONPOINTER_ISA
 
 inline Class 
@@ -230,6 +245,11 @@ objc_object::initIsa(Class cls, bool nonpointer, bool hasCxxDtor)
         newisa.shiftcls = (uintptr_t)cls >> 3;
 #endif
 
+#if SUPPORT_BIASED_RC
+        // The retain count is biased to this thread.
+        if (slowpath(cls->usesBiasedRC())) biased_rc_init(cls, &newisa);
+#endif
+
         // This write must be performed in a single store in some cases
         // (for example when realizing a class because other threads
         // may simultaneously try to use the class).
@@ -260,9 +280,15 @@ objc_object::changeIsa(Class newCls)
     do {
         transcribeToSideTable = false;
         oldisa = LoadExclusive(&isa.bits);
-        if ((oldisa.bits == 0  ||  oldisa.nonpointer)  &&
-            !newCls->isFuture()  &&  newCls->canAllocNonpointer())
-        {
+        bool nonpointer = (oldisa.bits == 0  ||  oldisa.nonpointer)  &&
+            !newCls->isFuture()  &&  newCls->canAllocNonpointer();
+#if SUPPORT_BIASED_RC
+        // A biased retain count can't be moved to the side table while 
+        // its owner may be changing it. It stays where the isa says it 
+        // is, whatever the new class, so the isa stays nonpointer.
+        if (oldisa.nonpointer  &&  biased_rc(oldisa)) nonpointer = true;
+#endif
+        if (nonpointer) {
             // 0 -> nonpointer
             // nonpointer -> nonpointer
 #if SUPPORT_INDEXED_ISA
@@ -280,6 +306,11 @@ objc_object::changeIsa(Class newCls)
             // isa.nonpointer is part of ISA_MAGIC_VALUE
             newisa.has_cxx_dtor = newCls->hasCxxDtor();
             newisa.shiftcls = (uintptr_t)newCls >> 3;
+#endif
+#if SUPPORT_BIASED_RC
+            if (oldisa.bits == 0  &&  newCls->usesBiasedRC()) {
+                biased_rc_init(newCls, &newisa);
+            }
 #endif
         }
         else if (oldisa.nonpointer) {
@@ -302,8 +333,19 @@ objc_object::changeIsa(Class newCls)
         // Copy oldisa's retain count et al to side table.
         // oldisa.has_assoc: nothing to do
         // oldisa.has_cxx_dtor: nothing to do
-        sidetable_moveExtraRC_nolock(oldisa.extra_rc, 
-                                     oldisa.deallocating, 
+        size_t extra_rc = oldisa.extra_rc;
+        bool isDeallocating = oldisa.deallocating;
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (oldisa.has_sidetable_rc  &&  rc_counter_present(oldisa)) {
+            // The whole retain count is in the counter. Retains and 
+            // releases that reach it from now on are redone with the 
+            // new isa, and wait for the side table lock.
+            size_t rc = rc_counter_freeze(oldisa, &isDeallocating);
+            extra_rc = rc ? rc - 1 : 0;
+        }
+#endif
+        sidetable_moveExtraRC_nolock(extra_rc, 
+                                     isDeallocating, 
                                      oldisa.weakly_referenced);
     }
 
@@ -396,6 +438,20 @@ objc_object::rootIsDeallocating()
 }
 
 
+// has_sidetable_rc, less the biased objects that set it only so that 
+// retain and release find their biased count, and never have side 
+// table data for it. Tells them apart by the isa alone.
+inline bool
+objc_object::hasSideTableRC(isa_t bits)
+{
+    if (fastpath(!bits.has_sidetable_rc)) return false;
+#if SUPPORT_BIASED_RC
+    if (biased_rc(bits)) return false;
+#endif
+    return true;
+}
+
+
 inline void 
 objc_object::clearDeallocating()
 {
@@ -403,7 +459,7 @@ objc_object::clearDeallocating()
         // Slow path for raw pointer isa.
         sidetable_clearDeallocating();
     }
-    else if (slowpath(isa.weakly_referenced  ||  isa.has_sidetable_rc)) {
+    else if (slowpath(isa.weakly_referenced  ||  hasSideTableRC(isa))) {
         // Slow path for non-pointer isa with weak refs and/or side table data.
         clearDeallocating_slow();
     }
@@ -421,17 +477,65 @@ objc_object::rootDealloc()
                  !isa.weakly_referenced  &&  
                  !isa.has_assoc  &&  
                  !isa.has_cxx_dtor  &&  
-                 !isa.has_sidetable_rc))
+                 !hasSideTableRC(isa)))
     {
         assert(!sidetable_present());
         free(this);
     } 
     else {
+#if SUPPORT_DEFERRED_DEALLOC
+        if (slowpath(shouldDeferDealloc())  &&  deferDealloc()) return;
+#endif
         object_dispose((id)this);
     }
 }
 
 
+#if SUPPORT_BIASED_RC
+
+static ALWAYS_INLINE objc::BiasedRCOwner *
+biased_rc_owner()
+{
+    return (objc::BiasedRCOwner *)tls_get_direct(BIASED_RC_KEY);
+}
+
+// Returns the biased retain count of this object, whose nonpointer isa 
+// is bits, or nil if it has none. Reads no class, so that objects 
+// whose count is in the side table or a counter don't pay for it.
+inline objc::BiasedRC *
+objc_object::biased_rc(isa_t bits)
+{
+    if (fastpath(!bits.has_sidetable_rc  ||  bits.extra_rc < RC_BIASED)) {
+        return nil;
+    }
+    return (objc::BiasedRC *)((uint8_t *)this + 
+                              (bits.extra_rc - RC_BIASED) * BIASED_RC_ALIGN);
+}
+
+// The owning thread retains and releases without atomics.
+// Everyone else, and the owner's last release, take the slow path.
+ALWAYS_INLINE id
+objc_object::biased_rc_retain(objc::BiasedRC *rc, bool tryRetain)
+{
+    if (fastpath(rc->ownedBy(biased_rc_owner()))) {
+        rc->retainOwned();
+        return (id)this;
+    }
+    return biased_rc_retain_slow(rc, tryRetain);
+}
+
+ALWAYS_INLINE bool
+objc_object::biased_rc_release(objc::BiasedRC *rc, bool performDealloc)
+{
+    if (fastpath(rc->ownedBy(biased_rc_owner()))  &&  rc->releaseOwned()) {
+        return false;
+    }
+    return biased_rc_release_slow(rc, performDealloc);
+}
+
+#endif
+
+
 // Equivalent to calling [this retain], with shortcuts if there is no override
 inline id 
 objc_object::retain()
@@ -453,6 +557,7 @@ objc_object::retain()
 // tryRetain=true is the -_tryRetain path.
 // handleOverflow=false is the frameless fast path.
 // handleOverflow=true is the framed slow path including overflow to side table
+// and retains of objects whose count is in an out-of-line counter
 // The code is structured this way to prevent duplication.
 
 ALWAYS_INLINE id 
@@ -474,12 +579,23 @@ objc_object::rootRetain(bool tryRetain, bool handleOverflow)
 
     bool sideTableLocked = false;
     bool transcribeToSideTable = false;
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+    bool sideTableRC = false;
+    size_t counterReturns = 0;
+    bool counterFull = false;
+#endif
 
     isa_t oldisa;
     isa_t newisa;
 
+ retry:
     do {
         transcribeToSideTable = false;
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (slowpath(sideTableRC)) {
+            sideTableRC = !rc_counter_returned(counterReturns);
+        }
+#endif
         oldisa = LoadExclusive(&isa.bits);
         newisa = oldisa;
         if (slowpath(!newisa.nonpointer)) {
@@ -494,21 +610,66 @@ objc_object::rootRetain(bool tryRetain, bool handleOverflow)
             if (!tryRetain && sideTableLocked) sidetable_unlock();
             return nil;
         }
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (slowpath(newisa.has_sidetable_rc  &&  !sideTableRC)) {
+            // The retain count may be in an out-of-line counter, 
+            // or biased to the allocating thread.
+            ClearExclusive(&isa.bits);
+#if SUPPORT_BIASED_RC
+            if (objc::BiasedRC *rc = biased_rc(newisa)) {
+                return biased_rc_retain(rc, tryRetain);
+            }
+#endif
+            if (!handleOverflow) return rootRetain_overflow(tryRetain);
+            if (!rc_counter_present(newisa)) {
+                // It is in the side table, and will stay there, 
+                // unless this isa is stale and it just returned inline.
+                sideTableRC = rc_counter_sidetable(&newisa, &counterReturns);
+                goto retry;
+            }
+            if (!tryRetain && sideTableLocked) sidetable_unlock();
+            sideTableLocked = false;
+            id result;
+            if (rc_counter_retain(newisa, tryRetain, &result)) return result;
+            // The count left the counter.
+            goto retry;
+        }
+#endif
         uintptr_t carry;
         newisa.bits = addc(newisa.bits, RC_ONE, 0, &carry);  // extra_rc++
+        bool overflow = carry;
+#if SUPPORT_BIASED_RC
+        // A side table count must not reach the extra_rc values that 
+        // mean a biased count. Only the slow path sees has_sidetable_rc.
+        if (handleOverflow  &&  newisa.has_sidetable_rc  &&  
+            newisa.extra_rc == RC_BIASED)
+        {
+            overflow = true;
+        }
+#endif
 
-        if (slowpath(carry)) {
+        if (slowpath(overflow)) {
             // newisa.extra_rc++ overflowed
             if (!handleOverflow) {
                 ClearExclusive(&isa.bits);
                 return rootRetain_overflow(tryRetain);
             }
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+            if (!newisa.has_sidetable_rc  &&  !counterFull) {
+                // Move the whole retain count to an out-of-line counter.
+                ClearExclusive(&isa.bits);
+                if (rc_counter_overflow(&counterFull)) return (id)this;
+                // No counter is free, or the isa changed.
+                goto retry;
+            }
+#endif
             // Leave half of the retain counts inline and 
             // prepare to copy the other half to the side table.
+            // (Below RC_BIASED, leave what is over RC_HALF.)
             if (!tryRetain && !sideTableLocked) sidetable_lock();
             sideTableLocked = true;
             transcribeToSideTable = true;
-            newisa.extra_rc = RC_HALF;
+            newisa.extra_rc = carry ? RC_HALF : newisa.extra_rc - RC_HALF;
             newisa.has_sidetable_rc = true;
         }
     } while (slowpath(!StoreExclusive(&isa.bits, oldisa.bits, newisa.bits)));
@@ -546,6 +707,7 @@ objc_object::release()
 // 
 // handleUnderflow=false is the frameless fast path.
 // handleUnderflow=true is the framed slow path including side table borrow
+// and releases of objects whose count is in an out-of-line counter
 // The code is structured this way to prevent duplication.
 
 ALWAYS_INLINE bool 
@@ -566,12 +728,21 @@ objc_object::rootRelease(bool performDealloc, bool handleUnderflow)
     if (isTaggedPointer()) return false;
 
     bool sideTableLocked = false;
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+    bool sideTableRC = false;
+    size_t counterReturns = 0;
+#endif
 
     isa_t oldisa;
     isa_t newisa;
 
  retry:
     do {
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (slowpath(sideTableRC)) {
+            sideTableRC = !rc_counter_returned(counterReturns);
+        }
+#endif
         oldisa = LoadExclusive(&isa.bits);
         newisa = oldisa;
         if (slowpath(!newisa.nonpointer)) {
@@ -579,6 +750,33 @@ objc_object::rootRelease(bool performDealloc, bool handleUnderflow)
             if (sideTableLocked) sidetable_unlock();
             return sidetable_release(performDealloc);
         }
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (slowpath(newisa.has_sidetable_rc  &&  !sideTableRC)) {
+            // The retain count may be in an out-of-line counter, 
+            // or biased to the allocating thread.
+            ClearExclusive(&isa.bits);
+#if SUPPORT_BIASED_RC
+            if (objc::BiasedRC *rc = biased_rc(newisa)) {
+                return biased_rc_release(rc, performDealloc);
+            }
+#endif
+            if (!handleUnderflow) return rootRelease_underflow(performDealloc);
+            if (!rc_counter_present(newisa)) {
+                // It is in the side table, and will stay there, 
+                // unless this isa is stale and it just returned inline.
+                sideTableRC = rc_counter_sidetable(&newisa, &counterReturns);
+                goto retry;
+            }
+            if (sideTableLocked) sidetable_unlock();
+            sideTableLocked = false;
+            bool result;
+            if (rc_counter_release(newisa, performDealloc, &result)) {
+                return result;
+            }
+            // The count left the counter.
+            goto retry;
+        }
+#endif
         // don't check newisa.fast_rr; we already called any RR overrides
         uintptr_t carry;
         newisa.bits = subc(newisa.bits, RC_ONE, 0, &carry);  // extra_rc--
@@ -685,6 +883,126 @@ objc_object::rootRelease(bool performDealloc, bool handleUnderflow)
 }
 
 
+// The lock-free case of rootRetain() alone, for retainMany(): 
+// an inline increment that does not overflow. 
+// Returns false, having changed nothing, for every other case.
+ALWAYS_INLINE bool 
+objc_object::rootRetain_inline()
+{
+    isa_t oldisa;
+    isa_t newisa;
+
+    do {
+        oldisa = LoadExclusive(&isa.bits);
+        newisa = oldisa;
+        uintptr_t carry;
+        newisa.bits = addc(newisa.bits, RC_ONE, 0, &carry);  // extra_rc++
+        if (slowpath(!oldisa.nonpointer  ||  carry
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+                     ||  oldisa.has_sidetable_rc
+#endif
+                     )) 
+        {
+            ClearExclusive(&isa.bits);
+            return false;
+        }
+    } while (slowpath(!StoreExclusive(&isa.bits, oldisa.bits, newisa.bits)));
+
+    return true;
+}
+
+
+// The lock-free cases of rootRelease() alone, for releaseMany(): 
+// an inline decrement, or the last release of an object with no 
+// side table retain count. In the latter case the object is marked 
+// deallocating and *shouldDealloc is set; the caller sends -dealloc.
+// Returns false, having changed nothing, for every other case.
+ALWAYS_INLINE bool 
+objc_object::rootRelease_inline(bool *shouldDealloc)
+{
+    isa_t oldisa;
+    isa_t newisa;
+    uintptr_t carry;
+
+    do {
+        oldisa = LoadExclusive(&isa.bits);
+        newisa = oldisa;
+        if (slowpath(!oldisa.nonpointer
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+                     ||  oldisa.has_sidetable_rc
+#endif
+                     )) 
+        {
+            ClearExclusive(&isa.bits);
+            return false;
+        }
+        newisa.bits = subc(newisa.bits, RC_ONE, 0, &carry);  // extra_rc--
+        if (slowpath(carry)) {
+            // Borrowing from the side table and overrelease errors 
+            // are left to rootRelease().
+            if (oldisa.has_sidetable_rc  ||  oldisa.deallocating) {
+                ClearExclusive(&isa.bits);
+                return false;
+            }
+            newisa = oldisa;
+            newisa.deallocating = true;
+        }
+    } while (slowpath(!StoreReleaseExclusive(&isa.bits, 
+                                             oldisa.bits, newisa.bits)));
+
+    *shouldDealloc = carry;
+    if (slowpath(carry)) __sync_synchronize();
+    return true;
+}
+
+
+// count releases at once, as rootRelease_inline() would one at a time, 
+// for an object that appears count times in a row in releaseMany()'s 
+// batch. Returns false, having changed nothing, if any of them would 
+// need rootRelease().
+ALWAYS_INLINE bool 
+objc_object::rootReleaseMany_inline(uintptr_t count, bool *shouldDealloc)
+{
+    isa_t oldisa;
+    isa_t newisa;
+    bool last;
+
+    do {
+        oldisa = LoadExclusive(&isa.bits);
+        newisa = oldisa;
+        if (slowpath(!oldisa.nonpointer
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+                     ||  oldisa.has_sidetable_rc
+#endif
+                     )) 
+        {
+            ClearExclusive(&isa.bits);
+            return false;
+        }
+        last = (oldisa.extra_rc < count);
+        if (slowpath(last)) {
+            // Only the last of them may take the count below zero, 
+            // and only with nothing to borrow.
+            if (oldisa.extra_rc + 1 != count  ||  
+                oldisa.has_sidetable_rc  ||  oldisa.deallocating) 
+            {
+                ClearExclusive(&isa.bits);
+                return false;
+            }
+            newisa.extra_rc = 0;
+            newisa.deallocating = true;
+        } else {
+            newisa.extra_rc = oldisa.extra_rc - count;
+        }
+    } while (slowpath(!StoreReleaseExclusive(&isa.bits, 
+                                             oldisa.bits, newisa.bits)));
+
+    *shouldDealloc = last;
+    if (slowpath(last)) __sync_synchronize();
+    return true;
+}
+
+
 // Equivalent to [this autorelease], with shortcuts if there is no override
 inline id 
 objc_object::autorelease()
@@ -715,7 +1033,28 @@ objc_object::rootRetainCount()
     sidetable_lock();
     isa_t bits = LoadExclusive(&isa.bits);
     ClearExclusive(&isa.bits);
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+ retry:
+#endif
     if (bits.nonpointer) {
+#if SUPPORT_BIASED_RC
+        objc::BiasedRC *biased;
+        if (bits.has_sidetable_rc  &&  (biased = biased_rc(bits))) {
+            sidetable_unlock();
+            return (uintptr_t)biased->retainCount();
+        }
+#endif
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+        if (bits.has_sidetable_rc  &&  rc_counter_present(bits)) {
+            sidetable_unlock();
+            return rc_counter_retainCount(bits);
+        }
+        size_t returns;
+        if (bits.has_sidetable_rc  &&  !rc_counter_sidetable(&bits, &returns)) {
+            // The count just returned inline, or the isa changed.
+            goto retry;
+        }
+#endif
         uintptr_t rc = 1 + bits.extra_rc;
         if (bits.has_sidetable_rc) {
             rc += sidetable_getExtraRC_nolock();
@@ -868,6 +1207,9 @@ inline void
 objc_object::rootDealloc()
 {
     if (isTaggedPointer()) return;
+#if SUPPORT_DEFERRED_DEALLOC
+    if (slowpath(shouldDeferDealloc())  &&  deferDealloc()) return;
+#endif
     object_dispose((id)this);
 }
 
@@ -105,6 +105,7 @@ class nocopy_t {
 #   include <libkern/OSAtomic.h>
 #   include <libkern/OSCacheControl.h>
 #   include <System/pthread_machdep.h>
+#   include <pthread/introspection.h>
 #   include "objc-probes.h"  // generated dtrace probe definitions.
 
 // Some libc functions call objc_msgSend() 
@@ -380,6 +381,12 @@ extern void _objc_fatal_with_reason(uint64_t reason, uint64_t flags,
 # if SUPPORT_RETURN_AUTORELEASE
 #   define RETURN_DISPOSITION_KEY ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY4)
 # endif
+# if SUPPORT_BIASED_RC
+#   define BIASED_RC_KEY         ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY5)
+# endif
+# if SUPPORT_DEFERRED_DEALLOC
+#   define DEFERRED_DEALLOC_KEY  ((tls_key_t)__PTK_FRAMEWORK_OBJC_KEY6)
+# endif
 #else
 #   define SUPPORT_DIRECT_THREAD_KEYS 0
 #endif
@@ -684,6 +691,12 @@ static bool is_valid_direct_key(tls_key_t k) {
             || k == AUTORELEASE_POOL_KEY
 #   if SUPPORT_RETURN_AUTORELEASE
             || k == RETURN_DISPOSITION_KEY
+#   endif
+#   if SUPPORT_BIASED_RC
+            || k == BIASED_RC_KEY
+#   endif
+#   if SUPPORT_DEFERRED_DEALLOC
+            || k == DEFERRED_DEALLOC_KEY
 #   endif
                );
 }
@@ -769,6 +782,12 @@ class mutex_tt : nocopy_t {
             (&mLock, OS_UNFAIR_LOCK_DATA_SYNCHRONIZATION);
     }
 
+    bool tryLock() {
+        if (!os_unfair_lock_trylock(&mLock)) return false;
+        lockdebug_mutex_lock(this);
+        return true;
+    }
+
     void unlock() {
         lockdebug_mutex_unlock(this);
 
@@ -672,11 +672,17 @@ static void defineLockOrder()
     lockdebug_lock_precedes_lock(&cacheUpdateLock, &crashlog_lock);
     lockdebug_lock_precedes_lock(&objcMsgLogLock, &crashlog_lock);
     lockdebug_lock_precedes_lock(&AltHandlerDebugLock, &crashlog_lock);
-    lockdebug_lock_precedes_lock(&AssociationsManagerLock, &crashlog_lock);
+    AssociationsLocks.precedeLock(&crashlog_lock);
     SideTableLocksPrecedeLock(&crashlog_lock);
     PropertyLocks.precedeLock(&crashlog_lock);
     StructLocks.precedeLock(&crashlog_lock);
     CppObjectLocks.precedeLock(&crashlog_lock);
+    WeakLocationLocks.precedeLock(&crashlog_lock);
+    WeakClearLocks.precedeLock(&crashlog_lock);
+#if SUPPORT_DEFERRED_DEALLOC
+    lockdebug_lock_precedes_lock(&DeferredDeallocLock, &crashlog_lock);
+#endif
+    lockdebug_lock_precedes_lock(&PoolPageCacheLock, &crashlog_lock);
 
     // loadMethodLock precedes everything
     // because it is held while +load methods run
@@ -694,20 +700,28 @@ static void defineLockOrder()
     lockdebug_lock_precedes_lock(&loadMethodLock, &cacheUpdateLock);
     lockdebug_lock_precedes_lock(&loadMethodLock, &objcMsgLogLock);
     lockdebug_lock_precedes_lock(&loadMethodLock, &AltHandlerDebugLock);
-    lockdebug_lock_precedes_lock(&loadMethodLock, &AssociationsManagerLock);
+    AssociationsLocks.succeedLock(&loadMethodLock);
+#if SUPPORT_DEFERRED_DEALLOC
+    // +load may release objects that defer their dealloc.
+    lockdebug_lock_precedes_lock(&loadMethodLock, &DeferredDeallocLock);
+#endif
+    // +load may autorelease objects onto new pool pages.
+    lockdebug_lock_precedes_lock(&loadMethodLock, &PoolPageCacheLock);
     SideTableLocksSucceedLock(&loadMethodLock);
     PropertyLocks.succeedLock(&loadMethodLock);
     StructLocks.succeedLock(&loadMethodLock);
     CppObjectLocks.succeedLock(&loadMethodLock);
+    WeakLocationLocks.succeedLock(&loadMethodLock);
+    WeakClearLocks.succeedLock(&loadMethodLock);
 
-    // PropertyLocks and CppObjectLocks and AssociationManagerLock 
+    // PropertyLocks and CppObjectLocks and AssociationsLocks 
     // precede everything because they are held while objc_retain() 
     // or C++ copy are called.
     // (StructLocks do not precede everything because it calls memmove only.)
     auto PropertyAndCppObjectAndAssocLocksPrecedeLock = [&](const void *lock) {
         PropertyLocks.precedeLock(lock);
         CppObjectLocks.precedeLock(lock);
-        lockdebug_lock_precedes_lock(&AssociationsManagerLock, lock);
+        AssociationsLocks.precedeLock(lock);
     };
 #if __OBJC2__
     PropertyAndCppObjectAndAssocLocksPrecedeLock(&runtimeLock);
@@ -726,10 +740,42 @@ static void defineLockOrder()
 
     SideTableLocksSucceedLocks(PropertyLocks);
     SideTableLocksSucceedLocks(CppObjectLocks);
-    SideTableLocksSucceedLock(&AssociationsManagerLock);
+    SideTableLocksSucceedLocks(AssociationsLocks);
+
+    // Every stripe, not just the first, as for WeakLocationLocks below.
+    {
+        int i = 0;
+        const void *lock;
+        while ((lock = AssociationsLocks.getLock(i++))) {
+            PropertyLocks.precedeLock(lock);
+            CppObjectLocks.precedeLock(lock);
+        }
+    }
+
+    // WeakLocationLocks are held while storeWeak() takes SideTable locks
+    // and looks up -allowsWeakReference, and C++ copies of structs 
+    // with __weak members call storeWeak().
+    auto PropertyAndCppObjectAndAssocLocksPrecedeLocks = 
+        [&](StripedMap<spinlock_t>& locks) {
+        int i = 0;
+        const void *lock;
+        while ((lock = locks.getLock(i++))) {
+            PropertyAndCppObjectAndAssocLocksPrecedeLock(lock);
+        }
+    };
+    PropertyAndCppObjectAndAssocLocksPrecedeLocks(WeakLocationLocks);
+    SideTableLocksSucceedLocks(WeakLocationLocks);
+#if __OBJC2__
+    WeakLocationLocks.precedeLock(&runtimeLock);
+#else
+    WeakLocationLocks.precedeLock(&methodListLock);
+#endif
+    WeakLocationLocks.precedeLock(&classInitLock);
 
-    PropertyLocks.precedeLock(&AssociationsManagerLock);
-    CppObjectLocks.precedeLock(&AssociationsManagerLock);
+    // WeakClearLocks are taken inside SideTable locks by weak pointer 
+    // unregistration, and alone by dealloc clearing weak pointers.
+    PropertyAndCppObjectAndAssocLocksPrecedeLocks(WeakClearLocks);
+    SideTableLocksPrecedeLocks(WeakClearLocks);
     
 #if __OBJC2__
     lockdebug_lock_precedes_lock(&classInitLock, &runtimeLock);
@@ -763,6 +809,9 @@ static void defineLockOrder()
     PropertyLocks.defineLockOrder();
     StructLocks.defineLockOrder();
     CppObjectLocks.defineLockOrder();
+    WeakLocationLocks.defineLockOrder();
+    WeakClearLocks.defineLockOrder();
+    AssociationsLocks.defineLockOrder();
 }
 // LOCKDEBUG
 #endif
@@ -779,9 +828,14 @@ void _objc_atfork_prepare()
     loadMethodLock.lock();
     PropertyLocks.lockAll();
     CppObjectLocks.lockAll();
-    AssociationsManagerLock.lock();
+    AssociationsLocks.lockAll();
+    WeakLocationLocks.lockAll();
     SideTableLockAll();
+    WeakClearLocks.lockAll();
     classInitLock.enter();
+#if SUPPORT_DEFERRED_DEALLOC
+    DeferredDeallocLock.enter();
+#endif
 #if __OBJC2__
     runtimeLock.lock();
     DemangleCacheLock.lock();
@@ -796,6 +850,7 @@ void _objc_atfork_prepare()
     objcMsgLogLock.lock();
     AltHandlerDebugLock.lock();
     StructLocks.lockAll();
+    PoolPageCacheLock.lock();
     crashlog_lock.lock();
 
     lockdebug_assert_all_locks_locked();
@@ -809,9 +864,12 @@ void _objc_atfork_parent()
     CppObjectLocks.unlockAll();
     StructLocks.unlockAll();
     PropertyLocks.unlockAll();
-    AssociationsManagerLock.unlock();
+    WeakLocationLocks.unlockAll();
+    WeakClearLocks.unlockAll();
+    AssociationsLocks.unlockAll();
     AltHandlerDebugLock.unlock();
     objcMsgLogLock.unlock();
+    PoolPageCacheLock.unlock();
     crashlog_lock.unlock();
     loadMethodLock.unlock();
     cacheUpdateLock.unlock();
@@ -825,6 +883,9 @@ void _objc_atfork_parent()
     NXUniqueStringLock.unlock();
     methodListLock.unlock();
     classLock.unlock();
+#endif
+#if SUPPORT_DEFERRED_DEALLOC
+    DeferredDeallocLock.leave();
 #endif
     classInitLock.leave();
 
@@ -843,14 +904,24 @@ void _objc_atfork_child()
     CppObjectLocks.forceResetAll();
     StructLocks.forceResetAll();
     PropertyLocks.forceResetAll();
-    AssociationsManagerLock.forceReset();
+    WeakLocationLocks.forceResetAll();
+    WeakClearLocks.forceResetAll();
+    AssociationsLocks.forceResetAll();
     AltHandlerDebugLock.forceReset();
     objcMsgLogLock.forceReset();
+    PoolPageCacheLock.forceReset();
     crashlog_lock.forceReset();
     loadMethodLock.forceReset();
     cacheUpdateLock.forceReset();
     selLock.forceReset();
     SideTableForceResetAll();
+#if SUPPORT_BIASED_RC
+    biased_rc_fork_child();
+#endif
+#if SUPPORT_DEFERRED_DEALLOC
+    DeferredDeallocLock.forceReset();
+    deferred_dealloc_fork_child();
+#endif
 #if __OBJC2__
     DemangleCacheLock.forceReset();
     runtimeLock.forceReset();
@@ -884,6 +955,11 @@ void _objc_init(void)
     static_init();
     lock_init();
     exception_init();
+#if __OBJC2__
+    cacheProfileInit();
+    cacheStatisticsInit();
+    cache_init();
+#endif
 
     _dyld_objc_notify_register(&map_images, load_images, unmap_image);
 }
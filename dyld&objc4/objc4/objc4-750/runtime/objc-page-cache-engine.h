@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-page-cache-engine.h
+* Free autorelease pool pages kept for reuse.
+*
+* A loop that pushes and pops a pool across a page boundary would
+* otherwise allocate and free an aligned page every time around.
+* Each thread keeps up to threadDepth free pages of its own, with no
+* lock. A thread whose cache is full moves all but half of it to a
+* global pool shared by every thread, and a thread whose cache is empty
+* takes back up to half a cache from it, so a thread that goes back
+* and forth across the same boundary touches the global pool once per
+* half a cache at most. The global pool holds up to globalLimit pages;
+* pages beyond that go back to the allocator.
+*
+* The cache only links pages and counts them; the caller allocates and
+* frees them, and holds a lock around the global pool calls. A free
+* page's first word is its link.
+**********************************************************************/
+
+#ifndef _OBJC_PAGE_CACHE_ENGINE_H
+#define _OBJC_PAGE_CACHE_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <initializer_list>
+
+namespace objc {
+
+struct FreePage {
+    FreePage *next;
+};
+
+// One thread's cache. All zero is empty.
+struct PageCacheThread {
+    FreePage *head;
+    unsigned count;
+};
+
+class PageCache {
+ public:
+    struct Stats {
+        std::atomic<uint64_t> allocated;  // pages from the allocator
+        std::atomic<uint64_t> freed;      // pages back to the allocator
+        std::atomic<uint64_t> reused;     // allocations a cache served
+        std::atomic<uint64_t> cached;     // pages in every cache now
+        std::atomic<uint64_t> maxCached;  // most pages ever cached
+    };
+
+ private:
+    FreePage *globalHead;
+    size_t globalCount;
+    size_t globalLimit;
+    unsigned depth;
+    Stats stats;
+
+    static void add(std::atomic<uint64_t>& counter, int64_t n) {
+        counter.fetch_add((uint64_t)n, std::memory_order_relaxed);
+    }
+
+    void cachedChanged(int64_t n) {
+        uint64_t now = stats.cached.fetch_add((uint64_t)n,
+                                              std::memory_order_relaxed) + n;
+        if (now > stats.maxCached.load(std::memory_order_relaxed)) {
+            stats.maxCached.store(now, std::memory_order_relaxed);
+        }
+    }
+
+ public:
+    void init(unsigned threadDepth, size_t globalPages) {
+        globalHead = nullptr;
+        globalCount = 0;
+        globalLimit = globalPages;
+        depth = threadDepth;
+
+        for (auto *counter : { &stats.allocated, &stats.freed,
+                               &stats.reused, &stats.cached,
+                               &stats.maxCached })
+        {
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+
+    unsigned threadDepth() const { return depth; }
+    const Stats& statistics() const { return stats; }
+
+    // The caller allocated or freed a page itself.
+    void allocated() { add(stats.allocated, 1); }
+    void freed(size_t count) { add(stats.freed, (int64_t)count); }
+
+    // A page from t, or nullptr if t is empty. No lock.
+    void *take(PageCacheThread& t) {
+        FreePage *page = t.head;
+        if (!page) return nullptr;
+        t.head = page->next;
+        t.count--;
+        add(stats.reused, 1);
+        cachedChanged(-1);
+        return page;
+    }
+
+    // Adds page to t and returns true, or returns false if t is full.
+    // No lock.
+    bool put(PageCacheThread& t, void *page) {
+        if (t.count >= depth) return false;
+        FreePage *p = (FreePage *)page;
+        p->next = t.head;
+        t.head = p;
+        t.count++;
+        cachedChanged(1);
+        return true;
+    }
+
+    // A page from the global pool, or nullptr if it is empty.
+    // If t is given, up to half of t's depth more pages move to it.
+    // The caller holds the global pool's lock.
+    void *takeGlobal(PageCacheThread *t) {
+        FreePage *page = globalHead;
+        if (!page) return nullptr;
+        globalHead = page->next;
+        globalCount--;
+        add(stats.reused, 1);
+        cachedChanged(-1);
+
+        if (t) {
+            while (globalHead  &&  t->count < (depth + 1) / 2) {
+                FreePage *p = globalHead;
+                globalHead = p->next;
+                globalCount--;
+                p->next = t->head;
+                t->head = p;
+                t->count++;
+            }
+        }
+        return page;
+    }
+
+    // Moves page, and t's pages beyond half of its depth if t is given,
+    // to the global pool. Returns the list of pages that did not fit,
+    // for the caller to free once it has dropped the lock.
+    // The caller holds the global pool's lock.
+    FreePage *putGlobal(PageCacheThread *t, void *page) {
+        FreePage *overflow = nullptr;
+        size_t overflowCount = 0;
+        auto give = [&](FreePage *p) {
+            if (globalCount < globalLimit) {
+                p->next = globalHead;
+                globalHead = p;
+                globalCount++;
+            } else {
+                p->next = overflow;
+                overflow = p;
+                overflowCount++;
+            }
+        };
+
+        give((FreePage *)page);
+        if (t) {
+            while (t->count > depth / 2) {
+                FreePage *p = t->head;
+                t->head = p->next;
+                t->count--;
+                give(p);
+            }
+        }
+        // page was not counted as cached, and the moved pages were.
+        cachedChanged(1 - (int64_t)overflowCount);
+        return overflow;
+    }
+
+    // Empties t into the global pool, as putGlobal() does.
+    // The caller holds the global pool's lock.
+    FreePage *flush(PageCacheThread& t) {
+        FreePage *overflow = nullptr;
+        while (t.head) {
+            FreePage *p = t.head;
+            t.head = p->next;
+            t.count--;
+            cachedChanged(-1);
+            FreePage *extra = putGlobal(nullptr, p);
+            if (extra) {
+                extra->next = overflow;
+                overflow = extra;
+            }
+        }
+        return overflow;
+    }
+};
+
+} // end namespace objc
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-pool-arena-engine.h
+* A thread's autorelease pool pages, carved from one reserved region.
+*
+* A thread that autoreleases millions of objects allocates a page for
+* every few hundred of them. With an arena, the thread takes its pages
+* in order from a region of address space, so a deep pool is a few
+* contiguous runs of memory, and a new page costs a pointer bump
+* instead of an allocation. The system backs the region only where it
+* is touched.
+*
+* A thread's pages are created and destroyed as a stack: a new page is
+* always the child of the last one, and kill() frees pages deepest
+* first. The arena relies on that and frees only its top page. Freed
+* pages stay resident up to keepBytes above the top, for the next
+* burst; give() hands back anything above that for the caller to
+* return to the system. take() says when it hands out a page that was
+* returned that way, so that the caller can tell the system it is in
+* use again; Darwin's footprint accounting needs MADV_FREE_REUSABLE and
+* MADV_FREE_REUSE in pairs.
+*
+* The caller reserves and releases the region, and returns discarded
+* memory, itself. When the region runs out, the caller starts another
+* arena for the pages that follow and links it as next, so a thread
+* whose pool stays shallow reserves no more than it uses. Pages still
+* come and go in stack order across arenas. An emptied arena stays
+* linked, with keepBytes resident, for the next deep pool; the chain
+* is released when the first arena empties. The arena is used by one
+* thread and takes no lock.
+**********************************************************************/
+
+#ifndef _OBJC_POOL_ARENA_ENGINE_H
+#define _OBJC_POOL_ARENA_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace objc {
+
+class PoolArena {
+    uintptr_t base;
+    uintptr_t limit;
+    uintptr_t top;    // the next page to take
+    uintptr_t dirty;  // the end of the pages touched and not discarded
+    uintptr_t discarded;  // the end of the pages discarded, if beyond dirty
+    size_t pageSize;
+    size_t keepBytes;
+
+ public:
+    PoolArena *next;  // the caller's arena for the pages after these
+
+    // region is aligned to pageSize and lasts as long as the arena.
+    void init(void *region, size_t bytes, size_t page, size_t keep) {
+        next = nullptr;
+        base = top = dirty = discarded = (uintptr_t)region;
+        limit = base + bytes / page * page;
+        pageSize = page;
+        keepBytes = keep;
+    }
+
+    void *region() const { return (void *)base; }
+    size_t regionBytes() const { return limit - base; }
+    size_t pages() const { return (top - base) / pageSize; }
+    size_t residentBytes() const { return dirty - base; }
+    bool empty() const { return top == base; }
+
+    // The page after the last one taken, or nullptr if the region is used 
+    // up. *reuse is set if the page was discarded by give() and the caller 
+    // must tell the system it is in use again.
+    void *take(bool *reuse) {
+        *reuse = false;
+        if (limit - top < pageSize) return nullptr;
+        void *page = (void *)top;
+        *reuse = (top >= dirty  &&  top < discarded);
+        top += pageSize;
+        if (top > dirty) dirty = top;
+        return page;
+    }
+
+    // Whether page is the last page taken, which is the only one give()
+    // accepts.
+    bool isTop(const void *page) const {
+        return top != base  &&  (uintptr_t)page == top - pageSize;
+    }
+
+    // Gives back the last page taken, which must be isTop(). Returns how 
+    // many bytes starting at *discard the caller should return to the 
+    // system, or 0.
+    size_t give(void *page, void **discard) {
+        top = (uintptr_t)page;
+        if (dirty - top <= keepBytes) return 0;
+        uintptr_t keep = top + keepBytes;
+        size_t bytes = dirty - keep;
+        *discard = (void *)keep;
+        if (dirty > discarded) discarded = dirty;
+        dirty = keep;
+        return bytes;
+    }
+};
+
+} // end namespace objc
+
+#endif
@@ -56,6 +56,13 @@ namespace {
     struct SideTable;
 };
 
+#if SUPPORT_BIASED_RC
+namespace objc {
+    struct BiasedRC;
+};
+struct BiasedRCTraits;
+#endif
+
 #include "isa.h"
 
 union isa_t {
@@ -71,6 +78,16 @@ union isa_t {
 #endif
 };
 
+#if SUPPORT_BIASED_RC
+// With has_sidetable_rc set, extra_rc values from RC_BIASED up mean the 
+// retain count is biased, and kept at (extra_rc - RC_BIASED) * 
+// BIASED_RC_ALIGN bytes into the object. Side table and out-of-line 
+// counts stay below RC_BIASED.
+#   define RC_BIASED        (RC_HALF + RC_HALF/2)
+#   define BIASED_RC_ALIGN  16
+#   define BIASED_RC_MAX_OFFSET ((RC_HALF*2 - 1 - RC_BIASED) * BIASED_RC_ALIGN)
+#endif
+
 
 struct objc_object {
 private:
@@ -129,6 +146,12 @@ public:
     bool rootReleaseShouldDealloc();
     uintptr_t rootRetainCount();
 
+    // Implementations of objc_retainMany() and objc_releaseMany()
+    // for at most RetainManyBatch objects, none nil or tagged
+    enum { RetainManyBatch = 128 };
+    static void retainMany(objc_object **objects, size_t count);
+    static void releaseMany(objc_object **objects, size_t count);
+
     // Implementation of dealloc methods
     bool rootIsDeallocating();
     void clearDeallocating();
@@ -147,8 +170,12 @@ private:
     bool rootRelease(bool performDealloc, bool handleUnderflow);
     id rootRetain_overflow(bool tryRetain);
     bool rootRelease_underflow(bool performDealloc);
+    bool rootRetain_inline();
+    bool rootRelease_inline(bool *shouldDealloc);
+    bool rootReleaseMany_inline(uintptr_t count, bool *shouldDealloc);
 
     void clearDeallocating_slow();
+    bool hasSideTableRC(isa_t bits);
 
     // Side table retain count overflow for nonpointer isa
     void sidetable_lock();
@@ -160,6 +187,37 @@ private:
     size_t sidetable_getExtraRC_nolock();
 #endif
 
+#if SUPPORT_RC_OVERFLOW_COUNTERS
+    // Out-of-line retain count for nonpointer isa
+    bool rc_counter_present(isa_t bits);
+    bool rc_counter_sidetable(isa_t *bits, size_t *returns);
+    bool rc_counter_returned(size_t returns);
+    bool rc_counter_overflow(bool *full);
+    bool rc_counter_retain(isa_t bits, bool tryRetain, id *result);
+    bool rc_counter_release(isa_t bits, bool performDealloc, bool *result);
+    void rc_counter_return(isa_t bits);
+    uintptr_t rc_counter_retainCount(isa_t bits);
+    size_t rc_counter_freeze(isa_t bits, bool *isDeallocating);
+#endif
+
+#if SUPPORT_BIASED_RC
+    // Biased retain count for nonpointer isa
+    friend struct BiasedRCTraits;
+    objc::BiasedRC *biased_rc(isa_t bits);
+    void biased_rc_init(Class cls, isa_t *newisa);
+    id biased_rc_retain(objc::BiasedRC *rc, bool tryRetain);
+    bool biased_rc_release(objc::BiasedRC *rc, bool performDealloc);
+    id biased_rc_retain_slow(objc::BiasedRC *rc, bool tryRetain);
+    bool biased_rc_release_slow(objc::BiasedRC *rc, bool performDealloc);
+    bool biased_rc_dealloc(bool performDealloc);
+#endif
+
+#if SUPPORT_DEFERRED_DEALLOC
+    // Teardown on a reaper thread
+    bool shouldDeferDealloc();
+    bool deferDealloc();
+#endif
+
     // Side-table-only retain count
     bool sidetable_isDeallocating();
     void sidetable_clearDeallocating();
@@ -168,10 +226,10 @@ private:
     void sidetable_setWeaklyReferenced_nolock();
 
     id sidetable_retain();
-    id sidetable_retain_slow(SideTable& table);
+    void sidetable_retain_nolock(SideTable& table);
 
     uintptr_t sidetable_release(bool performDealloc = true);
-    uintptr_t sidetable_release_slow(SideTable& table, bool performDealloc = true);
+    bool sidetable_release_nolock(SideTable& table);
 
     bool sidetable_tryRetain();
 
@@ -415,6 +473,7 @@ static inline bool sectnameStartsWith(const char *sectname, const char *prefix){
 /* selectors */
 extern void sel_init(size_t selrefCount);
 extern SEL sel_registerNameNoLock(const char *str, bool copy);
+extern SEL sel_lookUpByName(const char *str);
 
 extern SEL SEL_load;
 extern SEL SEL_initialize;
@@ -436,6 +495,8 @@ extern SEL SEL_tryRetain;
 extern SEL SEL_isDeallocating;
 extern SEL SEL_retainWeakReference;
 extern SEL SEL_allowsWeakReference;
+extern SEL SEL_usesBiasedRefcount;
+extern SEL SEL_deallocsInBackground;
 
 /* preoptimization */
 extern void preopt_init(void);
@@ -541,16 +602,22 @@ extern void gdb_objc_class_changed(Class cls, unsigned long changes, const char
 #undef OPTION
 
 extern void environ_init(void);
+extern void cacheProfileInit(void);
+extern void cacheStatisticsInit(void);
+extern void cache_init(void);
+extern void cache_quiescent(void);
 
 extern void logReplacedMethod(const char *className, SEL s, bool isMeta, const char *catName, IMP oldImp, IMP newImp);
 
 
 // objc per-thread storage
+#include "objc-page-cache-engine.h"
 typedef struct {
     struct _objc_initializing_classes *initializingClasses; // for +initialize
     struct SyncCache *syncCache;  // for @synchronize
     struct alt_handler_list *handlerList;  // for exception alt handlers
     char *printableNames[4];  // temporary demangled names for logging
+    objc::PageCacheThread poolPageCache;  // free autorelease pool pages
 
     // If you add new fields here, don't forget to update 
     // _objc_pthread_destroyspecific()
@@ -575,6 +642,12 @@ extern void _destroySyncCache(struct SyncCache *cache);
 // arr
 extern void arr_init(void);
 extern id objc_autoreleaseReturnValue(id obj);
+#if SUPPORT_BIASED_RC
+extern void biased_rc_fork_child(void);
+#endif
+#if SUPPORT_DEFERRED_DEALLOC
+extern void deferred_dealloc_fork_child(void);
+#endif
 
 // block trampolines
 extern IMP _imp_implementationWithBlockNoCopy(id block);
@@ -738,6 +811,11 @@ class TimeLogger {
     }
 };
 
+#include "objc-stripe-engine.h"
+#if SUPPORT_BIASED_RC
+#include "objc-biased-refcount-engine.h"
+#endif
+
 enum { CacheLineSize = 64 };
 
 // StripedMap<T> is a map of void* -> T, sized appropriately 
@@ -771,6 +849,14 @@ class StripedMap {
         return const_cast<StripedMap<T>>(this)[p]; 
     }
 
+    // For StripedMaps of counters that must be summed.
+    template <typename Fn>
+    void forEach(Fn fn) {
+        for (unsigned int i = 0; i < StripeCount; i++) {
+            fn(array[i].value);
+        }
+    }
+
     // Shortcuts for StripedMaps of locks.
     void lockAll() {
         for (unsigned int i = 0; i < StripeCount; i++) {
@@ -825,6 +911,94 @@ class StripedMap {
 };
 
 
+// ScalableStripedMap<T, MaxStripeCount> is like StripedMap<T>, but 
+// init() chooses the stripe count - from the CPU count unless told 
+// otherwise - and it hashes with objc::stripe_index().
+// Values never move between stripes, so the count cannot change once 
+// the map is in use. Only the chosen stripes are constructed, so the 
+// storage for the rest stays untouched.
+// Has no constructor so that it can live in zero-filled storage 
+// and be used by code that runs before C++ initializers.
+template<typename T, unsigned MaxStripeCount>
+class ScalableStripedMap {
+    struct PaddedT {
+        T value alignas(CacheLineSize);
+    };
+
+    alignas(CacheLineSize) uint8_t storage[MaxStripeCount * sizeof(PaddedT)];
+    unsigned stripeCount;
+
+    PaddedT *array() { return reinterpret_cast<PaddedT *>(storage); }
+
+    unsigned indexForPointer(const void *p) const {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+        return objc::stripe_index(addr, stripeCount);
+    }
+
+ public:
+    // count 0 chooses a count for this machine of at least minCount.
+    void init(unsigned count, unsigned minCount) {
+        if (count == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_CONF);
+            count = objc::stripe_count_for_cpus
+                (cpus > 0 ? (unsigned)cpus : 1, minCount, MaxStripeCount);
+        }
+        if (count > MaxStripeCount) count = MaxStripeCount;
+        stripeCount = count;
+        for (unsigned int i = 0; i < stripeCount; i++) {
+            new (&array()[i]) PaddedT();
+        }
+    }
+
+    unsigned count() const { return stripeCount; }
+
+    // The stripe operator[] returns for p.
+    unsigned stripeIndex(const void *p) const { return indexForPointer(p); }
+
+    T& operator[] (const void *p) { 
+        return array()[indexForPointer(p)].value; 
+    }
+
+    T& stripe(unsigned int i) { return array()[i].value; }
+
+    // Shortcuts for ScalableStripedMaps of locks.
+    void lockAll() {
+        for (unsigned int i = 0; i < stripeCount; i++) {
+            array()[i].value.lock();
+        }
+    }
+
+    void unlockAll() {
+        for (unsigned int i = 0; i < stripeCount; i++) {
+            array()[i].value.unlock();
+        }
+    }
+
+    void forceResetAll() {
+        for (unsigned int i = 0; i < stripeCount; i++) {
+            array()[i].value.forceReset();
+        }
+    }
+
+    void defineLockOrder() {
+        for (unsigned int i = 1; i < stripeCount; i++) {
+            lockdebug_lock_precedes_lock(&array()[i-1].value, 
+                                         &array()[i].value);
+        }
+    }
+
+    void precedeLock(const void *newlock) {
+        // assumes defineLockOrder is also called
+        lockdebug_lock_precedes_lock(&array()[stripeCount-1].value, newlock);
+    }
+
+    void succeedLock(const void *oldlock) {
+        // assumes defineLockOrder is also called
+        lockdebug_lock_precedes_lock(oldlock, &array()[0].value);
+    }
+};
+
+
 // DisguisedPtr<T> acts like pointer type T*, except the 
 // stored value is disguised to hide it from tools like `leaks`.
 // nil is disguised as itself so zero-filled memory works as expected, 
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-refcount-engine.h
+* Out-of-line retain counts for objects whose inline count overflowed.
+*
+* When isa.extra_rc overflows, the side table takes half of the count
+* and every later overflow or borrow takes the stripe lock. An object
+* that is retained and released from many threads at once, such as a
+* singleton or a shared string, can cross those boundaries constantly.
+*
+* Instead such an object can move its whole retain count into a
+* counter of its own, and keep that counter's index in its isa.
+* Retain and release are then one compare-and-swap on a counter no
+* other object shares, with no lock. When releases take the count
+* back down to half the inline limit, the object returns it to its
+* isa and frees the counter for another object.
+*
+* Counters live in a fixed array and are never deallocated, so a
+* counter's memory is always valid to touch. Each counter records
+* its owner; an operation on a counter the object no longer owns
+* must be redone through the object's isa. A counter's word holds:
+*   count         the object's whole retain count, not extra_rc + 1
+*   Deallocating  set by the release that took the count to zero
+*   Moved         set when the count is leaving the counter, for the
+*                 side table because the object's isa became a raw
+*                 pointer, or for the isa on the way back inline; an
+*                 operation that sees it must be redone through the isa
+*   generation    bumped each time the counter is freed, so a
+*                 compare-and-swap by a thread that read the previous
+*                 owner's word fails
+**********************************************************************/
+
+#ifndef _OBJC_REFCOUNT_ENGINE_H
+#define _OBJC_REFCOUNT_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+namespace objc {
+
+// Padded to a cache line so hot objects don't share one.
+struct RefcountCounter {
+    std::atomic<uintptr_t> object;
+    std::atomic<uint64_t> word;
+    char pad[64 - sizeof(uintptr_t) - sizeof(uint64_t)];
+
+    constexpr RefcountCounter() : object(0), word(0), pad{} { }
+};
+static_assert(sizeof(RefcountCounter) == 64,
+              "RefcountCounter should fill a cache line");
+
+
+template <size_t Count>
+class RefcountCounters {
+    RefcountCounter counters[Count];
+    std::atomic<size_t> hint;
+    // Counters left owned by objects whose count moved to the side table.
+    std::atomic<size_t> moved;
+    // Counters freed after their count returned inline. See returns().
+    std::atomic<size_t> returned;
+
+ public:
+    enum : size_t { None = ~(size_t)0 };
+
+    static constexpr uint64_t CountMask = (1ULL << 48) - 1;
+    static constexpr uint64_t Deallocating = 1ULL << 48;
+    static constexpr uint64_t Moved = 1ULL << 49;
+    static constexpr unsigned GenerationShift = 50;
+    static constexpr uint64_t GenerationMask = ~0ULL << GenerationShift;
+
+    enum Result {
+        Done,          // the operation took effect
+        Last,          // release took the count to zero; deallocate
+        Failed,        // tryRetain of a deallocating object
+        MovedAway,     // redo the operation through the object's isa
+        Overreleased,  // release of an object whose count was zero
+    };
+
+    constexpr RefcountCounters() 
+        : counters(), hint(0), moved(0), returned(0) { }
+
+    // Claims a free counter for object, holding count retains.
+    // Returns its index, or None if every counter is in use.
+    size_t alloc(uintptr_t object, uint64_t count) {
+        size_t start = hint.load(std::memory_order_relaxed);
+        for (size_t n = 0; n < Count; n++) {
+            size_t i = (start + n) % Count;
+            RefcountCounter& c = counters[i];
+            uintptr_t expected = 0;
+            if (c.object.load(std::memory_order_relaxed) == 0  &&
+                c.object.compare_exchange_strong(expected, object,
+                                                 std::memory_order_acquire))
+            {
+                uint64_t w = c.word.load(std::memory_order_relaxed);
+                c.word.store((w & GenerationMask) | count,
+                             std::memory_order_release);
+                hint.store(i + 1, std::memory_order_relaxed);
+                return i;
+            }
+        }
+        return None;
+    }
+
+    // Frees a counter from alloc() that is unused or whose object
+    // is done deallocating.
+    void free(size_t i) {
+        RefcountCounter& c = counters[i];
+        uint64_t w = c.word.load(std::memory_order_relaxed);
+        uint64_t generation = (w & GenerationMask) + (1ULL << GenerationShift);
+        c.word.store(generation, std::memory_order_relaxed);
+        c.object.store(0, std::memory_order_release);
+    }
+
+    bool owns(size_t i, uintptr_t object) const {
+        return i < Count  &&
+            counters[i].object.load(std::memory_order_acquire) == object;
+    }
+
+    uint64_t count(size_t i) const {
+        return counters[i].word.load(std::memory_order_relaxed) & CountMask;
+    }
+
+    // Fails if the object no longer owns counter i.
+    Result retain(size_t i, uintptr_t object) {
+        RefcountCounter& c = counters[i];
+        uint64_t w = c.word.load(std::memory_order_acquire);
+        do {
+            if (c.object.load(std::memory_order_acquire) != object) {
+                return MovedAway;
+            }
+            if (w & Moved) return MovedAway;
+        } while (!c.word.compare_exchange_weak(w, w + 1,
+                                               std::memory_order_relaxed,
+                                               std::memory_order_acquire));
+        return Done;
+    }
+
+    // Fails if the object is deallocating, or no longer owns counter i.
+    Result tryRetain(size_t i, uintptr_t object) {
+        RefcountCounter& c = counters[i];
+        uint64_t w = c.word.load(std::memory_order_acquire);
+        do {
+            if (c.object.load(std::memory_order_acquire) != object) {
+                return MovedAway;
+            }
+            if (w & Moved) return MovedAway;
+            if ((w & Deallocating)  ||  (w & CountMask) == 0) return Failed;
+        } while (!c.word.compare_exchange_weak(w, w + 1,
+                                               std::memory_order_relaxed,
+                                               std::memory_order_acquire));
+        return Done;
+    }
+
+    // Fails if the object no longer owns counter i. The count never
+    // goes below zero; a release at zero is Overreleased and changes
+    // nothing. *remaining is the count after a release that is Done.
+    Result release(size_t i, uintptr_t object, uint64_t *remaining) {
+        RefcountCounter& c = counters[i];
+        uint64_t w = c.word.load(std::memory_order_acquire);
+        uint64_t value;
+        Result result;
+        do {
+            if (c.object.load(std::memory_order_acquire) != object) {
+                return MovedAway;
+            }
+            if (w & Moved) return MovedAway;
+            if ((w & CountMask) == 0) return Overreleased;
+            value = w - 1;
+            result = Done;
+            if ((value & CountMask) == 0  &&  !(w & Deallocating)) {
+                // Nobody may retain now but tryRetain(), which fails 
+                // at zero, so this cannot lose a race with one.
+                // A release at zero with Deallocating set balances 
+                // a retain made during dealloc.
+                value |= Deallocating;
+                result = Last;
+            }
+        } while (!c.word.compare_exchange_weak(w, value,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire));
+        *remaining = value & CountMask;
+        return result;
+    }
+
+    // Stops counter i from counting so that its count can return 
+    // to the object's isa, if the object owns it and it holds between 
+    // 1 and limit retains and is not deallocating. Returns whether it 
+    // did, with the count. Later operations on it return MovedAway. 
+    // Call freeReturned() once the isa holds the count, or leave the 
+    // counter frozen for freeze() if the isa became a raw pointer.
+    bool freezeBelow(size_t i, uintptr_t object, uint64_t limit,
+                     uint64_t *count) {
+        RefcountCounter& c = counters[i];
+        uint64_t w = c.word.load(std::memory_order_acquire);
+        do {
+            if (c.object.load(std::memory_order_acquire) != object) {
+                return false;
+            }
+            uint64_t n = w & CountMask;
+            if ((w & (Moved | Deallocating))  ||  n == 0  ||  n > limit) {
+                return false;
+            }
+        } while (!c.word.compare_exchange_weak(w, w | Moved,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire));
+        *count = w & CountMask;
+        return true;
+    }
+
+    // Frees counter i after freezeBelow() and the object's isa 
+    // taking the count back.
+    void freeReturned(size_t i) {
+        returned.fetch_add(1, std::memory_order_release);
+        free(i);
+    }
+
+    // Counts freeReturned() calls. A thread that read an isa naming 
+    // a counter and then found the object no longer owns it can't 
+    // tell whether the count is in the side table or back in the 
+    // isa. If returns() is unchanged between a read before loading 
+    // the isa again and a later one, no count went back inline then.
+    size_t returns() const {
+        return returned.load(std::memory_order_acquire);
+    }
+
+    // Stops counter i from counting. Returns its last count and
+    // whether it was deallocating. Later operations on it return
+    // MovedAway. The object keeps owning the counter until forget().
+    uint64_t freeze(size_t i, bool *deallocating) {
+        RefcountCounter& c = counters[i];
+        uint64_t w = c.word.fetch_or(Moved, std::memory_order_acq_rel);
+        moved.fetch_add(1, std::memory_order_relaxed);
+        *deallocating = (w & Deallocating);
+        return w & CountMask;
+    }
+
+    // Frees a frozen counter owned by object, if any.
+    // Threads may still be returning from a MovedAway operation on it,
+    // so call only once object is done deallocating.
+    void forget(uintptr_t object) {
+        if (moved.load(std::memory_order_relaxed) == 0) return;
+        for (size_t i = 0; i < Count; i++) {
+            if (owns(i, object)  &&
+                (counters[i].word.load(std::memory_order_relaxed) & Moved))
+            {
+                moved.fetch_sub(1, std::memory_order_relaxed);
+                free(i);
+            }
+        }
+    }
+};
+
+} // end namespace objc
+
+#endif
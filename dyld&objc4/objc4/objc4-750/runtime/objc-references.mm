@@ -26,8 +26,8 @@
 
 
 #include "objc-private.h"
+#include "objc-associations-engine.h"
 #include <objc/message.h>
-#include <map>
 
 #if _LIBCPP_VERSION
 #   include <unordered_map>
@@ -86,12 +86,6 @@ namespace objc_references_support {
         }
     };
     
-    struct ObjectPointerLess {
-        bool operator()(const void *p1, const void *p2) const {
-            return p1 < p2;
-        }
-    };
-    
     struct ObjcPointerHash {
         uintptr_t operator()(void *p) const {
             return DisguisedPointerHash()(uintptr_t(p));
@@ -165,16 +159,16 @@ namespace objc_references_support {
         bool hasValue() { return _value != nil; }
     };
 
-#if TARGET_OS_WIN32
-    typedef hash_map<void *, ObjcAssociation> ObjectAssociationMap;
-    typedef hash_map<disguised_ptr_t, ObjectAssociationMap *> AssociationsHashMap;
-#else
-    typedef ObjcAllocator<std::pair<void * const, ObjcAssociation> > ObjectAssociationMapAllocator;
-    class ObjectAssociationMap : public std::map<void *, ObjcAssociation, ObjectPointerLess, ObjectAssociationMapAllocator> {
+    // One object's associations, in a flat array. See objc-associations-engine.h.
+    class ObjectAssociationMap : public objc::AssociationFlatMap<ObjcAssociation> {
     public:
         void *operator new(size_t n) { return ::malloc(n); }
         void operator delete(void *ptr) { ::free(ptr); }
     };
+
+#if TARGET_OS_WIN32
+    typedef hash_map<disguised_ptr_t, ObjectAssociationMap *> AssociationsHashMap;
+#else
     typedef ObjcAllocator<std::pair<const disguised_ptr_t, ObjectAssociationMap*> > AssociationsHashMapAllocator;
     class AssociationsHashMap : public unordered_map<disguised_ptr_t, ObjectAssociationMap *, DisguisedPointerHash, DisguisedPointerEqual, AssociationsHashMapAllocator> {
     public:
@@ -186,27 +180,38 @@ namespace objc_references_support {
 
 using namespace objc_references_support;
 
-// class AssociationsManager manages a lock / hash table singleton pair.
-// Allocating an instance acquires the lock, and calling its assocations()
-// method lazily allocates the hash table.
+// class AssociationsManager manages the lock / hash table pair of the 
+// stripe that an object's associations live in, so that threads working 
+// on different objects' associations rarely wait for each other.
+// Allocating an instance acquires the stripe's lock, and calling its 
+// assocations() method lazily allocates the stripe's hash table.
 
-spinlock_t AssociationsManagerLock;
+StripedMap<spinlock_t> AssociationsLocks;
 
 class AssociationsManager {
-    // associative references: object pointer -> PtrPtrHashMap.
-    static AssociationsHashMap *_map;
+    // associative references: object pointer -> ObjectAssociationMap, 
+    // one hash table per stripe of AssociationsLocks.
+    static StripedMap<AssociationsHashMap *> _maps;
+    spinlock_t &_lock;
+    AssociationsHashMap *&_map;
 public:
-    AssociationsManager()   { AssociationsManagerLock.lock(); }
-    ~AssociationsManager()  { AssociationsManagerLock.unlock(); }
+    AssociationsManager(id object) 
+        : _lock(AssociationsLocks[object]), _map(_maps[object])
+    {
+        _lock.lock();
+    }
+    ~AssociationsManager()  { _lock.unlock(); }
     
     AssociationsHashMap &associations() {
         if (_map == NULL)
             _map = new AssociationsHashMap();
         return *_map;
     }
+
+    bool empty() { return _map == NULL  ||  _map->size() == 0; }
 };
 
-AssociationsHashMap *AssociationsManager::_map = NULL;
+StripedMap<AssociationsHashMap *> AssociationsManager::_maps;
 
 // expanded policy bits.
 
@@ -223,17 +228,15 @@ id _object_get_associative_reference(id object, void *key) {
     id value = nil;
     uintptr_t policy = OBJC_ASSOCIATION_ASSIGN;
     {
-        AssociationsManager manager;
+        AssociationsManager manager(object);
         AssociationsHashMap &associations(manager.associations());
         disguised_ptr_t disguised_object = DISGUISE(object);
         AssociationsHashMap::iterator i = associations.find(disguised_object);
         if (i != associations.end()) {
             ObjectAssociationMap *refs = i->second;
-            ObjectAssociationMap::iterator j = refs->find(key);
-            if (j != refs->end()) {
-                ObjcAssociation &entry = j->second;
-                value = entry.value();
-                policy = entry.policy();
+            if (ObjcAssociation *entry = refs->find(key)) {
+                value = entry->value();
+                policy = entry->policy();
                 if (policy & OBJC_ASSOCIATION_GETTER_RETAIN) {
                     objc_retain(value);
                 }
@@ -273,39 +276,35 @@ void _object_set_associative_reference(id object, void *key, id value, uintptr_t
     ObjcAssociation old_association(0, nil);
     id new_value = value ? acquireValue(value, policy) : nil;
     {
-        AssociationsManager manager;
+        AssociationsManager manager(object);
         AssociationsHashMap &associations(manager.associations());
         disguised_ptr_t disguised_object = DISGUISE(object);
         if (new_value) {
             // break any existing association.
+            ObjectAssociationMap *refs;
             AssociationsHashMap::iterator i = associations.find(disguised_object);
             if (i != associations.end()) {
                 // secondary table exists
-                ObjectAssociationMap *refs = i->second;
-                ObjectAssociationMap::iterator j = refs->find(key);
-                if (j != refs->end()) {
-                    old_association = j->second;
-                    j->second = ObjcAssociation(policy, new_value);
-                } else {
-                    (*refs)[key] = ObjcAssociation(policy, new_value);
-                }
+                refs = i->second;
             } else {
                 // create the new association (first time).
-                ObjectAssociationMap *refs = new ObjectAssociationMap;
+                refs = new ObjectAssociationMap;
                 associations[disguised_object] = refs;
-                (*refs)[key] = ObjcAssociation(policy, new_value);
                 object->setHasAssociatedObjects();
             }
+            bool inserted;
+            ObjcAssociation *entry = refs->insert(key, &inserted);
+            if (!entry) {
+                _objc_fatal("objc_setAssociatedObject: out of memory");
+            }
+            if (!inserted) old_association = *entry;
+            *entry = ObjcAssociation(policy, new_value);
         } else {
             // setting the association to nil breaks the association.
             AssociationsHashMap::iterator i = associations.find(disguised_object);
             if (i !=  associations.end()) {
                 ObjectAssociationMap *refs = i->second;
-                ObjectAssociationMap::iterator j = refs->find(key);
-                if (j != refs->end()) {
-                    old_association = j->second;
-                    refs->erase(j);
-                }
+                refs->erase(key, &old_association);
             }
         }
     }
@@ -316,16 +315,16 @@ void _object_set_associative_reference(id object, void *key, id value, uintptr_t
 void _object_remove_assocations(id object) {
     vector< ObjcAssociation,ObjcAllocator<ObjcAssociation> > elements;
     {
-        AssociationsManager manager;
+        AssociationsManager manager(object);
+        if (manager.empty()) return;
         AssociationsHashMap &associations(manager.associations());
-        if (associations.size() == 0) return;
         disguised_ptr_t disguised_object = DISGUISE(object);
         AssociationsHashMap::iterator i = associations.find(disguised_object);
         if (i != associations.end()) {
             // copy all of the associations that need to be removed.
             ObjectAssociationMap *refs = i->second;
-            for (ObjectAssociationMap::iterator j = refs->begin(), end = refs->end(); j != end; ++j) {
-                elements.push_back(j->second);
+            for (auto& entry : *refs) {
+                elements.push_back(entry.value);
             }
             // remove the secondary table.
             delete refs;
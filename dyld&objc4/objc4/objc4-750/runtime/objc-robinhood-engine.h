@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-robinhood-engine.h
+* Open addressing with linear probing, Robin Hood insertion, and
+* backward-shift deletion, for the weak table and its referrer sets.
+*
+* A slot's displacement is how far it sits past the slot its hash
+* picks. Insertion gives each slot to whichever item is displaced
+* further, so displacements stay short and even. Deletion moves the
+* following items of the run back one slot instead of leaving a hole,
+* so there are no tombstones: a lookup stops at the first empty slot,
+* or at the first item displaced less than the lookup has probed,
+* because the key would have taken that item's slot.
+*
+* The caller keeps the largest displacement ever inserted, which
+* old code and heap tools use to bound a scan. Lookups also honor it.
+**********************************************************************/
+
+#ifndef _OBJC_ROBINHOOD_ENGINE_H
+#define _OBJC_ROBINHOOD_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace objc {
+
+// Traits supplies:
+//   typedef ... Slot;                      a table element
+//   typedef ... Key;
+//   static bool empty(const Slot&);
+//   static Key key(const Slot&);
+//   static uintptr_t hash(Key);
+//   static void move(Slot& dst, const Slot& src);
+//   static void swap(Slot& a, Slot& b);
+//   static void clear(Slot&);
+template <typename Traits>
+struct RobinHood {
+    typedef typename Traits::Slot Slot;
+    typedef typename Traits::Key Key;
+
+    enum : size_t { NotFound = ~(size_t)0 };
+
+    static size_t displacement(const Slot& slot, size_t index, size_t mask) {
+        return (index - Traits::hash(Traits::key(slot))) & mask;
+    }
+
+    // Inserts item, which must not already be present, into a table
+    // with at least one empty slot. item is used as scratch space and
+    // holds some other displaced value afterwards. Returns false if
+    // the table had no empty slot.
+    static bool insert(Slot *slots, size_t mask, Slot& item,
+                       uintptr_t *maxDisplacement)
+    {
+        size_t index = Traits::hash(Traits::key(item)) & mask;
+        size_t distance = 0;
+        for (size_t probes = 0; probes <= mask; probes++) {
+            Slot& slot = slots[index];
+            if (Traits::empty(slot)) {
+                Traits::move(slot, item);
+                if (distance > *maxDisplacement) *maxDisplacement = distance;
+                return true;
+            }
+            size_t resident = displacement(slot, index, mask);
+            if (resident < distance) {
+                // Take the slot from an item closer to home,
+                // and carry that one on instead.
+                Traits::swap(slot, item);
+                if (distance > *maxDisplacement) *maxDisplacement = distance;
+                distance = resident;
+            }
+            index = (index + 1) & mask;
+            distance++;
+        }
+        return false;
+    }
+
+    // Returns key's index, or NotFound.
+    static size_t find(const Slot *slots, size_t mask,
+                       uintptr_t maxDisplacement, Key key)
+    {
+        size_t index = Traits::hash(key) & mask;
+        for (size_t distance = 0; distance <= maxDisplacement; distance++) {
+            const Slot& slot = slots[index];
+            if (Traits::empty(slot)) return NotFound;
+            if (Traits::key(slot) == key) return index;
+            if (displacement(slot, index, mask) < distance) return NotFound;
+            index = (index + 1) & mask;
+        }
+        return NotFound;
+    }
+
+    // Empties the slot at index, moving the rest of its run back.
+    static void erase(Slot *slots, size_t mask, size_t index) {
+        for (;;) {
+            size_t next = (index + 1) & mask;
+            const Slot& slot = slots[next];
+            if (Traits::empty(slot)  ||  displacement(slot, next, mask) == 0) {
+                break;
+            }
+            Traits::move(slots[index], slot);
+            index = next;
+        }
+        Traits::clear(slots[index]);
+    }
+};
+
+} // end namespace objc
+
+#endif
@@ -24,6 +24,8 @@
 #ifndef _OBJC_RUNTIME_NEW_H
 #define _OBJC_RUNTIME_NEW_H
 
+#include "objc-method-index-engine.h"
+
 #if __LP64__
 typedef uint32_t mask_t;  // x86_64 & arm64 asm are less efficient with 16-bits
 #else
@@ -47,6 +49,11 @@ private:
 #endif
 
 public:
+    // A key that is never a selector. Scans continue past it, so it 
+    // replaces an entry without breaking the probe sequence of others.
+    // See cache_evict_nolock().
+    static constexpr cache_key_t EvictedKey = 2;
+
     inline cache_key_t key() const { return _key; }
     inline IMP imp() const { return (IMP)_imp; }
     inline void setKey(cache_key_t newKey) { _key = newKey; }
@@ -435,8 +442,9 @@ struct locstamped_category_list_t {
 #define RW_CONSTRUCTING       (1<<26)
 // class allocated and registered
 #define RW_CONSTRUCTED        (1<<25)
-// available for use; was RW_FINALIZE_ON_MAIN_THREAD
-// #define RW_24 (1<<24)
+// class's instances are torn down on a reaper thread; 
+// was RW_FINALIZE_ON_MAIN_THREAD
+#define RW_DEFERS_DEALLOC     (1<<24)
 // class +load has been called
 #define RW_LOADED             (1<<23)
 #if !SUPPORT_NONPOINTER_ISA
@@ -445,8 +453,8 @@ struct locstamped_category_list_t {
 #endif
 // class has instance-specific GC layout
 #define RW_HAS_INSTANCE_SPECIFIC_LAYOUT (1 << 21)
-// available for use
-// #define RW_20       (1<<20)
+// class's instances keep a biased retain count at data()->biasedRCOffset
+#define RW_USES_BIASED_RC     (1<<20)
 // class has started realizing but not yet completed it
 #define RW_REALIZING          (1<<19)
 
@@ -823,6 +831,28 @@ class protocol_array_t :
 };
 
 
+// Selectors that a class is known not to respond to, even after its 
+// method resolver ran. Direct-mapped; a collision evicts the older 
+// selector. Allocated on first use and freed with the class.
+struct negative_cache_t {
+    enum { Capacity = 16 };
+    SEL sels[Capacity];
+
+    static unsigned index(SEL sel) {
+        return (unsigned)(((uintptr_t)sel >> 3) ^ ((uintptr_t)sel >> 7)) 
+            & (Capacity - 1);
+    }
+};
+
+
+// Selector to method for classes with several method lists.
+// Built by getMethodNoSuper_nolock() and discarded when methods change.
+typedef objc::method_index_tt<SEL, method_t> method_index_t;
+
+// Per-class method cache counters. See objc-cache.mm.
+struct cache_stats_t;
+
+
 struct class_rw_t {
     // Be warned that Symbolication knows the layout of this structure.
     uint32_t flags;
@@ -843,6 +873,15 @@ struct class_rw_t {
     uint32_t index;
 #endif
 
+    negative_cache_t *negativeCache;
+    method_index_t *methodIndex;
+    objc::sel_shadow_t *methodSels;
+    cache_stats_t *cacheStats;
+
+#if SUPPORT_BIASED_RC
+    uint32_t biasedRCOffset;
+#endif
+
     void setFlags(uint32_t set) 
     {
         OSAtomicOr32Barrier(set, &flags);
@@ -1218,6 +1257,25 @@ struct objc_class : objc_object {
     }
 
 
+#if SUPPORT_BIASED_RC
+    // realizeClass() propagates this from the superclass.
+    bool usesBiasedRC() {
+        return data()->flags & RW_USES_BIASED_RC;
+    }
+    uint32_t biasedRCOffset() {
+        assert(usesBiasedRC());
+        return data()->biasedRCOffset;
+    }
+#endif
+
+#if SUPPORT_DEFERRED_DEALLOC
+    // realizeClass() propagates this from the superclass.
+    bool defersDealloc() {
+        return data()->flags & RW_DEFERS_DEALLOC;
+    }
+#endif
+
+
 #if SUPPORT_NONPOINTER_ISA
     // Tracked in non-pointer isas; not tracked otherwise
 #else
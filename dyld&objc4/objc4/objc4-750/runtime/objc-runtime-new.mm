@@ -32,6 +32,7 @@
 #include "objc-runtime-new.h"
 #include "objc-file.h"
 #include "objc-cache.h"
+#include "objc-weak.h"
 #include <Block.h>
 #include <objc/message.h>
 #include <mach/shared_region.h>
@@ -52,7 +53,14 @@ static bool methodListImplementsRR(const method_list_t *mlist);
 static bool methodListImplementsAWZ(const method_list_t *mlist);
 static void updateCustomRR_AWZ(Class cls, method_t *meth);
 static method_t *search_method_list(const method_list_t *mlist, SEL sel);
+static void discardMethodIndex(class_rw_t *rw);
+static void addToMethodIndex(class_rw_t *rw, method_list_t *mlist);
 static void flushCaches(Class cls);
+static void flushCaches(Class cls, SEL sel);
+static void presizeCacheFromProfile(Class cls);
+static void fillCacheFromProfile(Class cls);
+static void negative_cache_evict_nolock(Class cls, SEL sel);
+static void negative_cache_erase_nolock(Class cls);
 static void initializeTaggedPointerObfuscator(void);
 #if SUPPORT_FIXUP
 static void fixupMessageRef(message_ref_t *msg);
@@ -806,6 +814,7 @@ attachCategories(Class cls, category_list *cats, bool flush_caches)
 
     prepareMethodLists(cls, mlists, mcount, NO, fromBundle);
     rw->methods.attachLists(mlists, mcount);
+    if (mcount > 0) discardMethodIndex(rw);
     free(mlists);
     if (flush_caches  &&  mcount > 0) flushCaches(cls);
 
@@ -1848,6 +1857,87 @@ static void reconcileInstanceVariables(Class cls, Class supercls, const class_ro
 }
 
 
+#if SUPPORT_BIASED_RC
+/***********************************************************************
+* reserveBiasedRC
+* Gives cls's instances a biased retain count if its superclass's have 
+* one, or if its metaclass implements +_usesBiasedRefcount, in which 
+* case the instance grows to hold it after the ivars and subclasses' 
+* ivars slide past it. Only the method's presence counts; it is never 
+* called. Categories count if they were attached when the metaclass 
+* was realized.
+* This may reallocate class_ro_t, updating our ro variable.
+* Locking: runtimeLock must be write-locked by the caller
+**********************************************************************/
+static void reserveBiasedRC(Class cls, Class supercls, Class metacls, 
+                            const class_ro_t*& ro)
+{
+    runtimeLock.assertLocked();
+
+    class_rw_t *rw = cls->data();
+    if (supercls  &&  supercls->usesBiasedRC()) {
+        rw->biasedRCOffset = supercls->biasedRCOffset();
+        rw->flags |= RW_USES_BIASED_RC;
+        return;
+    }
+
+    if (DisableBiasedRC  ||  cls->instancesRequireRawIsa()) return;
+    if (!getMethodNoSuper_nolock(metacls, SEL_usesBiasedRefcount)) return;
+
+    // The isa holds the offset in BIASED_RC_ALIGN units, 
+    // in what extra_rc has from RC_BIASED up.
+    uint32_t offset = (ro->instanceSize + BIASED_RC_ALIGN - 1) & 
+        ~(uint32_t)(BIASED_RC_ALIGN - 1);
+    if (offset > BIASED_RC_MAX_OFFSET) {
+        if (PrintConnecting) {
+            _objc_inform("CLASS: class '%s' is too large for biased "
+                         "retain counts", cls->nameForLogging());
+        }
+        return;
+    }
+
+    class_ro_t *ro_w = make_ro_writeable(rw);
+    ro = rw->ro;
+    rw->biasedRCOffset = offset;
+    ro_w->instanceSize = rw->biasedRCOffset + sizeof(objc::BiasedRC);
+    rw->flags |= RW_USES_BIASED_RC;
+
+    if (PrintConnecting) {
+        _objc_inform("CLASS: class '%s' keeps biased retain counts "
+                     "at offset %u", cls->nameForLogging(), 
+                     rw->biasedRCOffset);
+    }
+}
+#endif
+
+
+#if SUPPORT_DEFERRED_DEALLOC
+/***********************************************************************
+* setDefersDealloc
+* Marks cls's instances for teardown on a reaper thread if its 
+* superclass's are, or if its metaclass implements 
+* +_deallocsInBackground. Only the method's presence counts.
+* Locking: runtimeLock must be write-locked by the caller
+**********************************************************************/
+static void setDefersDealloc(Class cls, Class supercls, Class metacls)
+{
+    runtimeLock.assertLocked();
+
+    if (!(supercls  &&  supercls->defersDealloc())) {
+        if (DisableDeferredDealloc) return;
+        if (!getMethodNoSuper_nolock(metacls, SEL_deallocsInBackground)) {
+            return;
+        }
+        if (PrintConnecting) {
+            _objc_inform("CLASS: class '%s' deallocates in the background",
+                         cls->nameForLogging());
+        }
+    }
+    cls->data()->flags |= RW_DEFERS_DEALLOC;
+}
+#endif
+
+
 /***********************************************************************
 * realizeClass
 * Performs first-time initialization on class cls, 
@@ -1949,6 +2039,15 @@ static Class realizeClass(Class cls)
     // This may reallocate class_ro_t, updating our ro variable.
     if (supercls  &&  !isMeta) reconcileInstanceVariables(cls, supercls, ro);
 
+#if SUPPORT_BIASED_RC
+    // Reserve room for a biased retain count if asked.
+    // This may reallocate class_ro_t, updating our ro variable.
+    if (!isMeta) reserveBiasedRC(cls, supercls, metacls, ro);
+#endif
+#if SUPPORT_DEFERRED_DEALLOC
+    if (!isMeta) setDefersDealloc(cls, supercls, metacls);
+#endif
+
     // Set fastInstanceSize if it wasn't set already.
     cls->setInstanceSize(ro->instanceSize);
 
@@ -1970,6 +2069,8 @@ static Class realizeClass(Class cls)
     // Attach categories
     methodizeClass(cls);
 
+    presizeCacheFromProfile(cls);
+
     return cls;
 }
 
@@ -2116,16 +2217,58 @@ static void flushCaches(Class cls)
     if (cls) {
         foreach_realized_class_and_subclass(cls, ^(Class c){
             cache_erase_nolock(c);
+            negative_cache_erase_nolock(c);
         });
     }
     else {
         foreach_realized_class_and_metaclass(^(Class c){
             cache_erase_nolock(c);
+            negative_cache_erase_nolock(c);
         });
     }
 }
 
 
+/***********************************************************************
+* flushCaches(cls, sel)
+* Evicts sel from the caches of cls and its subclasses, or of every 
+* class if cls is nil, when only sel's implementation has changed. 
+* Every other cached entry stays valid and stays cached.
+* Locking: runtimeLock must be held by the caller. It also keeps 
+* lookUpImpOrForward() from re-caching the old IMP.
+**********************************************************************/
+static void flushCaches(Class cls, SEL sel)
+{
+    runtimeLock.assertLocked();
+
+    if (DisableCacheEviction) {
+        flushCaches(cls);
+        return;
+    }
+
+    mutex_locker_t lock(cacheUpdateLock);
+
+    __block unsigned evicted = 0;
+    auto evict = ^(Class c){
+        if (cache_evict_nolock(c, sel)) evicted++;
+        negative_cache_evict_nolock(c, sel);
+    };
+
+    if (cls) {
+        foreach_realized_class_and_subclass(cls, evict);
+    }
+    else {
+        foreach_realized_class_and_metaclass(evict);
+    }
+
+    if (PrintCaches) {
+        _objc_inform("CACHES: evicted '%s' from %u caches (%s)", 
+                     sel_getName(sel), evicted, 
+                     cls ? cls->nameForLogging() : "all classes");
+    }
+}
+
+
 void _objc_flush_caches(Class cls)
 {
     {
@@ -2147,6 +2290,382 @@ void _objc_flush_caches(Class cls)
 }
 
 
+/***********************************************************************
+* Method cache profiles.
+* _objc_writeMethodCacheProfile() records the selectors in every 
+* class's method cache. With OBJC_CACHE_PROFILE=path, a later launch 
+* reads that file at startup, presizes each listed cache when its class 
+* is realized, and fills it when the class is initialized. Early 
+* messages then hit instead of each missing and expanding the cache.
+*
+* Everything in the file is named by string, relative to its image:
+*   objc-cache-profile 1
+*   @/path/of/image
+*   -ClassName selector selector:with: ...
+*   +ClassName selector ...
+* A class line belongs to the image line before it; '+' is the 
+* metaclass. Classes that are no longer in that image and selectors 
+* that the class no longer implements are ignored.
+*
+* OBJC_RECORD_CACHE_PROFILE=YES writes the file again at exit.
+**********************************************************************/
+struct cache_profile_entry_t {
+    const char *image;
+    const char **sels;
+    uint32_t count;
+    bool isMeta;
+    cache_profile_entry_t *next;  // same class name in another image
+};
+
+static const char cacheProfileHeader[] = "objc-cache-profile 1\n";
+
+// class name => cache_profile_entry_t list. Read-only after startup.
+static NXMapTable *cacheProfile;
+static const char *cacheProfilePath;
+
+// The file's contents are kept: entries point into them.
+static bool loadCacheProfile(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0  ||  st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    char *buf = (char *)malloc(size + 1);
+    bool ok = (read(fd, buf, size) == (ssize_t)size);
+    close(fd);
+    buf[size] = '\0';
+
+    if (!ok  ||  
+        0 != strncmp(buf, cacheProfileHeader, sizeof(cacheProfileHeader)-1))
+    {
+        free(buf);
+        return false;
+    }
+
+    NXMapTable *map = NXCreateMapTable(NXStrValueMapPrototype, 64);
+    const char *image = nil;
+    unsigned classCount = 0;
+    unsigned selCount = 0;
+
+    char *line = buf + sizeof(cacheProfileHeader) - 1;
+    while (*line) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+
+        if (line[0] == '@') {
+            image = line + 1;
+        }
+        else if ((line[0] == '+'  ||  line[0] == '-')  &&  image) {
+            // Split "+ClassName sel sel ..." in place.
+            uint32_t max = 0;
+            for (char *c = line; *c; c++) if (*c == ' ') max++;
+
+            auto entry = (cache_profile_entry_t *)calloc(sizeof(*entry), 1);
+            entry->sels = (const char **)calloc(max ?: 1, sizeof(char *));
+            entry->image = image;
+            entry->isMeta = (line[0] == '+');
+
+            char *name = line + 1;
+            char *c = strchr(name, ' ');
+            while (c) {
+                *c++ = '\0';
+                if (*c  &&  *c != ' ') entry->sels[entry->count++] = c;
+                c = strchr(c, ' ');
+            }
+
+            entry->next = (cache_profile_entry_t *)NXMapGet(map, name);
+            NXMapInsert(map, name, entry);
+            classCount++;
+            selCount += entry->count;
+        }
+
+        if (!end) break;
+        line = end + 1;
+    }
+
+    cacheProfile = map;
+    if (PrintCaches) {
+        _objc_inform("CACHES: loaded cache profile %s: "
+                     "%u classes, %u selectors", path, classCount, selCount);
+    }
+    return true;
+}
+
+static void writeCacheProfileAtExit(void)
+{
+    if (!_objc_writeMethodCacheProfile(cacheProfilePath)  &&  PrintCaches) {
+        _objc_inform("CACHES: could not write cache profile %s", 
+                     cacheProfilePath);
+    }
+}
+
+void cacheProfileInit(void)
+{
+    // Like environ_init(), ignore the environment when setuid or setgid.
+    if (issetugid()) return;
+
+    const char *path = getenv("OBJC_CACHE_PROFILE");
+    if (!path  ||  !*path) return;
+    cacheProfilePath = strdup(path);
+
+    if (!loadCacheProfile(cacheProfilePath)  &&  PrintCaches) {
+        _objc_inform("CACHES: no usable cache profile at %s", 
+                     cacheProfilePath);
+    }
+    if (RecordCacheProfile) {
+        atexit(&writeCacheProfileAtExit);
+    }
+}
+
+static cache_profile_entry_t *cacheProfileEntry(Class cls)
+{
+    if (!cacheProfile) return nil;
+
+    auto entry = (cache_profile_entry_t *)
+        NXMapGet(cacheProfile, cls->mangledName());
+    bool isMeta = cls->isMetaClass();
+    const char *image = nil;
+    for ( ; entry; entry = entry->next) {
+        if (entry->isMeta != isMeta) continue;
+        if (!image) image = dyld_image_path_containing_address(cls);
+        if (image  &&  0 == strcmp(image, entry->image)) return entry;
+    }
+    return nil;
+}
+
+// Called when cls is realized. cls can't be cached yet, 
+// but its cache can be made big enough.
+static void presizeCacheFromProfile(Class cls)
+{
+    runtimeLock.assertLocked();
+
+    cache_profile_entry_t *entry = cacheProfileEntry(cls);
+    if (entry  &&  entry->count > 0) cache_presize(cls, entry->count);
+}
+
+// Called when cls is initialized, for the class and its metaclass.
+static void fillCacheFromProfile(Class cls)
+{
+    runtimeLock.assertLocked();
+
+    cache_profile_entry_t *entry = cacheProfileEntry(cls);
+    if (!entry) return;
+
+    uint32_t filled = 0;
+    for (uint32_t i = 0; i < entry->count; i++) {
+        SEL sel = sel_lookUpByName(entry->sels[i]);
+        if (!sel  ||  cache_getImp(cls, sel)) continue;
+
+        // Like lookUpImpOrForward() but never caches forwarding, 
+        // so method resolvers still run.
+        for (Class c = cls; c; c = c->superclass) {
+            method_t *m = getMethodNoSuper_nolock(c, sel);
+            if (m) {
+                cache_fill(cls, sel, m->imp, nil);
+                filled++;
+                break;
+            }
+        }
+    }
+
+    if (PrintCaches) {
+        _objc_inform("CACHES: preloaded %u of %u entries for %s%s", 
+                     filled, entry->count, cls->nameForLogging(), 
+                     cls->isMetaClass() ? " (meta)" : "");
+    }
+}
+
+
+bool _objc_writeMethodCacheProfile(const char *path)
+{
+    struct item_t {
+        const char *image;
+        Class cls;
+    };
+
+    if (!path) return false;
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+
+    mutex_locker_t lock(runtimeLock);
+    mutex_locker_t lock2(cacheUpdateLock);
+
+    __block item_t *items = nil;
+    __block size_t count = 0;
+    __block size_t capacity = 0;
+    foreach_realized_class_and_metaclass(^(Class cls) {
+        if (cls->cache.occupied() == 0) return;
+        const char *image = dyld_image_path_containing_address(cls);
+        if (!image) return;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            items = (item_t *)realloc(items, capacity * sizeof(*items));
+        }
+        items[count++] = item_t{image, cls};
+    });
+
+    // Group classes by image.
+    std::sort(items, items + count, [](const item_t& a, const item_t& b) {
+        return strcmp(a.image, b.image) < 0;
+    });
+
+    fputs(cacheProfileHeader, f);
+    const char *lastImage = nil;
+    for (size_t i = 0; i < count; i++) {
+        Class cls = items[i].cls;
+        if (!lastImage  ||  0 != strcmp(lastImage, items[i].image)) {
+            lastImage = items[i].image;
+            fprintf(f, "@%s\n", lastImage);
+        }
+
+        fprintf(f, "%c%s", cls->isMetaClass() ? '+' : '-', 
+                cls->mangledName());
+        bucket_t *buckets = cls->cache.buckets();
+        mask_t capacity = cls->cache.capacity();
+        for (mask_t b = 0; b < capacity; b++) {
+            // Skip empty buckets, the end marker, evicted entries, 
+            // and forwarding.
+            cache_key_t key = buckets[b].key();
+            if (key <= bucket_t::EvictedKey) continue;
+            if (buckets[b].imp() == (IMP)_objc_msgForward_impcache) continue;
+            fprintf(f, " %s", sel_getName((SEL)key));
+        }
+        fputc('\n', f);
+    }
+
+    free(items);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+
+    if (PrintCaches) {
+        _objc_inform("CACHES: wrote cache profile %s: %zu classes", 
+                     path, count);
+    }
+    return ok;
+}
+
+
+/***********************************************************************
+* Method cache statistics.
+* _objc_getMethodCacheStatistics() reports one class or the aggregate.
+* _objc_writeMethodCacheStatistics() writes every class, so that a 
+* thrashing class - many expansions or flushes, or misses far beyond 
+* its entries - can be found with sort(1). `retained` counts entries 
+* that selector evictions kept but a full flush would have erased.
+*
+* With OBJC_RECORD_CACHE_STATISTICS=YES and OBJC_CACHE_STATISTICS=path, 
+* the file is written at exit.
+**********************************************************************/
+static const char *cacheStatisticsPath;
+
+void _objc_getMethodCacheStatistics(Class cls, 
+                                    objc_method_cache_statistics *stats)
+{
+    bzero(stats, sizeof(*stats));
+
+    mutex_locker_t lock(runtimeLock);
+    mutex_locker_t lock2(cacheUpdateLock);
+
+    cache_addCounters_nolock(cls, stats);
+    if (cls) {
+        cache_addContents_nolock(cls, stats);
+    } else {
+        foreach_realized_class_and_metaclass(^(Class c) {
+            cache_addContents_nolock(c, stats);
+        });
+    }
+}
+
+
+static void writeCacheStatisticsLine(FILE *f, const char *name, bool isMeta, 
+                                     const objc_method_cache_statistics& s)
+{
+    fprintf(f, "%s\t%d\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t"
+            "%.2f\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n", 
+            name, isMeta ? 1 : 0, 
+            (unsigned long long)s.misses, (unsigned long long)s.fills, 
+            (unsigned long long)s.expansions, (unsigned long long)s.flushes, 
+            (unsigned long long)s.evictions, (unsigned long long)s.retained, 
+            (unsigned long long)s.capacity, (unsigned long long)s.entries, 
+            s.entries ? (double)s.probes / s.entries : 0.0, 
+            (unsigned long long)s.maxProbes, 
+            (unsigned long long)s.garbageBytes, 
+            (unsigned long long)s.collectedBytes, 
+            (unsigned long long)s.reclaims, 
+            (unsigned long long)
+                (s.reclaims ? s.reclaimLatency / s.reclaims : 0), 
+            (unsigned long long)s.maxReclaimLatency);
+}
+
+bool _objc_writeMethodCacheStatistics(const char *path)
+{
+    if (!path) return false;
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+
+    objc_method_cache_statistics total;
+    _objc_getMethodCacheStatistics(nil, &total);
+
+    fputs("class\tmeta\tmisses\tfills\texpansions\tflushes\t"
+          "evictions\tretained\tcapacity\tentries\tavgProbes\tmaxProbes\t"
+          "garbageBytes\tcollectedBytes\treclaims\tavgReclaimLatency\t"
+          "maxReclaimLatency\n", f);
+    writeCacheStatisticsLine(f, "*", false, total);
+
+    mutex_locker_t lock(runtimeLock);
+    mutex_locker_t lock2(cacheUpdateLock);
+
+    __block size_t count = 0;
+    foreach_realized_class_and_metaclass(^(Class cls) {
+        objc_method_cache_statistics s;
+        bzero(&s, sizeof(s));
+        cache_addCounters_nolock(cls, &s);
+        cache_addContents_nolock(cls, &s);
+        if (s.capacity == 0  &&  s.misses == 0) return;
+        writeCacheStatisticsLine(f, cls->mangledName(), 
+                                 cls->isMetaClass(), s);
+        count++;
+    });
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+
+    if (PrintCaches) {
+        _objc_inform("CACHES: wrote cache statistics %s: %zu classes", 
+                     path, count);
+    }
+    return ok;
+}
+
+static void writeCacheStatisticsAtExit(void)
+{
+    if (!_objc_writeMethodCacheStatistics(cacheStatisticsPath)  &&  
+        PrintCaches) 
+    {
+        _objc_inform("CACHES: could not write cache statistics %s", 
+                     cacheStatisticsPath);
+    }
+}
+
+void cacheStatisticsInit(void)
+{
+    if (!RecordCacheStatistics) return;
+
+    // Like environ_init(), ignore the environment when setuid or setgid.
+    if (issetugid()) return;
+
+    const char *path = getenv("OBJC_CACHE_STATISTICS");
+    if (!path  ||  !*path) return;
+    cacheStatisticsPath = strdup(path);
+    atexit(&writeCacheStatisticsAtExit);
+}
+
+
 /***********************************************************************
 * map_images
 * Process the given images which are being mapped in by dyld.
@@ -3036,7 +3555,7 @@ _method_setImplementation(Class cls, method_t *m, IMP imp)
     // RR/AWZ updates are slow if cls is nil (i.e. unknown)
     // fixme build list of classes whose Methods are known externally?
 
-    flushCaches(cls);
+    flushCaches(cls, m->name);
 
     updateCustomRR_AWZ(cls, m);
 
@@ -3068,7 +3587,8 @@ void method_exchangeImplementations(Method m1, Method m2)
     // Cache updates are slow because class is unknown
     // fixme build list of classes whose Methods are known externally?
 
-    flushCaches(nil);
+    flushCaches(nil, m1->name);
+    if (m2->name != m1->name) flushCaches(nil, m2->name);
 
     updateCustomRR_AWZ(nil, m1);
     updateCustomRR_AWZ(nil, m2);
@@ -4663,34 +5183,9 @@ static method_t *findMethodInSortedMethodList(SEL key, const method_list_t *list
 {
     assert(list);
 
-    const method_t * const first = &list->first;
-    const method_t *base = first;
-    const method_t *probe;
-    uintptr_t keyValue = (uintptr_t)key;
-    uint32_t count;
-    
-    for (count = list->count; count != 0; count >>= 1) {
-        probe = base + (count >> 1);
-        
-        uintptr_t probeValue = (uintptr_t)probe->name;
-        
-        if (keyValue == probeValue) {
-            // `probe` is a match.
-            // Rewind looking for the *first* occurrence of this value.
-            // This is required for correct category overrides.
-            while (probe > first && keyValue == (uintptr_t)probe[-1].name) {
-                probe--;
-            }
-            return (method_t *)probe;
-        }
-        
-        if (keyValue > probeValue) {
-            base = probe + 1;
-            count--;
-        }
-    }
-    
-    return nil;
+    // See objc-method-index-engine.h.
+    return (method_t *)
+        objc::sorted_method_search(&list->first, list->count, key);
 }
 
 /***********************************************************************
@@ -4726,6 +5221,97 @@ static method_t *search_method_list(const method_list_t *mlist, SEL sel)
     return nil;
 }
 
+/***********************************************************************
+* Method index.
+* A class with more than one method list (i.e. with categories or 
+* added methods) gets a method_index_t on its first method search. 
+* It answers in one probe what search_method_list() would answer 
+* after searching every list.
+* attachCategories() discards the index because the new lists override 
+* old ones. addMethod() only adds selectors the class doesn't have yet, 
+* so it updates the index in place if there is room.
+* Locking: runtimeLock must be held by the caller
+**********************************************************************/
+static method_index_t *buildMethodIndex(class_rw_t *rw)
+{
+    runtimeLock.assertLocked();
+
+    // Insert in search order so the first match wins.
+    method_index_t *index = method_index_t::create(rw->methods.count());
+    for (auto& meth : rw->methods) {
+        index->insert(meth.name, &meth);
+    }
+    return index;
+}
+
+static void discardMethodIndex(class_rw_t *rw)
+{
+    runtimeLock.assertLocked();
+
+    if (rw->methodIndex) {
+        free(rw->methodIndex);
+        rw->methodIndex = nil;
+    }
+}
+
+/***********************************************************************
+* Method selector shadow.
+* A class with one method list of at least SelShadowMinCount methods 
+* keeps a sel_shadow_t of that list: its selectors alone, searched 
+* without loading the types and imps in between.
+* The shadow remembers its list, so it is rebuilt if the class's only 
+* list is ever a different one.
+* Locking: runtimeLock must be held by the caller
+**********************************************************************/
+enum { SelShadowMinCount = 16 };
+
+static objc::sel_shadow_t *
+selShadowForList(class_rw_t *rw, method_list_t *mlist)
+{
+    runtimeLock.assertLocked();
+
+    if (DisableMethodIndex) return nil;
+    if (!mlist->isFixedUp()  ||  mlist->entsize() != sizeof(method_t)  ||  
+        mlist->count < SelShadowMinCount)
+    {
+        return nil;
+    }
+
+    objc::sel_shadow_t *shadow = rw->methodSels;
+    if (shadow  &&  shadow->list() == mlist) return shadow;
+
+    free(shadow);
+    shadow = objc::sel_shadow_t::create(mlist, &mlist->first, mlist->count);
+    rw->methodSels = shadow;
+    return shadow;
+}
+
+
+static void addToMethodIndex(class_rw_t *rw, method_list_t *mlist)
+{
+    runtimeLock.assertLocked();
+
+    method_index_t *index = rw->methodIndex;
+    if (!index) return;
+
+    if (method_index_t::byteSizeForCount(index->size() + mlist->count) > 
+        index->byteSize()) 
+    {
+        // Full. Rebuild it bigger on the next search.
+        discardMethodIndex(rw);
+        return;
+    }
+    for (auto& meth : *mlist) {
+        index->insert(meth.name, &meth);
+    }
+}
+
+
+/***********************************************************************
+* getMethodNoSuper_nolock
+* fixme
+* Locking: runtimeLock must be read- or write-locked by the caller
+**********************************************************************/
 static method_t *
 getMethodNoSuper_nolock(Class cls, SEL sel)
 {
@@ -4735,8 +5321,26 @@ getMethodNoSuper_nolock(Class cls, SEL sel)
     // fixme nil cls? 
     // fixme nil sel?
 
-    for (auto mlists = cls->data()->methods.beginLists(), 
-              end = cls->data()->methods.endLists(); 
+    auto rw = cls->data();
+    if (!rw->methodIndex  &&  !DisableMethodIndex  &&  
+        rw->methods.countLists() > 1) 
+    {
+        rw->methodIndex = buildMethodIndex(rw);
+    }
+    if (rw->methodIndex) {
+        return rw->methodIndex->find(sel);
+    }
+
+    if (rw->methods.countLists() == 1) {
+        method_list_t *mlist = *rw->methods.beginLists();
+        if (auto shadow = selShadowForList(rw, mlist)) {
+            int32_t i = shadow->find((uintptr_t)sel);
+            return (i < 0) ? nil : &mlist->get(i);
+        }
+    }
+
+    for (auto mlists = rw->methods.beginLists(), 
+              end = rw->methods.endLists(); 
          mlists != end;
          ++mlists)
     {
@@ -4748,6 +5352,44 @@ getMethodNoSuper_nolock(Class cls, SEL sel)
 }
 
 
+/***********************************************************************
+* getMethodsNoSuper_nolock
+* getMethodNoSuper_nolock() for each of count selectors.
+* A class with a selector shadow searches for all of them at once.
+* Locking: runtimeLock must be held by the caller
+**********************************************************************/
+static void
+getMethodsNoSuper_nolock(Class cls, const SEL *sels, uint32_t count, 
+                         method_t **outMethods)
+{
+    runtimeLock.assertLocked();
+
+    assert(cls->isRealized());
+
+    auto rw = cls->data();
+    objc::sel_shadow_t *shadow = nil;
+    method_list_t *mlist = nil;
+    if (count > 1  &&  !rw->methodIndex  &&  rw->methods.countLists() == 1) {
+        mlist = *rw->methods.beginLists();
+        shadow = selShadowForList(rw, mlist);
+    }
+
+    if (!shadow) {
+        for (uint32_t i = 0; i < count; i++) {
+            outMethods[i] = getMethodNoSuper_nolock(cls, sels[i]);
+        }
+        return;
+    }
+
+    int32_t *found = (int32_t *)malloc(count * sizeof(*found));
+    shadow->findMany((const uintptr_t *)sels, count, found);
+    for (uint32_t i = 0; i < count; i++) {
+        outMethods[i] = (found[i] < 0) ? nil : &mlist->get(found[i]);
+    }
+    free(found);
+}
+
+
 /***********************************************************************
 * getMethod_nolock
 * fixme
@@ -4840,11 +5482,75 @@ log_and_fill_cache(Class cls, IMP imp, SEL sel, id receiver, Class implementer)
 **********************************************************************/
 IMP _class_lookupMethodAndLoadCache3(id obj, SEL sel, Class cls)
 {
+    cache_countMiss(cls);
     return lookUpImpOrForward(cls, sel, obj, 
                               YES/*initialize*/, NO/*cache*/, YES/*resolver*/);
 }
 
 
+/***********************************************************************
+* Negative method cache.
+* Remembers selectors that lookUpImpOrForward() could not find in a 
+* class even after calling its method resolver, so that lookUpImpOrNil() 
+* and class_respondsToSelector() can answer "no" again without 
+* runtimeLock. The _objc_msgForward_impcache entry in the method cache 
+* does the same for the messenger, but only once the class is 
+* initialized and only until the method cache fills up.
+*
+* Filled with runtimeLock held. Cleared by flushCaches(), which runs 
+* whenever methods are added to the class or its superclasses, or 
+* just the changed selector's entry when only one method changed.
+* Readers need no lock: each entry is one SEL, so a reader sees either 
+* the old or the new selector. A reader that races a flush answers as 
+* if it had run before the flush.
+**********************************************************************/
+static bool negative_cache_lookup(Class cls, SEL sel)
+{
+    if (!cls->isRealized()) return false;
+
+    negative_cache_t *nc = cls->data()->negativeCache;
+    return nc  &&  nc->sels[negative_cache_t::index(sel)] == sel;
+}
+
+static void negative_cache_fill(Class cls, SEL sel)
+{
+    runtimeLock.assertLocked();
+
+    if (DisableNegativeCache) return;
+
+    class_rw_t *rw = cls->data();
+    negative_cache_t *nc = rw->negativeCache;
+    if (!nc) {
+        nc = (negative_cache_t *)calloc(sizeof(negative_cache_t), 1);
+        // Readers may load the pointer without the lock.
+        atomic_thread_fence(memory_order_release);
+        rw->negativeCache = nc;
+    }
+    nc->sels[negative_cache_t::index(sel)] = sel;
+}
+
+static void negative_cache_evict_nolock(Class cls, SEL sel)
+{
+    runtimeLock.assertLocked();
+
+    negative_cache_t *nc = cls->data()->negativeCache;
+    if (!nc) return;
+    unsigned i = negative_cache_t::index(sel);
+    if (nc->sels[i] == sel) nc->sels[i] = nil;
+}
+
+static void negative_cache_erase_nolock(Class cls)
+{
+    runtimeLock.assertLocked();
+
+    negative_cache_t *nc = cls->data()->negativeCache;
+    if (!nc) return;
+    for (unsigned i = 0; i < negative_cache_t::Capacity; i++) {
+        nc->sels[i] = nil;
+    }
+}
+
+
 /***********************************************************************
 * lookUpImpOrForward.
 * The standard IMP lookup. 
@@ -4865,10 +5571,21 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
 
     runtimeLock.assertUnlocked();
 
+    // Our caller has finished with any method cache it was reading.
+    cache_quiescent();
+
     // Optimistic cache lookup
     if (cache) {
         imp = cache_getImp(cls, sel);
         if (imp) return imp;
+        cache_countMiss(cls);
+
+        // An earlier search, resolver included, found nothing.
+        if (negative_cache_lookup(cls, sel)  &&  
+            (!initialize  ||  cls->isInitialized()))
+        {
+            return (IMP)_objc_msgForward_impcache;
+        }
     }
 
     // runtimeLock is held during isRealized and isInitialized checking
@@ -4971,6 +5688,7 @@ IMP lookUpImpOrForward(Class cls, SEL sel, id inst,
 
     imp = (IMP)_objc_msgForward_impcache;
     cache_fill(cls, sel, imp, inst);
+    if (triedResolver) negative_cache_fill(cls, sel);
 
  done:
     runtimeLock.unlock();
@@ -5203,6 +5921,10 @@ objc_class::setInitialized()
     // Update the +initialize flags.
     // Do this last.
     metacls->changeInfo(RW_INITIALIZED, RW_INITIALIZING);
+
+    // Now the caches may be filled.
+    fillCacheFromProfile(cls);
+    fillCacheFromProfile(metacls);
 }
 
 
@@ -5713,7 +6435,8 @@ addMethod(Class cls, SEL name, IMP imp, const char *types, bool replace)
 
         prepareMethodLists(cls, &newlist, 1, NO, NO);
         cls->data()->methods.attachLists(&newlist, 1);
-        flushCaches(cls);
+        addToMethodIndex(cls->data(), newlist);
+        flushCaches(cls, name);
 
         result = nil;
     }
@@ -5752,9 +6475,12 @@ addMethods(Class cls, const SEL *names, const IMP *imps, const char **types,
     SEL *failedNames = nil;
     uint32_t failedCount = 0;
     
+    method_t **existing = (method_t **)malloc(count * sizeof(*existing));
+    getMethodsNoSuper_nolock(cls, names, count, existing);
+
     for (uint32_t i = 0; i < count; i++) {
         method_t *m;
-        if ((m = getMethodNoSuper_nolock(cls, names[i]))) {
+        if ((m = existing[i])) {
             // already exists
             if (!replace) {
                 // report failure
@@ -5787,12 +6513,14 @@ addMethods(Class cls, const SEL *names, const IMP *imps, const char **types,
         
         prepareMethodLists(cls, &newlist, 1, NO, NO);
         cls->data()->methods.attachLists(&newlist, 1);
+        addToMethodIndex(cls->data(), newlist);
         flushCaches(cls);
     } else {
         // Attaching the method list to the class consumes it. If we don't
         // do that, we have to free the memory ourselves.
         free(newlist);
     }
+    free(existing);
     
     if (outFailedCount) *outFailedCount = failedCount;
     
@@ -6066,6 +6794,9 @@ objc_duplicateClass(Class original, const char *name,
     class_rw_t *rw = (class_rw_t *)calloc(sizeof(*original->data()), 1);
     rw->flags = (original->data()->flags | RW_COPIED_RO | RW_REALIZING);
     rw->version = original->data()->version;
+#if SUPPORT_BIASED_RC
+    rw->biasedRCOffset = original->data()->biasedRCOffset;
+#endif
     rw->firstSubclass = nil;
     rw->nextSiblingClass = nil;
 
@@ -6146,6 +6877,18 @@ static void objc_initializeClassPair_internal(Class superclass, const char *name
         meta_ro_w->instanceStart = superclass->ISA()->unalignedInstanceSize();
         cls->setInstanceSize(cls_ro_w->instanceStart);
         meta->setInstanceSize(meta_ro_w->instanceStart);
+#if SUPPORT_BIASED_RC
+        // The superclass's instance size includes its biased retain count.
+        if (superclass->usesBiasedRC()) {
+            cls->data()->biasedRCOffset = superclass->biasedRCOffset();
+            cls->data()->flags |= RW_USES_BIASED_RC;
+        }
+#endif
+#if SUPPORT_DEFERRED_DEALLOC
+        if (superclass->defersDealloc()) {
+            cls->data()->flags |= RW_DEFERS_DEALLOC;
+        }
+#endif
     } else {
         cls_ro_w->instanceStart = 0;
         meta_ro_w->instanceStart = (uint32_t)sizeof(objc_class);
@@ -6381,6 +7124,10 @@ static void free_class(Class cls)
     auto ro = rw->ro;
 
     cache_delete(cls);
+    try_free(rw->negativeCache);
+    try_free(rw->methodSels);
+    try_free(rw->cacheStats);
+    discardMethodIndex(rw);
     
     for (auto& meth : rw->methods) {
         try_free(meth.types);
@@ -6590,6 +7337,16 @@ _object_copyFromZone(id oldObj, size_t extraBytes, void *zone)
     uint8_t *copyDst = (uint8_t *)obj + sizeof(Class);
     uint8_t *copySrc = (uint8_t *)oldObj + sizeof(Class);
     size_t copySize = size - sizeof(Class);
+#if SUPPORT_BIASED_RC
+    if (cls->usesBiasedRC()) {
+        // ...and except the biased retain count, which is the copy's own.
+        size_t rcStart = cls->biasedRCOffset();
+        size_t rcEnd = rcStart + sizeof(objc::BiasedRC);
+        memmove(copyDst, copySrc, rcStart - sizeof(Class));
+        memmove((uint8_t *)obj + rcEnd, (uint8_t *)oldObj + rcEnd, 
+                size - rcEnd);
+    } else
+#endif
     memmove(copyDst, copySrc, copySize);
 
     fixupCopiedIvars(obj, oldObj);
@@ -6673,7 +7430,8 @@ object_dispose(id obj)
     if (!obj) return nil;
 
     objc_destructInstance(obj);    
-    free(obj);
+    // A weak load may still be reading a weakly-referenced object.
+    weak_free(obj);
 
     return nil;
 }
@@ -111,6 +111,8 @@ SEL SEL_tryRetain = NULL;
 SEL SEL_isDeallocating = NULL;
 SEL SEL_retainWeakReference = NULL;
 SEL SEL_allowsWeakReference = NULL;
+SEL SEL_usesBiasedRefcount = NULL;
+SEL SEL_deallocsInBackground = NULL;
 
 
 header_info *FirstHeader = 0;  // NULL means empty list
@@ -408,6 +410,7 @@ _objc_pthread_data *_objc_fetch_pthread_data(bool create)
 * arg shouldn't be NULL, but we check anyway.
 **********************************************************************/
 extern void _destroyInitializingClassList(struct _objc_initializing_classes *list);
+extern void _destroyPoolPageCache(objc::PageCacheThread *cache);
 void _objc_pthread_destroyspecific(void *arg)
 {
     _objc_pthread_data *data = (_objc_pthread_data *)arg;
@@ -415,6 +418,7 @@ void _objc_pthread_destroyspecific(void *arg)
         _destroyInitializingClassList(data->initializingClasses);
         _destroySyncCache(data->syncCache);
         _destroyAltHandlerList(data->handlerList);
+        _destroyPoolPageCache(&data->poolPageCache);
         for (int i = 0; i < (int)countof(data->printableNames); i++) {
             if (data->printableNames[i]) {
                 free(data->printableNames[i]);  
@@ -89,6 +89,8 @@ void sel_init(size_t selrefCount)
     t(_isDeallocating, isDeallocating);
     s(retainWeakReference);
     s(allowsWeakReference);
+    t(_usesBiasedRefcount, usesBiasedRefcount);
+    t(_deallocsInBackground, deallocsInBackground);
 
 #undef s
 #undef t
@@ -168,6 +170,22 @@ static SEL __sel_registerName(const char *name, bool shouldLock, bool copy)
 }
 
 
+// Like sel_getUid(), but returns nil instead of registering a new selector.
+SEL sel_lookUpByName(const char *name)
+{
+    if (!name) return (SEL)0;
+
+    SEL result = search_builtins(name);
+    if (result) return result;
+
+    mutex_locker_t lock(selLock);
+    if (namedSelectors) {
+        result = (SEL)NXMapGet(namedSelectors, name);
+    }
+    return result;
+}
+
+
 SEL sel_registerName(const char *name) {
     return __sel_registerName(name, 1, 1);     // YES lock, YES copy
 }
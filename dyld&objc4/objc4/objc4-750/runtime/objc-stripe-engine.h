@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-stripe-engine.h
+* Choosing a lock stripe for an object.
+*
+* StripedMap has a fixed stripe count and hashes with a shift and xor
+* of a few low address bits, so objects at page-aligned addresses all 
+* land in 8 of its 64 stripes. ScalableStripedMap picks its stripe count
+* once at startup from the CPU count and hashes with a multiply,
+* which mixes every address bit into the choice.
+**********************************************************************/
+
+#ifndef _OBJC_STRIPE_ENGINE_H
+#define _OBJC_STRIPE_ENGINE_H
+
+#include <stdint.h>
+
+namespace objc {
+
+// StripedMap's hash.
+static inline unsigned
+stripe_index_legacy(uintptr_t addr, unsigned count)
+{
+    return ((addr >> 4) ^ (addr >> 9)) % count;
+}
+
+// Fibonacci hash of the address, then a multiply-shift into
+// [0, count), so count need not be a power of two.
+static inline unsigned
+stripe_index(uintptr_t addr, unsigned count)
+{
+    uint64_t h = (uint64_t)addr * 0x9e3779b97f4a7c15ull;
+    return (unsigned)(((h >> 32) * (uint64_t)count) >> 32);
+}
+
+// Stripes for cpuCount CPUs: enough that threads on different CPUs
+// rarely meet on one lock, within [minCount, maxCount].
+static inline unsigned
+stripe_count_for_cpus(unsigned cpuCount, unsigned minCount, unsigned maxCount)
+{
+    enum { StripesPerCPU = 4 };
+    unsigned count = cpuCount * StripesPerCPU;
+    if (count < minCount) count = minCount;
+    if (count > maxCount) count = maxCount;
+    return count;
+}
+
+} // end namespace objc
+
+#endif
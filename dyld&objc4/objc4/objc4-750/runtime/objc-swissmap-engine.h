@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2018 Apple Inc.  All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/***********************************************************************
+* objc-swissmap-engine.h
+* An open-addressed hash map that probes a group of slots at a time.
+*
+* DenseMap probes one bucket at a time, comparing whole keys, and marks
+* erased buckets with a tombstone key that every later lookup must step
+* over. SwissMap keeps one control byte per slot beside the slots:
+*   Empty     never used since the last rehash
+*   Deleted   erased
+*   0..127    full; the low 7 bits of the key's hash
+* Slots are probed 16 at a time, or 8 without SSE2 or NEON. One
+* compare of a group's control bytes against the hash finds the few
+* slots whose keys are worth comparing, and another finds whether the
+* group has an empty slot, which ends the probe. The probe moves from
+* group to group by triangular steps, which visit every group of a
+* power-of-2 table.
+*
+* An erased slot becomes Empty if its group still has an empty slot,
+* because then no probe ever went past the group. Otherwise it becomes
+* Deleted. At most 7/8 of the slots, and never all of them, may be
+* full or Deleted, so every probe ends. Tables of 4 and 8 slots are
+* one partial group whose missing slots are Sentinels, which match
+* nothing.
+*
+* It has the part of DenseMap's interface that RefcountMap uses,
+* including ZeroValuesArePurgeable: values of zero are dropped when
+* the table is rehashed. Unlike DenseMap, an insertion never reuses
+* the slot of a zero value.
+*
+* RefcountMap is still a DenseMap. SwissMap is faster on misses and
+* churn but slower on the hits and retain/release that side tables
+* mostly do (bench/refcount-map), so it is kept only to be measured.
+**********************************************************************/
+
+#ifndef _OBJC_SWISSMAP_ENGINE_H
+#define _OBJC_SWISSMAP_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if __x86_64__  &&  __SSE2__
+#   include <emmintrin.h>
+#elif __arm64__  ||  __aarch64__
+#   include <arm_neon.h>
+#endif
+
+namespace objc {
+
+enum class SwissKernel { Scalar, SSE2, NEON };
+
+#if __x86_64__  &&  __SSE2__
+static constexpr SwissKernel swiss_kernel = SwissKernel::SSE2;
+#elif __arm64__  ||  __aarch64__
+static constexpr SwissKernel swiss_kernel = SwissKernel::NEON;
+#else
+static constexpr SwissKernel swiss_kernel = SwissKernel::Scalar;
+#endif
+
+enum : int8_t {
+    SwissEmpty = -128,
+    SwissDeleted = -2,
+    SwissSentinel = -1,
+};
+
+// Slots of a group that matched, lowest first.
+// Slot i is bit i << shift; the other bits are clear.
+struct SwissMask {
+    uint64_t bits;
+    unsigned shift;
+
+    explicit operator bool() const { return bits != 0; }
+    unsigned lowest() const { return __builtin_ctzll(bits) >> shift; }
+    void clearLowest() { bits &= bits - 1; }
+};
+
+// Scalar: 8 control bytes in a word. match() may also report a full
+// slot just above a true match, which only costs a key compare; the
+// other matches are exact.
+template <SwissKernel Kernel>
+struct SwissGroup {
+    enum { Width = 8 };
+    static constexpr uint64_t lsbs = 0x0101010101010101ull;
+    static constexpr uint64_t msbs = 0x8080808080808080ull;
+    uint64_t ctrl;
+
+    explicit SwissGroup(const int8_t *c) { memcpy(&ctrl, c, sizeof(ctrl)); }
+
+    SwissMask match(int8_t h) const {
+        uint64_t x = ctrl ^ (lsbs * (uint8_t)h);
+        return SwissMask{(x - lsbs) & ~x & msbs, 3};
+    }
+    // High bit set and bit 1 clear: only Empty.
+    SwissMask matchEmpty() const {
+        return SwissMask{ctrl & (~ctrl << 6) & msbs, 3};
+    }
+    // High bit set and bit 0 clear: Empty or Deleted, not Sentinel.
+    SwissMask matchFree() const {
+        return SwissMask{ctrl & (~ctrl << 7) & msbs, 3};
+    }
+};
+
+#if __x86_64__  &&  __SSE2__
+template <>
+struct SwissGroup<SwissKernel::SSE2> {
+    enum { Width = 16 };
+    __m128i ctrl;
+
+    explicit SwissGroup(const int8_t *c)
+        : ctrl(_mm_loadu_si128((const __m128i *)c)) { }
+
+    SwissMask match(int8_t h) const {
+        __m128i eq = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h));
+        return SwissMask{(uint32_t)_mm_movemask_epi8(eq), 0};
+    }
+    SwissMask matchEmpty() const { return match(SwissEmpty); }
+    SwissMask matchFree() const {
+        __m128i lt = _mm_cmplt_epi8(ctrl, _mm_set1_epi8(SwissSentinel));
+        return SwissMask{(uint32_t)_mm_movemask_epi8(lt), 0};
+    }
+};
+#endif
+
+#if __arm64__  ||  __aarch64__
+template <>
+struct SwissGroup<SwissKernel::NEON> {
+    enum { Width = 16 };
+    int8x16_t ctrl;
+
+    explicit SwissGroup(const int8_t *c) : ctrl(vld1q_s8(c)) { }
+
+    // Narrows each 0x00 or 0xff byte to 4 bits, and keeps one of them.
+    static SwissMask mask(uint8x16_t eq) {
+        uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(narrow), 0);
+        return SwissMask{bits & 0x8888888888888888ull, 2};
+    }
+
+    SwissMask match(int8_t h) const {
+        return mask(vceqq_s8(ctrl, vdupq_n_s8(h)));
+    }
+    SwissMask matchEmpty() const { return match(SwissEmpty); }
+    SwissMask matchFree() const {
+        return mask(vcltq_s8(ctrl, vdupq_n_s8(SwissSentinel)));
+    }
+};
+#endif
+
+
+template <typename KeyT, typename ValueT, bool IsConst>
+class SwissMapIterator {
+    typedef std::pair<KeyT, ValueT> Bucket;
+    template <typename, typename, bool> friend class SwissMapIterator;
+
+ public:
+    typedef typename std::conditional<IsConst, const Bucket, Bucket>::type
+        value_type;
+    typedef value_type *pointer;
+    typedef value_type &reference;
+
+ private:
+    pointer Ptr, End;
+    const int8_t *Ctrl;
+
+    void AdvancePastFreeSlots() {
+        while (Ptr != End  &&  *Ctrl < 0) {
+            ++Ptr;
+            ++Ctrl;
+        }
+    }
+
+ public:
+    SwissMapIterator() : Ptr(nullptr), End(nullptr), Ctrl(nullptr) { }
+
+    SwissMapIterator(pointer Pos, pointer E, const int8_t *C,
+                     bool NoAdvance = false)
+        : Ptr(Pos), End(E), Ctrl(C)
+    {
+        if (!NoAdvance) AdvancePastFreeSlots();
+    }
+
+    // Converts iterator to const_iterator.
+    SwissMapIterator(const SwissMapIterator<KeyT, ValueT, false>& I)
+        : Ptr(I.Ptr), End(I.End), Ctrl(I.Ctrl) { }
+
+    reference operator*() const { return *Ptr; }
+    pointer operator->() const { return Ptr; }
+
+    bool operator==(const SwissMapIterator<KeyT, ValueT, true>& RHS) const {
+        return Ptr == RHS.Ptr;
+    }
+    bool operator!=(const SwissMapIterator<KeyT, ValueT, true>& RHS) const {
+        return Ptr != RHS.Ptr;
+    }
+
+    SwissMapIterator& operator++() {
+        ++Ptr;
+        ++Ctrl;
+        AdvancePastFreeSlots();
+        return *this;
+    }
+};
+
+
+// KeyInfoT supplies getHashValue(key) and isEqual(a, b), as
+// DenseMapInfo does. Its empty and tombstone keys are not used.
+template <typename KeyT, typename ValueT,
+          bool ZeroValuesArePurgeable, typename KeyInfoT,
+          SwissKernel Kernel = swiss_kernel>
+class SwissMap {
+    typedef std::pair<KeyT, ValueT> BucketT;
+    typedef SwissGroup<Kernel> Group;
+
+    enum : unsigned {
+        MinBuckets = 4,
+        MinCompact = 1024,
+        NotFound = ~0u,
+    };
+
+    // NumBuckets control bytes, at least one group's worth,
+    // followed by NumBuckets slots.
+    int8_t *Ctrl;
+    unsigned NumEntries;
+    unsigned NumBuckets;
+    // Empty slots that may still be filled before a rehash.
+    unsigned GrowthLeft;
+
+    static unsigned ctrlSize(unsigned buckets) {
+        return buckets < Group::Width ? (unsigned)Group::Width : buckets;
+    }
+    // Leaves at least one Empty slot, so that every probe ends.
+    static unsigned maxLoad(unsigned buckets) {
+        return buckets - (buckets < 16 ? 1 : buckets / 8);
+    }
+    unsigned groupMask() const {
+        return (ctrlSize(NumBuckets) / Group::Width) - 1;
+    }
+
+    BucketT *buckets() const {
+        return (BucketT *)(Ctrl + ctrlSize(NumBuckets));
+    }
+
+    static int8_t h2(unsigned hash) { return (int8_t)(hash & 0x7f); }
+    static unsigned h1(unsigned hash) { return hash >> 7; }
+
+    unsigned probe(const KeyT& Val, unsigned hash) const {
+        if (NumBuckets == 0) return NotFound;
+        const BucketT *B = buckets();
+        unsigned mask = groupMask();
+        unsigned g = h1(hash) & mask;
+        for (unsigned step = 1; ; step++) {
+            Group group(Ctrl + g * Group::Width);
+            for (SwissMask m = group.match(h2(hash)); m; m.clearLowest()) {
+                unsigned i = g * Group::Width + m.lowest();
+                if (KeyInfoT::isEqual(B[i].first, Val)) return i;
+            }
+            if (group.matchEmpty()) return NotFound;
+            g = (g + step) & mask;
+        }
+    }
+
+    // The first slot an insertion of hash may take.
+    unsigned findFree(unsigned hash) const {
+        unsigned mask = groupMask();
+        unsigned g = h1(hash) & mask;
+        for (unsigned step = 1; ; step++) {
+            SwissMask m = Group(Ctrl + g * Group::Width).matchFree();
+            if (m) return g * Group::Width + m.lowest();
+            g = (g + step) & mask;
+        }
+    }
+
+    void allocate(unsigned buckets) {
+        NumBuckets = buckets;
+        NumEntries = 0;
+        if (buckets == 0) {
+            Ctrl = nullptr;
+            GrowthLeft = 0;
+            return;
+        }
+        unsigned ctrlBytes = ctrlSize(buckets);
+        Ctrl = (int8_t *)operator new(ctrlBytes + buckets * sizeof(BucketT));
+        memset(Ctrl, SwissEmpty, buckets);
+        memset(Ctrl + buckets, SwissSentinel, ctrlBytes - buckets);
+        GrowthLeft = maxLoad(buckets);
+    }
+
+    void destroyAll() {
+        BucketT *B = buckets();
+        for (unsigned i = 0; i < NumBuckets; i++) {
+            if (Ctrl[i] >= 0) B[i].~BucketT();
+        }
+    }
+
+    // Moves every entry to a new table of NewNumBuckets slots,
+    // dropping zero values if they are purgeable.
+    void rehash(unsigned NewNumBuckets) {
+        int8_t *OldCtrl = Ctrl;
+        BucketT *OldBuckets = buckets();
+        unsigned OldNumBuckets = NumBuckets;
+
+        allocate(NewNumBuckets);
+        for (unsigned i = 0; i < OldNumBuckets; i++) {
+            if (OldCtrl[i] < 0) continue;
+            BucketT& B = OldBuckets[i];
+            if (!(ZeroValuesArePurgeable  &&  B.second == 0)) {
+                unsigned hash = KeyInfoT::getHashValue(B.first);
+                unsigned j = findFree(hash);
+                Ctrl[j] = h2(hash);
+                new (&buckets()[j]) BucketT(std::move(B));
+                NumEntries++;
+                GrowthLeft--;
+            }
+            B.~BucketT();
+        }
+        operator delete(OldCtrl);
+    }
+
+    // Rehashes to make room for one more entry: in place if most
+    // of the used slots are Deleted or zero, otherwise twice the size.
+    void rehashForInsert() {
+        unsigned live = 0;
+        for (unsigned i = 0; i < NumBuckets; i++) {
+            if (Ctrl[i] < 0) continue;
+            if (ZeroValuesArePurgeable  &&  buckets()[i].second == 0) continue;
+            live++;
+        }
+        unsigned NewNumBuckets = MinBuckets;
+        while (maxLoad(NewNumBuckets) / 2 < live + 1) NewNumBuckets *= 2;
+        if (NewNumBuckets < NumBuckets  &&  NumBuckets <= MinCompact) {
+            NewNumBuckets = NumBuckets;
+        }
+        rehash(NewNumBuckets);
+    }
+
+    BucketT *insertNew(const KeyT& Key, unsigned hash) {
+        unsigned i = NumBuckets ? findFree(hash) : NotFound;
+        if (i == NotFound  ||  (Ctrl[i] == SwissEmpty  &&  GrowthLeft == 0)) {
+            rehashForInsert();
+            i = findFree(hash);
+        }
+        if (Ctrl[i] == SwissEmpty) GrowthLeft--;
+        Ctrl[i] = h2(hash);
+        NumEntries++;
+        BucketT *B = &buckets()[i];
+        new (B) BucketT(Key, ValueT());
+        return B;
+    }
+
+    void eraseAt(unsigned i) {
+        buckets()[i].~BucketT();
+        NumEntries--;
+        unsigned g = i & ~(unsigned)(Group::Width - 1);
+        if (Group(Ctrl + g).matchEmpty()) {
+            Ctrl[i] = SwissEmpty;
+            GrowthLeft++;
+        } else {
+            Ctrl[i] = SwissDeleted;
+        }
+        compact();
+    }
+
+ public:
+    typedef KeyT key_type;
+    typedef ValueT mapped_type;
+    typedef BucketT value_type;
+    typedef SwissMapIterator<KeyT, ValueT, false> iterator;
+    typedef SwissMapIterator<KeyT, ValueT, true> const_iterator;
+
+    constexpr SwissMap()
+        : Ctrl(nullptr), NumEntries(0), NumBuckets(0), GrowthLeft(0) { }
+
+    SwissMap(const SwissMap&) = delete;
+    SwissMap& operator=(const SwissMap&) = delete;
+
+    ~SwissMap() {
+        destroyAll();
+        operator delete(Ctrl);
+    }
+
+    iterator begin() {
+        return empty() ? end()
+            : iterator(buckets(), buckets() + NumBuckets, Ctrl);
+    }
+    iterator end() {
+        BucketT *E = buckets() + NumBuckets;
+        return iterator(E, E, Ctrl + NumBuckets, true);
+    }
+    const_iterator begin() const {
+        return empty() ? end()
+            : const_iterator(buckets(), buckets() + NumBuckets, Ctrl);
+    }
+    const_iterator end() const {
+        BucketT *E = buckets() + NumBuckets;
+        return const_iterator(E, E, Ctrl + NumBuckets, true);
+    }
+
+    bool empty() const { return NumEntries == 0; }
+    unsigned size() const { return NumEntries; }
+
+    void clear() {
+        destroyAll();
+        operator delete(Ctrl);
+        allocate(0);
+    }
+
+    bool count(const KeyT& Val) const {
+        return probe(Val, KeyInfoT::getHashValue(Val)) != NotFound;
+    }
+
+    iterator find(const KeyT& Val) {
+        unsigned i = probe(Val, KeyInfoT::getHashValue(Val));
+        if (i == NotFound) return end();
+        return iterator(&buckets()[i], buckets() + NumBuckets, Ctrl + i, true);
+    }
+    const_iterator find(const KeyT& Val) const {
+        unsigned i = probe(Val, KeyInfoT::getHashValue(Val));
+        if (i == NotFound) return end();
+        return const_iterator(&buckets()[i], buckets() + NumBuckets,
+                              Ctrl + i, true);
+    }
+
+    ValueT lookup(const KeyT& Val) const {
+        unsigned i = probe(Val, KeyInfoT::getHashValue(Val));
+        return i == NotFound ? ValueT() : buckets()[i].second;
+    }
+
+    std::pair<iterator, bool> insert(const std::pair<KeyT, ValueT>& KV) {
+        unsigned hash = KeyInfoT::getHashValue(KV.first);
+        unsigned i = probe(KV.first, hash);
+        bool inserted = (i == NotFound);
+        BucketT *B;
+        if (inserted) {
+            B = insertNew(KV.first, hash);
+            B->second = KV.second;
+        } else {
+            B = &buckets()[i];
+        }
+        return std::make_pair(iterator(B, buckets() + NumBuckets,
+                                       Ctrl + (B - buckets()), true),
+                              inserted);
+    }
+
+    value_type& FindAndConstruct(const KeyT& Key) {
+        unsigned hash = KeyInfoT::getHashValue(Key);
+        unsigned i = probe(Key, hash);
+        if (i != NotFound) return buckets()[i];
+        return *insertNew(Key, hash);
+    }
+
+    ValueT& operator[](const KeyT& Key) {
+        return FindAndConstruct(Key).second;
+    }
+
+    bool erase(const KeyT& Val) {
+        unsigned i = probe(Val, KeyInfoT::getHashValue(Val));
+        if (i == NotFound) return false;
+        eraseAt(i);
+        return true;
+    }
+    void erase(iterator I) {
+        eraseAt((unsigned)(&*I - buckets()));
+    }
+
+    // Free if empty.
+    // Shrink if at least 15/16 empty and larger than MinCompact.
+    void compact() {
+        if (NumEntries == 0) {
+            clear();
+        }
+        else if (NumBuckets / 16 > NumEntries  &&  NumBuckets > MinCompact) {
+            unsigned NewNumBuckets = MinBuckets;
+            while (maxLoad(NewNumBuckets) / 2 < NumEntries) NewNumBuckets *= 2;
+            rehash(NewNumBuckets);
+        }
+    }
+
+    // The raw memory used by the table, as DenseMap reports it.
+    size_t getMemorySize() const {
+        if (NumBuckets == 0) return 0;
+        return ctrlSize(NumBuckets) + NumBuckets * sizeof(BucketT);
+    }
+};
+
+} // end namespace objc
+
+#endif
@@ -26,6 +26,7 @@
 
 #include <objc/objc.h>
 #include "objc-config.h"
+#include "objc-epoch.h"
 
 __BEGIN_DECLS
 
@@ -48,6 +49,26 @@ deallocated by briefly placing it in the table just prior to invoking
 dealloc, and removing it via objc_clear_deallocating just prior to memory 
 reclamation.
 
+Each SideTable stripe has its own weak table, and the register, 
+unregister and clear operations run under that stripe's lock. Readers 
+lock the object's stripe too, unless OBJC_LOCKFREE_WEAK_LOAD is set: then 
+objc_loadWeakRetained() reads the variable inside a weak load epoch, and 
+weak_free() frees a weakly-referenced object only after every load that 
+could have read it has finished. storeWeak() registers the new value 
+under the new object's lock, publishes it, and then unregisters the old 
+value under the old object's lock, so one variable may briefly be 
+registered with two objects. weak_move_begin() marks that window, and 
+weak_clear_no_lock() nils a variable only if it still holds the object 
+being cleared.
+
+An object with more weak pointers than one clear batch is not cleared 
+under its side table lock. weak_clear_no_lock() moves its entry from the 
+table to the table's detached list, and weak_clear_detached() nils the 
+weak pointers a batch at a time under the object's WeakClearLocks stripe. 
+Weak pointers unregistered meanwhile are removed from the detached entry 
+under that lock too, so their storage is never written once it may have 
+been freed. The object is not freed until every batch is done.
+
 */
 
 // The address of a __weak variable.
@@ -66,9 +87,14 @@ typedef DisguisedPtr<objc_object *> weak_referrer_t;
  * It maintains and stores
  * a hash set of weak references pointing to an object.
  * If out_of_line_ness != REFERRERS_OUT_OF_LINE then the set
- * is instead a small inline array.
+ * is instead a small inline array, as large as WEAK_ENTRY_SIZE allows.
  */
+#if WEAK_ENTRY_SIZE
+#define WEAK_INLINE_COUNT \
+    ((WEAK_ENTRY_SIZE - sizeof(DisguisedPtr<objc_object>)) / sizeof(weak_referrer_t))
+#else
 #define WEAK_INLINE_COUNT 4
+#endif
 
 // out_of_line_ness field overlaps with the low two bits of inline_referrers[1].
 // inline_referrers[1] is a DisguisedPtr of a pointer-aligned address.
@@ -106,12 +132,31 @@ struct weak_entry_t {
         : referent(newReferent)
     {
         inline_referrers[0] = newReferrer;
-        for (int i = 1; i < WEAK_INLINE_COUNT; i++) {
+        for (size_t i = 1; i < WEAK_INLINE_COUNT; i++) {
             inline_referrers[i] = nil;
         }
     }
 };
 
+#if WEAK_ENTRY_SIZE
+static_assert(sizeof(weak_entry_t) == WEAK_ENTRY_SIZE, 
+              "weak_entry_t should fill WEAK_ENTRY_SIZE bytes");
+#endif
+
+// Objects with more weak pointers than this are cleared without the 
+// side table lock, in batches of this many referrer table slots.
+#define WEAK_CLEAR_BATCH 1024
+
+/**
+ * An entry taken out of the weak table while its referrers are 
+ * being cleared. Stays on its table's detached list until they are.
+ */
+struct weak_detached_t {
+    weak_entry_t entry;
+    weak_detached_t *next;
+    uint64_t start;   // when the clear began, for statistics
+};
+
 /**
  * The global weak references table. Stores object ids as keys,
  * and weak_entry_t structs as their values.
@@ -121,6 +166,7 @@ struct weak_table_t {
     size_t    num_entries;
     uintptr_t mask;
     uintptr_t max_hash_displacement;
+    weak_detached_t *detached;
 };
 
 /// Adds an (object, weak pointer) pair to the weak table.
@@ -130,13 +176,46 @@ id weak_register_no_lock(weak_table_t *weak_table, id referent,
 /// Removes an (object, weak pointer) pair from the weak table.
 void weak_unregister_no_lock(weak_table_t *weak_table, id referent, id *referrer);
 
+/// Removes an (object, weak pointer) pair from the weak table, if present.
+/// For a weak pointer that already holds another object, whose old 
+/// object may have been deallocated and its address reused meanwhile.
+void weak_unregister_moved_no_lock(weak_table_t *weak_table, id referent, 
+                                   id *referrer);
+
 #if DEBUG
 /// Returns true if an object is weakly referenced somewhere.
 bool weak_is_registered_no_lock(weak_table_t *weak_table, id referent);
 #endif
 
-/// Called on object destruction. Sets all remaining weak pointers to nil.
-void weak_clear_no_lock(weak_table_t *weak_table, id referent);
+/// Called on object destruction. Sets all remaining weak pointers to nil,
+/// or detaches them if there are many and returns the detached entry. 
+/// The caller must then drop the side table lock, call 
+/// weak_clear_detached(), and call weak_detached_remove_no_lock() with 
+/// the lock held again.
+weak_detached_t *weak_clear_no_lock(weak_table_t *weak_table, id referent);
+
+/// Sets a detached entry's weak pointers to nil, a batch at a time. 
+/// Call without the side table lock.
+void weak_clear_detached(weak_detached_t *detached);
+
+/// Removes a cleared entry from the detached list and frees it.
+void weak_detached_remove_no_lock(weak_table_t *weak_table, 
+                                  weak_detached_t *detached);
+
+/// Logs weak clear statistics. For OBJC_PRINT_WEAK_CLEARS.
+void weak_print_statistics(void);
+
+/// Bracket the time a weak pointer is registered with both its old 
+/// and new objects. Call with the weak pointer's location lock held.
+void weak_move_begin(id *referrer);
+void weak_move_end(id *referrer);
+
+/// Bracket a read of a weak pointer made without the side table lock.
+objc::EpochRecord *weak_load_begin(void);
+void weak_load_end(objc::EpochRecord *record);
+
+/// Frees a deallocated object, once no weak load can still be using it.
+void weak_free(id referent);
 
 __END_DECLS
 
@@ -24,6 +24,7 @@
 #include "objc-private.h"
 
 #include "objc-weak.h"
+#include "objc-robinhood-engine.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -66,6 +67,303 @@ static inline uintptr_t w_hash_pointer(objc_object **key) {
     return ptr_hash((uintptr_t)key);
 }
 
+
+/***********************************************************************
+* Robin Hood probing of the weak table and of out-of-line referrer sets.
+* See objc-robinhood-engine.h. max_hash_displacement still records the
+* longest displacement, so lookups and heap tools stay bounded by it.
+**********************************************************************/
+struct weak_entry_traits {
+    typedef weak_entry_t Slot;
+    typedef objc_object *Key;
+    static bool empty(const weak_entry_t& e) { return e.referent == nil; }
+    static objc_object *key(const weak_entry_t& e) { return e.referent; }
+    static uintptr_t hash(objc_object *key) { return hash_pointer(key); }
+    static void move(weak_entry_t& dst, const weak_entry_t& src) {
+        memcpy(&dst, &src, sizeof(dst));
+    }
+    static void swap(weak_entry_t& a, weak_entry_t& b) {
+        alignas(weak_entry_t) uint8_t tmp[sizeof(weak_entry_t)];
+        memcpy(tmp, &a, sizeof(tmp));
+        memcpy(&a, &b, sizeof(tmp));
+        memcpy(&b, tmp, sizeof(tmp));
+    }
+    static void clear(weak_entry_t& e) { bzero(&e, sizeof(e)); }
+};
+typedef objc::RobinHood<weak_entry_traits> weak_entry_probe;
+
+struct weak_referrer_traits {
+    typedef weak_referrer_t Slot;
+    typedef objc_object **Key;
+    static bool empty(const weak_referrer_t& r) { return r == nil; }
+    static objc_object **key(const weak_referrer_t& r) { return r; }
+    static uintptr_t hash(objc_object **key) { return w_hash_pointer(key); }
+    static void move(weak_referrer_t& dst, const weak_referrer_t& src) {
+        dst = src;
+    }
+    static void swap(weak_referrer_t& a, weak_referrer_t& b) {
+        weak_referrer_t tmp = a;
+        a = b;
+        b = tmp;
+    }
+    static void clear(weak_referrer_t& r) { r = nil; }
+};
+typedef objc::RobinHood<weak_referrer_traits> weak_referrer_probe;
+
+
+/***********************************************************************
+* Weak pointers being moved.
+* storeWeak() publishes a weak pointer's new value before unregistering 
+* it from its old object. A dealloc of the old object in between finds 
+* a weak pointer holding some other object, which is otherwise a sign 
+* of a direct store that bypassed objc_storeWeak(). Moves in progress 
+* are counted per stripe of weak pointer addresses.
+**********************************************************************/
+struct weak_move_count_t {
+    std::atomic<uint32_t> count;
+    constexpr weak_move_count_t() : count(0) { }
+};
+
+static StripedMap<weak_move_count_t> weakMoves;
+
+void weak_move_begin(id *referrer)
+{
+    weakMoves[referrer].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void weak_move_end(id *referrer)
+{
+    weakMoves[referrer].count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Call with the side table lock of the weak pointer's old object held, 
+// or its WeakClearLocks stripe if its entry is detached. The mover needs 
+// that lock to finish, so a move that published the value we read is 
+// still counted.
+static bool weak_move_in_progress(objc_object **referrer)
+{
+    return weakMoves[referrer].count.load(std::memory_order_relaxed) > 0;
+}
+
+
+/***********************************************************************
+* Weak clears of heavily weak-referenced objects.
+* An object with more than WEAK_CLEAR_BATCH weak pointers is detached 
+* from the weak table, and its weak pointers are nilled a batch 
+* at a time under its WeakClearLocks stripe instead of its side table 
+* lock. Such clears are counted, with histograms of how long the side 
+* table lock was held and how long the whole clear took.
+**********************************************************************/
+StripedMap<spinlock_t> WeakClearLocks;
+
+struct weak_clear_stats_t {
+    std::atomic<uint64_t> clears;
+    std::atomic<uint64_t> batched;
+    std::atomic<uint64_t> referrers;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> lockHistogram[OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> clearHistogram[OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS];
+};
+
+static weak_clear_stats_t weakClearStats;
+
+static unsigned weak_histogram_bucket(uint64_t time)
+{
+    unsigned bucket = time ? 63 - __builtin_clzll(time) : 0;
+    return std::min(bucket, (unsigned)OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS - 1);
+}
+
+static void weak_count(std::atomic<uint64_t>& counter, uint64_t n = 1)
+{
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+void _objc_getWeakClearStatistics(objc_weak_clear_statistics *stats)
+{
+    auto& s = weakClearStats;
+    stats->clears = s.clears.load(std::memory_order_relaxed);
+    stats->batched = s.batched.load(std::memory_order_relaxed);
+    stats->referrers = s.referrers.load(std::memory_order_relaxed);
+    stats->batches = s.batches.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS; i++) {
+        stats->lockHistogram[i] = 
+            s.lockHistogram[i].load(std::memory_order_relaxed);
+        stats->clearHistogram[i] = 
+            s.clearHistogram[i].load(std::memory_order_relaxed);
+    }
+}
+
+void weak_print_statistics(void)
+{
+    objc_weak_clear_statistics stats;
+    _objc_getWeakClearStatistics(&stats);
+
+    _objc_inform("WEAK: %llu objects with more than %u weak references "
+                 "deallocated, %llu of them in %llu batches, "
+                 "%llu weak variables nilled", 
+                 (unsigned long long)stats.clears, WEAK_CLEAR_BATCH, 
+                 (unsigned long long)stats.batched, 
+                 (unsigned long long)stats.batches, 
+                 (unsigned long long)stats.referrers);
+    if (stats.clears == 0) return;
+
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    _objc_inform("WEAK:   at least        lock held       whole clear");
+    for (unsigned i = 0; i < OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS; i++) {
+        if (!stats.lockHistogram[i]  &&  !stats.clearHistogram[i]) continue;
+        double us = (double)(1ull << i) * timebase.numer / timebase.denom 
+            / 1000.0;
+        _objc_inform("WEAK:   %10.1f us  %12llu  %12llu", i ? us : 0.0, 
+                     (unsigned long long)stats.lockHistogram[i], 
+                     (unsigned long long)stats.clearHistogram[i]);
+    }
+}
+
+
+/***********************************************************************
+* Lock-free weak loads.
+* With OBJC_LOCKFREE_WEAK_LOAD, objc_loadWeakRetained() reads a weak 
+* pointer and retains the object without the object's side table lock. 
+* Once dealloc has begun the retain fails, but the object's memory must 
+* still be there for it to fail on. So loads run inside a weak load 
+* epoch, and weak_free() retires a weakly-referenced object instead of 
+* freeing it. Only objects freed by object_dispose() get here; one 
+* freed any other way while a load reads it is a use after free. 
+* weak_clear_no_lock() has nilled every weak pointer to the object by 
+* then, so the object can be freed as soon as the loads in progress 
+* have finished. 
+* Each thread keeps its own garbage, so freeing takes no lock. Advancing 
+* the epoch scans every thread's record, so a thread does it only once 
+* it has retired WEAK_COLLECT_COUNT objects or WEAK_COLLECT_BYTES bytes 
+* since it last did. A thread that exits with garbage still pending 
+* hands it to weakOrphans, and the next thread to collect frees it.
+**********************************************************************/
+#define WEAK_COLLECT_COUNT 64
+#define WEAK_COLLECT_BYTES (16*1024)
+
+struct weak_thread_t {
+    objc::EpochRecord *record;
+    objc::EpochGarbage garbage;
+    // Retired since this thread last collected.
+    size_t retiredCount;
+    size_t retiredBytes;
+    // Next in weakOrphans, once the thread has exited.
+    weak_thread_t *nextOrphan;
+};
+
+static objc::EpochDomain weakLoadEpochs;
+static tls_key_t weak_tls;
+static std::atomic<weak_thread_t *> weakOrphans;
+
+static void weak_orphan(weak_thread_t *thread)
+{
+    weak_thread_t *head = weakOrphans.load(std::memory_order_relaxed);
+    do {
+        thread->nextOrphan = head;
+    } while (!weakOrphans.compare_exchange_weak(head, thread, 
+                                                std::memory_order_release, 
+                                                std::memory_order_relaxed));
+}
+
+static void weak_dispose(void *p, size_t)
+{
+    free(p);
+}
+
+static void weak_collect(weak_thread_t *thread)
+{
+    thread->retiredCount = 0;
+    thread->retiredBytes = 0;
+    weakLoadEpochs.tryAdvance();
+    weakLoadEpochs.tryAdvance();
+    thread->garbage.collect(weakLoadEpochs, weak_dispose);
+
+    if (!weakOrphans.load(std::memory_order_relaxed)) return;
+
+    // Take the whole list, so no other thread collects the same garbage.
+    weak_thread_t *orphan = weakOrphans.exchange(nil, std::memory_order_acquire);
+    while (orphan) {
+        weak_thread_t *next = orphan->nextOrphan;
+        orphan->garbage.collect(weakLoadEpochs, weak_dispose);
+        if (orphan->garbage.pendingCount() > 0) {
+            weak_orphan(orphan);
+        } else {
+            orphan->garbage.freeStorage();
+            delete orphan;
+        }
+        orphan = next;
+    }
+}
+
+static void weak_tls_destroy(void *value)
+{
+    auto thread = (weak_thread_t *)value;
+    weakLoadEpochs.releaseRecord(thread->record);
+    thread->record = nil;
+    if (thread->garbage.pendingCount() > 0) weak_collect(thread);
+    // Loads running right now may hold up what is left. 
+    // Don't wait for them.
+    if (thread->garbage.pendingCount() > 0) {
+        weak_orphan(thread);
+        return;
+    }
+    thread->garbage.freeStorage();
+    delete thread;
+}
+
+static weak_thread_t *weak_thread()
+{
+    INIT_ONCE_PTR(weak_tls, tls_create(&weak_tls_destroy), (void)0);
+
+    auto thread = (weak_thread_t *)tls_get(weak_tls);
+    if (!thread) {
+        thread = new weak_thread_t();
+        thread->record = weakLoadEpochs.acquireRecord();
+        tls_set(weak_tls, thread);
+    }
+    return thread;
+}
+
+objc::EpochRecord *weak_load_begin(void)
+{
+    objc::EpochRecord *record = weak_thread()->record;
+    weakLoadEpochs.enter(record);
+    return record;
+}
+
+void weak_load_end(objc::EpochRecord *record)
+{
+    weakLoadEpochs.exit(record);
+}
+
+void weak_free(id referent_id)
+{
+    objc_object *referent = (objc_object *)referent_id;
+
+    // A load reads the isa before it knows whether the object can be 
+    // retained without the lock, so any weakly-referenced object may 
+    // have been read. A raw isa keeps that bit in the side table, 
+    // where clearDeallocating() has erased it, so keep all of those.
+    if (!LockFreeWeakLoad  ||  
+        (referent->hasNonpointerIsa()  &&  !referent->isWeaklyReferenced()))
+    {
+        free(referent);
+        return;
+    }
+
+    weak_thread_t *thread = weak_thread();
+    size_t size = malloc_size(referent);
+    thread->garbage.retire(referent, size, weakLoadEpochs.current());
+    thread->retiredCount++;
+    thread->retiredBytes += size;
+    if (thread->retiredCount >= WEAK_COLLECT_COUNT  ||  
+        thread->retiredBytes >= WEAK_COLLECT_BYTES)
+    {
+        weak_collect(thread);
+    }
+}
+
 /** 
  * Grow the entry's hash table of referrers. Rehashes each
  * of the referrers.
@@ -78,8 +376,11 @@ static void grow_refs_and_insert(weak_entry_t *entry,
 {
     assert(entry->out_of_line());
 
+    // The table spilled from inline storage is not a power of two 
+    // if WEAK_INLINE_COUNT is not.
     size_t old_size = TABLE_SIZE(entry);
-    size_t new_size = old_size ? old_size * 2 : 8;
+    size_t new_size = 8;
+    while (new_size < old_size * 2) new_size *= 2;
 
     size_t num_refs = entry->num_refs;
     weak_referrer_t *old_refs = entry->referrers;
@@ -140,104 +441,151 @@ static void append_referrer(weak_entry_t *entry, objc_object **new_referrer)
     if (entry->num_refs >= TABLE_SIZE(entry) * 3/4) {
         return grow_refs_and_insert(entry, new_referrer);
     }
-    size_t begin = w_hash_pointer(new_referrer) & (entry->mask);
-    size_t index = begin;
-    size_t hash_displacement = 0;
-    while (entry->referrers[index] != nil) {
-        hash_displacement++;
-        index = (index+1) & entry->mask;
-        if (index == begin) bad_weak_table(entry);
-    }
-    if (hash_displacement > entry->max_hash_displacement) {
-        entry->max_hash_displacement = hash_displacement;
+    weak_referrer_t ref = new_referrer;
+    if (!weak_referrer_probe::insert(entry->referrers, entry->mask, ref, 
+                                     &entry->max_hash_displacement)) 
+    {
+        bad_weak_table(entry);
     }
-    weak_referrer_t &ref = entry->referrers[index];
-    ref = new_referrer;
     entry->num_refs++;
 }
 
+static void unknown_referrer(objc_object **old_referrer)
+{
+    _objc_inform("Attempted to unregister unknown __weak variable "
+                 "at %p. This is probably incorrect use of "
+                 "objc_storeWeak() and objc_loadWeak(). "
+                 "Break on objc_weak_error to debug.\n", 
+                 old_referrer);
+    objc_weak_error();
+}
+
+/** 
+ * Remove old_referrer from an inline referrer set, if it's present.
+ * Returns false if it was not.
+ */
+static bool remove_inline_referrer(weak_entry_t *entry, 
+                                   objc_object **old_referrer)
+{
+    for (size_t i = 0; i < WEAK_INLINE_COUNT; i++) {
+        if (entry->inline_referrers[i] == old_referrer) {
+            entry->inline_referrers[i] = nil;
+            return true;
+        }
+    }
+    return false;
+}
+
 /** 
  * Remove old_referrer from set of referrers, if it's present.
  * Does not remove duplicates, because duplicates should not exist. 
  * 
- * @todo this is slow if old_referrer is not present. Is this ever the case? 
+ * A missing referrer can happen: after a weak pointer moved to another 
+ * object, its old object's address may be reused by an object with weak 
+ * references of its own. Robin Hood ordering lets the lookup for it stop
+ * at the first slot whose referrer is closer to home.
  *
  * @param entry The entry holding the referrers.
  * @param old_referrer The referrer to remove. 
+ * @param complain Whether a missing referrer is an error.
  */
-static void remove_referrer(weak_entry_t *entry, objc_object **old_referrer)
+static void remove_referrer(weak_entry_t *entry, objc_object **old_referrer, 
+                            bool complain)
 {
     if (! entry->out_of_line()) {
-        for (size_t i = 0; i < WEAK_INLINE_COUNT; i++) {
-            if (entry->inline_referrers[i] == old_referrer) {
-                entry->inline_referrers[i] = nil;
-                return;
-            }
+        if (!remove_inline_referrer(entry, old_referrer)  &&  complain) {
+            unknown_referrer(old_referrer);
         }
-        _objc_inform("Attempted to unregister unknown __weak variable "
-                     "at %p. This is probably incorrect use of "
-                     "objc_storeWeak() and objc_loadWeak(). "
-                     "Break on objc_weak_error to debug.\n", 
-                     old_referrer);
-        objc_weak_error();
         return;
     }
 
-    size_t begin = w_hash_pointer(old_referrer) & (entry->mask);
-    size_t index = begin;
-    size_t hash_displacement = 0;
-    while (entry->referrers[index] != old_referrer) {
-        index = (index+1) & entry->mask;
-        if (index == begin) bad_weak_table(entry);
-        hash_displacement++;
-        if (hash_displacement > entry->max_hash_displacement) {
-            _objc_inform("Attempted to unregister unknown __weak variable "
-                         "at %p. This is probably incorrect use of "
-                         "objc_storeWeak() and objc_loadWeak(). "
-                         "Break on objc_weak_error to debug.\n", 
-                         old_referrer);
-            objc_weak_error();
+    size_t index = 
+        weak_referrer_probe::find(entry->referrers, entry->mask, 
+                                  entry->max_hash_displacement, old_referrer);
+    if (index == weak_referrer_probe::NotFound) {
+        if (complain) unknown_referrer(old_referrer);
+        return;
+    }
+    weak_referrer_probe::erase(entry->referrers, entry->mask, index);
+    entry->num_refs--;
+}
+
+/** 
+ * Remove old_referrer from a detached entry's referrers, if it's present.
+ * weak_clear_detached() walks the referrers by index while this runs 
+ * between its batches, so the slot is nilled in place rather than 
+ * shifting the rest of its run back past the walk. The resulting holes 
+ * mean the lookup cannot stop early.
+ *
+ * @param entry The detached entry holding the referrers.
+ * @param old_referrer The referrer to remove. 
+ * @param complain Whether a missing referrer is an error.
+ */
+static void remove_detached_referrer(weak_entry_t *entry, 
+                                     objc_object **old_referrer, 
+                                     bool complain)
+{
+    if (! entry->out_of_line()) {
+        if (!remove_inline_referrer(entry, old_referrer)  &&  complain) {
+            unknown_referrer(old_referrer);
+        }
+        return;
+    }
+
+    size_t index = w_hash_pointer(old_referrer) & (entry->mask);
+    for (size_t hash_displacement = 0; 
+         hash_displacement <= entry->max_hash_displacement;
+         hash_displacement++)
+    {
+        if (entry->referrers[index] == old_referrer) {
+            entry->referrers[index] = nil;
+            entry->num_refs--;
             return;
         }
+        index = (index+1) & entry->mask;
     }
-    entry->referrers[index] = nil;
-    entry->num_refs--;
+    if (complain) unknown_referrer(old_referrer);
 }
 
 /** 
  * Add new_entry to the object's table of weak references.
  * Does not check whether the referent is already in the table.
+ * new_entry is used as scratch space and is clobbered.
  */
 static void weak_entry_insert(weak_table_t *weak_table, weak_entry_t *new_entry)
 {
     weak_entry_t *weak_entries = weak_table->weak_entries;
     assert(weak_entries != nil);
 
-    size_t begin = hash_pointer(new_entry->referent) & (weak_table->mask);
-    size_t index = begin;
-    size_t hash_displacement = 0;
-    while (weak_entries[index].referent != nil) {
-        index = (index+1) & weak_table->mask;
-        if (index == begin) bad_weak_table(weak_entries);
-        hash_displacement++;
+    if (!weak_entry_probe::insert(weak_entries, weak_table->mask, *new_entry,
+                                  &weak_table->max_hash_displacement)) 
+    {
+        bad_weak_table(weak_entries);
     }
-
-    weak_entries[index] = *new_entry;
     weak_table->num_entries++;
-
-    if (hash_displacement > weak_table->max_hash_displacement) {
-        weak_table->max_hash_displacement = hash_displacement;
-    }
 }
 
 
+// Entries that fill a cache line are allocated on cache line boundaries.
+static weak_entry_t *weak_entries_alloc(size_t count)
+{
+#if WEAK_ENTRY_SIZE
+    weak_entry_t *entries = (weak_entry_t *)
+        malloc_zone_memalign(malloc_default_zone(), WEAK_ENTRY_SIZE, 
+                             count * sizeof(weak_entry_t));
+    bzero(entries, count * sizeof(weak_entry_t));
+    return entries;
+#else
+    return (weak_entry_t *)calloc(count, sizeof(weak_entry_t));
+#endif
+}
+
 static void weak_resize(weak_table_t *weak_table, size_t new_size)
 {
     size_t old_size = TABLE_SIZE(weak_table);
 
     weak_entry_t *old_entries = weak_table->weak_entries;
-    weak_entry_t *new_entries = (weak_entry_t *)
-        calloc(new_size, sizeof(weak_entry_t));
+    weak_entry_t *new_entries = weak_entries_alloc(new_size);
 
     weak_table->mask = new_size - 1;
     weak_table->weak_entries = new_entries;
@@ -272,28 +620,40 @@ static void weak_compact_maybe(weak_table_t *weak_table)
 {
     size_t old_size = TABLE_SIZE(weak_table);
 
-    // Shrink if larger than 1024 buckets and at most 1/16 full.
-    if (old_size >= 1024  && old_size / 16 >= weak_table->num_entries) {
-        weak_resize(weak_table, old_size / 8);
+    // Shrink if larger than 1024 buckets and at most 1/8 full.
+    // Erasing no longer leaves holes behind, so this need not wait 
+    // for the table to empty out as far.
+    if (old_size >= 1024  && old_size / 8 >= weak_table->num_entries) {
+        weak_resize(weak_table, old_size / 4);
         // leaves new table no more than 1/2 full
     }
 }
 
 
 /**
- * Remove entry from the zone's table of weak references.
+ * Remove entry from the zone's table of weak references, 
+ * leaving its out-of-line referrers to the caller.
  */
-static void weak_entry_remove(weak_table_t *weak_table, weak_entry_t *entry)
+static void weak_entry_erase(weak_table_t *weak_table, weak_entry_t *entry)
 {
-    // remove entry
-    if (entry->out_of_line()) free(entry->referrers);
-    bzero(entry, sizeof(*entry));
+    weak_entry_probe::erase(weak_table->weak_entries, weak_table->mask, 
+                            entry - weak_table->weak_entries);
 
     weak_table->num_entries--;
 
     weak_compact_maybe(weak_table);
 }
 
+/**
+ * Remove entry from the zone's table of weak references.
+ */
+static void weak_entry_remove(weak_table_t *weak_table, weak_entry_t *entry)
+{
+    // remove entry
+    if (entry->out_of_line()) free(entry->referrers);
+    weak_entry_erase(weak_table, entry);
+}
+
 
 /** 
  * Return the weak reference table entry for the given referent. 
@@ -314,19 +674,28 @@ weak_entry_for_referent(weak_table_t *weak_table, objc_object *referent)
 
     if (!weak_entries) return nil;
 
-    size_t begin = hash_pointer(referent) & weak_table->mask;
-    size_t index = begin;
-    size_t hash_displacement = 0;
-    while (weak_table->weak_entries[index].referent != referent) {
-        index = (index+1) & weak_table->mask;
-        if (index == begin) bad_weak_table(weak_table->weak_entries);
-        hash_displacement++;
-        if (hash_displacement > weak_table->max_hash_displacement) {
-            return nil;
-        }
+    size_t index = 
+        weak_entry_probe::find(weak_entries, weak_table->mask, 
+                               weak_table->max_hash_displacement, referent);
+    if (index == weak_entry_probe::NotFound) return nil;
+
+    return &weak_entries[index];
+}
+
+/** 
+ * Return the detached entry for the given referent, whose referrers 
+ * are being cleared. If there is none, return NULL. 
+ */
+static weak_detached_t *
+weak_detached_for_referent(weak_table_t *weak_table, objc_object *referent)
+{
+    for (weak_detached_t *detached = weak_table->detached; 
+         detached; 
+         detached = detached->next)
+    {
+        if (detached->entry.referent == referent) return detached;
     }
-    
-    return &weak_table->weak_entries[index];
+    return nil;
 }
 
 /** 
@@ -344,9 +713,9 @@ weak_entry_for_referent(weak_table_t *weak_table, objc_object *referent)
  * @param referent The object.
  * @param referrer The weak reference.
  */
-void
-weak_unregister_no_lock(weak_table_t *weak_table, id referent_id, 
-                        id *referrer_id)
+static void
+weak_unregister(weak_table_t *weak_table, id referent_id, 
+                id *referrer_id, bool complain)
 {
     objc_object *referent = (objc_object *)referent_id;
     objc_object **referrer = (objc_object **)referrer_id;
@@ -356,7 +725,7 @@ weak_unregister_no_lock(weak_table_t *weak_table, id referent_id,
     if (!referent) return;
 
     if ((entry = weak_entry_for_referent(weak_table, referent))) {
-        remove_referrer(entry, referrer);
+        remove_referrer(entry, referrer, complain);
         bool empty = true;
         if (entry->out_of_line()  &&  entry->num_refs != 0) {
             empty = false;
@@ -374,11 +743,33 @@ weak_unregister_no_lock(weak_table_t *weak_table, id referent_id,
             weak_entry_remove(weak_table, entry);
         }
     }
+    else if (weak_detached_t *detached = 
+             weak_detached_for_referent(weak_table, referent)) 
+    {
+        // The referent is deallocating. Take the referrer out before 
+        // its storage can go away under weak_clear_detached().
+        mutex_locker_t lock(WeakClearLocks[referent]);
+        remove_detached_referrer(&detached->entry, referrer, complain);
+    }
 
     // Do not set *referrer = nil. objc_storeWeak() requires that the 
     // value not change.
 }
 
+void
+weak_unregister_no_lock(weak_table_t *weak_table, id referent_id, 
+                        id *referrer_id)
+{
+    weak_unregister(weak_table, referent_id, referrer_id, true);
+}
+
+void
+weak_unregister_moved_no_lock(weak_table_t *weak_table, id referent_id, 
+                              id *referrer_id)
+{
+    weak_unregister(weak_table, referent_id, referrer_id, false);
+}
+
 /** 
  * Registers a new (object, weak pointer) pair. Creates a new weak
  * object entry if it does not exist.
@@ -451,14 +842,49 @@ weak_is_registered_no_lock(weak_table_t *weak_table, id referent_id)
 #endif
 
 
+/** 
+ * Nils a weak pointer if it still holds referent. 
+ * Call with a lock that storeWeak() needs in order to unregister the 
+ * weak pointer from referent: its side table lock, or its WeakClearLocks 
+ * stripe once its entry is detached.
+ * 
+ * @return true if the weak pointer was nilled.
+ */
+static bool weak_clear_referrer(objc_object **referrer, objc_object *referent)
+{
+    // storeWeak() publishes a new value without our lock, 
+    // so nil the variable only if it still holds referent.
+    objc_object *value = referent;
+    if (__atomic_compare_exchange_n(referrer, &value, (objc_object *)nil,
+                                    false, __ATOMIC_SEQ_CST, 
+                                    __ATOMIC_SEQ_CST))
+    {
+        return true;
+    }
+    if (value  &&  !weak_move_in_progress(referrer)) {
+        _objc_inform("__weak variable at %p holds %p instead of %p. "
+                     "This is probably incorrect use of "
+                     "objc_storeWeak() and objc_loadWeak(). "
+                     "Break on objc_weak_error to debug.\n", 
+                     referrer, (void*)value, (void*)referent);
+        objc_weak_error();
+    }
+    return false;
+}
+
 /** 
  * Called by dealloc; nils out all weak pointers that point to the 
  * provided object so that they can no longer be used.
+ * An object with more than WEAK_CLEAR_BATCH referrers is instead 
+ * moved to the table's detached list, for the caller to clear 
+ * with weak_clear_detached() after dropping the lock.
  * 
  * @param weak_table 
  * @param referent The object being deallocated. 
+ * 
+ * @return The detached entry, or nil if every weak pointer was nilled.
  */
-void 
+weak_detached_t *
 weak_clear_no_lock(weak_table_t *weak_table, id referent_id) 
 {
     objc_object *referent = (objc_object *)referent_id;
@@ -467,7 +893,25 @@ weak_clear_no_lock(weak_table_t *weak_table, id referent_id)
     if (entry == nil) {
         /// XXX shouldn't happen, but does with mismatched CF/objc
         //printf("XXX no entry for clear deallocating %p\n", referent);
-        return;
+        return nil;
+    }
+
+    bool heavy = entry->out_of_line()  &&  
+        entry->num_refs > WEAK_CLEAR_BATCH;
+    uint64_t start = heavy ? nanoseconds() : 0;
+
+    if (heavy  &&  !DisableBatchedWeakClear) {
+        auto detached = (weak_detached_t *)malloc(sizeof(weak_detached_t));
+        detached->entry = *entry;
+        detached->start = start;
+        detached->next = weak_table->detached;
+        weak_table->detached = detached;
+        weak_entry_erase(weak_table, entry);
+
+        auto& lockTime = weakClearStats.lockHistogram
+            [weak_histogram_bucket(nanoseconds() - start)];
+        weak_count(lockTime);
+        return detached;
     }
 
     // zero out references
@@ -483,23 +927,85 @@ weak_clear_no_lock(weak_table_t *weak_table, id referent_id)
         count = WEAK_INLINE_COUNT;
     }
     
+    size_t nilled = 0;
     for (size_t i = 0; i < count; ++i) {
         objc_object **referrer = referrers[i];
-        if (referrer) {
-            if (*referrer == referent) {
-                *referrer = nil;
-            }
-            else if (*referrer) {
-                _objc_inform("__weak variable at %p holds %p instead of %p. "
-                             "This is probably incorrect use of "
-                             "objc_storeWeak() and objc_loadWeak(). "
-                             "Break on objc_weak_error to debug.\n", 
-                             referrer, (void*)*referrer, (void*)referent);
-                objc_weak_error();
-            }
-        }
+        if (referrer  &&  weak_clear_referrer(referrer, referent)) nilled++;
     }
     
     weak_entry_remove(weak_table, entry);
+
+    if (heavy) {
+        unsigned bucket = weak_histogram_bucket(nanoseconds() - start);
+        weak_count(weakClearStats.clears);
+        weak_count(weakClearStats.referrers, nilled);
+        weak_count(weakClearStats.lockHistogram[bucket]);
+        weak_count(weakClearStats.clearHistogram[bucket]);
+    }
+    return nil;
 }
 
+
+/** 
+ * Nils out the weak pointers of an entry detached by weak_clear_no_lock(), 
+ * WEAK_CLEAR_BATCH at a time. Between batches other threads may 
+ * unregister weak pointers from the entry.
+ * 
+ * @param detached The detached entry. 
+ */
+void
+weak_clear_detached(weak_detached_t *detached)
+{
+    weak_entry_t *entry = &detached->entry;
+    objc_object *referent = entry->referent;
+    spinlock_t& clearLock = WeakClearLocks[referent];
+
+    // Nothing is registered with a deallocating object, 
+    // so the referrer table does not grow.
+    size_t count = TABLE_SIZE(entry);
+    size_t nilled = 0;
+    size_t batches = 0;
+    for (size_t begin = 0; begin < count; begin += WEAK_CLEAR_BATCH) {
+        size_t end = std::min(begin + WEAK_CLEAR_BATCH, count);
+        mutex_locker_t lock(clearLock);
+        for (size_t i = begin; i < end; i++) {
+            objc_object **referrer = entry->referrers[i];
+            if (referrer  &&  weak_clear_referrer(referrer, referent)) {
+                nilled++;
+            }
+        }
+        batches++;
+    }
+
+    weak_count(weakClearStats.referrers, nilled);
+    weak_count(weakClearStats.batches, batches);
+}
+
+
+/** 
+ * Removes an entry cleared by weak_clear_detached() from the 
+ * detached list, and frees it.
+ * 
+ * @param weak_table 
+ * @param detached The detached entry. 
+ */
+void
+weak_detached_remove_no_lock(weak_table_t *weak_table, 
+                             weak_detached_t *detached)
+{
+    weak_detached_t **link = &weak_table->detached;
+    while (*link != detached) {
+        if (!*link) bad_weak_table(weak_table->weak_entries);
+        link = &(*link)->next;
+    }
+    *link = detached->next;
+
+    auto& clearTime = weakClearStats.clearHistogram
+        [weak_histogram_bucket(nanoseconds() - detached->start)];
+    weak_count(weakClearStats.clears);
+    weak_count(weakClearStats.batched);
+    weak_count(clearTime);
+
+    free(detached->entry.referrers);
+    free(detached);
+}
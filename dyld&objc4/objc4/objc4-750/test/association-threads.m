@@ -0,0 +1,90 @@
+// TEST_CONFIG MEM=mrc
+
+// Associated objects are stored in stripes chosen by object address.
+// Set, replace, read and remove associations on many objects from
+// several threads at once, and check every value is released exactly
+// once, whether by replacement, removal or deallocation.
+
+#include "test.h"
+#include "testroot.i"
+
+#define THREADS 8
+#define OBJECTS 1000
+#define KEYS 4
+
+static int values;
+
+@interface Value : TestRoot @end
+@implementation Value
+-(void)dealloc {
+    OSAtomicIncrement32(&values);
+    [super dealloc];
+}
+@end
+
+static char keys[KEYS];
+static id objs[THREADS][OBJECTS];
+
+static void *threadfn(void *arg)
+{
+    int t = (int)(intptr_t)arg;
+    id *mine = objs[t];
+
+    for (int i = 0; i < OBJECTS; i++) {
+        mine[i] = [TestRoot new];
+        for (int k = 0; k < KEYS; k++) {
+            id value = [Value new];
+            objc_setAssociatedObject(mine[i], &keys[k], value,
+                                     OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+            [value release];
+        }
+    }
+
+    for (int i = 0; i < OBJECTS; i++) {
+        // Replace one value, clear another, read the rest.
+        id value = [Value new];
+        objc_setAssociatedObject(mine[i], &keys[0], value,
+                                 OBJC_ASSOCIATION_RETAIN);
+        testassert(objc_getAssociatedObject(mine[i], &keys[0]) == value);
+        [value release];
+        objc_setAssociatedObject(mine[i], &keys[1], nil,
+                                 OBJC_ASSOCIATION_ASSIGN);
+        testassert(objc_getAssociatedObject(mine[i], &keys[1]) == nil);
+        testassert(objc_getAssociatedObject(mine[i], &keys[2]) != nil);
+    }
+
+    for (int i = 0; i < OBJECTS; i++) {
+        if (i % 2) objc_removeAssociatedObjects(mine[i]);
+        [mine[i] release];
+    }
+
+    return NULL;
+}
+
+int main()
+{
+    pthread_t th[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&th[t], NULL, &threadfn, (void *)(intptr_t)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+
+    // Each object had KEYS values and one replacement.
+    testassert(values == THREADS * OBJECTS * (KEYS + 1));
+    testassert(TestRootDealloc == THREADS * OBJECTS * (KEYS + 2));
+
+    testprintf("Associations survive a class change\n");
+    values = 0;
+    id obj = [TestRoot new];
+    id value = [Value new];
+    objc_setAssociatedObject(obj, &keys[0], value, OBJC_ASSOCIATION_RETAIN);
+    [value release];
+    object_setClass(obj, [Value class]);
+    testassert(objc_getAssociatedObject(obj, &keys[0]) == value);
+    [obj release];
+    testassert(values == 2);
+
+    succeed(__FILE__);
+}
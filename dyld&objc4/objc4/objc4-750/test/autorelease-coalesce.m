@@ -0,0 +1,111 @@
+// TEST_ENV OBJC_AUTORELEASE_COALESCING=4
+// TEST_CONFIG MEM=mrc
+
+// With OBJC_AUTORELEASE_COALESCING, repeated autoreleases of an object
+// among the top entries of the pool share one entry and a count. Check
+// that each pop still sends exactly one -release per -autorelease,
+// that counts never cross a pool boundary, and that entries straddling
+// page boundaries are released correctly.
+
+#include "test.h"
+#include "testroot.i"
+
+#define LOTS 100000
+
+static void resetCounts(void)
+{
+    TestRootRelease = 0;
+    TestRootDealloc = 0;
+}
+
+int main()
+{
+    testprintf("Repeats of one object\n");
+    resetCounts();
+    void *pool = objc_autoreleasePoolPush();
+    id obj = [TestRoot new];
+    for (int i = 0; i < 1000; i++) [[obj retain] autorelease];
+    testassert([obj retainCount] == 1001);
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootRelease == 1000);
+    testassert([obj retainCount] == 1);
+    [obj release];
+    testassert(TestRootDealloc == 1);
+
+    testprintf("Repeats within the window\n");
+    resetCounts();
+    pool = objc_autoreleasePoolPush();
+    id objs[4];
+    for (int i = 0; i < 4; i++) objs[i] = [TestRoot new];
+    for (int r = 0; r < 100; r++) {
+        for (int i = 0; i < 4; i++) [[objs[i] retain] autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootRelease == 400);
+    for (int i = 0; i < 4; i++) {
+        testassert([objs[i] retainCount] == 1);
+        [objs[i] release];
+    }
+
+    testprintf("Repeats beyond the window\n");
+    resetCounts();
+    pool = objc_autoreleasePoolPush();
+    id many[9];
+    for (int i = 0; i < 9; i++) many[i] = [TestRoot new];
+    for (int r = 0; r < 100; r++) {
+        for (int i = 0; i < 9; i++) [[many[i] retain] autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootRelease == 900);
+    for (int i = 0; i < 9; i++) [many[i] release];
+    testassert(TestRootDealloc == 9);
+
+    testprintf("Pool boundaries\n");
+    resetCounts();
+    obj = [TestRoot new];
+    void *outer = objc_autoreleasePoolPush();
+    [[obj retain] autorelease];
+    void *inner = objc_autoreleasePoolPush();
+    [[obj retain] autorelease];
+    [[obj retain] autorelease];
+    objc_autoreleasePoolPop(inner);
+    testassert(TestRootRelease == 2);
+    testassert([obj retainCount] == 2);
+    [[obj retain] autorelease];
+    objc_autoreleasePoolPop(outer);
+    testassert(TestRootRelease == 4);
+    testassert([obj retainCount] == 1);
+    [obj release];
+
+    testprintf("Page boundaries\n");
+    resetCounts();
+    obj = [TestRoot new];
+    int repeats = 0;
+    pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < LOTS; i++) {
+        // Runs of one to three repeats between other objects.
+        for (int r = 0; r <= i % 3; r++, repeats++) {
+            [[obj retain] autorelease];
+        }
+        [[TestRoot new] autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootRelease == LOTS + repeats);
+    testassert(TestRootDealloc == LOTS);
+    testassert([obj retainCount] == 1);
+    [obj release];
+
+    testprintf("Objects deallocated by the pop\n");
+    resetCounts();
+    pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < 1000; i++) {
+        id o = [TestRoot new];
+        [[o retain] autorelease];
+        [[o retain] autorelease];
+        [o autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootDealloc == 1000);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,110 @@
+// TEST_CONFIG
+
+// Changing one method evicts only its selector from the method caches
+// of the class and its subclasses. Check that every cache sees the
+// change and that the other entries stay cached.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define COUNT 32
+
+@interface Base : TestRoot @end
+@implementation Base
+-(int)a { return 1; }
+-(int)b { return 2; }
+@end
+
+@interface Sub : Base @end
+@implementation Sub @end
+
+@interface SubSub : Sub @end
+@implementation SubSub @end
+
+@interface Base (Missing)
+-(int)c;
+@end
+
+static int one(id self __unused, SEL _cmd __unused) { return 11; }
+static int two(id self __unused, SEL _cmd __unused) { return 22; }
+static int three(id self __unused, SEL _cmd __unused) { return 33; }
+
+static SEL sels[COUNT];
+
+static uint64_t entries(Class cls)
+{
+    struct objc_method_cache_statistics stats;
+    _objc_getMethodCacheStatistics(cls, &stats);
+    return stats.entries;
+}
+
+int main()
+{
+    int (*call)(id, SEL) = (int(*)(id, SEL))objc_msgSend;
+    Class base = [Base class];
+    Class sub = [Sub class];
+    Base *b = [Base new];
+    Sub *s = [Sub new];
+    SubSub *ss = [SubSub new];
+
+    for (int i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "filler%d", i);
+        sels[i] = sel_registerName(name);
+        testassert(class_addMethod(base, sels[i], (IMP)three, "i@:"));
+    }
+    for (int i = 0; i < COUNT; i++) {
+        testassert(call(s, sels[i]) == 33);
+        testassert(call(ss, sels[i]) == 33);
+    }
+    testassert([b a] == 1  &&  [s a] == 1  &&  [ss a] == 1);
+    testassert([b b] == 2  &&  [s b] == 2  &&  [ss b] == 2);
+
+    testprintf("method_setImplementation\n");
+    uint64_t before = entries(sub);
+    IMP old = method_setImplementation(class_getInstanceMethod(base, @selector(a)), (IMP)one);
+    testassert(entries(sub) == before - 1);
+    testassert([b a] == 11  &&  [s a] == 11  &&  [ss a] == 11);
+    testassert([b b] == 2  &&  [s b] == 2  &&  [ss b] == 2);
+
+    testprintf("method_exchangeImplementations\n");
+    method_exchangeImplementations(class_getInstanceMethod(base, @selector(a)),
+                                   class_getInstanceMethod(base, @selector(b)));
+    testassert([b a] == 2  &&  [s a] == 2  &&  [ss a] == 2);
+    testassert([b b] == 11  &&  [s b] == 11  &&  [ss b] == 11);
+    method_exchangeImplementations(class_getInstanceMethod(base, @selector(a)),
+                                   class_getInstanceMethod(base, @selector(b)));
+    method_setImplementation(class_getInstanceMethod(base, @selector(a)), old);
+    testassert([ss a] == 1  &&  [ss b] == 2);
+
+    testprintf("class_addMethod overriding a superclass\n");
+    testassert(class_addMethod(sub, @selector(a), (IMP)two, "i@:"));
+    testassert([b a] == 1  &&  [s a] == 22  &&  [ss a] == 22);
+    for (int i = 0; i < COUNT; i++) {
+        testassert(call(ss, sels[i]) == 33);
+    }
+
+    testprintf("class_addMethod for a missing selector\n");
+    testassert(!class_respondsToSelector(object_getClass(ss), @selector(c)));
+    testassert(!class_respondsToSelector(object_getClass(s), @selector(c)));
+    testassert(class_addMethod(base, @selector(c), (IMP)three, "i@:"));
+    testassert(class_respondsToSelector(object_getClass(ss), @selector(c)));
+    testassert([ss c] == 33  &&  [s c] == 33  &&  [b c] == 33);
+
+    testprintf("Repeated evictions and refills\n");
+    Method m = class_getInstanceMethod(base, sels[0]);
+    for (int i = 0; i < 1000; i++) {
+        method_setImplementation(m, (i & 1) ? (IMP)three : (IMP)one);
+        int expected = (i & 1) ? 33 : 11;
+        testassert(call(ss, sels[0]) == expected);
+        testassert(call(s, sels[i % COUNT]) == (i % COUNT ? 33 : expected));
+    }
+
+    RELEASE_VAR(b);
+    RELEASE_VAR(s);
+    RELEASE_VAR(ss);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,69 @@
+// TEST_CONFIG
+
+// Fill one class's method cache from many threads at once, through
+// several resizes, and check every call reaches the right implementation.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define THREADS 16
+#define COUNT 512
+#define PASSES 64
+
+@interface Filler : TestRoot @end
+@implementation Filler @end
+
+static SEL sels[COUNT];
+static id obj;
+
+static void *threadfn(void *arg)
+{
+    uintptr_t (*call)(id, SEL) = (uintptr_t(*)(id, SEL))objc_msgSend;
+    uintptr_t start = (uintptr_t)arg;
+
+    // Each thread walks the selectors from a different place so
+    // fills and resizes interleave.
+    for (int pass = 0; pass < PASSES; pass++) {
+        for (uintptr_t n = 0; n < COUNT; n++) {
+            uintptr_t i = (start + n) % COUNT;
+            testassert(call(obj, sels[i]) == i);
+        }
+        if (pass % 8 == 0) {
+            // Setting an implementation flushes or evicts the cache.
+            Method m = class_getInstanceMethod([Filler class], sels[start]);
+            method_setImplementation(m, method_getImplementation(m));
+        }
+    }
+
+    return NULL;
+}
+
+int main()
+{
+    Class cls = [Filler class];
+    for (uintptr_t i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "method%lu", (unsigned long)i);
+        sels[i] = sel_registerName(name);
+        IMP imp = imp_implementationWithBlock(^(id self __unused) {
+            return i;
+        });
+        testassert(class_addMethod(cls, sels[i], imp, "L@:"));
+    }
+
+    obj = [Filler new];
+
+    pthread_t th[THREADS];
+    for (uintptr_t t = 0; t < THREADS; t++) {
+        pthread_create(&th[t], NULL, &threadfn, (void *)(t * COUNT / THREADS));
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+
+    RELEASE_VAR(obj);
+
+    succeed(__FILE__);
+}
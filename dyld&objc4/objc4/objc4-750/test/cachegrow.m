@@ -0,0 +1,56 @@
+// TEST_CONFIG
+
+// Call enough distinct methods to make a method cache grow several
+// times, and check every call still reaches the right implementation.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define COUNT 1000
+
+@interface Grower : TestRoot @end
+@implementation Grower @end
+
+static SEL sels[COUNT];
+
+int main()
+{
+    Class cls = [Grower class];
+    for (uintptr_t i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "method%lu", (unsigned long)i);
+        sels[i] = sel_registerName(name);
+        IMP imp = imp_implementationWithBlock(^(id self __unused) {
+            return i;
+        });
+        testassert(class_addMethod(cls, sels[i], imp, "L@:"));
+    }
+
+    id obj = [Grower new];
+    uintptr_t (*call)(id, SEL) = (uintptr_t(*)(id, SEL))objc_msgSend;
+
+    // Each pass adds to the cache; later passes hit what earlier ones
+    // filled, across every resize in between.
+    for (int pass = 0; pass < 3; pass++) {
+        for (uintptr_t i = 0; i < COUNT; i++) {
+            testassert(call(obj, sels[i]) == i);
+            if (i % 7 == 0) {
+                testassert(call(obj, sels[i/2]) == i/2);
+            }
+        }
+    }
+
+    // Replacing one method still reaches the new implementation.
+    IMP imp = imp_implementationWithBlock(^(id self __unused) {
+        return (uintptr_t)COUNT;
+    });
+    method_setImplementation(class_getInstanceMethod(cls, sels[COUNT/2]), imp);
+    testassert(call(obj, sels[COUNT/2]) == COUNT);
+    testassert(call(obj, sels[COUNT/2 + 1]) == COUNT/2 + 1);
+
+    RELEASE_VAR(obj);
+
+    succeed(__FILE__);
+}
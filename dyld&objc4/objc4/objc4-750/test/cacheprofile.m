@@ -0,0 +1,94 @@
+// TEST_CONFIG
+
+// Write a method cache profile, then run again with OBJC_CACHE_PROFILE
+// set and check that the profiled cache is filled at +initialize
+// without changing which methods are called.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+
+@interface Profiled : TestRoot
+-(int)one;
+-(int)two;
+@end
+@implementation Profiled
+-(int)one { return 1; }
+-(int)two { return 2; }
++(BOOL)resolveInstanceMethod:(SEL)sel {
+    if (sel == @selector(resolved)) {
+        class_addMethod(self, sel, imp_implementationWithBlock(^(id obj __unused) { return 3; }), "i@:");
+        return YES;
+    }
+    return NO;
+}
+@end
+
+@interface Profiled (Resolved)
+-(int)resolved;
+-(int)missing;
+@end
+
+static bool profileHas(const char *path, const char *text)
+{
+    FILE *f = fopen(path, "r");
+    testassert(f);
+    char buf[4096];
+    size_t len = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[len] = '\0';
+    return strstr(buf, text) != NULL;
+}
+
+int main(int argc __unused, char **argv)
+{
+    const char *path = getenv("OBJC_CACHE_PROFILE");
+
+    if (!path) {
+        testprintf("Record a profile\n");
+        char tmp[] = "/tmp/cacheprofile.XXXXXX";
+        int fd = mkstemp(tmp);
+        testassert(fd >= 0);
+        close(fd);
+
+        Profiled *obj = [Profiled new];
+        testassert([obj one] == 1);
+        testassert([obj two] == 2);
+        testassert([obj resolved] == 3);
+        testassert(!class_respondsToSelector(object_getClass(obj), @selector(missing)));
+        RELEASE_VAR(obj);
+
+        testassert(_objc_writeMethodCacheProfile(tmp));
+        testassert(profileHas(tmp, "objc-cache-profile 1\n"));
+        testassert(profileHas(tmp, "-Profiled "));
+        testassert(profileHas(tmp, " one"));
+        testassert(!profileHas(tmp, " missing"));
+
+        // Entries for another image are ignored.
+        FILE *f = fopen(tmp, "a");
+        fprintf(f, "@/no/such/image\n-Profiled one two missing\n");
+        fclose(f);
+
+        setenv("OBJC_CACHE_PROFILE", tmp, 1);
+        execv(argv[0], argv);
+        fail("exec failed");
+    }
+
+    testprintf("Replay the profile\n");
+    [Profiled class];
+
+    struct objc_method_cache_statistics stats;
+    _objc_getMethodCacheStatistics([Profiled class], &stats);
+    testassert(stats.entries >= 3);
+    testassert(stats.capacity >= stats.entries);
+
+    Profiled *obj = [Profiled new];
+    testassert([obj one] == 1);
+    testassert([obj two] == 2);
+    testassert(!class_respondsToSelector(object_getClass(obj), @selector(missing)));
+    RELEASE_VAR(obj);
+
+    unlink(path);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,101 @@
+// TEST_CONFIG
+
+// Replaced method caches are freed once every thread has passed a
+// quiescent state. Keep other threads messaging through caches while
+// they are replaced, and check the replaced caches are freed without
+// those threads ever seeing a wrong implementation.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define THREADS 8
+#define COUNT 256
+#define ROUNDS 200
+
+@interface Reclaimed : TestRoot @end
+@implementation Reclaimed @end
+
+static SEL sels[COUNT];
+static id obj;
+static volatile int stop;
+
+static void *messenger(void *arg __unused)
+{
+    uintptr_t (*call)(id, SEL) = (uintptr_t(*)(id, SEL))objc_msgSend;
+    while (!stop) {
+        @autoreleasepool {
+            for (uintptr_t i = 0; i < COUNT; i++) {
+                testassert(call(obj, sels[i]) == i);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *idler(void *arg __unused)
+{
+    // A thread that never looks up a method must not hold up reclamation.
+    while (!stop) usleep(1000);
+    return NULL;
+}
+
+int main()
+{
+    Class cls = [Reclaimed class];
+    for (uintptr_t i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "method%lu", (unsigned long)i);
+        sels[i] = sel_registerName(name);
+        IMP imp = imp_implementationWithBlock(^(id self __unused) {
+            return i;
+        });
+        testassert(class_addMethod(cls, sels[i], imp, "L@:"));
+    }
+    obj = [Reclaimed new];
+
+    struct objc_method_cache_statistics before;
+    _objc_getMethodCacheStatistics(nil, &before);
+
+    pthread_t th[THREADS + 1];
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&th[t], NULL, &messenger, NULL);
+    }
+    pthread_create(&th[THREADS], NULL, &idler, NULL);
+
+    // Each new class's cache grows several times, and each growth
+    // retires the old buckets while the messengers may be reading them.
+    for (int r = 0; r < ROUNDS; r++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Reclaimed%d", r);
+        Class c = objc_allocateClassPair(cls, name, 0);
+        objc_registerClassPair(c);
+        id o = [c new];
+        uintptr_t (*call)(id, SEL) = (uintptr_t(*)(id, SEL))objc_msgSend;
+        for (uintptr_t i = 0; i < COUNT; i++) {
+            testassert(call(o, sels[i]) == i);
+        }
+        RELEASE_VAR(o);
+        Method m = class_getInstanceMethod(cls, sels[r % COUNT]);
+        method_setImplementation(m, method_getImplementation(m));
+    }
+
+    stop = 1;
+    for (int t = 0; t <= THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+
+    struct objc_method_cache_statistics after;
+    _objc_getMethodCacheStatistics(nil, &after);
+    testprintf("reclaimed %llu caches, %llu bytes pending\n",
+               (unsigned long long)(after.reclaims - before.reclaims),
+               (unsigned long long)after.garbageBytes);
+    testassert(after.reclaims > before.reclaims);
+    testassert(after.collectedBytes > before.collectedBytes);
+    testassert(after.maxReclaimLatency >= before.maxReclaimLatency);
+
+    RELEASE_VAR(obj);
+
+    succeed(__FILE__);
+}
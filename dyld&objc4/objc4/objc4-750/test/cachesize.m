@@ -0,0 +1,102 @@
+// TEST_ENV OBJC_DISABLE_CACHE_EVICTION=YES
+// TEST_CONFIG
+
+// A flushed method cache that was mostly empty shrinks one step, a busy
+// one keeps its size, and no cache grows past the capacity limit.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define BUSY 256
+#define LIMIT 65536
+#define LOTS (LIMIT - LIMIT/8)
+
+@interface Sized : TestRoot @end
+@implementation Sized @end
+
+@interface Huge : TestRoot @end
+@implementation Huge @end
+
+static SEL sels[LOTS];
+
+static uintptr_t (*call)(id, SEL) = (uintptr_t(*)(id, SEL))objc_msgSend;
+
+static void addMethods(Class cls, int count)
+{
+    for (uintptr_t i = 0; i < (uintptr_t)count; i++) {
+        if (!sels[i]) {
+            char name[32];
+            snprintf(name, sizeof(name), "method%lu", (unsigned long)i);
+            sels[i] = sel_registerName(name);
+        }
+        IMP imp = imp_implementationWithBlock(^(id self __unused) {
+            return i;
+        });
+        testassert(class_addMethod(cls, sels[i], imp, "L@:"));
+    }
+}
+
+static uint64_t capacity(Class cls)
+{
+    struct objc_method_cache_statistics stats;
+    _objc_getMethodCacheStatistics(cls, &stats);
+    return stats.capacity;
+}
+
+static void flush(Class cls)
+{
+    // With OBJC_DISABLE_CACHE_EVICTION this flushes the whole cache.
+    Method m = class_getInstanceMethod(cls, sels[0]);
+    method_setImplementation(m, method_getImplementation(m));
+}
+
+int main()
+{
+    Class cls = [Sized class];
+    addMethods(cls, BUSY);
+    id obj = [Sized new];
+
+    testprintf("A busy cache keeps its size\n");
+    for (uintptr_t i = 0; i < BUSY; i++) testassert(call(obj, sels[i]) == i);
+    uint64_t busy = capacity(cls);
+    testassert(busy >= BUSY);
+    flush(cls);
+    testassert(call(obj, sels[1]) == 1);
+    testassert(capacity(cls) == busy);
+
+    testprintf("An idle cache shrinks one step per flush\n");
+    // One entry fits in 4 buckets, so caches of 32 or more shrink.
+    uint64_t last = busy;
+    for (int i = 0; i < 20; i++) {
+        flush(cls);
+        testassert(call(obj, sels[1]) == 1);
+        uint64_t now = capacity(cls);
+        if (last >= 32) testassert(now == last / 2);
+        else testassert(now == last);
+        last = now;
+    }
+    testassert(last == 16);
+
+    testprintf("And regrows when it is busy again\n");
+    for (uintptr_t i = 0; i < BUSY; i++) testassert(call(obj, sels[i]) == i);
+    testassert(capacity(cls) == busy);
+
+    testprintf("No cache grows past the limit\n");
+    Class huge = [Huge class];
+    addMethods(huge, LOTS);
+    id hugeObj = [Huge new];
+    for (int pass = 0; pass < 2; pass++) {
+        for (uintptr_t i = 0; i < LOTS; i++) {
+            testassert(call(hugeObj, sels[i]) == i);
+            if (i % 4096 == 0) testassert(capacity(huge) <= LIMIT);
+        }
+    }
+    testassert(capacity(huge) == LIMIT);
+
+    RELEASE_VAR(obj);
+    RELEASE_VAR(hugeObj);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,102 @@
+// TEST_ENV OBJC_RECORD_CACHE_STATISTICS=YES
+// TEST_CONFIG
+
+// Check the method cache counters reported by
+// _objc_getMethodCacheStatistics() and _objc_writeMethodCacheStatistics().
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define COUNT 64
+
+@interface Counted : TestRoot @end
+@implementation Counted @end
+
+static SEL sels[COUNT];
+
+int main()
+{
+    Class cls = [Counted class];
+    for (uintptr_t i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "method%lu", (unsigned long)i);
+        sels[i] = sel_registerName(name);
+        IMP imp = imp_implementationWithBlock(^(id self __unused) {
+            return i;
+        });
+        testassert(class_addMethod(cls, sels[i], imp, "L@:"));
+    }
+
+    id obj = [Counted new];
+    uintptr_t (*call)(id, SEL) = (uintptr_t(*)(id, SEL))objc_msgSend;
+
+    struct objc_method_cache_statistics before;
+    _objc_getMethodCacheStatistics(cls, &before);
+
+    testprintf("Misses, fills and expansions\n");
+    for (uintptr_t i = 0; i < COUNT; i++) {
+        testassert(call(obj, sels[i]) == i);
+    }
+    struct objc_method_cache_statistics after;
+    _objc_getMethodCacheStatistics(cls, &after);
+    testassert(after.misses - before.misses >= COUNT);
+    testassert(after.fills - before.fills >= COUNT);
+    testassert(after.expansions > before.expansions);
+    testassert(after.entries >= COUNT);
+    testassert(after.capacity > after.entries);
+    testassert(after.probes >= after.entries);
+    testassert(after.maxProbes >= 1);
+
+    testprintf("Hits are not counted\n");
+    before = after;
+    for (uintptr_t i = 0; i < COUNT; i++) {
+        testassert(call(obj, sels[i]) == i);
+    }
+    _objc_getMethodCacheStatistics(cls, &after);
+    testassert(after.misses == before.misses);
+    testassert(after.fills == before.fills);
+
+    testprintf("Changed methods\n");
+    Method m = class_getInstanceMethod(cls, sels[0]);
+    method_setImplementation(m, method_getImplementation(m));
+    _objc_getMethodCacheStatistics(cls, &after);
+    testassert(after.flushes + after.evictions >
+               before.flushes + before.evictions);
+
+    testprintf("The aggregate covers every class\n");
+    struct objc_method_cache_statistics total;
+    _objc_getMethodCacheStatistics(nil, &total);
+    testassert(total.misses >= after.misses);
+    testassert(total.fills >= after.fills);
+    testassert(total.entries >= after.entries);
+    testassert(total.capacity >= after.capacity);
+
+    testprintf("Write the statistics\n");
+    char path[] = "/tmp/cachestats.XXXXXX";
+    int fd = mkstemp(path);
+    testassert(fd >= 0);
+    close(fd);
+    testassert(_objc_writeMethodCacheStatistics(path));
+    FILE *f = fopen(path, "r");
+    testassert(f);
+    char line[1024];
+    testassert(fgets(line, sizeof(line), f));
+    testassert(0 == strncmp(line, "class\tmeta\tmisses\t", 18));
+    testassert(fgets(line, sizeof(line), f));
+    testassert(0 == strncmp(line, "*\t0\t", 4));
+    bool found = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (0 == strncmp(line, "Counted\t0\t", 10)) found = true;
+    }
+    testassert(found);
+    fclose(f);
+    unlink(path);
+
+    testassert(!_objc_writeMethodCacheStatistics("/no/such/dir/stats"));
+
+    RELEASE_VAR(obj);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,144 @@
+// TEST_ENV OBJC_DEFERRED_DEALLOC_THREADS=2 OBJC_DEFERRED_DEALLOC_LIMIT=256
+// TEST_CONFIG MEM=mrc
+
+// Instances of a class that implements +_deallocsInBackground, and
+// objects deallocated by objc_autoreleasePoolPopDeferringDealloc(),
+// run -dealloc on the releasing thread and the rest of their teardown
+// on a reaper thread. Check where each part runs, that weak references
+// stop loading at once, and that memory pressure and the queue limit
+// make the releasing thread do the teardown itself.
+
+#include "test.h"
+#include "testroot.i"
+
+#define LOTS 1000
+
+static pthread_t mainThread;
+static int deallocsOnMain;
+static int valueDeallocs;
+static int valueDeallocsOnMain;
+
+@interface Background : TestRoot @end
+@implementation Background
++(void)_deallocsInBackground { }
+-(void)dealloc {
+    if (pthread_equal(pthread_self(), mainThread)) deallocsOnMain++;
+    [super dealloc];
+}
+@end
+
+@interface Value : TestRoot @end
+@implementation Value
+-(void)dealloc {
+    OSAtomicIncrement32(&valueDeallocs);
+    if (pthread_equal(pthread_self(), mainThread)) {
+        OSAtomicIncrement32(&valueDeallocsOnMain);
+    }
+    [super dealloc];
+}
+@end
+
+static const char *key = "key";
+
+static id withValue(id obj)
+{
+    id value = [Value new];
+    objc_setAssociatedObject(obj, &key, value, OBJC_ASSOCIATION_RETAIN);
+    [value release];
+    return obj;
+}
+
+static void waitForReapers(void)
+{
+    struct objc_deferred_dealloc_statistics stats;
+    for (int i = 0; i < 10000; i++) {
+        _objc_getDeferredDeallocStatistics(&stats);
+        if (stats.depth == 0  &&  stats.reclaimed == stats.deferred) return;
+        usleep(1000);
+    }
+    fail("deferred deallocations were not reclaimed");
+}
+
+static void reset(void)
+{
+    waitForReapers();
+    deallocsOnMain = valueDeallocs = valueDeallocsOnMain = 0;
+}
+
+int main()
+{
+    mainThread = pthread_self();
+    struct objc_deferred_dealloc_statistics before, after;
+
+    testprintf("Teardown runs on a reaper\n");
+    reset();
+    _objc_getDeferredDeallocStatistics(&before);
+    id obj = withValue([Background new]);
+    id weak = nil;
+    objc_storeWeak(&weak, obj);
+    [obj release];
+    testassert(deallocsOnMain == 1);
+    testassert(objc_loadWeakRetained(&weak) == nil);
+    waitForReapers();
+    testassert(valueDeallocs == 1);
+    testassert(valueDeallocsOnMain == 0);
+    testassert(weak == nil);
+    _objc_getDeferredDeallocStatistics(&after);
+    testassert(after.deferred == before.deferred + 1);
+    testassert(after.reclaimed == before.reclaimed + 1);
+    uint64_t latencies = 0;
+    for (int i = 0; i < OBJC_DEFERRED_DEALLOC_HISTOGRAM_BUCKETS; i++) {
+        latencies += after.latencyHistogram[i];
+    }
+    testassert(latencies == after.reclaimed);
+
+    testprintf("Pools popped with deferred dealloc\n");
+    reset();
+    _objc_getDeferredDeallocStatistics(&before);
+    void *pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < 100; i++) {
+        [withValue([TestRoot new]) autorelease];
+    }
+    objc_autoreleasePoolPopDeferringDealloc(pool);
+    waitForReapers();
+    testassert(valueDeallocs == 100);
+    _objc_getDeferredDeallocStatistics(&after);
+    testassert(after.deferred + after.refused >=
+               before.deferred + before.refused + 100);
+
+    testprintf("Ordinary objects are not deferred\n");
+    reset();
+    _objc_getDeferredDeallocStatistics(&before);
+    [withValue([TestRoot new]) release];
+    testassert(valueDeallocs == 1  &&  valueDeallocsOnMain == 1);
+    _objc_getDeferredDeallocStatistics(&after);
+    testassert(after.deferred == before.deferred);
+
+    testprintf("Memory pressure\n");
+    reset();
+    _objc_setDeferredDeallocUnderPressure(true);
+    _objc_getDeferredDeallocStatistics(&before);
+    for (int i = 0; i < 10; i++) {
+        [withValue([Background new]) release];
+    }
+    testassert(valueDeallocs == 10  &&  valueDeallocsOnMain == 10);
+    _objc_getDeferredDeallocStatistics(&after);
+    testassert(after.deferred == before.deferred);
+    testassert(after.refused == before.refused + 10);
+    _objc_setDeferredDeallocUnderPressure(false);
+
+    testprintf("The queue limit\n");
+    reset();
+    _objc_getDeferredDeallocStatistics(&before);
+    for (int i = 0; i < LOTS; i++) {
+        [withValue([Background new]) release];
+    }
+    waitForReapers();
+    testassert(valueDeallocs == LOTS);
+    _objc_getDeferredDeallocStatistics(&after);
+    testassert(after.deferred + after.refused ==
+               before.deferred + before.refused + LOTS);
+    testassert(after.maxDepth <= 256);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,127 @@
+// TEST_CFLAGS -Wl,-no_objc_category_merging
+// TEST_CONFIG
+
+// Classes with several method lists search them through a method index.
+// Check that it gives the same answers as searching the lists in order:
+// categories override the class, and methods added later are found.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define ADDED 300
+
+@interface Indexed : TestRoot @end
+@implementation Indexed
+-(int)base { return 0; }
+-(int)one { return 0; }
+-(int)two { return 0; }
+-(int)three { return 0; }
+@end
+
+@interface Indexed (cat1) @end
+@implementation Indexed (cat1)
+-(int)one { return 1; }
+-(int)cat1 { return 1; }
+@end
+
+@interface Indexed (cat2) @end
+@implementation Indexed (cat2)
+-(int)two { return 2; }
+-(int)cat2 { return 2; }
+@end
+
+@interface Indexed (cat3) @end
+@implementation Indexed (cat3)
+-(int)three { return 3; }
+-(int)cat3 { return 3; }
+@end
+
+@interface Indexed (Declared)
+-(int)base;
+-(int)one;
+-(int)two;
+-(int)three;
+-(int)cat1;
+-(int)cat2;
+-(int)cat3;
+@end
+
+static SEL added[ADDED];
+
+int main()
+{
+    Class cls = [Indexed class];
+    Indexed *obj = [Indexed new];
+
+    testprintf("Categories override the class\n");
+    testassert([obj base] == 0);
+    testassert([obj one] == 1);
+    testassert([obj two] == 2);
+    testassert([obj three] == 3);
+    testassert([obj cat1] == 1);
+    testassert([obj cat2] == 2);
+    testassert([obj cat3] == 3);
+    testassert(!class_respondsToSelector(cls, @selector(missing)));
+
+    testprintf("Added methods are found\n");
+    int (*call)(id, SEL) = (int(*)(id, SEL))objc_msgSend;
+    for (int i = 0; i < ADDED; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "added%d", i);
+        added[i] = sel_registerName(name);
+        IMP imp = imp_implementationWithBlock(^(id self __unused) {
+            return 100 + i;
+        });
+        testassert(class_addMethod(cls, added[i], imp, "i@:"));
+        testassert(!class_addMethod(cls, added[i], imp, "i@:"));
+        testassert(call(obj, added[i]) == 100 + i);
+        testassert([obj one] == 1);
+    }
+    for (int i = 0; i < ADDED; i++) {
+        testassert(call(obj, added[i]) == 100 + i);
+    }
+
+    testprintf("Replaced methods are found\n");
+    class_replaceMethod(cls, @selector(two),
+                        imp_implementationWithBlock(^(id self __unused) {
+                            return 22;
+                        }), "i@:");
+    testassert([obj two] == 22);
+    testassert(method_getImplementation(class_getInstanceMethod(cls, @selector(two))) == class_getMethodImplementation(cls, @selector(two)));
+
+    testprintf("Methods added in bulk are found\n");
+    SEL names[2] = { @selector(one), sel_registerName("bulk") };
+    IMP imps[2] = {
+        imp_implementationWithBlock(^(id self __unused) { return -1; }),
+        imp_implementationWithBlock(^(id self __unused) { return 44; }),
+    };
+    const char *types[2] = { "i@:", "i@:" };
+    uint32_t failedCount = 0;
+    SEL *failed = class_addMethodsBulk(cls, names, imps, types, 2, &failedCount);
+    testassert(failedCount == 1);
+    testassert(failed  &&  failed[0] == @selector(one));
+    free(failed);
+    testassert([obj one] == 1);
+    testassert(call(obj, names[1]) == 44);
+
+    testprintf("Lookups agree with method lists\n");
+    unsigned int count;
+    Method *methods = class_copyMethodList(cls, &count);
+    testassert(count == 10 + ADDED + 1);
+    for (unsigned int i = 0; i < count; i++) {
+        // The first method list that has a selector wins.
+        SEL sel = method_getName(methods[i]);
+        bool first = true;
+        for (unsigned int j = 0; j < i; j++) {
+            if (method_getName(methods[j]) == sel) first = false;
+        }
+        if (first) testassert(class_getInstanceMethod(cls, sel) == methods[i]);
+    }
+    free(methods);
+
+    RELEASE_VAR(obj);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,80 @@
+// TEST_CONFIG
+
+// A class whose only method list is large is searched through a
+// selector-only copy of that list. Check every method is found, that
+// missing selectors are not, and that bulk additions see what exists.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+#define M(n) -(int)m##n { return n; }
+#define M8(n) M(n##0) M(n##1) M(n##2) M(n##3) M(n##4) M(n##5) M(n##6) M(n##7)
+
+@interface Large : TestRoot @end
+@implementation Large
+M8(1) M8(2) M8(3) M8(4) M8(5)
+@end
+
+#define COUNT 40
+
+int main()
+{
+    Class cls = [Large class];
+    Large *obj = [Large new];
+    int (*call)(id, SEL) = (int(*)(id, SEL))objc_msgSend;
+
+    testprintf("Every method is found\n");
+    unsigned int count;
+    Method *methods = class_copyMethodList(cls, &count);
+    testassert(count == COUNT);
+    for (unsigned int i = 0; i < count; i++) {
+        SEL sel = method_getName(methods[i]);
+        testassert(class_getInstanceMethod(cls, sel) == methods[i]);
+        int expected = atoi(sel_getName(sel) + 1);
+        testassert(call(obj, sel) == expected);
+    }
+    free(methods);
+
+    testprintf("Missing selectors are not found\n");
+    for (int i = 0; i < 100; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "m%d", i);
+        SEL sel = sel_registerName(name);
+        bool present = (i >= 10  &&  i < 58  &&  i % 10 < 8);
+        testassert(class_respondsToSelector(cls, sel) == present);
+        snprintf(name, sizeof(name), "n%d", i);
+        testassert(!class_respondsToSelector(cls, sel_registerName(name)));
+    }
+
+    testprintf("Bulk additions skip existing methods\n");
+    SEL names[COUNT];
+    IMP imps[COUNT];
+    const char *types[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), i % 2 ? "m%d" : "n%d", 10 + i/8*10 + i%8);
+        names[i] = sel_registerName(name);
+        imps[i] = imp_implementationWithBlock(^(id self __unused) {
+            return -1;
+        });
+        types[i] = "i@:";
+    }
+    uint32_t failedCount = 0;
+    SEL *failed = class_addMethodsBulk(cls, names, imps, types, COUNT, &failedCount);
+    testassert(failedCount == COUNT/2);
+    for (uint32_t i = 0; i < failedCount; i++) {
+        testassert(sel_getName(failed[i])[0] == 'm');
+    }
+    free(failed);
+    for (int i = 0; i < COUNT; i++) {
+        int result = call(obj, names[i]);
+        if (i % 2) testassert(result == atoi(sel_getName(names[i]) + 1));
+        else testassert(result == -1);
+    }
+
+    RELEASE_VAR(obj);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,93 @@
+// TEST_CONFIG
+
+// Selectors a class does not respond to are remembered. Check that
+// adding the method later, to the class or to a superclass, is seen,
+// and that the resolver is not asked again in between.
+
+#include "test.h"
+#include "testroot.i"
+#include <objc/runtime.h>
+
+#define MISSING 64
+
+static int resolves;
+
+@interface Super : TestRoot @end
+@implementation Super
++(BOOL)resolveInstanceMethod:(SEL)sel {
+    if (sel == @selector(resolved)) {
+        class_addMethod(self, sel, imp_implementationWithBlock(^(id obj __unused) { return 7; }), "i@:");
+        return YES;
+    }
+    resolves++;
+    return NO;
+}
+@end
+
+@interface Sub : Super @end
+@implementation Sub @end
+
+@interface Super (Missing)
+-(int)missing;
+-(int)resolved;
+@end
+
+static int missing_fn(id self __unused, SEL _cmd __unused) { return 3; }
+
+int main()
+{
+    Super *sup = [Super new];
+    Sub *sub = [Sub new];
+    SEL sel = @selector(missing);
+
+    testprintf("Misses are stable\n");
+    for (int i = 0; i < 10; i++) {
+        testassert(!class_respondsToSelector(object_getClass(sup), sel));
+        testassert(!class_respondsToSelector(object_getClass(sub), sel));
+        testassert(!class_respondsToSelector([Sub class], sel));
+    }
+    int before = resolves;
+    testassert(!class_respondsToSelector(object_getClass(sub), sel));
+    testassert(resolves == before);
+
+    testprintf("Resolved methods are found\n");
+    testassert(class_respondsToSelector(object_getClass(sub), @selector(resolved)));
+    testassert([sub resolved] == 7);
+
+    testprintf("Adding to a superclass is seen by a subclass\n");
+    testassert(class_addMethod([Super class], sel, (IMP)missing_fn, "i@:"));
+    testassert(class_respondsToSelector(object_getClass(sup), sel));
+    testassert(class_respondsToSelector(object_getClass(sub), sel));
+    testassert(class_respondsToSelector([Sub class], sel));
+    testassert([sub missing] == 3);
+
+    testprintf("More misses than the cache holds\n");
+    SEL sels[MISSING];
+    for (int i = 0; i < MISSING; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "missing%d", i);
+        sels[i] = sel_registerName(name);
+        testassert(!class_respondsToSelector(object_getClass(sub), sels[i]));
+    }
+    for (int i = 0; i < MISSING; i++) {
+        testassert(!class_respondsToSelector(object_getClass(sub), sels[i]));
+    }
+    testassert(class_addMethod([Sub class], sels[MISSING/2], (IMP)missing_fn, "i@:"));
+    for (int i = 0; i < MISSING; i++) {
+        testassert(class_respondsToSelector(object_getClass(sub), sels[i]) == (i == MISSING/2));
+        testassert(!class_respondsToSelector(object_getClass(sup), sels[i]));
+    }
+
+    testprintf("Classes that were never messaged\n");
+    Class cls = objc_allocateClassPair([Super class], "Unmessaged", 0);
+    objc_registerClassPair(cls);
+    testassert(!class_respondsToSelector(cls, sels[0]));
+    testassert(!class_respondsToSelector(cls, sels[0]));
+    testassert(class_addMethod(cls, sels[0], (IMP)missing_fn, "i@:"));
+    testassert(class_respondsToSelector(cls, sels[0]));
+
+    RELEASE_VAR(sup);
+    RELEASE_VAR(sub);
+
+    succeed(__FILE__);
+}
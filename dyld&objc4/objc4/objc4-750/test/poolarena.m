@@ -0,0 +1,68 @@
+// TEST_ENV OBJC_PRINT_POOL_HIGHWATER=YES OBJC_POOL_PAGE_SIZE=40000 OBJC_POOL_ARENA=1
+// TEST_CONFIG MEM=mrc
+/*
+TEST_RUN_OUTPUT
+objc\[\d+\]: POOL HIGHWATER: pool pages of 65536 bytes; page cache of \d+ pages per thread and \d+ global
+objc\[\d+\]: POOL HIGHWATER: pool arenas of up to 1 MB
+(objc\[\d+\]: POOL HIGHWATER: .*
+)*OK: poolarena.m
+objc\[\d+\]: POOL HIGHWATER: .*
+END
+*/
+
+// OBJC_POOL_PAGE_SIZE rounds up to a power of two pages, and
+// OBJC_POOL_ARENA carves pool pages from arenas that grow as pools
+// deepen. Fill pools deeper than one arena on several threads, so
+// pages come from chained arenas and are reused, and check every
+// object is released once.
+
+#include "test.h"
+#include "testroot.i"
+
+#define THREADS 4
+// More than 1 MB of entries.
+#define DEEP 200000
+
+static void cycle(int rounds)
+{
+    for (int r = 0; r < rounds; r++) {
+        void *outer = objc_autoreleasePoolPush();
+        for (int i = 0; i < DEEP; i++) {
+            [[TestRoot new] autorelease];
+            if (i % 50000 == 0) {
+                // Pop a pool that spans a page boundary.
+                void *inner = objc_autoreleasePoolPush();
+                for (int j = 0; j < 10000; j++) [[TestRoot new] autorelease];
+                objc_autoreleasePoolPop(inner);
+            }
+        }
+        objc_autoreleasePoolPop(outer);
+    }
+}
+
+static void *threadfn(void *arg __unused)
+{
+    cycle(3);
+    return NULL;
+}
+
+int main()
+{
+    const int perRound = DEEP + (DEEP/50000) * 10000;
+
+    cycle(3);
+    testassert(TestRootDealloc == 3 * perRound);
+
+    for (int generation = 0; generation < 2; generation++) {
+        pthread_t th[THREADS];
+        for (int t = 0; t < THREADS; t++) {
+            pthread_create(&th[t], NULL, &threadfn, NULL);
+        }
+        for (int t = 0; t < THREADS; t++) {
+            pthread_join(th[t], NULL);
+        }
+    }
+    testassert(TestRootDealloc == (3 + 2*THREADS*3) * perRound);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,86 @@
+// TEST_ENV OBJC_BATCHED_POOL_DRAIN=YES
+// TEST_CONFIG MEM=mrc
+
+// With OBJC_BATCHED_POOL_DRAIN, pool pops release their contents a
+// batch at a time. Check that repeated entries, objects whose -dealloc
+// releases other pool entries, and objects autoreleased from -dealloc
+// during the pop are all released exactly as an unbatched pop would.
+
+#include "test.h"
+#include "testroot.i"
+
+#define COUNT 5000
+
+@interface Holder : TestRoot {
+@public
+    id held;
+    bool autoreleaseInDealloc;
+}
+@end
+@implementation Holder
+-(void)dealloc {
+    [held release];
+    if (autoreleaseInDealloc) {
+        // Lands in the pool being popped, which releases it too.
+        [[TestRoot new] autorelease];
+    }
+    [super dealloc];
+}
+@end
+
+int main()
+{
+    testprintf("Plain objects, some autoreleased repeatedly\n");
+    void *pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < COUNT; i++) {
+        id obj = [TestRoot new];
+        [obj autorelease];
+        if (i % 3 == 0) [[obj retain] autorelease];
+        if (i % 7 == 0) [[obj retain] autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootDealloc == COUNT);
+
+    testprintf("Objects that release other entries\n");
+    TestRootDealloc = 0;
+    pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < COUNT; i++) {
+        Holder *h = [Holder new];
+        h->held = [TestRoot new];
+        // The held object is in the pool after its holder, and before.
+        [[h->held retain] autorelease];
+        [h autorelease];
+        [[h->held retain] autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootDealloc == 2*COUNT);
+
+    testprintf("Objects autoreleased during the pop\n");
+    TestRootDealloc = 0;
+    pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < COUNT; i++) {
+        Holder *h = [Holder new];
+        h->autoreleaseInDealloc = true;
+        [h autorelease];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootDealloc == 2*COUNT);
+
+    testprintf("Objects that survive the pop\n");
+    TestRootDealloc = 0;
+    id survivors[100];
+    pool = objc_autoreleasePoolPush();
+    for (int i = 0; i < 100; i++) {
+        survivors[i] = [[TestRoot new] autorelease];
+        [survivors[i] retain];
+    }
+    objc_autoreleasePoolPop(pool);
+    testassert(TestRootDealloc == 0);
+    for (int i = 0; i < 100; i++) {
+        testassert([survivors[i] retainCount] == 1);
+        [survivors[i] release];
+    }
+    testassert(TestRootDealloc == 100);
+
+    succeed(__FILE__);
+}
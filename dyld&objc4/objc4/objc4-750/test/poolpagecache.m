@@ -0,0 +1,67 @@
+// TEST_ENV OBJC_PRINT_POOL_HIGHWATER=YES OBJC_POOL_PAGE_CACHE=2 OBJC_POOL_PAGE_CACHE_GLOBAL=4
+// TEST_CONFIG MEM=mrc
+/*
+TEST_RUN_OUTPUT
+objc\[\d+\]: POOL HIGHWATER: pool pages of \d+ bytes; page cache of 2 pages per thread and 4 global
+(objc\[\d+\]: POOL HIGHWATER: .*
+)*OK: poolpagecache.m
+objc\[\d+\]: POOL HIGHWATER: \d+ pool pages allocated, [1-9]\d* allocations avoided by the page cache; \d+ KB resident in pool pages, \d+ KB of it cached \(at most \d+ KB\)
+END
+*/
+
+// Pool pages freed by a pop are cached for the next push, per thread
+// and then globally. Push and pop pools several pages deep on threads
+// that come and go, and check every object is released exactly once
+// and that the page cache avoided allocations.
+
+#include "test.h"
+#include "testroot.i"
+
+#define THREADS 4
+#define ROUNDS 50
+// Several pages' worth of entries, whatever the page size.
+#define DEEP 20000
+
+static void cycle(void)
+{
+    for (int r = 0; r < ROUNDS; r++) {
+        void *outer = objc_autoreleasePoolPush();
+        for (int i = 0; i < DEEP; i++) {
+            [[TestRoot new] autorelease];
+            if (i % 5000 == 0) {
+                void *inner = objc_autoreleasePoolPush();
+                [[TestRoot new] autorelease];
+                objc_autoreleasePoolPop(inner);
+            }
+        }
+        objc_autoreleasePoolPop(outer);
+    }
+}
+
+static void *threadfn(void *arg __unused)
+{
+    cycle();
+    return NULL;
+}
+
+int main()
+{
+    cycle();
+    testassert(TestRootDealloc == ROUNDS * (DEEP + DEEP/5000));
+
+    // Each generation of threads starts with the pages the last one
+    // left in the global cache.
+    for (int generation = 0; generation < 3; generation++) {
+        pthread_t th[THREADS];
+        for (int t = 0; t < THREADS; t++) {
+            pthread_create(&th[t], NULL, &threadfn, NULL);
+        }
+        for (int t = 0; t < THREADS; t++) {
+            pthread_join(th[t], NULL);
+        }
+    }
+    testassert(TestRootDealloc ==
+               (1 + 3*THREADS) * ROUNDS * (DEEP + DEEP/5000));
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,116 @@
+// TEST_CONFIG MEM=mrc
+
+// Instances of a class that implements +_usesBiasedRefcount count
+// retains on their allocating thread without atomics. Check retain
+// counts from the owner and from other threads, that an instance
+// released last by another thread is deallocated by the owner's next
+// autorelease pool pop or exit, and that weak references and
+// subclasses behave as usual. Without SUPPORT_BIASED_RC these are
+// ordinary objects and the same results hold.
+
+#include "test.h"
+#include "testroot.i"
+
+#define LOTS 1000
+#define THREADS 4
+
+@interface Biased : TestRoot @end
+@implementation Biased
++(void)_usesBiasedRefcount { }
+@end
+
+// Subclass ivars are laid out after the inherited biased count.
+@interface BiasedSub : Biased {
+    id ivar __unused;
+}
+@end
+@implementation BiasedSub @end
+
+static id shared;
+
+static void *retainReleaseLots(void *arg __unused)
+{
+    for (int i = 0; i < LOTS; i++) [shared retain];
+    for (int i = 0; i < LOTS; i++) [shared release];
+    return NULL;
+}
+
+static void *releaseOnce(void *arg __unused)
+{
+    [shared release];
+    return NULL;
+}
+
+static void *allocate(void *arg __unused)
+{
+    shared = [BiasedSub new];
+    [shared retain];
+    return NULL;
+}
+
+static void onThreads(void *(*fn)(void *), int count)
+{
+    pthread_t th[THREADS];
+    for (int t = 0; t < count; t++) pthread_create(&th[t], NULL, fn, NULL);
+    for (int t = 0; t < count; t++) pthread_join(th[t], NULL);
+}
+
+int main()
+{
+    testprintf("Retains on the owner\n");
+    id obj = [Biased new];
+    for (int i = 0; i < LOTS; i++) [obj retain];
+    testassert([obj retainCount] == LOTS + 1);
+    for (int i = 0; i < LOTS; i++) [obj release];
+    testassert([obj retainCount] == 1);
+    [obj release];
+    testassert(TestRootDealloc == 1);
+
+    testprintf("Retains on other threads\n");
+    shared = [Biased new];
+    onThreads(&retainReleaseLots, THREADS);
+    testassert([shared retainCount] == 1);
+    testassert(TestRootDealloc == 1);
+    [shared release];
+    testassert(TestRootDealloc == 2);
+
+    testprintf("Released last by another thread\n");
+    @autoreleasepool {
+        shared = [BiasedSub new];
+        [shared retain];
+        onThreads(&releaseOnce, 2);
+    }
+    testassert(TestRootDealloc == 3);
+
+    testprintf("Allocated by a thread that has exited\n");
+    onThreads(&allocate, 1);
+    testassert([shared retainCount] == 2);
+    [shared release];
+    [shared release];
+    @autoreleasepool { }
+    testassert(TestRootDealloc == 4);
+
+    testprintf("Weak references\n");
+    obj = [BiasedSub new];
+    id weak = nil;
+    objc_storeWeak(&weak, obj);
+    shared = obj;
+    onThreads(&retainReleaseLots, THREADS);
+    id loaded = objc_loadWeakRetained(&weak);
+    testassert(loaded == obj);
+    [loaded release];
+    [obj release];
+    testassert(TestRootDealloc == 5);
+    testassert(objc_loadWeakRetained(&weak) == nil);
+
+    testprintf("Many unmerged objects on one thread\n");
+    for (int i = 0; i < 3 * 4096; i++) {
+        obj = [Biased new];
+        [obj retain];
+        [obj release];
+        [obj release];
+    }
+    testassert(TestRootDealloc == 5 + 3 * 4096);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,78 @@
+// TEST_CONFIG MEM=mrc
+
+// Retain counts that overflow the isa move out of line, to the side
+// table or, with SUPPORT_RC_OVERFLOW_COUNTERS, to an atomic counter, and
+// come back when they fall. Cross that boundary repeatedly, from one
+// thread and from several, on more objects than there are counters,
+// and check retainCount and deallocation stay exact.
+
+#include "test.h"
+#include "testroot.i"
+
+#define OBJECTS 300
+#define THREADS 8
+#define LOOPS 64
+#define DELTA 300
+
+static id objs[OBJECTS];
+
+static void *threadfn(void *arg __unused)
+{
+    for (int l = 0; l < LOOPS; l++) {
+        for (int i = 0; i < OBJECTS; i += 37) {
+            for (int d = 0; d < DELTA; d++) [objs[i] retain];
+            for (int d = 0; d < DELTA; d++) [objs[i] release];
+        }
+    }
+    return NULL;
+}
+
+int main()
+{
+    testprintf("Overflow many objects at once\n");
+    for (int i = 0; i < OBJECTS; i++) {
+        objs[i] = [TestRoot new];
+        for (int d = 0; d < DELTA + i; d++) [objs[i] retain];
+    }
+    for (int i = 0; i < OBJECTS; i++) {
+        testassert([objs[i] retainCount] == (unsigned long)(DELTA + i + 1));
+    }
+
+    testprintf("Cross the boundary back and forth\n");
+    for (int i = 0; i < OBJECTS; i++) {
+        for (int d = 0; d < DELTA + i; d++) {
+            [objs[i] release];
+            if (d % 61 == 0) {
+                [objs[i] retain];
+                [objs[i] release];
+            }
+        }
+        testassert([objs[i] retainCount] == 1);
+    }
+    testassert(TestRootDealloc == 0);
+
+    testprintf("From several threads\n");
+    pthread_t th[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&th[t], NULL, &threadfn, NULL);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+    for (int i = 0; i < OBJECTS; i++) {
+        testassert([objs[i] retainCount] == 1);
+    }
+    testassert(TestRootDealloc == 0);
+
+    testprintf("Deallocate while overflowed elsewhere\n");
+    for (int i = 0; i < OBJECTS; i++) {
+        if (i % 2) {
+            for (int d = 0; d < DELTA; d++) [objs[i] retain];
+            for (int d = 0; d < DELTA; d++) [objs[i] release];
+        }
+        [objs[i] release];
+        testassert(TestRootDealloc == i + 1);
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,46 @@
+// TEST_CONFIG MEM=mrc
+
+// Fill the side tables' retain count maps with many entries, erase them
+// in a shuffled order, and check the counts that remain are exact.
+
+#include "test.h"
+#include "testroot.i"
+
+#define OBJECTS 10000
+#define DELTA 300
+#define CHECK_EVERY 499
+
+static id objs[OBJECTS];
+static int order[OBJECTS];
+
+int main()
+{
+    for (int i = 0; i < OBJECTS; i++) {
+        objs[i] = [TestRoot new];
+        for (int d = 0; d < DELTA + i % 7; d++) [objs[i] retain];
+        order[i] = i;
+    }
+
+    srandom(1);
+    for (int i = OBJECTS - 1; i > 0; i--) {
+        int j = (int)(random() % (i + 1));
+        int t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+
+    for (int n = 0; n < OBJECTS; n++) {
+        int i = order[n];
+        testassert([objs[i] retainCount] == (unsigned long)(DELTA + i % 7 + 1));
+        for (int d = 0; d < DELTA + i % 7; d++) [objs[i] release];
+        testassert([objs[i] retainCount] == 1);
+        [objs[i] release];
+        testassert(TestRootDealloc == n + 1);
+        if (n % CHECK_EVERY == 0) {
+            for (int m = n + 1; m < OBJECTS; m++) {
+                int k = order[m];
+                testassert([objs[k] retainCount] == (unsigned long)(DELTA + k % 7 + 1));
+            }
+        }
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,113 @@
+// TEST_CFLAGS -framework Foundation
+// TEST_CONFIG MEM=mrc
+
+// objc_retainMany() and objc_releaseMany() behave like objc_retain()
+// and objc_release() on each element: nil and tagged pointers are
+// skipped, duplicates count once per appearance, custom retain and
+// release are called, and objects released to zero are deallocated
+// before the call returns.
+
+#include "test.h"
+#include "testroot.i"
+#import <Foundation/Foundation.h>
+
+#define SMALL 7
+#define LARGE 3000
+
+static int plainDeallocs;
+
+@interface Plain : NSObject @end
+@implementation Plain
+-(void)dealloc {
+    plainDeallocs++;
+    [super dealloc];
+}
+@end
+
+enum Kind { None, Custom, Default };
+
+static void fill(id *objs, enum Kind *kinds, int count)
+{
+    // Alternate the default retain/release with TestRoot's custom ones,
+    // and sprinkle in nil and tagged pointers.
+    for (int i = 0; i < count; i++) {
+        kinds[i] = None;
+        if (i % 11 == 5) {
+            objs[i] = nil;
+        } else if (i % 11 == 9) {
+            objs[i] = [NSNumber numberWithInt:i];
+        } else if (i % 2) {
+            objs[i] = [Plain new];
+            kinds[i] = Default;
+        } else {
+            objs[i] = [TestRoot new];
+            kinds[i] = Custom;
+        }
+    }
+}
+
+static void check(int count)
+{
+    TestRootRetain = TestRootRelease = TestRootDealloc = 0;
+    plainDeallocs = 0;
+
+    id *objs = (id *)calloc(count, sizeof(id));
+    enum Kind *kinds = (enum Kind *)calloc(count, sizeof(enum Kind));
+    fill(objs, kinds, count);
+    int custom = 0, plain = 0;
+    for (int i = 0; i < count; i++) {
+        if (kinds[i] == Custom) custom++;
+        else if (kinds[i] == Default) plain++;
+    }
+
+    objc_retainMany(objs, count);
+    testassert(TestRootRetain == custom);
+    for (int i = 0; i < count; i++) {
+        if (kinds[i] != None) testassert([objs[i] retainCount] == 2);
+    }
+
+    // Retain and release in the same batch.
+    objc_retainMany(objs, count);
+    objc_releaseMany(objs, count);
+    testassert(TestRootRetain == 2*custom);
+    testassert(TestRootRelease == custom);
+    testassert(TestRootDealloc == 0  &&  plainDeallocs == 0);
+
+    // Down to zero.
+    objc_releaseMany(objs, count);
+    objc_releaseMany(objs, count);
+    testassert(TestRootRelease == 3*custom);
+    testassert(TestRootDealloc == custom);
+    testassert(plainDeallocs == plain);
+
+    free(objs);
+    free(kinds);
+}
+
+int main()
+{
+    testprintf("Empty\n");
+    objc_retainMany(NULL, 0);
+    objc_releaseMany(NULL, 0);
+
+    testprintf("Small batches\n");
+    check(SMALL);
+
+    testprintf("Large batches\n");
+    check(LARGE);
+
+    testprintf("Duplicates\n");
+    id obj = [Plain new];
+    id dups[LARGE];
+    for (int i = 0; i < LARGE; i++) dups[i] = obj;
+    objc_retainMany(dups, LARGE);
+    testassert([obj retainCount] == LARGE + 1);
+    objc_releaseMany(dups, LARGE - 1);
+    testassert([obj retainCount] == 2);
+    plainDeallocs = 0;
+    dups[1] = obj;
+    objc_releaseMany(dups, 2);
+    testassert(plainDeallocs == 1);
+
+    succeed(__FILE__);
+}
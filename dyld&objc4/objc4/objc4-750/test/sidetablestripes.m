@@ -0,0 +1,93 @@
+// TEST_ENV OBJC_SIDE_TABLE_STRIPES=7
+// TEST_CONFIG MEM=mrc
+
+// OBJC_SIDE_TABLE_STRIPES sets the side table stripe count, which need
+// not be a power of two. Check the count and the per-stripe statistics
+// while objects with side table retain counts and weak references are
+// spread across the stripes from several threads.
+
+#include "test.h"
+#include "testroot.i"
+
+#define OBJECTS 200
+#define THREADS 8
+#define LOTS 300
+
+static id objs[OBJECTS];
+static id weaks[OBJECTS];
+
+static void *threadfn(void *arg)
+{
+    uintptr_t start = (uintptr_t)arg;
+    for (int round = 0; round < 20; round++) {
+        for (uintptr_t n = 0; n < OBJECTS; n++) {
+            id obj = objs[(start + n) % OBJECTS];
+            [obj retain];
+            [obj release];
+        }
+    }
+    return NULL;
+}
+
+static void totals(unsigned *count, uint64_t *acquires,
+                   uint64_t *refcounts, uint64_t *weakEntries)
+{
+    struct objc_side_table_stripe_statistics stats[16];
+    *count = _objc_getSideTableStatistics(stats, 16);
+    *acquires = *refcounts = *weakEntries = 0;
+    for (unsigned i = 0; i < *count  &&  i < 16; i++) {
+        testassert(stats[i].contentions <= stats[i].acquires);
+        *acquires += stats[i].acquires;
+        *refcounts += stats[i].refcounts;
+        *weakEntries += stats[i].weakEntries;
+    }
+}
+
+int main()
+{
+    testassert(_objc_getSideTableStatistics(NULL, 0) == 7);
+
+    unsigned count;
+    uint64_t acquires, refcounts, weakEntries;
+    totals(&count, &acquires, &refcounts, &weakEntries);
+    testassert(count == 7);
+    uint64_t acquiresBefore = acquires;
+    uint64_t refcountsBefore = refcounts;
+    uint64_t weakEntriesBefore = weakEntries;
+
+    testprintf("Fill the side tables\n");
+    for (int i = 0; i < OBJECTS; i++) {
+        objs[i] = [TestRoot new];
+        objc_storeWeak(&weaks[i], objs[i]);
+        for (int r = 0; r < LOTS; r++) [objs[i] retain];
+    }
+    totals(&count, &acquires, &refcounts, &weakEntries);
+    testassert(acquires > acquiresBefore);
+    testassert(refcounts >= refcountsBefore + OBJECTS);
+    testassert(weakEntries >= weakEntriesBefore + OBJECTS);
+
+    testprintf("Retain and release from several threads\n");
+    pthread_t th[THREADS];
+    for (uintptr_t t = 0; t < THREADS; t++) {
+        pthread_create(&th[t], NULL, &threadfn, (void *)(t * OBJECTS / THREADS));
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+
+    testprintf("Empty the side tables\n");
+    for (int i = 0; i < OBJECTS; i++) {
+        testassert([objs[i] retainCount] == LOTS + 1);
+        for (int r = 0; r < LOTS; r++) [objs[i] release];
+        @autoreleasepool {
+            testassert(objc_loadWeak(&weaks[i]) == objs[i]);
+        }
+        [objs[i] release];
+        testassert(objc_loadWeak(&weaks[i]) == nil);
+    }
+    testassert(TestRootDealloc == OBJECTS);
+    totals(&count, &acquires, &refcounts, &weakEntries);
+    testassert(weakEntries == weakEntriesBefore);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,99 @@
+// TEST_CONFIG MEM=mrc
+
+// An object with more than 1024 weak references has them cleared in
+// batches outside its side table lock. Check every reference is nilled,
+// including while another thread destroys some of them, and check
+// _objc_getWeakClearStatistics().
+
+#include "test.h"
+#include "testroot.i"
+
+#define HEAVY 5000
+#define LIGHT 1000
+
+static id *vars;
+static semaphore_t go;
+static semaphore_t done;
+
+static void *destroyer(void *arg __unused)
+{
+    while (1) {
+        semaphore_wait(go);
+        // Every other variable, racing the batched clear.
+        for (int i = 0; i < HEAVY; i += 2) {
+            objc_destroyWeak(&vars[i]);
+        }
+        semaphore_signal(done);
+    }
+    return NULL;
+}
+
+static void weaken(id obj, int count)
+{
+    for (int i = 0; i < count; i++) {
+        objc_initWeak(&vars[i], obj);
+    }
+}
+
+int main()
+{
+    vars = (id *)calloc(HEAVY, sizeof(id));
+
+    struct objc_weak_clear_statistics before, after;
+    _objc_getWeakClearStatistics(&before);
+
+    testprintf("Light objects are cleared as before\n");
+    id obj = [TestRoot new];
+    weaken(obj, LIGHT);
+    [obj release];
+    for (int i = 0; i < LIGHT; i++) {
+        testassert(vars[i] == nil);
+    }
+    _objc_getWeakClearStatistics(&after);
+    testassert(after.clears == before.clears);
+
+    testprintf("Heavy objects are cleared in batches\n");
+    obj = [TestRoot new];
+    weaken(obj, HEAVY);
+    [obj release];
+    for (int i = 0; i < HEAVY; i++) {
+        testassert(vars[i] == nil);
+    }
+    _objc_getWeakClearStatistics(&after);
+    testassert(after.clears == before.clears + 1);
+    testassert(after.batched == before.batched + 1);
+    testassert(after.referrers >= before.referrers + HEAVY);
+    testassert(after.batches >= before.batches + HEAVY/1024);
+    uint64_t lockTotal = 0, clearTotal = 0;
+    for (int i = 0; i < OBJC_WEAK_CLEAR_HISTOGRAM_BUCKETS; i++) {
+        lockTotal += after.lockHistogram[i];
+        clearTotal += after.clearHistogram[i];
+    }
+    testassert(lockTotal == after.clears);
+    testassert(clearTotal == after.clears);
+
+    testprintf("Weak variables destroyed during the clear\n");
+    semaphore_create(mach_task_self(), &go, 0, 0);
+    semaphore_create(mach_task_self(), &done, 0, 0);
+    pthread_t th;
+    pthread_create(&th, NULL, &destroyer, NULL);
+    for (int round = 0; round < 50; round++) {
+        obj = [TestRoot new];
+        weaken(obj, HEAVY);
+        semaphore_signal(go);
+        [obj release];
+        semaphore_wait(done);
+        for (int i = 1; i < HEAVY; i += 2) {
+            testassert(vars[i] == nil);
+        }
+        for (int i = 0; i < HEAVY; i++) {
+            vars[i] = nil;
+        }
+    }
+
+    testassert(TestRootDealloc == 52);
+
+    free(vars);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,57 @@
+// TEST_CONFIG MEM=mrc
+
+// Weak table entries keep their first few referrers inline and move
+// to an out-of-line set when those run out; how many fit depends on
+// WEAK_ENTRY_SIZE. Cross that boundary in both directions with every
+// referrer count up to 40 and check each variable is nilled.
+
+#include "test.h"
+#include "testroot.i"
+
+#define MAX 40
+
+static id vars[MAX];
+
+int main()
+{
+    int deallocs = 0;
+
+    for (int count = 1; count <= MAX; count++) {
+        id obj = [TestRoot new];
+        id other = [TestRoot new];
+
+        for (int i = 0; i < count; i++) {
+            objc_initWeak(&vars[i], obj);
+        }
+
+        // Remove every third referrer and add it back, then move
+        // every fifth to another object.
+        for (int i = 0; i < count; i += 3) {
+            objc_storeWeak(&vars[i], nil);
+        }
+        for (int i = 0; i < count; i += 3) {
+            testassert(vars[i] == nil);
+            objc_storeWeak(&vars[i], obj);
+        }
+        for (int i = 0; i < count; i += 5) {
+            objc_storeWeak(&vars[i], other);
+        }
+
+        [obj release];
+        deallocs++;
+        testassert(TestRootDealloc == deallocs);
+        for (int i = 0; i < count; i++) {
+            if (i % 5 == 0) testassert(vars[i] == other);
+            else testassert(vars[i] == nil);
+        }
+
+        [other release];
+        deallocs++;
+        testassert(TestRootDealloc == deallocs);
+        for (int i = 0; i < count; i++) {
+            testassert(vars[i] == nil);
+        }
+    }
+
+    succeed(__FILE__);
+}
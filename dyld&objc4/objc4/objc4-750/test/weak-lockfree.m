@@ -0,0 +1,110 @@
+// TEST_ENV OBJC_LOCKFREE_WEAK_LOAD=YES
+// TEST_CONFIG MEM=mrc
+
+// With OBJC_LOCKFREE_WEAK_LOAD, objc_loadWeakRetained() reads weak
+// variables without the side table lock. Race loads against stores
+// and deallocation, and check a load returns either nil or a live
+// object that is still the variable's referent.
+
+#include "test.h"
+#include "testroot.i"
+
+#define VARS 64
+#define THREADS 4
+#define ROUNDS 2000
+
+static id vars[VARS];
+static volatile int stop;
+
+@interface Tagged : TestRoot {
+@public
+    uintptr_t tag;
+}
+@end
+@implementation Tagged
+-(void)dealloc {
+    tag = 0;
+    [super dealloc];
+}
+@end
+
+static void *loader(void *arg __unused)
+{
+    uint64_t loads = 0;
+    while (!stop) {
+        for (int i = 0; i < VARS; i++) {
+            Tagged *obj = objc_loadWeakRetained(&vars[i]);
+            if (obj) {
+                // A retained result must not have been deallocated.
+                testassert(obj->tag == 0x5a5a5a5a);
+                [obj release];
+            }
+            loads++;
+        }
+    }
+    testprintf("%llu loads\n", (unsigned long long)loads);
+    return NULL;
+}
+
+static Tagged *make(void)
+{
+    Tagged *obj = [Tagged new];
+    obj->tag = 0x5a5a5a5a;
+    return obj;
+}
+
+int main()
+{
+    for (int generation = 0; generation < 4; generation++) {
+        stop = 0;
+        pthread_t th[THREADS];
+        for (int t = 0; t < THREADS; t++) {
+            pthread_create(&th[t], NULL, &loader, NULL);
+        }
+
+        Tagged *objs[VARS];
+        for (int i = 0; i < VARS; i++) {
+            objs[i] = make();
+            objc_initWeak(&vars[i], objs[i]);
+        }
+
+        for (int r = 0; r < ROUNDS; r++) {
+            int i = r % VARS;
+            if (r & 1) {
+                // Deallocate the referent while loaders may be reading 
+                // it. One may still hold it, so it may still load.
+                [objs[i] release];
+                id loaded = objc_loadWeakRetained(&vars[i]);
+                testassert(loaded == nil  ||  loaded == objs[i]);
+                [loaded release];
+                objs[i] = make();
+                objc_storeWeak(&vars[i], objs[i]);
+            } else {
+                // Move the variable to an object in another stripe.
+                int j = (i + VARS/2) % VARS;
+                objc_storeWeak(&vars[i], objs[j]);
+                objc_storeWeak(&vars[i], objs[i]);
+            }
+        }
+
+        // Loader threads exit each generation, leaving any garbage
+        // they were collecting to be orphaned.
+        stop = 1;
+        for (int t = 0; t < THREADS; t++) {
+            pthread_join(th[t], NULL);
+        }
+
+        for (int i = 0; i < VARS; i++) {
+            id loaded = objc_loadWeakRetained(&vars[i]);
+            testassert(loaded == objs[i]);
+            [loaded release];
+            [objs[i] release];
+            testassert(objc_loadWeakRetained(&vars[i]) == nil);
+            objc_destroyWeak(&vars[i]);
+        }
+    }
+
+    testassert(TestRootDealloc == 4 * (VARS + ROUNDS/2));
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,68 @@
+// TEST_CONFIG MEM=mrc
+
+// Grow the weak tables with many weakly-referenced objects, then
+// deallocate them in a scrambled order so entries are removed from the
+// middle of probe sequences, and the tables shrink. Check after each
+// step that the remaining weak variables still load their referents.
+
+#include "test.h"
+#include "testroot.i"
+
+#define OBJECTS 20000
+#define CHECK_EVERY 997
+
+static id objs[OBJECTS];
+static id vars[OBJECTS];
+static id vars2[OBJECTS];
+
+static void check(int live[], int count)
+{
+    for (int n = 0; n < count; n++) {
+        int i = live[n];
+        id loaded = objc_loadWeakRetained(&vars[i]);
+        testassert(loaded == objs[i]);
+        [loaded release];
+        loaded = objc_loadWeakRetained(&vars2[i]);
+        testassert(loaded == objs[i]);
+        [loaded release];
+    }
+}
+
+int main()
+{
+    static int order[OBJECTS];
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < OBJECTS; i++) {
+            objs[i] = [TestRoot new];
+            objc_initWeak(&vars[i], objs[i]);
+            objc_initWeak(&vars2[i], objs[i]);
+            order[i] = i;
+        }
+
+        // Fisher-Yates with a fixed seed.
+        srandom(round + 1);
+        for (int i = OBJECTS - 1; i > 0; i--) {
+            int j = (int)(random() % (i + 1));
+            int t = order[i]; order[i] = order[j]; order[j] = t;
+        }
+
+        for (int n = 0; n < OBJECTS; n++) {
+            int i = order[n];
+            [objs[i] release];
+            testassert(vars[i] == nil);
+            testassert(vars2[i] == nil);
+            objs[i] = nil;
+            if (n % CHECK_EVERY == 0) check(order + n + 1, OBJECTS - n - 1);
+        }
+
+        for (int i = 0; i < OBJECTS; i++) {
+            objc_destroyWeak(&vars[i]);
+            objc_destroyWeak(&vars2[i]);
+        }
+    }
+
+    testassert(TestRootDealloc == 3 * OBJECTS);
+
+    succeed(__FILE__);
+}